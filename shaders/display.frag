@@ -7,11 +7,31 @@ out vec4 color;
 uniform sampler2D sim_texture;
 // screen size of window on which we are displaying (in pixels)
 uniform vec2 screen_size;
-// size of absorbing boundary layer in sim_texture (in texels)
-uniform float damping_area_size;
+// size of absorbing boundary layer in sim_texture along x and y (in texels), which is 0 along a
+// periodic axis
+uniform vec2 damping_area_size;
+// what to show: 0 for the wave value, 1 for the rms and 2 for the peak of the accumulated intensity,
+// and 3 for the amplitude and 4 for the phase of a phasor
+uniform int display_mode;
+// intensity accumulators (mean u^2, peak |u|), the same size as sim_texture
+uniform sampler2D accum_texture;
+// scale applied to intensities before they are colored
+uniform float display_gain;
+// texture holding the shown phasor, and if it is in the (z, w) rather than the (x, y) channels
+uniform sampler2D phasor_texture;
+uniform bool phasor_high;
+// Mirror symmetry about x = 0 and y = 0 (see wave_sim.frag). The half of the texture that isn't
+// simulated is shown as the reflection of the other half, with u and the phasors changing sign
+// across an odd plane.
+uniform ivec2 symmetry;
+
+// convert a hue in [0, 1) to a fully saturated rgb color
+vec3 hue_color(float hue) {
+    return clamp(abs(mod(hue * 6.0 + vec3(0.0, 4.0, 2.0), 6.0) - 3.0) - 1.0, 0.0, 1.0);
+}
 
 void main() {
-    vec2 damping_offset = vec2(damping_area_size, damping_area_size);
+    vec2 damping_offset = damping_area_size;
     vec2 tex_size = vec2(textureSize(sim_texture, 0));
     vec2 damping_relative_cover = damping_offset / tex_size;
 
@@ -19,11 +39,47 @@ void main() {
     vec2 screen_pos = gl_FragCoord.xy / screen_size;
     // get position in texture
     vec2 sim_pos = screen_pos * (vec2(1.0, 1.0) - 2.0 * damping_relative_cover) + damping_relative_cover;
+    // reflect into the simulated half, and keep the filtering from reaching past its first texel
+    float parity = 1.0;
+    vec2 first_texel = (floor(tex_size / 2.0) + 0.5) / tex_size;
+    if(symmetry.x != 0) {
+        if(sim_pos.x < 0.5) {
+            sim_pos.x = 1.0 - sim_pos.x;
+            parity *= float(symmetry.x);
+        }
+        sim_pos.x = max(sim_pos.x, first_texel.x);
+    }
+    if(symmetry.y != 0) {
+        if(sim_pos.y < 0.5) {
+            sim_pos.y = 1.0 - sim_pos.y;
+            parity *= float(symmetry.y);
+        }
+        sim_pos.y = max(sim_pos.y, first_texel.y);
+    }
     vec4 point = texture(sim_texture, sim_pos);
+    point.x *= parity;
     // draw boundaries white
     if(point.a > 0.0) {
         color = vec4(1.0, 1.0, 1.0, 1.0);
     }
+    // color phase by hue, dimmed where the amplitude is small
+    else if(display_mode == 4) {
+        vec4 phasors = texture(phasor_texture, sim_pos);
+        vec2 phasor = parity * (phasor_high ? phasors.zw : phasors.xy);
+        float brightness = clamp(6.0 * display_gain * length(phasor), 0.0, 1.0);
+        color = vec4(brightness * hue_color(atan(phasor.y, phasor.x) / 6.283185307 + 0.5), 1.0);
+    }
+    // color intensities from black through red and yellow to white
+    else if(display_mode == 3) {
+        vec4 phasors = texture(phasor_texture, sim_pos);
+        float value = 2.0 * display_gain * length(phasor_high ? phasors.zw : phasors.xy);
+        color = vec4(clamp(3.0 * value, 0.0, 1.0), clamp(3.0 * value - 1.0, 0.0, 1.0), clamp(3.0 * value - 2.0, 0.0, 1.0), 1.0);
+    }
+    else if(display_mode != 0) {
+        vec4 accum = texture(accum_texture, sim_pos);
+        float value = display_gain * (display_mode == 1 ? sqrt(accum.r) : accum.g);
+        color = vec4(clamp(3.0 * value, 0.0, 1.0), clamp(3.0 * value - 1.0, 0.0, 1.0), clamp(3.0 * value - 2.0, 0.0, 1.0), 1.0);
+    }
     // otherwise color based on wave value
     else if(point.x > 0.0) {
         color = vec4(point.x, 0.0, 0.0, 1.0);
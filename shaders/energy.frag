@@ -0,0 +1,51 @@
+#version 300 es
+precision highp float;
+precision highp int;
+
+// This shader draws the energy of each cell of the simulation state (the same terms as
+// field_energy in energy.cpp). reduce.frag then sums it into the total energy of the field.
+
+out vec4 color;
+
+uniform sampler2D sim_texture;
+
+// Physical parameters
+uniform float delta_x;
+uniform float delta_y;
+uniform float wave_speed_vacuum;
+// Mirror symmetry about x = 0 and y = 0 (see wave_sim.frag). The texels that aren't simulated count
+// with the state of their mirror image, so the energy is that of the whole field.
+uniform ivec2 symmetry;
+
+// Return the state of the texel at point, read from its mirror image if it isn't simulated
+vec4 fetch_state(ivec2 point, ivec2 size) {
+    float parity = 1.0;
+    if(symmetry.x != 0 && point.x < size.x / 2) {
+        point.x = size.x - 1 - point.x;
+        parity *= float(symmetry.x);
+    }
+    if(symmetry.y != 0 && point.y < size.y / 2) {
+        point.y = size.y - 1 - point.y;
+        parity *= float(symmetry.y);
+    }
+    vec4 state = texelFetch(sim_texture, point, 0);
+    return vec4(parity * state.xy, state.zw);
+}
+
+void main() {
+    ivec2 size = textureSize(sim_texture, 0);
+    ivec2 pos = ivec2(gl_FragCoord.xy);
+    vec4 state = fetch_state(pos, size);
+    // cells on the edge are compared with themselves, which gives a difference of 0
+    vec4 right = fetch_state(ivec2(min(pos.x + 1, size.x - 1), pos.y), size);
+    vec4 up = fetch_state(ivec2(pos.x, min(pos.y + 1, size.y - 1)), size);
+
+    float u_x = right.r - state.r;
+    float u_y = up.r - state.r;
+    // differences across a boundary don't count
+    float grad2 = (1.0 - right.a) * u_x * u_x / (delta_x * delta_x) + (1.0 - up.a) * u_y * u_y / (delta_y * delta_y);
+    float speed = state.b * wave_speed_vacuum;
+    float energy = 0.5 * (1.0 - state.a) * (state.g * state.g + speed * speed * grad2);
+
+    color = vec4(energy * delta_x * delta_y, 0.0, 0.0, 1.0);
+}
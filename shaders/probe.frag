@@ -0,0 +1,30 @@
+#version 300 es
+precision highp float;
+precision highp int;
+
+// This shader copies the u value of each probe point into one row of the probe texture. Fragment x
+// of the row samples the point whose cell is stored in texel x of probe_cells.
+
+out vec4 color;
+
+uniform sampler2D sim_texture;
+// (x, y) cell of each probe point
+uniform sampler2D probe_cells;
+// Mirror symmetry about x = 0 and y = 0 (see wave_sim.frag). Points in texels that aren't simulated
+// sample their mirror image.
+uniform ivec2 symmetry;
+
+void main() {
+    ivec2 size = textureSize(sim_texture, 0);
+    ivec2 cell = ivec2(texelFetch(probe_cells, ivec2(int(gl_FragCoord.x), 0), 0).xy);
+    float parity = 1.0;
+    if(symmetry.x != 0 && cell.x < size.x / 2) {
+        cell.x = size.x - 1 - cell.x;
+        parity *= float(symmetry.x);
+    }
+    if(symmetry.y != 0 && cell.y < size.y / 2) {
+        cell.y = size.y - 1 - cell.y;
+        parity *= float(symmetry.y);
+    }
+    color = vec4(parity * texelFetch(sim_texture, cell, 0).r, 0.0, 0.0, 1.0);
+}
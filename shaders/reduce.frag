@@ -0,0 +1,27 @@
+#version 300 es
+precision highp float;
+precision highp int;
+
+// This shader sums each 2x2 block of texels of the source texture into one texel, so drawing it
+// over a chain of textures that halve in size each time leaves the sum of the first in a single
+// texel. Blocks on the edge of an odd sized source only sum the texels inside it.
+
+out vec4 color;
+
+uniform sampler2D source;
+
+void main() {
+    ivec2 size = textureSize(source, 0);
+    ivec2 pos = 2 * ivec2(gl_FragCoord.xy);
+
+    float sum = 0.0;
+    for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+            ivec2 p = pos + ivec2(dx, dy);
+            if (p.x < size.x && p.y < size.y) {
+                sum += texelFetch(source, p, 0).r;
+            }
+        }
+    }
+    color = vec4(sum, 0.0, 0.0, 1.0);
+}
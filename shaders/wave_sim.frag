@@ -6,8 +6,31 @@ precision highp int;
 layout(location=0) out vec4 color;
 uniform sampler2D sim_texture;
 
-// Distance between center of each texel (in m).
+// Intensity accumulators. Red is the running mean of u^2, green is the peak |u|. These are only
+// written when the second draw buffer is enabled, and only read and updated if accum_enabled is set.
+layout(location=1) out vec4 accum;
+uniform bool accum_enabled;
+uniform sampler2D accum_texture;
+// weight of the new u^2 in the mean, and factor the peak decays by each step
+uniform float accum_alpha;
+uniform float accum_decay;
+
+// Running DFT phasors of u. Each texture holds the phasors of two frequencies as (re, im, re, im).
+// These are only written when the third and fourth draw buffers are enabled, and only read and
+// updated if phasors_enabled is set.
+layout(location=2) out vec4 phasors01;
+layout(location=3) out vec4 phasors23;
+uniform bool phasors_enabled;
+uniform sampler2D phasor_texture0;
+uniform sampler2D phasor_texture1;
+// factor the previous phasors are kept by, and the twiddle u is multiplied by for each frequency
+uniform float phasor_keep;
+uniform vec4 phasor_twiddles01;
+uniform vec4 phasor_twiddles23;
+
+// Distance between the centers of neighboring texels along x and y (in m).
 uniform float delta_x;
+uniform float delta_y;
 // Size of each time step (in s)
 uniform float delta_t;
 // Wave speed in free space (in m/s)
@@ -16,9 +39,50 @@ uniform float wave_speed_vacuum;
 // Size of absorbing boundary layer (in texels)
 uniform float damping_area_size;
 
+// Laplacian stencil (see Stencil in scene.hpp). The second derivative along each axis is
+// (stencil_weights[0] * u + sum of stencil_weights[k] * (u(x - k) + u(x + k))) / delta_x^2, for k up
+// to stencil_radius (and likewise along y, over delta_y^2).
+uniform int stencil_radius;
+uniform float stencil_weights[4];
+
+// Mirror symmetry about x = 0 and y = 0 (see SimSettings::symmetry_x): 0 for none, 1 for even, and
+// -1 for odd. Only the texels from the middle of the texture on are simulated along a mirrored
+// axis, and the others are read from their mirror image.
+uniform ivec2 symmetry;
+
+// Periodic boundaries along x and y (see SimSettings::periodic_x): 1 if the axis wraps around, and
+// has no absorbing layer along it.
+uniform ivec2 periodic;
+
+// Wrap point around the periodic axes, for points up to one texture size outside of it
+ivec2 wrap_texel(ivec2 point, ivec2 tex_size) {
+    if(periodic.x != 0) {
+        point.x = (point.x + tex_size.x) % tex_size.x;
+    }
+    if(periodic.y != 0) {
+        point.y = (point.y + tex_size.y) % tex_size.y;
+    }
+    return point;
+}
+
+// Return the texel that holds the state of point, and set parity to the sign its u is read with
+ivec2 mirror_texel(ivec2 point, ivec2 tex_size, out float parity) {
+    parity = 1.0;
+    if(symmetry.x != 0 && point.x < tex_size.x / 2) {
+        point.x = tex_size.x - 1 - point.x;
+        parity *= float(symmetry.x);
+    }
+    if(symmetry.y != 0 && point.y < tex_size.y / 2) {
+        point.y = tex_size.y - 1 - point.y;
+        parity *= float(symmetry.y);
+    }
+    return point;
+}
+
 // Get the value of the wave at a point. Point is the point to get, and u_neighbor is the value of the neighbor of point being considered. u_neighbor is returned if the point is a boundary.
 float get_value(ivec2 point, float u_neighbor) {
     ivec2 tex_size = textureSize(sim_texture, 0);
+    point = wrap_texel(point, tex_size);
     // if point is outside simulation area, fix wave value to u_neighbor.
     // this creates the boundary condition u_x = 0
     if(point.x < 0 || point.x >= tex_size.x || point.y < 0 || point.y >= tex_size.y) {
@@ -26,24 +90,76 @@ float get_value(ivec2 point, float u_neighbor) {
     }
 
     // sample point
-    vec4 point_val = texelFetch(sim_texture, point, 0);
+    float parity;
+    vec4 point_val = texelFetch(sim_texture, mirror_texel(point, tex_size, parity), 0);
     // if the alpha channel is non zero, this is a boundary with condition u_x = 0
     if(point_val.a != 0.0) {
         return u_neighbor;
     }
     // otherwise, we can use the sample point
-    return point_val.x;
+    return parity * point_val.x;
+}
+
+// Weighted sum of the neighbors of a point at distance 1 to stencil_radius along the axis dir. Neighbors past a boundary or the edge take the value of their mirror image across it (folded back until it lands on an open texel), which creates the boundary condition u_x = 0.
+float stencil_axis(ivec2 point, ivec2 dir, float u_point) {
+    ivec2 tex_size = textureSize(sim_texture, 0);
+    // line[3 + i] is the value at offset i
+    float line[7];
+    line[3] = u_point;
+
+    // number of open texels before the first boundary in either direction
+    int open_lo = 0;
+    int open_hi = 0;
+    for(int side = -1; side <= 1; side += 2) {
+        for(int k = 1; k <= stencil_radius; k++) {
+            ivec2 p = wrap_texel(point + side * k * dir, tex_size);
+            if(p.x < 0 || p.x >= tex_size.x || p.y < 0 || p.y >= tex_size.y) {
+                break;
+            }
+            float parity;
+            vec4 val = texelFetch(sim_texture, mirror_texel(p, tex_size, parity), 0);
+            if(val.a != 0.0) {
+                break;
+            }
+            line[3 + side * k] = parity * val.x;
+            if(side < 0) {
+                open_lo = k;
+            } else {
+                open_hi = k;
+            }
+        }
+    }
+
+    float sum = 0.0;
+    for(int k = 1; k <= stencil_radius; k++) {
+        for(int side = -1; side <= 1; side += 2) {
+            int i = side * k;
+            while(i > open_hi || i < -open_lo) {
+                i = i > open_hi ? 2 * open_hi + 1 - i : -2 * open_lo - 1 - i;
+            }
+            sum += stencil_weights[k] * line[3 + i];
+        }
+    }
+    return sum;
 }
 
 // calculate the new u_tt value for a point based on its neighbors
 float calc_wave_eq(ivec2 point, float u_point, float wave_speed) {
-    // get neighbors and calculate laplacian (via second symmetric derivative)
-    float u0 = get_value(ivec2(point.x - 1, point.y), u_point);
-    float u1 = get_value(ivec2(point.x + 1, point.y), u_point);
-    float u2 = get_value(ivec2(point.x, point.y - 1), u_point);
-    float u3 = get_value(ivec2(point.x, point.y + 1), u_point);
+    float laplace;
+    if(stencil_radius > 1) {
+        // wider stencils for higher order accuracy
+        float center = stencil_weights[0] * u_point;
+        laplace = (stencil_axis(point, ivec2(1, 0), u_point) + center) / (delta_x * delta_x) +
+                  (stencil_axis(point, ivec2(0, 1), u_point) + center) / (delta_y * delta_y);
+    } else {
+        // get neighbors and calculate laplacian (via second symmetric derivative)
+        float u0 = get_value(ivec2(point.x - 1, point.y), u_point);
+        float u1 = get_value(ivec2(point.x + 1, point.y), u_point);
+        float u2 = get_value(ivec2(point.x, point.y - 1), u_point);
+        float u3 = get_value(ivec2(point.x, point.y + 1), u_point);
 
-    float laplace = (u0 + u1 + u2 + u3 - 4.0 * u_point) / (delta_x * delta_x);
+        laplace = (u0 + u1 - 2.0 * u_point) / (delta_x * delta_x) + (u2 + u3 - 2.0 * u_point) / (delta_y * delta_y);
+    }
 
     return wave_speed * wave_speed * laplace;
 }
@@ -53,8 +169,10 @@ float calc_wave_eq(ivec2 point, float u_point, float wave_speed) {
 float damping(vec2 point) {
     ivec2 tex_size = textureSize(sim_texture, 0);
 
-    // get distance from point to closest edge
-    float dist = min(min(point.x, point.y), min(float(tex_size.x) - point.x, float(tex_size.y) - point.y));
+    // get distance from point to closest edge. A periodic axis has no edges.
+    float dist_x = periodic.x != 0 ? damping_area_size : min(point.x, float(tex_size.x) - point.x);
+    float dist_y = periodic.y != 0 ? damping_area_size : min(point.y, float(tex_size.y) - point.y);
+    float dist = min(dist_x, dist_y);
 
     if(dist < damping_area_size) {
         float norm = dist / damping_area_size;
@@ -78,4 +196,14 @@ void main() {
     u += u_t * delta_t;
 
     color = vec4(u, u_t, point.b, point.a);
+
+    if(accum_enabled) {
+        vec4 last_accum = texelFetch(accum_texture, ivec2(gl_FragCoord.xy), 0);
+        accum = vec4(last_accum.r + accum_alpha * (u * u - last_accum.r), max(abs(u), last_accum.g * accum_decay), 0.0, 0.0);
+    }
+
+    if(phasors_enabled) {
+        phasors01 = phasor_keep * texelFetch(phasor_texture0, ivec2(gl_FragCoord.xy), 0) + u * phasor_twiddles01;
+        phasors23 = phasor_keep * texelFetch(phasor_texture1, ivec2(gl_FragCoord.xy), 0) + u * phasor_twiddles23;
+    }
 }
\ No newline at end of file
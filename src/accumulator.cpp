@@ -0,0 +1,43 @@
+#include "accumulator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+IntensityAccumulator::Weights IntensityAccumulator::next_step(float delta_t) {
+  steps++;
+  float mean_alpha = 1.0f / (float)steps;
+  if (window <= 0.0f) {
+    return {mean_alpha, 1.0f};
+  }
+
+  float decay = std::exp(-delta_t / window);
+  return {std::max(1.0f - decay, mean_alpha), decay};
+}
+
+bool write_pfm(const std::string &path, size_t width, size_t height, const float *data,
+               size_t stride) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  // a negative scale marks the data as little endian
+  fprintf(file, "Pf\n%zu %zu\n-1.0\n", width, height);
+  std::vector<float> row(width);
+  bool ok = true;
+  for (size_t y = 0; y < height && ok; y++) {
+    for (size_t x = 0; x < width; x++) {
+      row[x] = data[stride * (y * width + x)];
+    }
+    ok = fwrite(row.data(), sizeof(float), width, file) == width;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
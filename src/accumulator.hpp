@@ -0,0 +1,40 @@
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// IntensityAccumulator tracks the time averaged intensity of u, for scenes where the mean power
+// matters more than the instantaneous field. Two planes are updated by the step kernel itself, so
+// they cost no extra passes over memory. After each step:
+//
+//   mean_square += alpha * (u^2 - mean_square)
+//   peak = max(|u|, peak * decay)
+//
+// With a window, alpha and decay give an exponential window of that length. Until window seconds
+// have been accumulated, alpha is 1 / steps instead, so the mean isn't biased towards its initial
+// 0. Without a window, mean_square is the plain mean over every step since the last reset.
+class IntensityAccumulator {
+public:
+  struct Weights {
+    float alpha, decay;
+  };
+
+  // length of the exponential window (in s), or 0 to average over every step
+  float window{0.0};
+  // number of steps accumulated since the last reset
+  uint64_t steps{0};
+
+  // Return the weights for the next step of delta_t seconds, and count the step
+  Weights next_step(float delta_t);
+  void reset() { steps = 0; }
+};
+
+// Write a width x height field as a single channel portable float map (rows bottom to top, which is
+// the same order as SimGrid). The value of cell i is data[stride * i]. Return false (and print to
+// stderr) if the file can't be written.
+bool write_pfm(const std::string &path, size_t width, size_t height, const float *data,
+               size_t stride = 1);
+
+#endif
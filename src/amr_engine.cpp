@@ -0,0 +1,487 @@
+#include "amr_engine.hpp"
+#include "energy.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+// the damping factors of Engine::init_damping for a grid of width x height cells
+static void init_damping(int damping_area_size, size_t width, size_t height,
+                         std::vector<float> &lut, std::vector<size_t> &index_x,
+                         std::vector<size_t> &index_y) {
+  const float size = (float)damping_area_size;
+  lut.clear();
+  for (size_t k = 0; (float)k + 0.5f < size; k++) {
+    float norm = ((float)k + 0.5f) / size;
+    lut.push_back(std::tanh(2.0f * norm + 1.0f));
+  }
+  index_x.resize(width);
+  for (size_t x = 0; x < width; x++) {
+    index_x[x] = std::min(x, width - 1 - x);
+  }
+  index_y.resize(height);
+  for (size_t y = 0; y < height; y++) {
+    index_y[y] = std::min(y, height - 1 - y);
+  }
+}
+
+// The planes a step reads and writes, which are width cells wide
+struct StepPlanes {
+  const float *u, *u_t, *ior_inv, *boundary;
+  float *out_u, *out_u_t;
+  size_t width, height;
+};
+
+// One step of the scheme of Engine::step_rows (with the 5 point stencil) for the cells in columns
+// [x0, x1) and rows [y0, y1) of planes. The damping factor of cell (x, y) is looked up with
+// min(damping_x[x + offset_x], damping_y[y + offset_y]).
+static void step_cells(const StepPlanes &planes, size_t x0, size_t x1, size_t y0, size_t y1,
+                       const SimSettings &settings, const std::vector<float> &damping_lut,
+                       const size_t *damping_x, ptrdiff_t offset_x, const size_t *damping_y,
+                       ptrdiff_t offset_y) {
+  const size_t width = planes.width, height = planes.height;
+  const float *u = planes.u;
+  const float *boundary = planes.boundary;
+  const float inv_delta_x2 = 1.0f / (settings.delta_x * settings.delta_x);
+  const float inv_delta_y2 = 1.0f / (settings.delta_y * settings.delta_y);
+  const float delta_t = settings.delta_t;
+
+  for (size_t y = y0; y < y1; y++) {
+    const size_t damping_row = damping_y[y + offset_y];
+    for (size_t x = x0; x < x1; x++) {
+      const size_t c = y * width + x;
+      const float u_point = u[c];
+      float u0 = (x > 0 && boundary[c - 1] == 0.0f) ? u[c - 1] : u_point;
+      float u1 = (x + 1 < width && boundary[c + 1] == 0.0f) ? u[c + 1] : u_point;
+      float u2 = (y > 0 && boundary[c - width] == 0.0f) ? u[c - width] : u_point;
+      float u3 = (y + 1 < height && boundary[c + width] == 0.0f) ? u[c + width] : u_point;
+
+      float laplace =
+          (u0 + u1 - 2.0f * u_point) * inv_delta_x2 + (u2 + u3 - 2.0f * u_point) * inv_delta_y2;
+      float wave_speed = planes.ior_inv[c] * settings.wave_speed_vacuum;
+      float u_tt = wave_speed * wave_speed * laplace;
+
+      size_t damping_index = std::min(damping_x[x + offset_x], damping_row);
+      float damping = damping_index < damping_lut.size() ? damping_lut[damping_index] : 1.0f;
+
+      float new_u_t = (planes.u_t[c] + u_tt * delta_t) * damping;
+      planes.out_u_t[c] = new_u_t;
+      planes.out_u[c] = u_point + new_u_t * delta_t;
+    }
+  }
+}
+
+AmrEngine::AmrEngine(const SimSettings &settings, Environment environment,
+                     const AmrOptions &options, unsigned threads)
+    : settings(settings), environment(std::move(environment)), options(options),
+      fine(settings.texture_width, settings.texture_height, settings.delta_x, settings.delta_y),
+      coarse_settings(settings.resized(settings.texture_width / 2, settings.texture_height / 2)),
+      coarse(coarse_settings.texture_width, coarse_settings.texture_height,
+             coarse_settings.delta_x, coarse_settings.delta_y),
+      coarse_next_u(coarse.size(), 0.0f), coarse_next_u_t(coarse.size(), 0.0f), pool(threads) {}
+
+std::unique_ptr<AmrEngine> AmrEngine::create(const SimSettings &settings, Environment environment,
+                                             const AmrOptions &options, unsigned threads) {
+  if (settings.texture_width % block_size != 0 || settings.texture_height % block_size != 0) {
+    fprintf(stderr, "Refined grids must be a multiple of %zu cells in both directions\n",
+            block_size);
+    return nullptr;
+  }
+  if (settings.stencil_order != 2) {
+    fprintf(stderr, "Refined grids only run the 5 point stencil\n");
+    return nullptr;
+  }
+  if (settings.periodic_x || settings.periodic_y) {
+    fprintf(stderr, "Refined grids don't run periodic boundaries\n");
+    return nullptr;
+  }
+  if (settings.symmetry_x != Symmetry::None || settings.symmetry_y != Symmetry::None) {
+    fprintf(stderr, "Refined grids don't run symmetry planes\n");
+    return nullptr;
+  }
+
+  auto res = std::unique_ptr<AmrEngine>(
+      new AmrEngine(settings, std::move(environment), options, threads));
+  init_damping(settings.damping_area_size, res->fine.width, res->fine.height,
+               res->fine_damping_lut, res->fine_damping_x, res->fine_damping_y);
+  init_damping(res->coarse_settings.damping_area_size, res->coarse.width, res->coarse.height,
+               res->coarse_damping_lut, res->coarse_damping_x, res->coarse_damping_y);
+
+  // media and boundaries don't change over time, so their channels are only rasterized once
+  for (SimGrid *grid : {&res->fine, &res->coarse}) {
+    grid->pass_mask = glm::bvec4(false, false, true, true);
+    res->environment.rasterize(*grid, res->time);
+    grid->pass_mask = glm::bvec4(true, true, false, false);
+  }
+
+  res->blocks_x = res->fine.width / block_size;
+  res->blocks_y = res->fine.height / block_size;
+  res->block_index.assign(res->blocks_x * res->blocks_y, -1);
+  res->boundary_blocks.assign(res->blocks_x * res->blocks_y, 0);
+  res->source_blocks.assign(res->blocks_x * res->blocks_y, 0);
+  res->unflagged_regrids.assign(res->blocks_x * res->blocks_y, SIZE_MAX);
+  for (size_t y = 0; y < res->fine.height; y++) {
+    for (size_t x = 0; x < res->fine.width; x++) {
+      if (res->fine.boundary[y * res->fine.width + x] != 0.0f) {
+        res->boundary_blocks[y / block_size * res->blocks_x + x / block_size] = 1;
+      }
+    }
+  }
+
+  // the blocks the sources start in
+  res->written.clear();
+  res->fine.write_log = &res->written;
+  res->environment.rasterize(res->fine, res->time);
+  res->fine.write_log = nullptr;
+  for (size_t c : res->written) {
+    const size_t x = c % res->fine.width, y = c / res->fine.width;
+    res->source_blocks[y / block_size * res->blocks_x + x / block_size] = 1;
+  }
+  res->regrid();
+  return res;
+}
+
+float AmrEngine::coarse_value(const std::vector<float> &plane, long x, long y) const {
+  // centers of the full resolution cells 2i and 2i + 1 are a quarter of a coarse cell either side
+  // of the center of coarse cell i
+  const float fx = std::clamp(0.5f * (float)x - 0.25f, 0.0f, (float)(coarse.width - 1));
+  const float fy = std::clamp(0.5f * (float)y - 0.25f, 0.0f, (float)(coarse.height - 1));
+  const size_t x0 = (size_t)fx, y0 = (size_t)fy;
+  const size_t x1 = std::min(x0 + 1, coarse.width - 1), y1 = std::min(y0 + 1, coarse.height - 1);
+  const float wx = fx - (float)x0, wy = fy - (float)y0;
+
+  const float *row0 = &plane[y0 * coarse.width], *row1 = &plane[y1 * coarse.width];
+  const float bottom = row0[x0] * (1.0f - wx) + row0[x1] * wx;
+  const float top = row1[x0] * (1.0f - wx) + row1[x1] * wx;
+  return bottom * (1.0f - wy) + top * wy;
+}
+
+void AmrEngine::init_block(Block &block) const {
+  const size_t n = block_size + 2;
+  block.u.assign(n * n, 0.0f);
+  block.u_t.assign(n * n, 0.0f);
+  block.ior_inv.assign(n * n, 1.0f);
+  block.boundary.assign(n * n, 1.0f);
+  block.next_u.assign(n * n, 0.0f);
+  block.next_u_t.assign(n * n, 0.0f);
+
+  for (size_t j = 0; j < n; j++) {
+    for (size_t i = 0; i < n; i++) {
+      const long x = (long)(block.bx * block_size + i) - 1;
+      const long y = (long)(block.by * block_size + j) - 1;
+      if (x < 0 || y < 0 || x >= (long)fine.width || y >= (long)fine.height) {
+        continue;
+      }
+      const size_t c = (size_t)y * fine.width + (size_t)x;
+      block.ior_inv[block_cell(i, j)] = fine.ior_inv[c];
+      block.boundary[block_cell(i, j)] = fine.boundary[c];
+      block.u[block_cell(i, j)] = coarse_value(coarse.u, x, y);
+      block.u_t[block_cell(i, j)] = coarse_value(coarse.u_t, x, y);
+    }
+  }
+}
+
+void AmrEngine::fill_ghosts(Block &block, float theta) {
+  const size_t n = block_size + 2;
+  auto fill = [&](size_t i, size_t j) {
+    const long x = (long)(block.bx * block_size + i) - 1;
+    const long y = (long)(block.by * block_size + j) - 1;
+    if (x < 0 || y < 0 || x >= (long)fine.width || y >= (long)fine.height) {
+      return;
+    }
+    float &ghost = block.u[block_cell(i, j)];
+    const int32_t other = block_index[(size_t)y / block_size * blocks_x + (size_t)x / block_size];
+    if (other >= 0) {
+      ghost = blocks[other].u[block_cell((size_t)x % block_size + 1, (size_t)y % block_size + 1)];
+    } else {
+      ghost = (1.0f - theta) * coarse_value(coarse_next_u, x, y) +
+              theta * coarse_value(coarse.u, x, y);
+    }
+  };
+  for (size_t i = 0; i < n; i++) {
+    fill(i, 0);
+    fill(i, n - 1);
+  }
+  for (size_t j = 1; j + 1 < n; j++) {
+    fill(0, j);
+    fill(n - 1, j);
+  }
+}
+
+void AmrEngine::step_blocks(float theta) {
+  // every ghost cell is filled before any block steps, since they read the cells of other blocks
+  pool.parallel_for(blocks.size(), [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      fill_ghosts(blocks[b], theta);
+    }
+  });
+  pool.parallel_for(blocks.size(), [&](size_t b0, size_t b1) {
+    TRACE_SCOPE("step_blocks");
+    for (size_t b = b0; b < b1; b++) {
+      Block &block = blocks[b];
+      StepPlanes planes{block.u.data(),      block.u_t.data(),      block.ior_inv.data(),
+                        block.boundary.data(), block.next_u.data(), block.next_u_t.data(),
+                        block_size + 2,        block_size + 2};
+      step_cells(planes, 1, block_size + 1, 1, block_size + 1, settings, fine_damping_lut,
+                 fine_damping_x.data(), (ptrdiff_t)(block.bx * block_size) - 1,
+                 fine_damping_y.data(), (ptrdiff_t)(block.by * block_size) - 1);
+    }
+  });
+  for (Block &block : blocks) {
+    std::swap(block.u, block.next_u);
+    std::swap(block.u_t, block.next_u_t);
+  }
+}
+
+void AmrEngine::restrict_blocks() {
+  pool.parallel_for(blocks.size(), [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      const Block &block = blocks[b];
+      for (size_t j = 0; j < block_size / 2; j++) {
+        for (size_t i = 0; i < block_size / 2; i++) {
+          const size_t c0 = block_cell(2 * i + 1, 2 * j + 1), c1 = c0 + 1;
+          const size_t c2 = block_cell(2 * i + 1, 2 * j + 2), c3 = c2 + 1;
+          const size_t c = (block.by * block_size / 2 + j) * coarse.width +
+                           block.bx * block_size / 2 + i;
+          coarse.u[c] = 0.25f * (block.u[c0] + block.u[c1] + block.u[c2] + block.u[c3]);
+          coarse.u_t[c] = 0.25f * (block.u_t[c0] + block.u_t[c1] + block.u_t[c2] + block.u_t[c3]);
+        }
+      }
+    }
+  });
+}
+
+void AmrEngine::regrid() {
+  TRACE_SCOPE("AmrEngine::regrid");
+
+  std::vector<uint8_t> flagged(blocks_x * blocks_y, 0);
+  for (size_t b = 0; b < flagged.size(); b++) {
+    flagged[b] = boundary_blocks[b] | source_blocks[b];
+  }
+
+  // blocks where the field changes too much between coarse cells to be resolved by them
+  float max_abs = 0.0f;
+  for (float value : coarse.u) {
+    max_abs = std::max(max_abs, std::abs(value));
+  }
+  const float threshold = options.gradient_threshold * max_abs;
+  const size_t coarse_block = block_size / 2;
+  for (size_t y = 0; y < coarse.height && max_abs > 0.0f; y++) {
+    for (size_t x = 0; x < coarse.width; x++) {
+      const size_t c = y * coarse.width + x;
+      if (coarse.boundary[c] != 0.0f) {
+        continue;
+      }
+      float change = 0.0f;
+      if (x + 1 < coarse.width && coarse.boundary[c + 1] == 0.0f) {
+        change = std::max(change, std::abs(coarse.u[c + 1] - coarse.u[c]));
+      }
+      if (y + 1 < coarse.height && coarse.boundary[c + coarse.width] == 0.0f) {
+        change = std::max(change, std::abs(coarse.u[c + coarse.width] - coarse.u[c]));
+      }
+      if (change > threshold) {
+        flagged[y / coarse_block * blocks_x + x / coarse_block] = 1;
+      }
+    }
+  }
+
+  // pad the flagged blocks with a ring of blocks
+  std::vector<uint8_t> refine(flagged.size(), 0);
+  for (size_t by = 0; by < blocks_y; by++) {
+    for (size_t bx = 0; bx < blocks_x; bx++) {
+      if (!flagged[by * blocks_x + bx]) {
+        continue;
+      }
+      for (size_t ny = by > 0 ? by - 1 : 0; ny <= std::min(by + 1, blocks_y - 1); ny++) {
+        for (size_t nx = bx > 0 ? bx - 1 : 0; nx <= std::min(bx + 1, blocks_x - 1); nx++) {
+          refine[ny * blocks_x + nx] = 1;
+        }
+      }
+    }
+  }
+  for (size_t b = 0; b < refine.size(); b++) {
+    unflagged_regrids[b] = refine[b] ? 0 : unflagged_regrids[b] + 1;
+    if (block_index[b] >= 0 && unflagged_regrids[b] < options.keep_regrids) {
+      refine[b] = 1;
+    }
+  }
+
+  // blocks that stay refined keep their state, new ones start from the coarse level, and the state
+  // of the dropped ones is already on the coarse level
+  std::vector<Block> next_blocks;
+  std::vector<int32_t> next_index(refine.size(), -1);
+  for (size_t b = 0; b < refine.size(); b++) {
+    if (!refine[b]) {
+      continue;
+    }
+    next_index[b] = (int32_t)next_blocks.size();
+    if (block_index[b] >= 0) {
+      next_blocks.push_back(std::move(blocks[block_index[b]]));
+    } else {
+      Block block;
+      block.bx = b % blocks_x;
+      block.by = b / blocks_x;
+      init_block(block);
+      next_blocks.push_back(std::move(block));
+    }
+  }
+  blocks = std::move(next_blocks);
+  block_index = std::move(next_index);
+  std::fill(source_blocks.begin(), source_blocks.end(), 0);
+}
+
+void AmrEngine::step() {
+  TRACE_SCOPE("AmrEngine::step");
+
+  // draw sources (and reset u on boundaries) on the coarse level, and run its step
+  {
+    TRACE_SCOPE("rasterize");
+    environment.rasterize(coarse, time);
+  }
+  StepPlanes planes{coarse.u.data(),        coarse.u_t.data(),     coarse.ior_inv.data(),
+                    coarse.boundary.data(), coarse_next_u.data(),  coarse_next_u_t.data(),
+                    coarse.width,           coarse.height};
+  pool.parallel_for(coarse.height, [&](size_t y0, size_t y1) {
+    TRACE_SCOPE("step_coarse");
+    step_cells(planes, 0, coarse.width, y0, y1, coarse_settings, coarse_damping_lut,
+               coarse_damping_x.data(), 0, coarse_damping_y.data(), 0);
+  });
+  std::swap(coarse.u, coarse_next_u);
+  std::swap(coarse.u_t, coarse_next_u_t);
+
+  // then bring the blocks up to the same time in two steps
+  for (int k = 0; k < 2; k++) {
+    {
+      TRACE_SCOPE("rasterize");
+      written.clear();
+      fine.write_log = &written;
+      environment.rasterize(fine, time);
+      fine.write_log = nullptr;
+    }
+    for (size_t c : written) {
+      const size_t x = c % fine.width, y = c / fine.width;
+      const size_t b = y / block_size * blocks_x + x / block_size;
+      source_blocks[b] = 1;
+      if (block_index[b] >= 0) {
+        Block &block = blocks[block_index[b]];
+        const size_t i = block_cell(x % block_size + 1, y % block_size + 1);
+        block.u[i] = fine.u[c];
+        block.u_t[i] = fine.u_t[c];
+      }
+    }
+    step_blocks(0.5f * (float)k);
+    time += settings.delta_t;
+    steps++;
+  }
+  restrict_blocks();
+
+  coarse_steps++;
+  if (coarse_steps % std::max(options.regrid_every, (size_t)1) == 0) {
+    regrid();
+  }
+
+  if (probe_set.capacity() > 0) {
+    float *out = probe_set.push(steps, time);
+    for (size_t i = 0; i < probe_set.point_count(); i++) {
+      glm::ivec2 cell = probe_set.cell(i);
+      out[i] = value(cell.x, cell.y);
+    }
+  }
+}
+
+void AmrEngine::run(size_t steps) {
+  for (size_t i = 0; i < steps; i += 2) {
+    step();
+  }
+}
+
+void AmrEngine::capture_probes(size_t capacity) {
+  probe_set = ProbeSet(environment, fine.width, fine.height, settings.delta_x, settings.delta_y,
+                       capacity);
+}
+
+float AmrEngine::value(size_t x, size_t y) const {
+  const int32_t b = block_index[y / block_size * blocks_x + x / block_size];
+  if (b >= 0) {
+    return blocks[b].u[block_cell(x % block_size + 1, y % block_size + 1)];
+  }
+  return coarse_value(coarse.u, (long)x, (long)y);
+}
+
+void AmrEngine::composite(SimGrid &grid) const {
+  if (grid.width != fine.width || grid.height != fine.height) {
+    grid = SimGrid(fine.width, fine.height, settings.delta_x, settings.delta_y);
+  }
+  grid.ior_inv = fine.ior_inv;
+  grid.boundary = fine.boundary;
+  for (size_t y = 0; y < fine.height; y++) {
+    for (size_t x = 0; x < fine.width; x++) {
+      const size_t c = y * fine.width + x;
+      const int32_t b = block_index[y / block_size * blocks_x + x / block_size];
+      if (b >= 0) {
+        const size_t i = block_cell(x % block_size + 1, y % block_size + 1);
+        grid.u[c] = blocks[b].u[i];
+        grid.u_t[c] = blocks[b].u_t[i];
+      } else {
+        grid.u[c] = coarse_value(coarse.u, (long)x, (long)y);
+        grid.u_t[c] = coarse_value(coarse.u_t, (long)x, (long)y);
+      }
+    }
+  }
+}
+
+double AmrEngine::energy() {
+  TRACE_SCOPE("AmrEngine::energy");
+
+  composite(composite_grid);
+  // blocks of the same size as Engine::energy, added in the same order
+  constexpr size_t block_rows = 32;
+  const size_t row_blocks = (fine.height + block_rows - 1) / block_rows;
+  energy_blocks.assign(row_blocks, 0.0);
+  pool.parallel_for(row_blocks, [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      size_t y0 = b * block_rows;
+      size_t y1 = std::min(y0 + block_rows, fine.height);
+      energy_blocks[b] = field_energy(composite_grid, settings.wave_speed_vacuum, y0, y1);
+    }
+  });
+
+  double total = 0.0;
+  for (double block : energy_blocks) {
+    total += block;
+  }
+  return total;
+}
+
+Snapshot AmrEngine::snapshot() const {
+  Snapshot res;
+  res.scene = settings.serialize() + "\n" + environment.serialize();
+  res.time = time;
+  composite(res.grid);
+  return res;
+}
+
+size_t AmrEngine::cell_count() const {
+  return coarse.size() + blocks.size() * block_size * block_size;
+}
+
+size_t AmrEngine::memory_footprint() const {
+  size_t floats = 0;
+  for (const SimGrid *grid : {&fine, &coarse, &composite_grid}) {
+    floats += grid->u.capacity() + grid->u_t.capacity() + grid->ior_inv.capacity() +
+              grid->boundary.capacity();
+  }
+  floats += coarse_next_u.capacity() + coarse_next_u_t.capacity() + coarse_damping_lut.capacity() +
+            fine_damping_lut.capacity();
+  for (const Block &block : blocks) {
+    floats += block.u.capacity() + block.u_t.capacity() + block.ior_inv.capacity() +
+              block.boundary.capacity() + block.next_u.capacity() + block.next_u_t.capacity();
+  }
+  size_t indices = coarse_damping_x.capacity() + coarse_damping_y.capacity() +
+                   fine_damping_x.capacity() + fine_damping_y.capacity() + written.capacity();
+  return floats * sizeof(float) + indices * sizeof(size_t) +
+         block_index.capacity() * sizeof(int32_t) + boundary_blocks.capacity() +
+         source_blocks.capacity();
+}
@@ -0,0 +1,148 @@
+#ifndef AMR_ENGINE_H
+#define AMR_ENGINE_H
+
+#include "grid.hpp"
+#include "probe.hpp"
+#include "scene.hpp"
+#include "snapshot.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct AmrOptions {
+  // coarse steps between choosing the refined blocks again
+  size_t regrid_every{8};
+  // blocks are refined where u changes between neighboring coarse cells by more than this fraction
+  // of the largest |u| on the coarse level
+  float gradient_threshold{0.05};
+  // refined blocks are only dropped once they haven't been flagged for this many regrids, since a
+  // block that is created again starts from the interpolated coarse level
+  size_t keep_regrids{4};
+};
+
+// AmrEngine runs a scene with block structured adaptive mesh refinement. A coarse level at half the
+// resolution of the scene (the scene resized to half its size) covers the whole simulation area,
+// and blocks of block_size x block_size cells at the full resolution are laid over it where the
+// coarse level isn't enough: around boundaries, around the cells that sources draw to, and where
+// the field changes quickly between coarse cells. The blocks are chosen again every regrid_every
+// coarse steps, and each flagged block is padded with a ring of blocks, so waves are refined before
+// they reach an area that needs it.
+//
+// Each step runs one coarse step of 2 delta_t, and then two steps of delta_t on the blocks. The
+// ghost cells around a block are copied from the neighboring blocks, or interpolated from the
+// coarse level (bilinear in space, and linear in time between the coarse states before and after
+// its step). Once the blocks have caught up, the average of each 2x2 group of their cells replaces
+// the coarse cell under it. Only the 5 point stencil and absorbing edges are supported, without
+// symmetry planes.
+class AmrEngine {
+  struct Block {
+    // position of the block (in blocks)
+    size_t bx{0}, by{0};
+    // planes of the block's cells and a ring of ghost cells around them, block_size + 2 cells wide.
+    // Ghost cells outside the simulation area are boundaries.
+    std::vector<float> u{}, u_t{}, ior_inv{}, boundary{};
+    std::vector<float> next_u{}, next_u_t{};
+  };
+
+  SimSettings settings;
+  Environment environment;
+  AmrOptions options;
+
+  // The full resolution grid. Its media and boundaries are copied into the blocks, and the sources
+  // are drawn to its u and u_t planes each step before the cells they write are copied into the
+  // blocks.
+  SimGrid fine;
+  std::vector<size_t> written{};
+
+  // the coarse level, and the planes its next step is written to. After a step, these hold the
+  // state before it, which the ghost cells are interpolated from.
+  SimSettings coarse_settings;
+  SimGrid coarse;
+  std::vector<float> coarse_next_u{}, coarse_next_u_t{};
+
+  // damping factors of the coarse level and of the blocks (see Engine::init_damping)
+  std::vector<float> coarse_damping_lut{}, fine_damping_lut{};
+  std::vector<size_t> coarse_damping_x{}, coarse_damping_y{};
+  std::vector<size_t> fine_damping_x{}, fine_damping_y{};
+
+  size_t blocks_x{0}, blocks_y{0};
+  std::vector<Block> blocks{};
+  // index in blocks of the block at each position, or -1 if it isn't refined
+  std::vector<int32_t> block_index{};
+  // 1 for the blocks that contain a boundary, and for the blocks that sources have drawn to since
+  // the last regrid
+  std::vector<uint8_t> boundary_blocks{}, source_blocks{};
+  // number of regrids since each block was last flagged
+  std::vector<size_t> unflagged_regrids{};
+
+  ThreadPool pool;
+
+  // current time (in s), number of delta_t steps, and number of coarse steps
+  float time{0.0};
+  uint64_t steps{0}, coarse_steps{0};
+
+  ProbeSet probe_set{};
+  // the field at full resolution, for energy
+  SimGrid composite_grid{};
+  std::vector<double> energy_blocks{};
+
+  AmrEngine(const SimSettings &settings, Environment environment, const AmrOptions &options,
+            unsigned threads);
+  // index of the cell at (x, y) of a block's planes, counting the ghost cells
+  static size_t block_cell(size_t x, size_t y) { return y * (block_size + 2) + x; }
+  // a plane of the coarse level interpolated at the center of the full resolution cell (x, y)
+  float coarse_value(const std::vector<float> &plane, long x, long y) const;
+  void fill_ghosts(Block &block, float theta);
+  void step_blocks(float theta);
+  // replace the coarse cells under the blocks with the average of the cells of the blocks
+  void restrict_blocks();
+  // choose the refined blocks again
+  void regrid();
+  void init_block(Block &block) const;
+
+public:
+  // side of the refined blocks (in full resolution cells)
+  static constexpr size_t block_size = 32;
+
+  // Create an engine for the given scene that runs on threads threads (or all hardware threads if
+  // threads is 0). Return nullptr (and print to stderr) if the grid isn't a multiple of block_size
+  // in both directions, or the scene uses a higher order stencil, periodic boundaries or symmetry
+  // planes.
+  static std::unique_ptr<AmrEngine> create(const SimSettings &settings, Environment environment,
+                                           const AmrOptions &options = {}, unsigned threads = 0);
+
+  // Draw the environment, and run one coarse step and two steps of the blocks
+  void step();
+  // Run at least steps steps of delta_t (rounded up to whole coarse steps)
+  void run(size_t steps);
+
+  // Sample the probes in the environment after each coarse step, keeping the last capacity samples
+  void capture_probes(size_t capacity);
+  const ProbeSet &probes() const { return probe_set; }
+
+  // u at the full resolution cell (x, y), from its block, or interpolated from the coarse level
+  float value(size_t x, size_t y) const;
+  // Write the field at full resolution to grid
+  void composite(SimGrid &grid) const;
+  // Total energy of the field at full resolution (see field_energy)
+  double energy();
+  // Save the field at full resolution (and the scene) to a snapshot
+  Snapshot snapshot() const;
+
+  // Number of cells on both levels, and the fraction that is of the cells of the full grid
+  size_t cell_count() const;
+  double cell_fraction() const { return (double)cell_count() / (double)fine.size(); }
+  size_t block_count() const { return blocks.size(); }
+
+  const SimSettings &get_settings() const { return settings; }
+  float get_time() const { return time; }
+  uint64_t get_steps() const { return steps; }
+  unsigned threads() const { return pool.size(); }
+
+  // Approximate memory used by the simulation state (in bytes)
+  size_t memory_footprint() const;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "batch_engine.hpp"
+#include "energy.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+BatchEngine::BatchEngine(size_t count, unsigned threads)
+    : count(count), lanes((count + lane_multiple - 1) / lane_multiple * lane_multiple),
+      pool(threads) {}
+
+std::unique_ptr<BatchEngine> BatchEngine::create(std::vector<Scene> scenes, unsigned threads) {
+  if (scenes.empty()) {
+    fprintf(stderr, "A batch needs at least one scene\n");
+    return nullptr;
+  }
+  for (const auto &scene : scenes) {
+    if (scene.settings.texture_width != scenes[0].settings.texture_width ||
+        scene.settings.texture_height != scenes[0].settings.texture_height) {
+      fprintf(stderr, "The scenes of a batch must have the same grid size\n");
+      return nullptr;
+    }
+    if (scene.settings.stencil_order != 2) {
+      fprintf(stderr, "Batches only run the 5 point stencil\n");
+      return nullptr;
+    }
+    if (scene.settings.periodic_x || scene.settings.periodic_y) {
+      fprintf(stderr, "Batches don't run periodic boundaries\n");
+      return nullptr;
+    }
+    if (scene.settings.symmetry_x != Symmetry::None ||
+        scene.settings.symmetry_y != Symmetry::None) {
+      fprintf(stderr, "Batches don't run symmetry planes\n");
+      return nullptr;
+    }
+  }
+
+  auto res = std::unique_ptr<BatchEngine>(new BatchEngine(scenes.size(), threads));
+  res->width = scenes[0].settings.texture_width;
+  res->height = scenes[0].settings.texture_height;
+  const size_t lanes = res->lanes, n = res->width * res->height;
+
+  res->u.assign(n * lanes, 0.0f);
+  res->u_t.assign(n * lanes, 0.0f);
+  res->ior_inv.assign(n * lanes, 1.0f);
+  res->boundary.assign(n * lanes, 0.0f);
+  res->next_u.assign(n * lanes, 0.0f);
+  res->next_u_t.assign(n * lanes, 0.0f);
+  res->inv_delta_x2.assign(lanes, 0.0f);
+  res->inv_delta_y2.assign(lanes, 0.0f);
+  res->delta_t.assign(lanes, 0.0f);
+  res->wave_speed_vacuum.assign(lanes, 0.0f);
+  res->ones.assign(lanes, 1.0f);
+  res->zeros.assign(lanes, 0.0f);
+  res->times.assign(scenes.size(), 0.0f);
+  res->probe_sets.resize(scenes.size());
+
+  for (size_t s = 0; s < scenes.size(); s++) {
+    const SimSettings &settings = scenes[s].settings;
+    res->inv_delta_x2[s] = 1.0f / (settings.delta_x * settings.delta_x);
+    res->inv_delta_y2[s] = 1.0f / (settings.delta_y * settings.delta_y);
+    res->delta_t[s] = settings.delta_t;
+    res->wave_speed_vacuum[s] = settings.wave_speed_vacuum;
+
+    // media and boundaries don't change over time, so their channels are only rasterized once
+    SimGrid grid{res->width, res->height, settings.delta_x, settings.delta_y};
+    grid.pass_mask = glm::bvec4(false, false, true, true);
+    scenes[s].environment.rasterize(grid, 0.0);
+    for (size_t c = 0; c < n; c++) {
+      res->ior_inv[c * lanes + s] = grid.ior_inv[c];
+      res->boundary[c * lanes + s] = grid.boundary[c];
+    }
+    grid.pass_mask = glm::bvec4(true, true, false, false);
+    res->source_grids.push_back(std::move(grid));
+
+    res->settings.push_back(settings);
+    res->environments.push_back(std::move(scenes[s].environment));
+  }
+  res->init_damping();
+  return res;
+}
+
+// the same damping factors as Engine::init_damping, with a column for each lane
+void BatchEngine::init_damping() {
+  damping_rows = 0;
+  for (const auto &s : settings) {
+    damping_rows = std::max(damping_rows, (size_t)std::max(s.damping_area_size, 0));
+  }
+  damping_lut.assign(damping_rows * lanes, 1.0f);
+  for (size_t s = 0; s < count; s++) {
+    float damping_area_size = (float)settings[s].damping_area_size;
+    for (size_t k = 0; (float)k + 0.5f < damping_area_size; k++) {
+      float norm = ((float)k + 0.5f) / damping_area_size;
+      damping_lut[k * lanes + s] = std::tanh(2.0f * norm + 1.0f);
+    }
+  }
+
+  damping_index_x.resize(width);
+  for (size_t x = 0; x < width; x++) {
+    damping_index_x[x] = std::min(x, width - 1 - x);
+  }
+  damping_index_y.resize(height);
+  for (size_t y = 0; y < height; y++) {
+    damping_index_y[y] = std::min(y, height - 1 - y);
+  }
+}
+
+void BatchEngine::step_rows(size_t y0, size_t y1) {
+  const size_t lanes = this->lanes;
+  const float *inv_delta_x2 = this->inv_delta_x2.data();
+  const float *inv_delta_y2 = this->inv_delta_y2.data();
+  const float *delta_t = this->delta_t.data();
+  const float *wave_speed_vacuum = this->wave_speed_vacuum.data();
+
+  for (size_t y = y0; y < y1; y++) {
+    const size_t damping_y = damping_index_y[y];
+
+    for (size_t x = 0; x < width; x++) {
+      const size_t c = (y * width + x) * lanes;
+      const float *u_c = &u[c];
+
+      // neighbors outside the simulation area are read as an open cell with this cell's value,
+      // which gives the same u_x = 0 condition as a boundary
+      const float *u_0 = x > 0 ? u_c - lanes : u_c;
+      const float *u_1 = x + 1 < width ? u_c + lanes : u_c;
+      const float *u_2 = y > 0 ? u_c - width * lanes : u_c;
+      const float *u_3 = y + 1 < height ? u_c + width * lanes : u_c;
+      const float *b_0 = x > 0 ? &boundary[c - lanes] : zeros.data();
+      const float *b_1 = x + 1 < width ? &boundary[c + lanes] : zeros.data();
+      const float *b_2 = y > 0 ? &boundary[c - width * lanes] : zeros.data();
+      const float *b_3 = y + 1 < height ? &boundary[c + width * lanes] : zeros.data();
+
+      size_t damping_index = std::min(damping_index_x[x], damping_y);
+      const float *damping =
+          damping_index < damping_rows ? &damping_lut[damping_index * lanes] : ones.data();
+
+      const float *ior_c = &ior_inv[c];
+      const float *u_t_c = &u_t[c];
+      float *out_u = &next_u[c];
+      float *out_u_t = &next_u_t[c];
+
+      // every lane runs the same arithmetic as Engine::step_rows, so the results match exactly.
+      // Each group of lanes is computed into local arrays, which can't alias the planes, and the
+      // neighbors are loaded before they are selected, so the loop has no branches or alias checks
+      // and is vectorized.
+      for (size_t s0 = 0; s0 < lanes; s0 += lane_multiple) {
+        float group_u[lane_multiple], group_u_t[lane_multiple];
+        for (size_t i = 0; i < lane_multiple; i++) {
+          const size_t s = s0 + i;
+          const float u_point = u_c[s];
+          const float n0 = u_0[s], n1 = u_1[s], n2 = u_2[s], n3 = u_3[s];
+          float u0 = b_0[s] == 0.0f ? n0 : u_point;
+          float u1 = b_1[s] == 0.0f ? n1 : u_point;
+          float u2 = b_2[s] == 0.0f ? n2 : u_point;
+          float u3 = b_3[s] == 0.0f ? n3 : u_point;
+
+          float laplace = (u0 + u1 - 2.0f * u_point) * inv_delta_x2[s] +
+                          (u2 + u3 - 2.0f * u_point) * inv_delta_y2[s];
+          float wave_speed = ior_c[s] * wave_speed_vacuum[s];
+          float u_tt = wave_speed * wave_speed * laplace;
+
+          float new_u_t = (u_t_c[s] + u_tt * delta_t[s]) * damping[s];
+          group_u_t[i] = new_u_t;
+          group_u[i] = u_point + new_u_t * delta_t[s];
+        }
+        std::copy(group_u, group_u + lane_multiple, out_u + s0);
+        std::copy(group_u_t, group_u_t + lane_multiple, out_u_t + s0);
+      }
+    }
+  }
+}
+
+void BatchEngine::step() {
+  TRACE_SCOPE("BatchEngine::step");
+
+  // draw sources (and reset u on boundaries) of each scene at its current time
+  {
+    TRACE_SCOPE("rasterize");
+    for (size_t s = 0; s < count; s++) {
+      SimGrid &grid = source_grids[s];
+      written.clear();
+      grid.write_log = &written;
+      environments[s].rasterize(grid, times[s]);
+      grid.write_log = nullptr;
+      for (size_t c : written) {
+        u[c * lanes + s] = grid.u[c];
+        u_t[c * lanes + s] = grid.u_t[c];
+      }
+    }
+  }
+
+  pool.parallel_for(height, [&](size_t y0, size_t y1) {
+    TRACE_SCOPE("step_rows");
+    step_rows(y0, y1);
+  });
+  std::swap(u, next_u);
+  std::swap(u_t, next_u_t);
+
+  for (size_t s = 0; s < count; s++) {
+    times[s] += settings[s].delta_t;
+  }
+  steps++;
+
+  for (size_t s = 0; s < count; s++) {
+    ProbeSet &probes = probe_sets[s];
+    if (probes.capacity() == 0) {
+      continue;
+    }
+    float *out = probes.push(steps, times[s]);
+    for (size_t i = 0; i < probes.point_count(); i++) {
+      glm::ivec2 cell = probes.cell(i);
+      out[i] = u[(cell.y * width + cell.x) * lanes + s];
+    }
+  }
+}
+
+void BatchEngine::run(size_t steps) {
+  for (size_t i = 0; i < steps; i++) {
+    step();
+  }
+}
+
+void BatchEngine::capture_probes(size_t capacity) {
+  for (size_t s = 0; s < count; s++) {
+    probe_sets[s] = ProbeSet(environments[s], width, height, settings[s].delta_x,
+                             settings[s].delta_y, capacity);
+  }
+}
+
+void BatchEngine::copy_state(size_t scene, SimGrid &grid) const {
+  grid = SimGrid(width, height, settings[scene].delta_x, settings[scene].delta_y);
+  for (size_t c = 0; c < grid.size(); c++) {
+    grid.u[c] = u[c * lanes + scene];
+    grid.u_t[c] = u_t[c * lanes + scene];
+    grid.ior_inv[c] = ior_inv[c * lanes + scene];
+    grid.boundary[c] = boundary[c * lanes + scene];
+  }
+}
+
+double BatchEngine::energy(size_t scene) const {
+  TRACE_SCOPE("BatchEngine::energy");
+
+  SimGrid grid;
+  copy_state(scene, grid);
+  // blocks of the same size as Engine::energy, added in the same order
+  constexpr size_t block_rows = 32;
+  double total = 0.0;
+  for (size_t y0 = 0; y0 < height; y0 += block_rows) {
+    total += field_energy(grid, settings[scene].wave_speed_vacuum, y0,
+                          std::min(y0 + block_rows, height));
+  }
+  return total;
+}
+
+size_t BatchEngine::memory_footprint() const {
+  size_t floats = u.capacity() + u_t.capacity() + ior_inv.capacity() + boundary.capacity() +
+                  next_u.capacity() + next_u_t.capacity() + damping_lut.capacity();
+  for (const auto &grid : source_grids) {
+    floats += grid.u.capacity() + grid.u_t.capacity() + grid.ior_inv.capacity() +
+              grid.boundary.capacity();
+  }
+  size_t indices = damping_index_x.capacity() + damping_index_y.capacity() + written.capacity();
+  return floats * sizeof(float) + indices * sizeof(size_t);
+}
@@ -0,0 +1,96 @@
+#ifndef BATCH_ENGINE_H
+#define BATCH_ENGINE_H
+
+#include "grid.hpp"
+#include "probe.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// BatchEngine steps several independent scenes with the same grid size in lockstep. The planes of
+// all the scenes are interleaved with the scene innermost (the value of cell c in scene s is at
+// c * lanes + s), so a single pass over the grid steps every scene, and the loop over the scenes
+// maps onto simd lanes. An ensemble of small grids, which would each be too small to amortize the
+// per step overhead or to split across threads, runs at close to the rate of one large grid.
+//
+// Apart from the grid size, each scene has its own settings, environment, and time, and follows
+// the same scheme as Engine, so each scene gives the same result it would on its own Engine.
+// There is no batched GL path: the GUI only shows one scene, so batches only run on the CPU.
+class BatchEngine {
+  size_t width{0}, height{0};
+  // number of scenes, and the number of lanes they are padded to
+  size_t count{0}, lanes{0};
+  std::vector<SimSettings> settings{};
+  std::vector<Environment> environments{};
+
+  // the sources of each scene are rasterized to a grid of their own, and the cells they write are
+  // copied into the interleaved planes
+  std::vector<SimGrid> source_grids{};
+  std::vector<size_t> written{};
+
+  // interleaved planes of all scenes, and the planes the next step is written to
+  std::vector<float> u{}, u_t{}, ior_inv{}, boundary{};
+  std::vector<float> next_u{}, next_u_t{};
+
+  // constants of each lane (0 for padding lanes, which stay at rest)
+  std::vector<float> inv_delta_x2{}, inv_delta_y2{}, delta_t{}, wave_speed_vacuum{};
+  // damping factor of each lane for cells at distance index k from the closest edge is
+  // damping_lut[k * lanes + s], or 1 past the last row
+  std::vector<float> damping_lut{};
+  size_t damping_rows{0};
+  std::vector<size_t> damping_index_x{}, damping_index_y{};
+  // a lane of ones (the damping outside the absorbing layer) and of zeros (an open neighbor)
+  std::vector<float> ones{}, zeros{};
+
+  ThreadPool pool;
+
+  // current time of each scene (in s), and number of steps run
+  std::vector<float> times{};
+  uint64_t steps{0};
+
+  std::vector<ProbeSet> probe_sets{};
+
+  BatchEngine(size_t count, unsigned threads);
+  void init_damping();
+  // run the simulation step of every scene for rows [y0, y1)
+  void step_rows(size_t y0, size_t y1);
+
+public:
+  // scenes are padded to a multiple of this many lanes, so the inner loop has no remainder
+  static constexpr size_t lane_multiple = 8;
+
+  // Create a batch of scenes that runs on threads threads (or all hardware threads if threads is
+  // 0). Return nullptr (and print to stderr) if there are no scenes, their grid sizes differ, or
+  // one of them uses a higher order stencil, periodic boundaries or symmetry planes.
+  static std::unique_ptr<BatchEngine> create(std::vector<Scene> scenes, unsigned threads = 0);
+
+  // Draw the environment of each scene, and run one step of all of them
+  void step();
+  // Run steps steps of the simulation
+  void run(size_t steps);
+
+  // Sample the probes of each scene after each step, keeping the last capacity samples
+  void capture_probes(size_t capacity);
+  const ProbeSet &probes(size_t scene) const { return probe_sets[scene]; }
+
+  // Copy the state of scene into grid
+  void copy_state(size_t scene, SimGrid &grid) const;
+  // Total energy of the field of scene (see field_energy), summed the same way as Engine::energy
+  double energy(size_t scene) const;
+
+  size_t size() const { return count; }
+  size_t grid_width() const { return width; }
+  size_t grid_height() const { return height; }
+  const SimSettings &get_settings(size_t scene) const { return settings[scene]; }
+  float get_time(size_t scene) const { return times[scene]; }
+  uint64_t get_steps() const { return steps; }
+  unsigned threads() const { return pool.size(); }
+
+  // Approximate memory used by the simulation state (in bytes)
+  size_t memory_footprint() const;
+};
+
+#endif
@@ -0,0 +1,480 @@
+#include "batch_engine.hpp"
+#include "engine.hpp"
+#include "progressive.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Benchmark the headless engine on each example scene at several grid sizes and thread counts.
+// With --batch, each run steps a batch of copies of the scene in lockstep on a BatchEngine instead.
+// Scenes a batch can't run are run on an Engine, and reported with a batch size of 1.
+// With --dispersion, report the numerical dispersion of each laplacian stencil instead.
+// With --progressive, report how much faster each scene settles when warm started from coarser
+// grids instead.
+
+#ifndef WAVES_EXAMPLES_DIR
+#define WAVES_EXAMPLES_DIR "examples"
+#endif
+
+struct BenchResult {
+  std::string scene;
+  size_t width, height;
+  unsigned threads;
+  // number of copies of the scene stepped together (1 for a plain Engine)
+  size_t batch;
+  size_t steps;
+  // wall time of the timed steps (in s)
+  double seconds;
+  double mcells_per_s;
+  double ns_per_cell;
+  size_t memory_bytes;
+  // speedup over the smallest thread count, divided by the increase in threads
+  double scaling_efficiency;
+};
+
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --examples dir    directory of .sim scenes to run (default %s)\n"
+          "  --steps n         number of timed steps per run (default 100)\n"
+          "  --warmup n        number of untimed steps before each run (default 10)\n"
+          "  --repeat n        number of times to repeat each run, keeping the fastest (default 3)\n"
+          "  --sizes a,b,...   grid sizes to run each scene at (default 256,512,1024)\n"
+          "  --threads a,b,... thread counts to run each size on (default 1,2,4,... up to all)\n"
+          "  --batch n         step n copies of each scene together on a batch engine\n"
+          "  --dispersion      report the phase velocity error and measured cost of each stencil\n"
+          "                    (csv only)\n"
+          "  --progressive n   report the time each scene takes to settle from zero and when\n"
+          "                    started from n coarser grids, on the most threads (csv only)\n"
+          "  --format fmt      output format, csv or json (default csv)\n"
+          "  --output file     file to write results to (default stdout)\n",
+          name, WAVES_EXAMPLES_DIR);
+}
+
+// parse a comma separated list of positive integers
+static std::vector<size_t> parse_list(const char *str) {
+  std::vector<size_t> res;
+  std::string s = str;
+  size_t pos = 0;
+  while (pos < s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == std::string::npos)
+      end = s.size();
+    res.push_back(std::stoul(s.substr(pos, end - pos)));
+    pos = end + 1;
+  }
+  return res;
+}
+
+// Run warmup untimed steps, then steps timed steps repeat times, and return the fastest time
+template <class E> static double time_steps(E &engine, size_t steps, size_t warmup, size_t repeat) {
+  engine.run(warmup);
+  double seconds = 0.0;
+  for (size_t r = 0; r < repeat; r++) {
+    auto start = std::chrono::steady_clock::now();
+    engine.run(steps);
+    auto end = std::chrono::steady_clock::now();
+    double run_seconds = std::chrono::duration<double>(end - start).count();
+    seconds = r == 0 ? run_seconds : std::min(seconds, run_seconds);
+  }
+  return seconds;
+}
+
+// Relative phase velocity error of a plane wave of cells_per_wavelength cells at angle (in radians
+// from the x axis) with stencil, stepped at courant = c dt / dx. The step is leapfrog, so
+//
+//   sin^2(w dt / 2) = (c dt / (2 dx))^2 * (eigenvalue(kx dx) + eigenvalue(ky dx))
+//
+// where eigenvalue(theta) = -(center + 2 * sum(weights[k - 1] * cos(k theta))) is the stencil's
+// eigenvalue for a wave with phase step theta per cell.
+static double phase_velocity_error(const Stencil &stencil, double cells_per_wavelength,
+                                   double angle, double courant) {
+  auto eigenvalue = [&](double theta) {
+    double sum = stencil.center;
+    for (int k = 1; k <= stencil.radius; k++) {
+      sum += 2.0 * stencil.weights[k - 1] * std::cos(k * theta);
+    }
+    return -sum;
+  };
+
+  double k_dx = 2.0 * M_PI / cells_per_wavelength;
+  double lambda = eigenvalue(k_dx * std::cos(angle)) + eigenvalue(k_dx * std::sin(angle));
+  double s = 0.5 * courant * std::sqrt(lambda);
+  if (s >= 1.0) {
+    // unstable (or at the stability limit)
+    return INFINITY;
+  }
+  double w_dt = 2.0 * std::asin(s);
+  return w_dt / (k_dx * courant) - 1.0;
+}
+
+// Largest phase velocity error over all directions
+static double max_phase_velocity_error(const Stencil &stencil, double cells_per_wavelength,
+                                       double courant) {
+  double res = 0.0;
+  for (int i = 0; i <= 32; i++) {
+    double angle = 0.25 * M_PI * i / 32.0;
+    res = std::max(res, std::abs(phase_velocity_error(stencil, cells_per_wavelength, angle,
+                                                      courant)));
+  }
+  return res;
+}
+
+// Fewest cells per wavelength (in steps of 0.1) above which the phase velocity error is at most
+// tolerance
+static double cells_per_wavelength_for(const Stencil &stencil, double tolerance, double courant) {
+  double cells = 400.0;
+  while (cells > 2.1 && max_phase_velocity_error(stencil, cells - 0.1, courant) <= tolerance) {
+    cells -= 0.1;
+  }
+  return cells;
+}
+
+// Measured time of one step of one cell (in s) with the stencil of order, on an empty grid of
+// dispersion_grid_size cells across stepped on one thread
+static constexpr size_t dispersion_grid_size = 512;
+static double time_per_cell(int order) {
+  SimSettings settings;
+  settings.stencil_order = order;
+  settings = settings.resized(dispersion_grid_size, dispersion_grid_size);
+  Engine engine{settings, Environment{}, 1};
+  const size_t steps = 20;
+  double seconds = time_steps(engine, steps, 2, 3);
+  return seconds / ((double)engine.state().size() * (double)steps);
+}
+
+// Write the phase velocity error of each stencil against cells per wavelength, at fractions of the
+// stable delta t, and print the cells per wavelength and time each stencil needs for 1% and 0.1%
+// error. The time is the cell steps it takes to run a wavelength square for a period, times the
+// measured time per cell step of the stencil. The time stepping is second order, so at the stable
+// delta t its error hides most of the gain of the wider stencils. Their errors cancel at a smaller
+// delta t, so for each stencil the fraction of the stable delta t that needs the least time is
+// used.
+static void write_dispersion(FILE *out) {
+  const int orders[] = {2, 4, 6};
+  const double tolerances[] = {1e-2, 1e-3};
+  const double fractions[] = {1.0, 0.85, 0.7, 0.6, 0.5, 0.42, 0.35, 0.3, 0.25, 0.2, 0.15, 0.125};
+  const double table_fractions[] = {1.0, 0.5, 0.35, 0.25};
+  const double cells_per_wavelength[] = {3, 4, 5, 6, 8, 10, 12, 16, 20, 24, 32, 48, 64};
+
+  fprintf(out, "order,points,delta_t_fraction,courant,cells_per_wavelength,max_phase_error\n");
+  double base_cells[2] = {}, base_time[2] = {};
+  for (int order : orders) {
+    SimSettings settings;
+    settings.stencil_order = order;
+    settings.delta_x = 1.0;
+    settings.delta_y = 1.0;
+    settings.wave_speed_vacuum = 1.0;
+    const Stencil &stencil = settings.stencil();
+    const double stable_courant = settings.stable_delta_t();
+    const int points = 4 * stencil.radius + 1;
+    const double cell_seconds = time_per_cell(order);
+
+    for (double fraction : table_fractions) {
+      for (double cells : cells_per_wavelength) {
+        double courant = fraction * stable_courant;
+        fprintf(out, "%d,%d,%g,%.4f,%g,%.6g\n", order, points, fraction, courant, cells,
+                max_phase_velocity_error(stencil, cells, courant));
+      }
+    }
+
+    for (size_t t = 0; t < 2; t++) {
+      double best_cells = 0.0, best_time = INFINITY, best_fraction = 1.0;
+      for (double fraction : fractions) {
+        double courant = fraction * stable_courant;
+        double cells = cells_per_wavelength_for(stencil, tolerances[t], courant);
+        double seconds = cells * cells * (cells / courant) * cell_seconds;
+        if (seconds < best_time) {
+          best_cells = cells;
+          best_time = seconds;
+          best_fraction = fraction;
+        }
+      }
+      if (order == 2) {
+        base_cells[t] = best_cells;
+        base_time[t] = best_time;
+      }
+      fprintf(stderr,
+              "order %d, %g%% error: %.1f cells per wavelength at %g x the stable delta t, %.2fx "
+              "the cells and %.2fx the time of order 2 (%.2f ns per cell step)\n",
+              order, tolerances[t] * 100.0, best_cells, best_fraction,
+              (best_cells * best_cells) / (base_cells[t] * base_cells[t]), best_time / base_time[t],
+              cell_seconds * 1e9);
+    }
+  }
+}
+
+// Run each scene with periodic sources at each size until it is steady, once from zero and once
+// warm started from levels coarser grids (see progressive_warm_start), and write the steps and time
+// of each run as csv. Both runs stop at the default steady tolerance, and the relative difference
+// of their final energies shows they have settled into the same state.
+static bool write_progressive(FILE *out, const std::vector<std::filesystem::path> &scene_paths,
+                              const std::vector<size_t> &sizes, unsigned threads, int levels) {
+  fprintf(out, "scene,width,height,threads,levels,full_steps,full_seconds,coarse_seconds,"
+               "fine_steps,progressive_seconds,speedup,energy_difference\n");
+  ProgressiveOptions options{};
+  options.levels = levels;
+  for (const auto &path : scene_paths) {
+    for (size_t size : sizes) {
+      // run 0 starts from zero, and run 1 from the coarse grids
+      size_t steps[2] = {};
+      double seconds[2] = {}, energy[2] = {}, coarse_seconds = 0.0;
+      bool periodic = true, settled = true;
+      for (int run = 0; run < 2 && periodic; run++) {
+        // environments can't be copied, so reload the objects for each engine
+        auto scene = Scene::load(path.string());
+        if (!scene) {
+          return false;
+        }
+        SimSettings settings = scene->settings.resized(size, size);
+        SteadyStateDetector detector{scene->environment, settings.delta_t, SteadyStateOptions{}};
+        periodic = detector.is_periodic();
+        if (!periodic) {
+          break;
+        }
+        Engine engine{settings, std::move(scene->environment), threads};
+        auto start = std::chrono::steady_clock::now();
+        if (run == 1) {
+          for (const auto &stage : progressive_warm_start(engine, options)) {
+            coarse_seconds += stage.seconds;
+          }
+        }
+        settled &= run_until_steady(engine, detector, options.max_steps, steps[run]) ==
+                   RunState::Steady;
+        auto end = std::chrono::steady_clock::now();
+        seconds[run] = std::chrono::duration<double>(end - start).count();
+        energy[run] = detector.energy();
+      }
+      if (!periodic) {
+        fprintf(stderr, "%s has no periodic sources\n", path.filename().string().c_str());
+        break;
+      }
+      if (!settled) {
+        fprintf(stderr, "%s %zux%zu didn't settle in %zu steps\n",
+                path.filename().string().c_str(), size, size, options.max_steps);
+      }
+
+      double speedup = seconds[0] / seconds[1];
+      fprintf(out, "%s,%zu,%zu,%u,%d,%zu,%.6f,%.6f,%zu,%.6f,%.4f,%.3g\n",
+              path.filename().string().c_str(), size, size, threads, levels, steps[0], seconds[0],
+              coarse_seconds, steps[1], seconds[1], speedup,
+              std::abs(energy[1] - energy[0]) / energy[0]);
+      fprintf(stderr, "%s %zux%zu: %.3f s from zero, %.3f s progressive (%.2fx)\n",
+              path.filename().string().c_str(), size, size, seconds[0], seconds[1], speedup);
+    }
+  }
+  return true;
+}
+
+static void write_csv(FILE *out, const std::vector<BenchResult> &results) {
+  fprintf(out, "scene,width,height,threads,batch,steps,seconds,mcells_per_s,ns_per_cell,"
+               "memory_bytes,scaling_efficiency\n");
+  for (const auto &r : results) {
+    fprintf(out, "%s,%zu,%zu,%u,%zu,%zu,%.6f,%.3f,%.4f,%zu,%.4f\n", r.scene.c_str(), r.width,
+            r.height, r.threads, r.batch, r.steps, r.seconds, r.mcells_per_s, r.ns_per_cell,
+            r.memory_bytes, r.scaling_efficiency);
+  }
+}
+
+static void write_json(FILE *out, const std::vector<BenchResult> &results) {
+  fprintf(out, "[\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto &r = results[i];
+    fprintf(out,
+            "  {\"scene\": \"%s\", \"width\": %zu, \"height\": %zu, \"threads\": %u, "
+            "\"batch\": %zu, \"steps\": %zu, \"seconds\": %.6f, \"mcells_per_s\": %.3f, "
+            "\"ns_per_cell\": %.4f, \"memory_bytes\": %zu, \"scaling_efficiency\": %.4f}%s\n",
+            r.scene.c_str(), r.width, r.height, r.threads, r.batch, r.steps, r.seconds,
+            r.mcells_per_s, r.ns_per_cell, r.memory_bytes, r.scaling_efficiency,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "]\n");
+}
+
+int main(int argc, char **argv) {
+  std::string examples_dir = WAVES_EXAMPLES_DIR;
+  size_t steps = 100, warmup = 10, repeat = 3, batch = 1;
+  bool dispersion = false;
+  int progressive_levels = 0;
+  std::vector<size_t> sizes = {256, 512, 1024};
+  std::vector<size_t> thread_counts;
+  std::string format = "csv";
+  const char *output_path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--examples") && has_value) {
+      examples_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--steps") && has_value) {
+      steps = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--warmup") && has_value) {
+      warmup = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--repeat") && has_value) {
+      repeat = std::max(1ul, std::stoul(argv[++i]));
+    } else if (!strcmp(argv[i], "--sizes") && has_value) {
+      sizes = parse_list(argv[++i]);
+    } else if (!strcmp(argv[i], "--threads") && has_value) {
+      thread_counts = parse_list(argv[++i]);
+    } else if (!strcmp(argv[i], "--batch") && has_value) {
+      batch = std::max(1ul, std::stoul(argv[++i]));
+    } else if (!strcmp(argv[i], "--dispersion")) {
+      dispersion = true;
+    } else if (!strcmp(argv[i], "--progressive") && has_value) {
+      progressive_levels = std::stoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--format") && has_value) {
+      format = argv[++i];
+    } else if (!strcmp(argv[i], "--output") && has_value) {
+      output_path = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (format != "csv" && format != "json") {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  if (dispersion) {
+    FILE *out = output_path != nullptr ? fopen(output_path, "w") : stdout;
+    if (out == nullptr) {
+      fprintf(stderr, "Cannot open file: %s\n", output_path);
+      return -1;
+    }
+    write_dispersion(out);
+    if (out != stdout)
+      fclose(out);
+    return 0;
+  }
+
+  if (thread_counts.empty()) {
+    unsigned hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned t = 1; t < hardware_threads; t *= 2) {
+      thread_counts.push_back(t);
+    }
+    thread_counts.push_back(hardware_threads);
+  }
+  std::sort(thread_counts.begin(), thread_counts.end());
+
+  std::vector<std::filesystem::path> scene_paths;
+  std::error_code err;
+  for (const auto &entry : std::filesystem::directory_iterator(examples_dir, err)) {
+    if (entry.path().extension() == ".sim") {
+      scene_paths.push_back(entry.path());
+    }
+  }
+  if (err || scene_paths.empty()) {
+    fprintf(stderr, "No scenes found in %s\n", examples_dir.c_str());
+    return -1;
+  }
+  std::sort(scene_paths.begin(), scene_paths.end());
+
+  if (progressive_levels > 0) {
+    FILE *out = output_path != nullptr ? fopen(output_path, "w") : stdout;
+    if (out == nullptr) {
+      fprintf(stderr, "Cannot open file: %s\n", output_path);
+      return -1;
+    }
+    bool ok = write_progressive(out, scene_paths, sizes, (unsigned)thread_counts.back(),
+                                progressive_levels);
+    if (out != stdout)
+      fclose(out);
+    return ok ? 0 : -1;
+  }
+
+  std::vector<BenchResult> results;
+  for (const auto &path : scene_paths) {
+    auto scene = Scene::load(path.string());
+    if (!scene) {
+      return -1;
+    }
+
+    for (size_t size : sizes) {
+      SimSettings settings = scene->settings.resized(size, size);
+      size_t first_result = results.size();
+
+      for (size_t threads : thread_counts) {
+        // environments can't be copied, so reload the objects for each engine
+        double seconds = 0.0, cells = 0.0;
+        size_t memory_bytes = 0;
+        std::unique_ptr<BatchEngine> batch_engine;
+        if (batch > 1) {
+          std::vector<Scene> scenes;
+          for (size_t k = 0; k < batch; k++) {
+            auto run_scene = Scene::load(path.string());
+            run_scene->settings = settings;
+            scenes.push_back(std::move(*run_scene));
+          }
+          batch_engine = BatchEngine::create(std::move(scenes), (unsigned)threads);
+          if (!batch_engine) {
+            fprintf(stderr, "Running %s without a batch\n", path.filename().string().c_str());
+          }
+        }
+        if (batch_engine) {
+          seconds = time_steps(*batch_engine, steps, warmup, repeat);
+          cells = (double)(batch_engine->grid_width() * batch_engine->grid_height() *
+                           batch_engine->size());
+          memory_bytes = batch_engine->memory_footprint();
+        } else {
+          auto run_scene = Scene::load(path.string());
+          Engine engine{settings, std::move(run_scene->environment), (unsigned)threads};
+          seconds = time_steps(engine, steps, warmup, repeat);
+          cells = (double)engine.state().size();
+          memory_bytes = engine.memory_footprint();
+        }
+
+        double cell_steps = cells * (double)steps;
+        BenchResult res{path.filename().string(),
+                        settings.texture_width,
+                        settings.texture_height,
+                        (unsigned)threads,
+                        batch_engine ? batch_engine->size() : 1,
+                        steps,
+                        seconds,
+                        cell_steps / seconds * 1e-6,
+                        seconds * 1e9 / cell_steps,
+                        memory_bytes,
+                        1.0};
+        results.push_back(res);
+
+        fprintf(stderr, "%s %zux%zu x%zu, %u threads: %.1f Mcells/s\n", res.scene.c_str(),
+                res.width, res.height, res.batch, res.threads, res.mcells_per_s);
+      }
+
+      // scaling efficiency is relative to the smallest thread count run at this size
+      const auto &base = results[first_result];
+      for (size_t i = first_result; i < results.size(); i++) {
+        results[i].scaling_efficiency = (results[i].mcells_per_s / base.mcells_per_s) /
+                                        ((double)results[i].threads / (double)base.threads);
+      }
+    }
+  }
+
+  FILE *out = stdout;
+  if (output_path != nullptr) {
+    out = fopen(output_path, "w");
+    if (out == nullptr) {
+      fprintf(stderr, "Cannot open file: %s\n", output_path);
+      return -1;
+    }
+  }
+
+  if (format == "json") {
+    write_json(out, results);
+  } else {
+    write_csv(out, results);
+  }
+
+  if (out != stdout)
+    fclose(out);
+
+  return 0;
+}
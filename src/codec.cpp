@@ -0,0 +1,389 @@
+#include "codec.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Probabilities are 11 bit fixed point, and adapt by 1/32 of the error after each bit (the same
+// model as lzma's range coder).
+static constexpr int probability_bits = 11;
+static constexpr uint16_t probability_init = 1 << (probability_bits - 1);
+static constexpr int adapt_shift = 5;
+static constexpr uint32_t range_top = 1 << 24;
+
+class RangeEncoder {
+  std::vector<uint8_t> &out;
+  uint64_t low{0};
+  uint32_t range{0xFFFFFFFF};
+  // last byte written, held back in case a carry propagates into it, followed by cache_size - 1
+  // 0xff bytes
+  uint8_t cache{0};
+  uint64_t cache_size{1};
+
+  void shift_low() {
+    if ((uint32_t)low < 0xFF000000u || (low >> 32) != 0) {
+      uint8_t carry = (uint8_t)(low >> 32);
+      uint8_t byte = cache;
+      do {
+        out.push_back(byte + carry);
+        byte = 0xFF;
+      } while (--cache_size != 0);
+      cache = (uint8_t)(low >> 24);
+    }
+    cache_size++;
+    low = (low & 0x00FFFFFF) << 8;
+  }
+
+  void normalize() {
+    while (range < range_top) {
+      range <<= 8;
+      shift_low();
+    }
+  }
+
+public:
+  explicit RangeEncoder(std::vector<uint8_t> &out) : out(out) {}
+
+  void encode_bit(uint16_t &probability, bool bit) {
+    uint32_t bound = (range >> probability_bits) * probability;
+    if (!bit) {
+      range = bound;
+      probability += ((1 << probability_bits) - probability) >> adapt_shift;
+    } else {
+      low += bound;
+      range -= bound;
+      probability -= probability >> adapt_shift;
+    }
+    normalize();
+  }
+
+  // encode the low bits bits of value with a fixed probability of 1/2
+  void encode_direct(uint64_t value, int bits) {
+    for (int i = bits - 1; i >= 0; i--) {
+      range >>= 1;
+      if ((value >> i) & 1) {
+        low += range;
+      }
+      normalize();
+    }
+  }
+
+  void flush() {
+    for (int i = 0; i < 5; i++) {
+      shift_low();
+    }
+  }
+};
+
+class RangeDecoder {
+  const uint8_t *data;
+  size_t size;
+  size_t pos{0};
+  uint32_t range{0xFFFFFFFF};
+  uint32_t code{0};
+
+  // bytes past the end of the data read as 0
+  uint8_t next_byte() { return pos < size ? data[pos++] : 0; }
+
+  void normalize() {
+    while (range < range_top) {
+      range <<= 8;
+      code = (code << 8) | next_byte();
+    }
+  }
+
+public:
+  RangeDecoder(const uint8_t *data, size_t size) : data(data), size(size) {
+    for (int i = 0; i < 5; i++) {
+      code = (code << 8) | next_byte();
+    }
+  }
+
+  bool decode_bit(uint16_t &probability) {
+    uint32_t bound = (range >> probability_bits) * probability;
+    bool bit;
+    if (code < bound) {
+      range = bound;
+      probability += ((1 << probability_bits) - probability) >> adapt_shift;
+      bit = false;
+    } else {
+      code -= bound;
+      range -= bound;
+      probability -= probability >> adapt_shift;
+      bit = true;
+    }
+    normalize();
+    return bit;
+  }
+
+  uint64_t decode_direct(int bits) {
+    uint64_t value = 0;
+    for (int i = 0; i < bits; i++) {
+      range >>= 1;
+      bool bit = code >= range;
+      if (bit) {
+        code -= range;
+      }
+      value = (value << 1) | bit;
+      normalize();
+    }
+    return value;
+  }
+};
+
+// quantized values are clamped to +-2^30, so differences and residuals always fit in 34 bits
+static constexpr float quantize_limit = (float)(1 << 30);
+static constexpr int max_magnitude_bits = 36;
+// residuals are coded with one of residual_contexts sets of probabilities, selected by the size of
+// the left and top residuals
+static constexpr int residual_contexts = 12;
+
+static int floor_log2(uint64_t value) {
+  int res = 0;
+  while (value >> (res + 1)) {
+    res++;
+  }
+  return res;
+}
+
+static int residual_context(uint64_t left_magnitude, uint64_t top_magnitude) {
+  uint64_t sum = left_magnitude + top_magnitude;
+  if (sum == 0) {
+    return 0;
+  }
+  return std::min(1 + floor_log2(sum), residual_contexts - 1);
+}
+
+// Adaptive probabilities for coding residuals
+struct ResidualModel {
+  uint16_t zero[residual_contexts];
+  uint16_t sign[residual_contexts];
+  // Exp-Golomb prefix (the number of bits in the magnitude)
+  uint16_t prefix[residual_contexts][max_magnitude_bits];
+  // highest bit of the magnitude below its leading one
+  uint16_t suffix[max_magnitude_bits];
+
+  ResidualModel() {
+    std::fill_n(&zero[0], residual_contexts, probability_init);
+    std::fill_n(&sign[0], residual_contexts, probability_init);
+    std::fill_n(&prefix[0][0], residual_contexts * max_magnitude_bits, probability_init);
+    std::fill_n(&suffix[0], max_magnitude_bits, probability_init);
+  }
+
+  void encode(RangeEncoder &enc, int64_t residual, int ctx) {
+    enc.encode_bit(zero[ctx], residual != 0);
+    if (residual == 0) {
+      return;
+    }
+    enc.encode_bit(sign[ctx], residual < 0);
+
+    uint64_t magnitude = residual < 0 ? -(uint64_t)residual : (uint64_t)residual;
+    int bits = floor_log2(magnitude);
+    for (int i = 0; i < bits; i++) {
+      enc.encode_bit(prefix[ctx][i], true);
+    }
+    enc.encode_bit(prefix[ctx][bits], false);
+    if (bits > 0) {
+      enc.encode_bit(suffix[bits], (magnitude >> (bits - 1)) & 1);
+      enc.encode_direct(magnitude, bits - 1);
+    }
+  }
+
+  // Return false if the data is invalid
+  bool decode(RangeDecoder &dec, int ctx, int64_t &residual) {
+    if (!dec.decode_bit(zero[ctx])) {
+      residual = 0;
+      return true;
+    }
+    bool negative = dec.decode_bit(sign[ctx]);
+
+    int bits = 0;
+    while (dec.decode_bit(prefix[ctx][bits])) {
+      if (++bits == max_magnitude_bits) {
+        return false;
+      }
+    }
+    uint64_t magnitude = 1;
+    if (bits > 0) {
+      magnitude = (magnitude << 1) | dec.decode_bit(suffix[bits]);
+      magnitude = (magnitude << (bits - 1)) | dec.decode_direct(bits - 1);
+    }
+
+    residual = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    return true;
+  }
+};
+
+// LOCO-I median edge detector prediction of the value at (x, y) from its left, top, and top left
+// neighbours. row points to the tile's values at (0, y), and the top row of a tile has no top
+// neighbours.
+static int64_t predict(const int64_t *row, size_t x, size_t width, bool first_row) {
+  if (first_row) {
+    return x > 0 ? row[x - 1] : 0;
+  }
+  int64_t top = row[x - width];
+  if (x == 0) {
+    return top;
+  }
+  int64_t left = row[x - 1];
+  int64_t top_left = row[x - 1 - width];
+  if (top_left >= std::max(left, top)) {
+    return std::min(left, top);
+  }
+  if (top_left <= std::min(left, top)) {
+    return std::max(left, top);
+  }
+  return left + top - top_left;
+}
+
+static int32_t quantize(float value, float step) {
+  float q = value / step;
+  if (!(std::fabs(q) < quantize_limit)) {
+    // out of range (or nan)
+    q = q > 0 ? quantize_limit : -quantize_limit;
+  }
+  return (int32_t)std::lrint(q);
+}
+
+FieldCodec::FieldCodec(size_t width, size_t height, float error_bound, ThreadPool &pool)
+    : width(width), height(height), step(2.0f * error_bound), previous(width * height, 0),
+      pool(pool) {}
+
+void FieldCodec::encode(const float *field, bool keyframe, std::vector<uint8_t> &out) {
+  TRACE_SCOPE("FieldCodec::encode");
+
+  const size_t tile_count = (height + tile_rows - 1) / tile_rows;
+  std::vector<std::vector<uint8_t>> tiles(tile_count);
+
+  pool.parallel_for(tile_count, [&](size_t begin, size_t end) {
+    std::vector<int64_t> values(tile_rows * width);
+    std::vector<uint64_t> magnitudes(2 * width);
+
+    for (size_t tile = begin; tile < end; tile++) {
+      TRACE_SCOPE("encode_tile");
+      size_t y0 = tile * tile_rows;
+      size_t y1 = std::min(height, y0 + tile_rows);
+
+      // quantize, and take the difference from the previous frame
+      for (size_t i = 0; i < (y1 - y0) * width; i++) {
+        size_t index = y0 * width + i;
+        int32_t q = quantize(field[index], step);
+        values[i] = keyframe ? q : (int64_t)q - previous[index];
+        previous[index] = q;
+      }
+
+      RangeEncoder enc{tiles[tile]};
+      ResidualModel model;
+      std::fill(magnitudes.begin(), magnitudes.end(), 0);
+      for (size_t y = y0; y < y1; y++) {
+        const int64_t *row = values.data() + (y - y0) * width;
+        uint64_t *row_magnitudes = magnitudes.data() + (y % 2) * width;
+        const uint64_t *top_magnitudes = magnitudes.data() + ((y + 1) % 2) * width;
+
+        for (size_t x = 0; x < width; x++) {
+          int64_t residual = row[x] - predict(row, x, width, y == y0);
+          int ctx = residual_context(x > 0 ? row_magnitudes[x - 1] : 0,
+                                     y > y0 ? top_magnitudes[x] : 0);
+          model.encode(enc, residual, ctx);
+          row_magnitudes[x] = residual < 0 ? -(uint64_t)residual : (uint64_t)residual;
+        }
+      }
+      enc.flush();
+    }
+  });
+
+  uint32_t header_size = (uint32_t)(1 + tile_count) * sizeof(uint32_t);
+  size_t size = header_size;
+  for (const auto &tile : tiles) {
+    size += tile.size();
+  }
+  out.resize(size);
+
+  uint8_t *dst = out.data();
+  uint32_t count = tile_count;
+  memcpy(dst, &count, sizeof(count));
+  dst += sizeof(count);
+  for (const auto &tile : tiles) {
+    uint32_t tile_size = tile.size();
+    memcpy(dst, &tile_size, sizeof(tile_size));
+    dst += sizeof(tile_size);
+  }
+  for (const auto &tile : tiles) {
+    memcpy(dst, tile.data(), tile.size());
+    dst += tile.size();
+  }
+}
+
+bool FieldCodec::decode(const uint8_t *data, size_t size, bool keyframe, float *field) {
+  TRACE_SCOPE("FieldCodec::decode");
+
+  const size_t tile_count = (height + tile_rows - 1) / tile_rows;
+  uint32_t count;
+  if (size < sizeof(count)) {
+    return false;
+  }
+  memcpy(&count, data, sizeof(count));
+  if (count != tile_count || size < (1 + tile_count) * sizeof(uint32_t)) {
+    return false;
+  }
+
+  // find the start of each tile
+  std::vector<size_t> tile_offsets(tile_count + 1);
+  tile_offsets[0] = (1 + tile_count) * sizeof(uint32_t);
+  for (size_t tile = 0; tile < tile_count; tile++) {
+    uint32_t tile_size;
+    memcpy(&tile_size, data + (1 + tile) * sizeof(uint32_t), sizeof(tile_size));
+    tile_offsets[tile + 1] = tile_offsets[tile] + tile_size;
+  }
+  if (tile_offsets[tile_count] > size) {
+    return false;
+  }
+
+  std::vector<uint8_t> tile_ok(tile_count, true);
+  pool.parallel_for(tile_count, [&](size_t begin, size_t end) {
+    std::vector<int64_t> values(tile_rows * width);
+    std::vector<uint64_t> magnitudes(2 * width);
+
+    for (size_t tile = begin; tile < end; tile++) {
+      TRACE_SCOPE("decode_tile");
+      size_t y0 = tile * tile_rows;
+      size_t y1 = std::min(height, y0 + tile_rows);
+
+      RangeDecoder dec{data + tile_offsets[tile], tile_offsets[tile + 1] - tile_offsets[tile]};
+      ResidualModel model;
+      std::fill(magnitudes.begin(), magnitudes.end(), 0);
+      for (size_t y = y0; y < y1; y++) {
+        int64_t *row = values.data() + (y - y0) * width;
+        uint64_t *row_magnitudes = magnitudes.data() + (y % 2) * width;
+        const uint64_t *top_magnitudes = magnitudes.data() + ((y + 1) % 2) * width;
+
+        for (size_t x = 0; x < width; x++) {
+          int ctx = residual_context(x > 0 ? row_magnitudes[x - 1] : 0,
+                                     y > y0 ? top_magnitudes[x] : 0);
+          int64_t residual;
+          if (!model.decode(dec, ctx, residual)) {
+            tile_ok[tile] = false;
+            return;
+          }
+          row[x] = residual + predict(row, x, width, y == y0);
+          row_magnitudes[x] = residual < 0 ? -(uint64_t)residual : (uint64_t)residual;
+        }
+      }
+
+      for (size_t i = 0; i < (y1 - y0) * width; i++) {
+        size_t index = y0 * width + i;
+        int64_t q = keyframe ? values[i] : previous[index] + values[i];
+        previous[index] = (int32_t)q;
+        field[index] = (float)q * step;
+      }
+    }
+  });
+
+  for (size_t tile = 0; tile < tile_count; tile++) {
+    if (!tile_ok[tile]) {
+      return false;
+    }
+  }
+  return true;
+}
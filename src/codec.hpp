@@ -0,0 +1,48 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "thread_pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// FieldCodec compresses a sequence of fields (such as recorded u frames) to within an absolute
+// error bound.
+//
+// Each value is quantized to the nearest multiple of 2 * error_bound, so the reconstruction error
+// is at most error_bound (plus float rounding). A keyframe codes the quantized field itself, and
+// every other frame codes the difference from the previous frame's quantized field. Since that
+// difference is exact in the integers, errors don't build up between keyframes. The (difference)
+// field is then predicted from its left, top, and top left neighbours (the LOCO-I median
+// predictor), and the prediction residuals are coded with an adaptive binary range coder: a zero
+// flag, a sign, and an Exp-Golomb magnitude, with the probabilities selected by the size of the
+// neighbouring residuals.
+//
+// The field is split into bands of tile_rows rows that are coded independently, so tiles are
+// encoded and decoded in parallel. An encoded frame is a uint32 tile count, the uint32 size of each
+// tile, and then the tiles.
+class FieldCodec {
+  size_t width, height;
+  // quantization step (twice the error bound)
+  float step;
+  // quantized values of the last encoded or decoded frame
+  std::vector<int32_t> previous;
+
+  ThreadPool &pool;
+
+public:
+  static constexpr size_t tile_rows = 64;
+
+  // Create a codec for width x height fields that runs on pool. error_bound must be positive.
+  FieldCodec(size_t width, size_t height, float error_bound, ThreadPool &pool);
+
+  // Encode field (width * height values), and replace out with the encoded frame. If keyframe is
+  // false, the frame is coded against the last encoded frame.
+  void encode(const float *field, bool keyframe, std::vector<uint8_t> &out);
+  // Decode an encoded frame into field. A frame that isn't a keyframe must follow the frame it was
+  // coded against. Return false if the data is invalid.
+  bool decode(const uint8_t *data, size_t size, bool keyframe, float *field);
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "compare.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+FieldDiff field_diff(const float *a, const float *ref, size_t n) {
+  FieldDiff res;
+  float max_abs = 0.0f, ref_max_abs = 0.0f;
+  double sum_sq = 0.0;
+  size_t i = 0;
+
+#if defined(__AVX__)
+  // clears the sign bit
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 max_v = _mm256_setzero_ps(), ref_max_v = _mm256_setzero_ps();
+  __m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+
+  for (; i + 8 <= n; i += 8) {
+    __m256 va = _mm256_loadu_ps(a + i);
+    __m256 vr = _mm256_loadu_ps(ref + i);
+    __m256 diff = _mm256_sub_ps(va, vr);
+    max_v = _mm256_max_ps(max_v, _mm256_and_ps(diff, abs_mask));
+    ref_max_v = _mm256_max_ps(ref_max_v, _mm256_and_ps(vr, abs_mask));
+
+    // accumulate squares in double precision so large fields don't lose small differences
+    __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(diff));
+    __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(diff, 1));
+    sum_lo = _mm256_add_pd(sum_lo, _mm256_mul_pd(lo, lo));
+    sum_hi = _mm256_add_pd(sum_hi, _mm256_mul_pd(hi, hi));
+  }
+
+  float max_lanes[8], ref_max_lanes[8];
+  double sum_lanes[4];
+  _mm256_storeu_ps(max_lanes, max_v);
+  _mm256_storeu_ps(ref_max_lanes, ref_max_v);
+  _mm256_storeu_pd(sum_lanes, _mm256_add_pd(sum_lo, sum_hi));
+  for (int k = 0; k < 8; k++) {
+    max_abs = std::max(max_abs, max_lanes[k]);
+    ref_max_abs = std::max(ref_max_abs, ref_max_lanes[k]);
+  }
+  for (int k = 0; k < 4; k++) {
+    sum_sq += sum_lanes[k];
+  }
+#elif defined(__SSE2__)
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 max_v = _mm_setzero_ps(), ref_max_v = _mm_setzero_ps();
+  __m128d sum_lo = _mm_setzero_pd(), sum_hi = _mm_setzero_pd();
+
+  for (; i + 4 <= n; i += 4) {
+    __m128 va = _mm_loadu_ps(a + i);
+    __m128 vr = _mm_loadu_ps(ref + i);
+    __m128 diff = _mm_sub_ps(va, vr);
+    max_v = _mm_max_ps(max_v, _mm_and_ps(diff, abs_mask));
+    ref_max_v = _mm_max_ps(ref_max_v, _mm_and_ps(vr, abs_mask));
+
+    __m128d lo = _mm_cvtps_pd(diff);
+    __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(diff, diff));
+    sum_lo = _mm_add_pd(sum_lo, _mm_mul_pd(lo, lo));
+    sum_hi = _mm_add_pd(sum_hi, _mm_mul_pd(hi, hi));
+  }
+
+  float max_lanes[4], ref_max_lanes[4];
+  double sum_lanes[2];
+  _mm_storeu_ps(max_lanes, max_v);
+  _mm_storeu_ps(ref_max_lanes, ref_max_v);
+  _mm_storeu_pd(sum_lanes, _mm_add_pd(sum_lo, sum_hi));
+  for (int k = 0; k < 4; k++) {
+    max_abs = std::max(max_abs, max_lanes[k]);
+    ref_max_abs = std::max(ref_max_abs, ref_max_lanes[k]);
+  }
+  sum_sq = sum_lanes[0] + sum_lanes[1];
+#endif
+
+  // remaining elements (or all of them without simd)
+  for (; i < n; i++) {
+    float diff = a[i] - ref[i];
+    max_abs = std::max(max_abs, std::abs(diff));
+    ref_max_abs = std::max(ref_max_abs, std::abs(ref[i]));
+    sum_sq += (double)diff * (double)diff;
+  }
+
+  // simd max drops nans, but they still propagate through the sum of squares
+  res.max_abs = std::isfinite(sum_sq) ? max_abs : INFINITY;
+  res.ref_max_abs = ref_max_abs;
+  res.rms = n > 0 ? std::sqrt(sum_sq / (double)n) : 0.0;
+  return res;
+}
@@ -0,0 +1,20 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <cstddef>
+
+// Difference between two fields
+struct FieldDiff {
+  // largest absolute difference of any element
+  float max_abs{0.0};
+  // root mean square of the differences
+  double rms{0.0};
+  // largest absolute value in the reference field
+  float ref_max_abs{0.0};
+};
+
+// Compare field a against reference field ref (both n elements long). This uses sse/avx when they
+// are available, and a scalar loop otherwise.
+FieldDiff field_diff(const float *a, const float *ref, size_t n);
+
+#endif
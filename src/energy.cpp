@@ -0,0 +1,230 @@
+#include "energy.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The energy density terms of cell c. The neighbor to the right is at c + right and the neighbor
+// above at c + up, where an offset of 0 means the neighbor is outside the grid.
+static inline double cell_energy(const float *u, const float *u_t, const float *ior_inv,
+                                 const float *boundary, size_t c, size_t right, size_t up,
+                                 float speed2, float aspect2) {
+  float open = 1.0f - boundary[c];
+  float u_x = u[c + right] - u[c];
+  float u_y = u[c + up] - u[c];
+  float grad2 = (1.0f - boundary[c + right]) * u_x * u_x +
+                (1.0f - boundary[c + up]) * aspect2 * u_y * u_y;
+  float c2 = ior_inv[c] * ior_inv[c] * speed2;
+  return (double)(open * (u_t[c] * u_t[c] + c2 * grad2));
+}
+
+double field_energy(const SimGrid &grid, float wave_speed_vacuum, size_t y0, size_t y1) {
+  const size_t width = grid.width;
+  const float *u = grid.u.data();
+  const float *u_t = grid.u_t.data();
+  const float *ior_inv = grid.ior_inv.data();
+  const float *boundary = grid.boundary.data();
+  // (c / delta_x)^2 in vacuum, which scales the squared differences to squared gradients
+  const float speed2 = wave_speed_vacuum * wave_speed_vacuum / (grid.delta_x * grid.delta_x);
+  // (delta_x / delta_y)^2, which scales the squared differences along y to the same units
+  const float aspect2 = (grid.delta_x * grid.delta_x) / (grid.delta_y * grid.delta_y);
+  double sum = 0.0;
+
+  for (size_t y = y0; y < y1; y++) {
+    const size_t row = y * width;
+    // the top row has no neighbors above, so it is compared with itself (which gives a difference
+    // of 0)
+    const size_t up = y + 1 < grid.height ? width : 0;
+    size_t x = 0;
+
+#if defined(__AVX__)
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 speed2_v = _mm256_set1_ps(speed2);
+    const __m256 aspect2_v = _mm256_set1_ps(aspect2);
+    __m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+
+    // the last cell of the row has no neighbor to the right, so it is left to the scalar loop
+    for (; x + 8 < width; x += 8) {
+      const size_t c = row + x;
+      __m256 u_c = _mm256_loadu_ps(u + c);
+      __m256 u_x = _mm256_sub_ps(_mm256_loadu_ps(u + c + 1), u_c);
+      __m256 u_y = _mm256_sub_ps(_mm256_loadu_ps(u + c + up), u_c);
+      __m256 open_x = _mm256_sub_ps(one, _mm256_loadu_ps(boundary + c + 1));
+      __m256 open_y =
+          _mm256_mul_ps(_mm256_sub_ps(one, _mm256_loadu_ps(boundary + c + up)), aspect2_v);
+      __m256 grad2 = _mm256_add_ps(_mm256_mul_ps(open_x, _mm256_mul_ps(u_x, u_x)),
+                                   _mm256_mul_ps(open_y, _mm256_mul_ps(u_y, u_y)));
+      __m256 ior = _mm256_loadu_ps(ior_inv + c);
+      __m256 c2 = _mm256_mul_ps(_mm256_mul_ps(ior, ior), speed2_v);
+      __m256 v = _mm256_loadu_ps(u_t + c);
+      __m256 e = _mm256_add_ps(_mm256_mul_ps(v, v), _mm256_mul_ps(c2, grad2));
+      e = _mm256_mul_ps(e, _mm256_sub_ps(one, _mm256_loadu_ps(boundary + c)));
+
+      // accumulate in double precision, so small cells aren't lost in the total of a large grid
+      sum_lo = _mm256_add_pd(sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(e)));
+      sum_hi = _mm256_add_pd(sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(e, 1)));
+    }
+
+    double sum_lanes[4];
+    _mm256_storeu_pd(sum_lanes, _mm256_add_pd(sum_lo, sum_hi));
+    for (int k = 0; k < 4; k++) {
+      sum += sum_lanes[k];
+    }
+#elif defined(__SSE2__)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 speed2_v = _mm_set1_ps(speed2);
+    const __m128 aspect2_v = _mm_set1_ps(aspect2);
+    __m128d sum_lo = _mm_setzero_pd(), sum_hi = _mm_setzero_pd();
+
+    for (; x + 4 < width; x += 4) {
+      const size_t c = row + x;
+      __m128 u_c = _mm_loadu_ps(u + c);
+      __m128 u_x = _mm_sub_ps(_mm_loadu_ps(u + c + 1), u_c);
+      __m128 u_y = _mm_sub_ps(_mm_loadu_ps(u + c + up), u_c);
+      __m128 open_x = _mm_sub_ps(one, _mm_loadu_ps(boundary + c + 1));
+      __m128 open_y = _mm_mul_ps(_mm_sub_ps(one, _mm_loadu_ps(boundary + c + up)), aspect2_v);
+      __m128 grad2 = _mm_add_ps(_mm_mul_ps(open_x, _mm_mul_ps(u_x, u_x)),
+                                _mm_mul_ps(open_y, _mm_mul_ps(u_y, u_y)));
+      __m128 ior = _mm_loadu_ps(ior_inv + c);
+      __m128 c2 = _mm_mul_ps(_mm_mul_ps(ior, ior), speed2_v);
+      __m128 v = _mm_loadu_ps(u_t + c);
+      __m128 e = _mm_add_ps(_mm_mul_ps(v, v), _mm_mul_ps(c2, grad2));
+      e = _mm_mul_ps(e, _mm_sub_ps(one, _mm_loadu_ps(boundary + c)));
+
+      sum_lo = _mm_add_pd(sum_lo, _mm_cvtps_pd(e));
+      sum_hi = _mm_add_pd(sum_hi, _mm_cvtps_pd(_mm_movehl_ps(e, e)));
+    }
+
+    double sum_lanes[2];
+    _mm_storeu_pd(sum_lanes, _mm_add_pd(sum_lo, sum_hi));
+    sum += sum_lanes[0] + sum_lanes[1];
+#endif
+
+    // remaining cells (or all of them without simd)
+    for (; x < width; x++) {
+      size_t right = x + 1 < width ? 1 : 0;
+      sum += cell_energy(u, u_t, ior_inv, boundary, row + x, right, up, speed2, aspect2);
+    }
+  }
+
+  return 0.5 * sum * (double)grid.delta_x * (double)grid.delta_y;
+}
+
+const char *run_state_name(RunState state) {
+  switch (state) {
+  case RunState::Running:
+    return "running";
+  case RunState::Steady:
+    return "steady";
+  case RunState::Decayed:
+    return "decayed";
+  }
+  return "unknown";
+}
+
+SteadyStateDetector::SteadyStateDetector(const Environment &environment, float delta_t,
+                                         const SteadyStateOptions &options)
+    : options(options) {
+  std::vector<float> frequencies;
+  for (const auto &obj : environment.objects) {
+    const Waveform *waveform = obj->source_waveform();
+    if (waveform == nullptr) {
+      continue;
+    }
+    if (auto *pulse = dynamic_cast<const GaussianEnvelope *>(waveform)) {
+      pulses_end = std::max(pulses_end, (double)pulse->start_t + pulse->duration_95);
+    } else {
+      frequencies.push_back(waveform->get_freq_amp().first);
+    }
+  }
+
+  // the energy of several sources only repeats once they are back in phase, so beats count as
+  // periods as well. Beats of almost equal frequencies would never settle, so they are capped.
+  double longest_source = 0.0;
+  for (size_t i = 0; i < frequencies.size(); i++) {
+    if (frequencies[i] > 0.0f) {
+      longest_source = std::max(longest_source, 1.0 / frequencies[i]);
+    }
+  }
+  period = longest_source;
+  for (size_t i = 0; i < frequencies.size(); i++) {
+    for (size_t j = i + 1; j < frequencies.size(); j++) {
+      double beat = std::abs((double)frequencies[i] - frequencies[j]);
+      if (beat > 0.0) {
+        period = std::max(period, std::min(1.0 / beat, 64.0 * longest_source));
+      }
+    }
+  }
+  periodic = period > 0.0;
+
+  every = std::max<size_t>(options.check_every, 1);
+  if (periodic) {
+    every = std::clamp<size_t>((size_t)(period / (32.0 * delta_t)), 1, every);
+  }
+}
+
+RunState SteadyStateDetector::add(double time, double energy) {
+  if (run_state != RunState::Running) {
+    return run_state;
+  }
+  peak = std::max(peak, energy);
+
+  if (!periodic) {
+    last = energy;
+    if (time >= pulses_end && energy <= options.decay_tolerance * peak) {
+      run_state = RunState::Decayed;
+    }
+    return run_state;
+  }
+
+  if (samples == 0) {
+    window_start = time;
+  } else {
+    // the energy is integrated over each window with the trapezoidal rule. A window ends a period
+    // after it starts (between two samples, where the energy is interpolated), so each mean is over
+    // exactly one period no matter how the samples line up with it.
+    while (time >= window_start + period) {
+      double end = window_start + period;
+      double end_energy = last + (energy - last) * (end - last_time) / (time - last_time);
+      window_integral += 0.5 * (last + end_energy) * (end - last_time);
+      double mean = window_integral / period;
+      if (last_mean >= 0.0) {
+        double change = std::abs(mean - last_mean);
+        bool steady = change <= options.steady_tolerance * std::max(mean, last_mean);
+        steady_count = steady ? steady_count + 1 : 0;
+      }
+      last_mean = mean;
+      window_start = end;
+      window_integral = 0.0;
+      last_time = end;
+      last = end_energy;
+    }
+    window_integral += 0.5 * (last + energy) * (time - last_time);
+  }
+  last_time = time;
+  last = energy;
+  samples++;
+
+  if (steady_count >= options.steady_periods && time >= pulses_end) {
+    run_state = RunState::Steady;
+  }
+  return run_state;
+}
+
+void SteadyStateDetector::reset() {
+  run_state = RunState::Running;
+  last = 0.0;
+  peak = 0.0;
+  samples = 0;
+  last_time = 0.0;
+  window_start = 0.0;
+  window_integral = 0.0;
+  last_mean = -1.0;
+  steady_count = 0;
+}
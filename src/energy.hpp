@@ -0,0 +1,92 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include "geometry.hpp"
+#include "grid.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// Total energy of rows [y0, y1) of a grid:
+//
+//   E = 1/2 * sum(u_t^2 + c^2 * ((u(x+1) - u)^2 / delta_x^2 + (u(y+1) - u)^2 / delta_y^2))
+//           * delta_x * delta_y
+//
+// where c is the wave speed of the cell. Boundary cells, and differences across a boundary or the
+// edge of the grid, don't count. This uses sse/avx when they are available, and a scalar loop
+// otherwise.
+double field_energy(const SimGrid &grid, float wave_speed_vacuum, size_t y0, size_t y1);
+
+// What a run has settled into
+enum class RunState {
+  // still changing
+  Running,
+  // the sources are periodic and the field has stopped changing from period to period
+  Steady,
+  // the sources are pulses that have ended, and the field has been absorbed
+  Decayed,
+};
+
+const char *run_state_name(RunState state);
+
+struct SteadyStateOptions {
+  // sample the energy every check_every steps (or more often, so there are at least 32 samples
+  // per period)
+  size_t check_every{16};
+  // the field is steady once its energy averaged over a period changes by less than
+  // steady_tolerance (relative) for steady_periods periods in a row
+  double steady_tolerance{1e-3};
+  int steady_periods{3};
+  // a pulse has decayed once the energy is below decay_tolerance times its peak
+  double decay_tolerance{1e-4};
+};
+
+// SteadyStateDetector decides when a run can stop, from the total field energy sampled every few
+// steps. If any source is periodic, the run is done once the energy averaged over each period stops
+// changing. The period is the longest of the source periods and the beat periods between them. If
+// every source is a GaussianEnvelope pulse (or there are no sources), the run is done once all the
+// pulses have ended and the energy has decayed to a small fraction of its peak.
+class SteadyStateDetector {
+  SteadyStateOptions options;
+  bool periodic{false};
+  // averaging window (in s) for periodic sources
+  double period{0.0};
+  // time (in s) after which every pulse has ended
+  double pulses_end{0.0};
+  size_t every{1};
+
+  RunState run_state{RunState::Running};
+  double last{0.0}, peak{0.0};
+  // number of samples added, and the time of the last one
+  uint64_t samples{0};
+  double last_time{0.0};
+  // start (in s) and energy integral of the current window
+  double window_start{0.0}, window_integral{0.0};
+  // mean of the last complete window (or negative if there is none yet)
+  double last_mean{-1.0};
+  int steady_count{0};
+
+public:
+  SteadyStateDetector() = default;
+  // Detect the state of runs of environment with steps of delta_t seconds
+  SteadyStateDetector(const Environment &environment, float delta_t,
+                      const SteadyStateOptions &options = {});
+
+  // If the energy should be sampled after step
+  bool wants(uint64_t step) const { return step % every == 0; }
+  // Add the energy sampled at time, and return the new state. Once the state isn't Running, it
+  // stays that way until reset.
+  RunState add(double time, double energy);
+  void reset();
+
+  RunState state() const { return run_state; }
+  bool is_periodic() const { return periodic; }
+  // averaging window (in s) for periodic sources
+  double window() const { return period; }
+  size_t check_every() const { return every; }
+  // last and largest sampled energy
+  double energy() const { return last; }
+  double peak_energy() const { return peak; }
+};
+
+#endif
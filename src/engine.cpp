@@ -0,0 +1,795 @@
+#include "engine.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+Engine::Engine(const SimSettings &settings, Environment environment, unsigned threads)
+    : settings(settings), environment(std::move(environment)),
+      grid(settings.texture_width, settings.texture_height, settings.delta_x, settings.delta_y),
+      next_u(grid.size(), 0.0f), next_u_t(grid.size(), 0.0f), pool(threads) {
+  init_damping();
+
+  // media and boundaries don't change over time, so their channels are only rasterized once
+  grid.pass_mask = glm::bvec4(false, false, true, true);
+  this->environment.rasterize(grid, time);
+  grid.pass_mask = glm::bvec4(true, true, false, false);
+  grid.mirror(settings.symmetry_x, settings.symmetry_y);
+}
+
+// precompute the damping factor used by damping() in wave_sim.frag
+void Engine::init_damping() {
+  float damping_area_size = (float)settings.damping_area_size;
+
+  // the distance from the center of cell k to the closest edge is k + 0.5 (where k is the index of
+  // the cell counted from the closest edge)
+  for (size_t k = 0; (float)k + 0.5f < damping_area_size; k++) {
+    float norm = ((float)k + 0.5f) / damping_area_size;
+    damping_lut.push_back(std::tanh(2.0f * norm + 1.0f));
+  }
+
+  // a periodic axis has no edges, so only the other axis counts
+  damping_index_x.resize(grid.width);
+  for (size_t x = 0; x < grid.width; x++) {
+    damping_index_x[x] = settings.periodic_x ? SIZE_MAX : std::min(x, grid.width - 1 - x);
+  }
+  damping_index_y.resize(grid.height);
+  for (size_t y = 0; y < grid.height; y++) {
+    damping_index_y[y] = settings.periodic_y ? SIZE_MAX : std::min(y, grid.height - 1 - y);
+  }
+}
+
+void Engine::mirror(bool ghosts_only) {
+  const size_t width = grid.width, height = grid.height;
+  const Symmetry symmetry_x = settings.symmetry_x, symmetry_y = settings.symmetry_y;
+  if (ghosts_only) {
+    const size_t radius = (size_t)settings.stencil().radius;
+    const size_t start_x = mirror_start(width, symmetry_x);
+    const size_t start_y = mirror_start(height, symmetry_y);
+    mirror_plane(grid.u.data(), width, height, symmetry_x, symmetry_y, true, 1,
+                 start_x - std::min(start_x, radius), start_x, start_y, height);
+    mirror_plane(grid.u.data(), width, height, symmetry_x, symmetry_y, true, 1, start_x, width,
+                 start_y - std::min(start_y, radius), start_y);
+    // the simulated cells at the far edge of a periodic axis wrap around to the first cells of the
+    // grid, which are images too
+    if (settings.periodic_x) {
+      mirror_plane(grid.u.data(), width, height, symmetry_x, symmetry_y, true, 1, 0,
+                   std::min(start_x, radius), start_y, height);
+    }
+    if (settings.periodic_y) {
+      mirror_plane(grid.u.data(), width, height, symmetry_x, symmetry_y, true, 1, start_x, width, 0,
+                   std::min(start_y, radius));
+    }
+    return;
+  }
+
+  pool.parallel_for(height, [&](size_t y0, size_t y1) {
+    auto mirror_rows = [&](std::vector<float> &plane, bool odd_sign) {
+      mirror_plane(plane.data(), width, height, symmetry_x, symmetry_y, odd_sign, 1, 0, width, y0,
+                   y1);
+    };
+    mirror_rows(grid.u, true);
+    mirror_rows(grid.u_t, true);
+    if (accumulating) {
+      mirror_rows(mean_square, false);
+      mirror_rows(peak, false);
+    }
+    for (size_t k = 0; k < phasor.frequencies.size(); k++) {
+      mirror_rows(phasor_re[k], true);
+      mirror_rows(phasor_im[k], true);
+    }
+  });
+}
+
+// Weighted sum of the values at offsets 1 to Radius either side of a cell, where line[Radius + i]
+// holds the value at offset i for the open cells from -open_lo to open_hi. The values past them are
+// folded back across the first closed cell until they land on an open one.
+template <int Radius>
+static inline float fold_sum(const float *line, int open_lo, int open_hi, const float *weights) {
+  auto value = [&](int i) {
+    while (i > open_hi || i < -open_lo) {
+      i = i > open_hi ? 2 * open_hi + 1 - i : -2 * open_lo - 1 - i;
+    }
+    return line[Radius + i];
+  };
+  float sum = 0.0f;
+  for (int k = 1; k <= Radius; k++) {
+    sum += weights[k - 1] * (value(-k) + value(k));
+  }
+  return sum;
+}
+
+// Weighted sum of the neighbors of cell c at distance 1 to Radius along one axis, where stride is
+// the step to the next cell along the axis, and room_lo and room_hi are the number of cells before
+// the edge of the grid in either direction. Neighbors past a boundary or the edge take the value of
+// their mirror image across it (folded back until it lands on an open cell), which creates the
+// boundary condition u_x = 0. For the 5 point stencil, this is the value of c, as in wave_sim.frag.
+template <int Radius>
+static inline float stencil_axis(const float *u, const float *boundary, size_t c,
+                                 ptrdiff_t stride, size_t room_lo, size_t room_hi,
+                                 const float *weights) {
+  // line[Radius + i] is the value at offset i
+  float line[2 * Radius + 1];
+  line[Radius] = u[c];
+  // number of open cells before the first boundary in either direction
+  int open_lo = 0, open_hi = 0;
+  while (open_hi < Radius && (size_t)open_hi < room_hi &&
+         boundary[c + (open_hi + 1) * stride] == 0.0f) {
+    open_hi++;
+    line[Radius + open_hi] = u[c + open_hi * stride];
+  }
+  while (open_lo < Radius && (size_t)open_lo < room_lo &&
+         boundary[c - (open_lo + 1) * stride] == 0.0f) {
+    open_lo++;
+    line[Radius - open_lo] = u[c - open_lo * stride];
+  }
+
+  return fold_sum<Radius>(line, open_lo, open_hi, weights);
+}
+
+// Laplacian of u at cell (x, y) of a grid whose periodic axes wrap around, so neighbors past the
+// edge of a periodic axis are read from the other side of the grid. Everything else is the same as
+// stencil_axis. This is slower than laplacian, and only used for the cells within the stencil
+// radius of a periodic edge.
+template <int Radius>
+static float wrapped_laplacian(const float *u, const float *boundary, size_t x, size_t y,
+                               size_t width, size_t height, bool periodic_x, bool periodic_y,
+                               const Stencil &stencil, float inv_delta_x2, float inv_delta_y2) {
+  const size_t c = y * width + x;
+  float sums[2];
+  for (int axis = 0; axis < 2; axis++) {
+    const long size = (long)(axis == 0 ? width : height);
+    const long pos = (long)(axis == 0 ? x : y);
+    const bool periodic = axis == 0 ? periodic_x : periodic_y;
+    // index of the cell at offset i along the axis, or SIZE_MAX past an edge that doesn't wrap
+    auto cell = [&](int i) {
+      long p = pos + i;
+      if (periodic) {
+        p = (p % size + size) % size;
+      } else if (p < 0 || p >= size) {
+        return SIZE_MAX;
+      }
+      return axis == 0 ? y * width + (size_t)p : (size_t)p * width + x;
+    };
+
+    float line[2 * Radius + 1];
+    line[Radius] = u[c];
+    int open[2] = {0, 0};
+    for (int side = 0; side < 2; side++) {
+      const int dir = side == 0 ? -1 : 1;
+      while (open[side] < Radius) {
+        const size_t neighbor = cell(dir * (open[side] + 1));
+        if (neighbor == SIZE_MAX || boundary[neighbor] != 0.0f) {
+          break;
+        }
+        open[side]++;
+        line[Radius + dir * open[side]] = u[neighbor];
+      }
+    }
+    sums[axis] = fold_sum<Radius>(line, open[0], open[1], stencil.weights);
+  }
+  const float center = stencil.center * u[c];
+  return (sums[0] + center) * inv_delta_x2 + (sums[1] + center) * inv_delta_y2;
+}
+
+// Laplacian of u at cell (x, y) with a stencil of radius Radius
+template <int Radius>
+static inline float laplacian(const float *u, const float *boundary, size_t x, size_t y,
+                              size_t width, size_t height, const Stencil &stencil,
+                              float inv_delta_x2, float inv_delta_y2) {
+  const size_t c = y * width + x;
+  const float u_point = u[c];
+  if (Radius == 1) {
+    // neighbors outside the simulation area or on a boundary take the value of this point, which
+    // creates the boundary condition u_x = 0
+    float u0 = (x > 0 && boundary[c - 1] == 0.0f) ? u[c - 1] : u_point;
+    float u1 = (x + 1 < width && boundary[c + 1] == 0.0f) ? u[c + 1] : u_point;
+    float u2 = (y > 0 && boundary[c - width] == 0.0f) ? u[c - width] : u_point;
+    float u3 = (y + 1 < height && boundary[c + width] == 0.0f) ? u[c + width] : u_point;
+
+    return (u0 + u1 - 2.0f * u_point) * inv_delta_x2 + (u2 + u3 - 2.0f * u_point) * inv_delta_y2;
+  }
+  float sum_x = stencil_axis<Radius>(u, boundary, c, 1, x, width - 1 - x, stencil.weights);
+  float sum_y =
+      stencil_axis<Radius>(u, boundary, c, (ptrdiff_t)width, y, height - 1 - y, stencil.weights);
+  const float center = stencil.center * u_point;
+  return (sum_x + center) * inv_delta_x2 + (sum_y + center) * inv_delta_y2;
+}
+
+// Set interior[x] to 1 for the cells in [x0, x1) of row y whose stencil of radius Radius stays
+// inside the grid and reads no boundary, and to 0 for the rest. The laplacian of those needs no
+// folding (see interior_laplacian). Only used for rows that don't wrap around a periodic edge.
+template <int Radius>
+static void find_interior(const float *boundary, size_t y, size_t width, size_t height, size_t x0,
+                          size_t x1, uint8_t *interior) {
+  std::fill(interior + x0, interior + x1, 0);
+  if (y < Radius || y + Radius >= height || width <= 2 * Radius) {
+    return;
+  }
+  const size_t row = y * width;
+  const size_t lo = std::max<size_t>(x0, Radius), hi = std::min<size_t>(x1, width - Radius);
+  // number of boundary cells of the row from x - Radius to x + Radius
+  int closed = 0;
+  for (size_t x = lo - Radius; x < lo + Radius; x++) {
+    closed += boundary[row + x] != 0.0f;
+  }
+  for (size_t x = lo; x < hi; x++) {
+    closed += boundary[row + x + Radius] != 0.0f;
+    bool open = closed == 0;
+    for (int k = 1; k <= Radius; k++) {
+      open &= (boundary[row + x - k * width] == 0.0f) & (boundary[row + x + k * width] == 0.0f);
+    }
+    interior[x] = open;
+    closed -= boundary[row + x - Radius] != 0.0f;
+  }
+}
+
+// Laplacian of u at cell c, for a cell that find_interior marked, so all its neighbors are open.
+// The sums are taken in the same order as in stencil_axis, so the result is the same.
+template <int Radius>
+static inline float interior_laplacian(const float *u, size_t c, size_t width,
+                                       const float *weights, float center, float inv_delta_x2,
+                                       float inv_delta_y2) {
+  float sum_x = 0.0f, sum_y = 0.0f;
+  for (int k = 1; k <= Radius; k++) {
+    sum_x += weights[k - 1] * (u[c - k] + u[c + k]);
+    sum_y += weights[k - 1] * (u[c - k * width] + u[c + k * width]);
+  }
+  const float center_u = center * u[c];
+  return (sum_x + center_u) * inv_delta_x2 + (sum_y + center_u) * inv_delta_y2;
+}
+
+// Step the cells in [x0, x1) of row y, which don't wrap around a periodic edge, with
+// step_cell(x, laplacian). Higher order stencils take the unfolded interior_laplacian for the cells
+// away from edges and boundaries, with interior and laplace (width cells each) as scratch space.
+// The 5 point stencil is cheap enough to take the boundary checks everywhere.
+template <int Radius, typename StepCell>
+static inline void step_plain_cells(const float *u, const float *boundary, size_t x0, size_t x1,
+                                    size_t y, size_t width, size_t height, const Stencil &stencil,
+                                    float inv_delta_x2, float inv_delta_y2, uint8_t *interior,
+                                    float *laplace, StepCell &&step_cell) {
+  if (Radius == 1) {
+    for (size_t x = x0; x < x1; x++) {
+      step_cell(x, laplacian<Radius>(u, boundary, x, y, width, height, stencil, inv_delta_x2,
+                                     inv_delta_y2));
+    }
+    return;
+  }
+  // the weights are copied, so the compiler doesn't have to reload them after each store
+  float weights[Radius];
+  std::copy(stencil.weights, stencil.weights + Radius, weights);
+  const float center = stencil.center;
+  find_interior<Radius>(boundary, y, width, height, x0, x1, interior);
+  for (size_t x = x0; x < x1;) {
+    if (!interior[x]) {
+      step_cell(x, laplacian<Radius>(u, boundary, x, y, width, height, stencil, inv_delta_x2,
+                                     inv_delta_y2));
+      x++;
+      continue;
+    }
+    // the laplacians of a run of interior cells are taken in a loop of their own, which has no
+    // branches and only reads u, so the compiler can vectorize it
+    size_t end = x + 1;
+    while (end < x1 && interior[end]) {
+      end++;
+    }
+    const float *row_u = u + y * width;
+    for (size_t i = x; i < end; i++) {
+      laplace[i] = interior_laplacian<Radius>(row_u, i, width, weights, center, inv_delta_x2,
+                                              inv_delta_y2);
+    }
+    for (; x < end; x++) {
+      step_cell(x, laplace[x]);
+    }
+  }
+}
+
+// Split columns [x0, x1) of a row into the cells within radius of a periodic edge, which read
+// across it (see wrapped_laplacian), and the rest: [plain_x0, plain_x1) are the cells that don't
+// wrap. Every cell of a row within radius of a periodic edge along y wraps.
+static inline void plain_columns(size_t x0, size_t x1, size_t width, size_t radius,
+                                 bool periodic_x, bool wrap_row, size_t &plain_x0,
+                                 size_t &plain_x1) {
+  plain_x0 = x0;
+  plain_x1 = x1;
+  if (wrap_row) {
+    plain_x0 = plain_x1 = x1;
+  } else if (periodic_x) {
+    plain_x0 = std::clamp(radius, x0, x1);
+    plain_x1 = std::clamp(width - std::min(width, radius), plain_x0, x1);
+  }
+}
+
+template <int Radius, bool Accumulate, bool Phasors>
+void Engine::step_rows(size_t y0, size_t y1, IntensityAccumulator::Weights weights,
+                       const PhasorAccumulator::Twiddles &twiddles) {
+  const size_t width = grid.width, height = grid.height;
+  const float *u = grid.u.data();
+  const float *u_t = grid.u_t.data();
+  const float *ior_inv = grid.ior_inv.data();
+  const float *boundary = grid.boundary.data();
+  float *out_u = next_u.data();
+  float *out_u_t = next_u_t.data();
+  float *mean_square_out = mean_square.data();
+  float *peak_out = peak.data();
+  const size_t phasor_count = phasor.frequencies.size();
+  float *phasor_re_out[PhasorAccumulator::max_frequencies];
+  float *phasor_im_out[PhasorAccumulator::max_frequencies];
+  for (size_t k = 0; k < phasor_count; k++) {
+    phasor_re_out[k] = phasor_re[k].data();
+    phasor_im_out[k] = phasor_im[k].data();
+  }
+
+  const float inv_delta_x2 = 1.0f / (settings.delta_x * settings.delta_x);
+  const float inv_delta_y2 = 1.0f / (settings.delta_y * settings.delta_y);
+  const float delta_t = settings.delta_t;
+  const float wave_speed_vacuum = settings.wave_speed_vacuum;
+  const Stencil &stencil = settings.stencil();
+
+  const size_t start_x = mirror_start(width, settings.symmetry_x);
+  const bool periodic_x = settings.periodic_x, periodic_y = settings.periodic_y;
+  std::vector<uint8_t> interior(Radius > 1 ? width : 0);
+  std::vector<float> laplace(Radius > 1 ? width : 0);
+
+  for (size_t y = y0; y < y1; y++) {
+    const size_t row = y * width;
+    const size_t damping_y = damping_index_y[y];
+    const bool wrap_row = periodic_y && (y < Radius || y + Radius >= height);
+
+    auto step_cell = [&](size_t x, float laplace) {
+      const size_t c = row + x;
+      const float u_point = u[c];
+      float wave_speed = ior_inv[c] * wave_speed_vacuum;
+      float u_tt = wave_speed * wave_speed * laplace;
+
+      size_t damping_index = std::min(damping_index_x[x], damping_y);
+      float damping = damping_index < damping_lut.size() ? damping_lut[damping_index] : 1.0f;
+
+      float new_u_t = (u_t[c] + u_tt * delta_t) * damping;
+      out_u_t[c] = new_u_t;
+      float new_u = u_point + new_u_t * delta_t;
+      out_u[c] = new_u;
+
+      if (Accumulate) {
+        mean_square_out[c] += weights.alpha * (new_u * new_u - mean_square_out[c]);
+        peak_out[c] = std::max(std::abs(new_u), peak_out[c] * weights.decay);
+      }
+      if (Phasors) {
+        for (size_t k = 0; k < phasor_count; k++) {
+          phasor_re_out[k][c] = twiddles.keep * phasor_re_out[k][c] + new_u * twiddles.re[k];
+          phasor_im_out[k][c] = twiddles.keep * phasor_im_out[k][c] + new_u * twiddles.im[k];
+        }
+      }
+    };
+
+    size_t plain_x0, plain_x1;
+    plain_columns(start_x, width, width, Radius, periodic_x, wrap_row, plain_x0, plain_x1);
+    for (size_t x = start_x; x < plain_x0; x++) {
+      step_cell(x, wrapped_laplacian<Radius>(u, boundary, x, y, width, height, periodic_x,
+                                             periodic_y, stencil, inv_delta_x2, inv_delta_y2));
+    }
+    step_plain_cells<Radius>(u, boundary, plain_x0, plain_x1, y, width, height, stencil,
+                             inv_delta_x2, inv_delta_y2, interior.data(),
+                             laplace.data(), step_cell);
+    for (size_t x = plain_x1; x < width; x++) {
+      step_cell(x, wrapped_laplacian<Radius>(u, boundary, x, y, width, height, periodic_x,
+                                             periodic_y, stencil, inv_delta_x2, inv_delta_y2));
+    }
+  }
+}
+
+template <int Radius>
+void Engine::step_rows(size_t y0, size_t y1, IntensityAccumulator::Weights weights,
+                       const PhasorAccumulator::Twiddles &twiddles) {
+  const bool phasors = !phasor.frequencies.empty();
+  if (accumulating && phasors) {
+    step_rows<Radius, true, true>(y0, y1, weights, twiddles);
+  } else if (accumulating) {
+    step_rows<Radius, true, false>(y0, y1, weights, twiddles);
+  } else if (phasors) {
+    step_rows<Radius, false, true>(y0, y1, weights, twiddles);
+  } else {
+    step_rows<Radius, false, false>(y0, y1, weights, twiddles);
+  }
+}
+
+template <int Radius> void Engine::step_tiles(size_t y0, size_t y1) {
+  const size_t width = grid.width, height = grid.height;
+  const float *u = grid.u.data();
+  // u_t is updated in place, since each cell only reads its own
+  float *u_t = grid.u_t.data();
+  const float *ior_inv = grid.ior_inv.data();
+  const float *boundary = grid.boundary.data();
+  float *out_u = next_u.data();
+  float *curvature = level_u_tt.data();
+
+  const float inv_delta_x2 = 1.0f / (settings.delta_x * settings.delta_x);
+  const float inv_delta_y2 = 1.0f / (settings.delta_y * settings.delta_y);
+  const float delta_t = settings.delta_t;
+  const float wave_speed_vacuum = settings.wave_speed_vacuum;
+  const Stencil &stencil = settings.stencil();
+  // number of steps since the last update of u_t of the tiles at level l, which update it in the
+  // steps that are a multiple of 2^l
+  auto phase = [&](uint8_t level) { return level_steps & (((uint64_t)1 << level) - 1); };
+  auto updates = [&](uint8_t level) { return phase(level) == 0; };
+  // The cells of a tile follow the parabola through u with slope u_t - 2^(l-1) delta_t * u_tt and
+  // curvature u_tt at the last update, which ends at u + 2^l delta_t * u_t, the same as one long
+  // step. The step to the next point is delta_t * (u_t + offset(level, phase) * u_tt).
+  auto offset = [&](uint8_t level, uint64_t phase) {
+    return ((float)phase + 0.5f - 0.5f * (float)(1 << level)) * delta_t;
+  };
+  const size_t start_x = mirror_start(width, settings.symmetry_x);
+  const bool periodic_x = settings.periodic_x, periodic_y = settings.periodic_y;
+  std::vector<uint8_t> interior(Radius > 1 ? width : 0);
+  std::vector<float> laplace(Radius > 1 ? width : 0);
+
+  for (size_t y = y0; y < y1; y++) {
+    const size_t row = y * width;
+    const size_t damping_y = damping_index_y[y];
+    const bool wrap_row = periodic_y && (y < Radius || y + Radius >= height);
+    const uint8_t *levels = &tile_levels[y / tile_size * tiles_x];
+
+    // each pass handles a run of neighboring tiles that either all skip the update of u_t, or all
+    // update it with the same time step
+    for (size_t tx = start_x / tile_size; tx < tiles_x;) {
+      const uint8_t level = levels[tx];
+      const bool update = updates(level);
+      size_t end = tx + 1;
+      while (end < tiles_x && (update ? levels[end] == level : !updates(levels[end]))) {
+        end++;
+      }
+      const size_t x0 = std::max(tx * tile_size, start_x), x1 = std::min(end * tile_size, width);
+      tx = end;
+
+      // between updates of u_t, u moves along the parabola of the last update, so it is current to
+      // second order for the neighbors that read it
+      if (!update) {
+        const float step_offset = offset(level, phase(level));
+        for (size_t c = row + x0; c < row + x1; c++) {
+          out_u[c] = u[c] + (u_t[c] + step_offset * curvature[c]) * delta_t;
+        }
+        continue;
+      }
+
+      // the same update as step_rows, with a time step of 2^level * delta_t for u_t. u_t of a
+      // global step is centered half a step of delta_t before u, and that of a tile 2^(l-1) steps
+      // before it, so the first update after global steps only covers the difference.
+      const float level_delta_t =
+          level_steps == 0 ? 0.5f * (float)((1 << level) + 1) * delta_t
+                           : (float)(1 << level) * delta_t;
+      const float step_offset = offset(level, 0);
+      const std::vector<float> &level_damping_lut = level_damping_luts[level];
+      auto step_cell = [&](size_t x, float laplace) {
+        const size_t c = row + x;
+        float wave_speed = ior_inv[c] * wave_speed_vacuum;
+        float u_tt = wave_speed * wave_speed * laplace;
+
+        size_t damping_index = std::min(damping_index_x[x], damping_y);
+        float damping = damping_index < level_damping_lut.size()
+                            ? level_damping_lut[damping_index]
+                            : 1.0f;
+
+        float new_u_t = (u_t[c] + u_tt * level_delta_t) * damping;
+        float step_u_t = new_u_t;
+        // tiles at level 0 update in every step, and don't need the parabola
+        if (level > 0) {
+          // its curvature includes the damping
+          const float damped_u_tt = (new_u_t - u_t[c]) / level_delta_t;
+          curvature[c] = damped_u_tt;
+          step_u_t += step_offset * damped_u_tt;
+        }
+        u_t[c] = new_u_t;
+        out_u[c] = u[c] + step_u_t * delta_t;
+      };
+
+      size_t plain_x0, plain_x1;
+      plain_columns(x0, x1, width, Radius, periodic_x, wrap_row, plain_x0, plain_x1);
+      for (size_t x = x0; x < plain_x0; x++) {
+        step_cell(x, wrapped_laplacian<Radius>(u, boundary, x, y, width, height, periodic_x,
+                                               periodic_y, stencil, inv_delta_x2, inv_delta_y2));
+      }
+      step_plain_cells<Radius>(u, boundary, plain_x0, plain_x1, y, width, height, stencil,
+                               inv_delta_x2, inv_delta_y2, interior.data(),
+                             laplace.data(), step_cell);
+      for (size_t x = plain_x1; x < x1; x++) {
+        step_cell(x, wrapped_laplacian<Radius>(u, boundary, x, y, width, height, periodic_x,
+                                               periodic_y, stencil, inv_delta_x2, inv_delta_y2));
+      }
+    }
+  }
+}
+
+void Engine::step() {
+  TRACE_SCOPE("Engine::step");
+
+  // draw sources (and reset u on boundaries) at the current time
+  {
+    TRACE_SCOPE("rasterize");
+    environment.rasterize(grid, time);
+  }
+  const bool mirrored =
+      settings.symmetry_x != Symmetry::None || settings.symmetry_y != Symmetry::None;
+  if (mirrored) {
+    // sources on the mirrored side may have drawn over the images the laplacian reads
+    mirror(true);
+  }
+
+  // the accumulators are only passed over when they are used, so plain steps run the same loop as
+  // before they existed
+  IntensityAccumulator::Weights weights{};
+  if (accumulating) {
+    weights = accumulator.next_step(settings.delta_t);
+  }
+  PhasorAccumulator::Twiddles twiddles{};
+  const bool phasors = !phasor.frequencies.empty();
+  if (phasors) {
+    // the phasors sample the state written by this step
+    twiddles = phasor.next_step((double)time + settings.delta_t);
+  }
+  const int radius = settings.stencil().radius;
+  const bool local = max_time_level > 0 && !accumulating && !phasors;
+  // only the rows on the positive side of a symmetry plane about y = 0 are stepped
+  const size_t start_y = mirror_start(grid.height, settings.symmetry_y);
+  if (local) {
+    pool.parallel_for(grid.height - start_y, [&](size_t y0, size_t y1) {
+      TRACE_SCOPE("step_tiles");
+      if (radius == 3) {
+        step_tiles<3>(start_y + y0, start_y + y1);
+      } else if (radius == 2) {
+        step_tiles<2>(start_y + y0, start_y + y1);
+      } else {
+        step_tiles<1>(start_y + y0, start_y + y1);
+      }
+    });
+    std::swap(grid.u, next_u);
+    level_steps++;
+  } else {
+    pool.parallel_for(grid.height - start_y, [&](size_t y0, size_t y1) {
+      TRACE_SCOPE("step_rows");
+      if (radius == 3) {
+        step_rows<3>(start_y + y0, start_y + y1, weights, twiddles);
+      } else if (radius == 2) {
+        step_rows<2>(start_y + y0, start_y + y1, weights, twiddles);
+      } else {
+        step_rows<1>(start_y + y0, start_y + y1, weights, twiddles);
+      }
+    });
+    std::swap(grid.u, next_u);
+    std::swap(grid.u_t, next_u_t);
+    // u_t is now centered as in global steps, which the next local step starts from
+    level_steps = 0;
+  }
+  if (mirrored) {
+    TRACE_SCOPE("mirror");
+    mirror(false);
+  }
+
+  time += settings.delta_t;
+  steps++;
+
+  if (probe_set.capacity() > 0) {
+    probe_set.sample(grid.u.data(), steps, time);
+  }
+}
+
+void Engine::run(size_t steps) {
+  for (size_t i = 0; i < steps; i++) {
+    step();
+  }
+}
+
+bool Engine::set_time_levels(int max_level) {
+  if (max_level < 0 || max_level > 8) {
+    fprintf(stderr, "The time level must be between 0 and 8\n");
+    return false;
+  }
+  for (const auto &obj : environment.objects) {
+    if (max_level > 0 && obj->source_waveform() != nullptr && obj->moves()) {
+      fprintf(stderr, "Local time stepping needs sources that don't move\n");
+      return false;
+    }
+  }
+  max_time_level = max_level;
+  if (max_level == 0) {
+    tile_levels.clear();
+    level_damping_luts.clear();
+    level_u_tt.clear();
+    return true;
+  }
+  init_time_levels();
+  return true;
+}
+
+void Engine::init_time_levels() {
+  const size_t width = grid.width, height = grid.height;
+  tiles_x = (width + tile_size - 1) / tile_size;
+  tiles_y = (height + tile_size - 1) / tile_size;
+
+  // the fastest medium in each tile sets its longest time step
+  std::vector<float> tile_ior_inv(tiles_x * tiles_y, 0.0f);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      float &max_ior_inv = tile_ior_inv[y / tile_size * tiles_x + x / tile_size];
+      max_ior_inv = std::max(max_ior_inv, grid.ior_inv[y * width + x]);
+    }
+  }
+  const float max_ior_inv = *std::max_element(tile_ior_inv.begin(), tile_ior_inv.end());
+  tile_levels.assign(tiles_x * tiles_y, 0);
+  for (size_t t = 0; t < tile_levels.size(); t++) {
+    int level = 0;
+    while (level < max_time_level && (float)(2 << level) * tile_ior_inv[t] <= max_ior_inv) {
+      level++;
+    }
+    tile_levels[t] = (uint8_t)level;
+  }
+
+  // sources are drawn every step, so the tiles they draw to step with delta_t
+  SimGrid sources{width, height, settings.delta_x, settings.delta_y};
+  sources.pass_mask = glm::bvec4(true, true, false, false);
+  std::vector<size_t> written;
+  sources.write_log = &written;
+  for (const auto &obj : environment.objects) {
+    if (obj->source_waveform() != nullptr) {
+      obj->rasterize(sources, time);
+    }
+  }
+  for (size_t c : written) {
+    tile_levels[c / width / tile_size * tiles_x + c % width / tile_size] = 0;
+  }
+
+  // limit the ratio of the time steps on either side of an interface to 2
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t ty = 0; ty < tiles_y; ty++) {
+      for (size_t tx = 0; tx < tiles_x; tx++) {
+        uint8_t &level = tile_levels[ty * tiles_x + tx];
+        for (size_t ny = ty > 0 ? ty - 1 : 0; ny <= std::min(ty + 1, tiles_y - 1); ny++) {
+          for (size_t nx = tx > 0 ? tx - 1 : 0; nx <= std::min(tx + 1, tiles_x - 1); nx++) {
+            const uint8_t neighbor = tile_levels[ny * tiles_x + nx];
+            if (level > neighbor + 1) {
+              level = neighbor + 1;
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // damping is applied once per update of u_t, so it is compounded over the steps it covers
+  level_damping_luts.assign(1, damping_lut);
+  for (int level = 1; level <= max_time_level; level++) {
+    std::vector<float> lut = level_damping_luts.back();
+    for (float &damping : lut) {
+      damping *= damping;
+    }
+    level_damping_luts.push_back(std::move(lut));
+  }
+  level_u_tt.assign(grid.size(), 0.0f);
+  level_steps = 0;
+}
+
+double Engine::time_level_savings() const {
+  if (max_time_level == 0) {
+    return 0.0;
+  }
+  double skipped = 0.0;
+  for (size_t ty = 0; ty < tiles_y; ty++) {
+    for (size_t tx = 0; tx < tiles_x; tx++) {
+      const size_t cells = (std::min((tx + 1) * tile_size, grid.width) - tx * tile_size) *
+                           (std::min((ty + 1) * tile_size, grid.height) - ty * tile_size);
+      skipped += (double)cells * (1.0 - 1.0 / (double)(1 << tile_levels[ty * tiles_x + tx]));
+    }
+  }
+  return skipped / (double)grid.size();
+}
+
+double Engine::energy() {
+  TRACE_SCOPE("Engine::energy");
+
+  constexpr size_t block_rows = 32;
+  const size_t blocks = (grid.height + block_rows - 1) / block_rows;
+  energy_blocks.assign(blocks, 0.0);
+  pool.parallel_for(blocks, [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      size_t y0 = b * block_rows;
+      size_t y1 = std::min(y0 + block_rows, grid.height);
+      energy_blocks[b] = field_energy(grid, settings.wave_speed_vacuum, y0, y1);
+    }
+  });
+
+  double total = 0.0;
+  for (double block : energy_blocks) {
+    total += block;
+  }
+  return total;
+}
+
+void Engine::accumulate(float window) {
+  accumulating = true;
+  accumulator.window = window;
+  accumulator.reset();
+  mean_square.assign(grid.size(), 0.0f);
+  peak.assign(grid.size(), 0.0f);
+}
+
+void Engine::extract_phasors(const std::vector<float> &frequencies) {
+  phasor.frequencies = frequencies;
+  phasor.frequencies.resize(std::min(frequencies.size(), PhasorAccumulator::max_frequencies));
+  phasor.reset();
+  for (size_t k = 0; k < PhasorAccumulator::max_frequencies; k++) {
+    bool used = k < phasor.frequencies.size();
+    phasor_re[k].assign(used ? grid.size() : 0, 0.0f);
+    phasor_im[k].assign(used ? grid.size() : 0, 0.0f);
+  }
+}
+
+void Engine::capture_probes(size_t capacity) {
+  probe_set = ProbeSet(environment, grid.width, grid.height, settings.delta_x, settings.delta_y,
+                       capacity);
+}
+
+Snapshot Engine::snapshot() const {
+  Snapshot res;
+  res.scene = settings.serialize() + "\n" + environment.serialize();
+  res.time = time;
+  res.grid = grid;
+  return res;
+}
+
+bool Engine::restore(const Snapshot &snapshot) {
+  if (snapshot.grid.width != grid.width || snapshot.grid.height != grid.height) {
+    fprintf(stderr, "Snapshot grid is %zux%zu, but the simulation grid is %zux%zu\n",
+            snapshot.grid.width, snapshot.grid.height, grid.width, grid.height);
+    return false;
+  }
+
+  grid.u = snapshot.grid.u;
+  grid.u_t = snapshot.grid.u_t;
+  grid.ior_inv = snapshot.grid.ior_inv;
+  grid.boundary = snapshot.grid.boundary;
+  // the snapshot may be of a run without the symmetry
+  grid.mirror(settings.symmetry_x, settings.symmetry_y);
+  time = snapshot.time;
+  steps = 0;
+  level_steps = 0;
+  return true;
+}
+
+bool Engine::restore(const MappedSnapshot &snapshot) {
+  if (snapshot.width() != grid.width || snapshot.height() != grid.height) {
+    fprintf(stderr, "Snapshot grid is %zux%zu, but the simulation grid is %zux%zu\n",
+            snapshot.width(), snapshot.height(), grid.width, grid.height);
+    return false;
+  }
+
+  snapshot.read_region(SnapshotPlane::U, 0, 0, grid.width, grid.height, grid.u.data());
+  snapshot.read_region(SnapshotPlane::UT, 0, 0, grid.width, grid.height, grid.u_t.data());
+  snapshot.read_region(SnapshotPlane::IorInv, 0, 0, grid.width, grid.height,
+                       grid.ior_inv.data());
+  snapshot.read_region(SnapshotPlane::Boundary, 0, 0, grid.width, grid.height,
+                       grid.boundary.data());
+  // the snapshot may be of a run without the symmetry
+  grid.mirror(settings.symmetry_x, settings.symmetry_y);
+  time = snapshot.time();
+  steps = 0;
+  level_steps = 0;
+  return true;
+}
+
+size_t Engine::memory_footprint() const {
+  size_t floats = grid.u.capacity() + grid.u_t.capacity() + grid.ior_inv.capacity() +
+                  grid.boundary.capacity() + next_u.capacity() + next_u_t.capacity() +
+                  damping_lut.capacity() + mean_square.capacity() + peak.capacity() +
+                  level_u_tt.capacity();
+  for (size_t k = 0; k < PhasorAccumulator::max_frequencies; k++) {
+    floats += phasor_re[k].capacity() + phasor_im[k].capacity();
+  }
+  for (const auto &lut : level_damping_luts) {
+    floats += lut.capacity();
+  }
+  size_t indices = damping_index_x.capacity() + damping_index_y.capacity();
+  return floats * sizeof(float) + indices * sizeof(size_t) + tile_levels.capacity();
+}
@@ -0,0 +1,158 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "accumulator.hpp"
+#include "energy.hpp"
+#include "grid.hpp"
+#include "phasor.hpp"
+#include "probe.hpp"
+#include "scene.hpp"
+#include "snapshot.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Engine is a headless (cpu) implementation of the simulation. It runs the same scheme as
+// wave_sim.frag on a SimGrid, split across the threads of a ThreadPool, and doesn't need a window or
+// gl context. A scene with symmetry planes only steps the cells on their positive side, and mirrors
+// them over the rest of the grid after each step, so the state, probes and planes are still those
+// of the whole field. Periodic axes wrap the stencil around the grid and have no absorbing layer.
+class Engine {
+  SimSettings settings;
+  Environment environment;
+
+  // current state
+  SimGrid grid;
+  // u and u_t planes that the next step is written to. These are swapped with the grid's planes
+  // after each step, the same way the gl path flips between its two sim textures.
+  std::vector<float> next_u{}, next_u_t{};
+
+  // damping factor for a cell is damping_lut[min(damping_index_x[x], damping_index_y[y])], or 1 if
+  // that index is past the end of damping_lut
+  std::vector<float> damping_lut{};
+  std::vector<size_t> damping_index_x{}, damping_index_y{};
+
+  // intensity planes updated by the step kernel while accumulating (see IntensityAccumulator)
+  IntensityAccumulator accumulator{};
+  bool accumulating{false};
+  std::vector<float> mean_square{}, peak{};
+  // real and imaginary phasor planes of each frequency, updated while extracting phasors (see
+  // PhasorAccumulator)
+  PhasorAccumulator phasor{};
+  std::vector<float> phasor_re[PhasorAccumulator::max_frequencies]{};
+  std::vector<float> phasor_im[PhasorAccumulator::max_frequencies]{};
+
+  ThreadPool pool;
+
+  // Current time (in s), and number of steps run since the engine was created or restored
+  float time{0.0};
+  uint64_t steps{0};
+
+  // probes of the environment, sampled after each step once capture_probes is called
+  ProbeSet probe_set{};
+
+  // Local time stepping (see set_time_levels). The grid is split into tile_size square tiles, and
+  // the cells of a tile at level l update u_t every 2^l steps, with a time step of 2^l delta_t. In
+  // between, u follows the parabola given by u, u_t and u_tt at the last update, which ends where
+  // the long step does. u is therefore current (to second order) in every tile after every step,
+  // so a tile reads its neighbors at its own time at an interface, whatever their level.
+  int max_time_level{0};
+  size_t tiles_x{0}, tiles_y{0};
+  std::vector<uint8_t> tile_levels{};
+  // damping_lut raised to the power 2^l for each level l
+  std::vector<std::vector<float>> level_damping_luts{};
+  // u_tt of each cell at the last update of its u_t, including the damping
+  std::vector<float> level_u_tt{};
+  // steps run since the tile levels were chosen, which sets which tiles update u_t in a step
+  uint64_t level_steps{0};
+
+  // energy of each block of rows, summed in order so the total doesn't depend on the threads
+  std::vector<double> energy_blocks{};
+
+  void init_damping();
+  // Copy the simulated cells of u (and of u_t and the intensity and phasor planes, unless
+  // ghosts_only) over the cells of the grid that are their mirror images (see
+  // SimSettings::symmetry_x). With ghosts_only, only the images of u that the laplacian reads next
+  // to the symmetry planes are written.
+  void mirror(bool ghosts_only);
+  // run the simulation step for the simulated cells of rows [y0, y1) with a laplacian stencil of
+  // radius Radius. The intensity planes are updated if Accumulate, and the phasor planes if
+  // Phasors.
+  template <int Radius, bool Accumulate, bool Phasors>
+  void step_rows(size_t y0, size_t y1, IntensityAccumulator::Weights weights,
+                 const PhasorAccumulator::Twiddles &twiddles);
+  template <int Radius>
+  void step_rows(size_t y0, size_t y1, IntensityAccumulator::Weights weights,
+                 const PhasorAccumulator::Twiddles &twiddles);
+  // run the simulation step for rows [y0, y1) with local time stepping
+  template <int Radius> void step_tiles(size_t y0, size_t y1);
+  // choose the level of each tile (see set_time_levels)
+  void init_time_levels();
+
+public:
+  // side of the tiles of local time stepping (in cells)
+  static constexpr size_t tile_size = 8;
+
+  // Create an engine for the given scene that runs on threads threads (or all hardware threads if
+  // threads is 0).
+  Engine(const SimSettings &settings, Environment environment, unsigned threads = 0);
+
+  // Draw the environment and run one step of the simulation
+  void step();
+  // Run steps steps of the simulation
+  void run(size_t steps);
+
+  // Sample the probes in the environment after each step, keeping the last capacity samples
+  void capture_probes(size_t capacity);
+  const ProbeSet &probes() const { return probe_set; }
+
+  // Accumulate the intensity of u after each step over an exponential window of window seconds (or
+  // over every step if window is 0). This resets the intensity planes.
+  void accumulate(float window);
+  bool is_accumulating() const { return accumulating; }
+  // Mean of u^2 and peak |u| of each cell (see IntensityAccumulator)
+  const std::vector<float> &mean_square_plane() const { return mean_square; }
+  const std::vector<float> &peak_plane() const { return peak; }
+
+  // Extract the phasors of u at frequencies (in Hz) after each step. This resets the phasor planes.
+  void extract_phasors(const std::vector<float> &frequencies);
+  const PhasorAccumulator &phasors() const { return phasor; }
+  // Real and imaginary phasor planes of the k-th frequency
+  const std::vector<float> &phasor_re_plane(size_t k) const { return phasor_re[k]; }
+  const std::vector<float> &phasor_im_plane(size_t k) const { return phasor_im[k]; }
+
+  // Step each tile with the largest power-of-two multiple of delta_t (up to 2^max_level) at which
+  // waves in the fastest medium in it cross no more cells per step than those in the fastest
+  // medium of the grid do with delta_t, or turn local time stepping off if max_level is 0. Every
+  // tile therefore runs at a Courant number no higher than global steps do, and tiles of the
+  // fastest medium step with delta_t. Tiles with sources always step with delta_t, and the levels
+  // of neighboring tiles differ by at most one. Steps that accumulate intensities or phasors step
+  // every tile with delta_t. Return false (and print to stderr) if a source moves, since its tiles
+  // would change.
+  bool set_time_levels(int max_level);
+  // Fraction of the u_t updates of a step with delta_t that local time stepping skips
+  double time_level_savings() const;
+
+  // Total energy of the field (see field_energy)
+  double energy();
+
+  // Save the current state (and the scene) to a snapshot
+  Snapshot snapshot() const;
+  // Restore the state and time from a snapshot. Return false if the snapshot's grid is a different
+  // size.
+  bool restore(const Snapshot &snapshot);
+  // Restore the state and time directly from the planes of a mapped snapshot file
+  bool restore(const MappedSnapshot &snapshot);
+
+  const SimGrid &state() const { return grid; }
+  const SimSettings &get_settings() const { return settings; }
+  float get_time() const { return time; }
+  uint64_t get_steps() const { return steps; }
+  unsigned threads() const { return pool.size(); }
+
+  // Approximate memory used by the simulation state (in bytes)
+  size_t memory_footprint() const;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "geometry.hpp"
+#include <algorithm>
 #include <cmath>
 
 #define PI 3.141592653589793
@@ -143,8 +144,15 @@ int Programs::init() {
       load_shader("/home/edward/Documents/waves_sim/shaders/object.frag", GL_FRAGMENT_SHADER);
   handle_shader =
       load_shader("/home/edward/Documents/waves_sim/shaders/handle.frag", GL_FRAGMENT_SHADER);
-
-  if (!vertex_shader || !sim_shader || !display_shader || !object_shader || !handle_shader) {
+  probe_shader =
+      load_shader("/home/edward/Documents/waves_sim/shaders/probe.frag", GL_FRAGMENT_SHADER);
+  energy_shader =
+      load_shader("/home/edward/Documents/waves_sim/shaders/energy.frag", GL_FRAGMENT_SHADER);
+  reduce_shader =
+      load_shader("/home/edward/Documents/waves_sim/shaders/reduce.frag", GL_FRAGMENT_SHADER);
+
+  if (!vertex_shader || !sim_shader || !display_shader || !object_shader || !handle_shader ||
+      !probe_shader || !energy_shader || !reduce_shader) {
     return -1;
   }
 
@@ -152,7 +160,11 @@ int Programs::init() {
   display_program = create_program(vertex_shader, display_shader);
   object_program = create_program(vertex_shader, object_shader);
   handle_program = create_program(vertex_shader, handle_shader);
-  if (!sim_program || !display_program || !object_shader || !handle_program) {
+  probe_program = create_program(vertex_shader, probe_shader);
+  energy_program = create_program(vertex_shader, energy_shader);
+  reduce_program = create_program(vertex_shader, reduce_shader);
+  if (!sim_program || !display_program || !object_shader || !handle_program || !probe_program ||
+      !energy_program || !reduce_program) {
     return -1;
   }
 
@@ -161,11 +173,32 @@ int Programs::init() {
   display_sim_tex_loc = glGetUniformLocation(display_program, "sim_texture");
   display_screen_size_loc = glGetUniformLocation(display_program, "screen_size");
   display_damping_area_size_loc = glGetUniformLocation(display_program, "damping_area_size");
+  display_mode_loc = glGetUniformLocation(display_program, "display_mode");
+  display_accum_tex_loc = glGetUniformLocation(display_program, "accum_texture");
+  display_gain_loc = glGetUniformLocation(display_program, "display_gain");
+  display_phasor_tex_loc = glGetUniformLocation(display_program, "phasor_texture");
+  display_phasor_high_loc = glGetUniformLocation(display_program, "phasor_high");
+  display_symmetry_loc = glGetUniformLocation(display_program, "symmetry");
 
   sim_delta_x_loc = glGetUniformLocation(sim_program, "delta_x");
+  sim_delta_y_loc = glGetUniformLocation(sim_program, "delta_y");
   sim_delta_t_loc = glGetUniformLocation(sim_program, "delta_t");
   sim_wave_speed_vacuum_loc = glGetUniformLocation(sim_program, "wave_speed_vacuum");
   sim_damping_area_size_loc = glGetUniformLocation(sim_program, "damping_area_size");
+  sim_stencil_radius_loc = glGetUniformLocation(sim_program, "stencil_radius");
+  sim_stencil_weights_loc = glGetUniformLocation(sim_program, "stencil_weights");
+  sim_symmetry_loc = glGetUniformLocation(sim_program, "symmetry");
+  sim_periodic_loc = glGetUniformLocation(sim_program, "periodic");
+  sim_accum_enabled_loc = glGetUniformLocation(sim_program, "accum_enabled");
+  sim_accum_tex_loc = glGetUniformLocation(sim_program, "accum_texture");
+  sim_accum_alpha_loc = glGetUniformLocation(sim_program, "accum_alpha");
+  sim_accum_decay_loc = glGetUniformLocation(sim_program, "accum_decay");
+  sim_phasors_enabled_loc = glGetUniformLocation(sim_program, "phasors_enabled");
+  sim_phasor_tex_locs[0] = glGetUniformLocation(sim_program, "phasor_texture0");
+  sim_phasor_tex_locs[1] = glGetUniformLocation(sim_program, "phasor_texture1");
+  sim_phasor_keep_loc = glGetUniformLocation(sim_program, "phasor_keep");
+  sim_phasor_twiddles_locs[0] = glGetUniformLocation(sim_program, "phasor_twiddles01");
+  sim_phasor_twiddles_locs[1] = glGetUniformLocation(sim_program, "phasor_twiddles23");
 
   sim_transform_loc = glGetUniformLocation(sim_program, "transform");
   display_transform_loc = glGetUniformLocation(display_program, "transform");
@@ -176,19 +209,40 @@ int Programs::init() {
   handle_hole_loc = glGetUniformLocation(handle_program, "hole");
   handle_selected_loc = glGetUniformLocation(handle_program, "selected");
 
+  probe_sim_tex_loc = glGetUniformLocation(probe_program, "sim_texture");
+  probe_cells_tex_loc = glGetUniformLocation(probe_program, "probe_cells");
+  probe_symmetry_loc = glGetUniformLocation(probe_program, "symmetry");
+  probe_transform_loc = glGetUniformLocation(probe_program, "transform");
+
+  energy_sim_tex_loc = glGetUniformLocation(energy_program, "sim_texture");
+  energy_delta_x_loc = glGetUniformLocation(energy_program, "delta_x");
+  energy_delta_y_loc = glGetUniformLocation(energy_program, "delta_y");
+  energy_wave_speed_vacuum_loc = glGetUniformLocation(energy_program, "wave_speed_vacuum");
+  energy_symmetry_loc = glGetUniformLocation(energy_program, "symmetry");
+  energy_transform_loc = glGetUniformLocation(energy_program, "transform");
+  reduce_source_tex_loc = glGetUniformLocation(reduce_program, "source");
+  reduce_transform_loc = glGetUniformLocation(reduce_program, "transform");
+
   return 0;
 }
 
-void MediumType::set_gl_color_mask() const {
+glm::vec4 MediumType::object_props() const { return glm::vec4(0.0, 0.0, 1.0 / ior, 1.0); }
+
+glm::bvec4 MediumType::color_mask() const {
   if (is_boundary) {
-    glColorMask(GL_TRUE, GL_TRUE, GL_FALSE, GL_TRUE);
+    return glm::bvec4(true, true, false, true);
   } else {
-    glColorMask(GL_FALSE, GL_FALSE, GL_TRUE, GL_FALSE);
+    return glm::bvec4(false, false, true, false);
   }
 }
 
+void MediumType::set_gl_color_mask() const {
+  glm::bvec4 mask = color_mask();
+  glColorMask(mask.r, mask.g, mask.b, mask.a);
+}
+
 void MediumType::set_object_uniforms(const Programs &programs) const {
-  glUniform4f(programs.object_object_props_loc, 0.0, 0.0, 1.0 / ior, 1.0);
+  glUniform4fv(programs.object_object_props_loc, 1, glm::value_ptr(object_props()));
 }
 
 void MediumType::set_gl_program(const Programs &programs) const {
@@ -286,6 +340,31 @@ bool SimObject::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+size_t SimObject::probe_points(std::vector<glm::vec2> &points) const {
+  // by default, objects don't measure anything
+  return 0;
+}
+
+bool SimObject::set_property(const std::string &name, float value) {
+  // by default, objects don't have any properties
+  return false;
+}
+
+// set field to value if name is field_name, and return if it was set
+static bool set_field(const std::string &name, const char *field_name, float &field, float value) {
+  if (name != field_name) {
+    return false;
+  }
+  field = value;
+  return true;
+}
+
+const Waveform *SimObject::source_waveform() const { return nullptr; }
+
+bool SimObject::moves() const { return false; }
+
+const MediumType *SimObject::object_medium() const { return nullptr; }
+
 static std::tuple<float, float> read_coord(std::istream &in) {
   float x = std::stof(SimObject::read_token(in));
   float y = std::stof(SimObject::read_token(in));
@@ -352,6 +431,19 @@ std::optional<std::unique_ptr<SimObject>> SimObject::deserialize(std::istream &i
       return {};
 
     return std::make_unique<LineSource>(x0, y0, x1, y1, width, std::move(waveform.value()), phase);
+  } else if (object == "Probe") {
+    auto [x, y] = read_coord(in);
+    if (in.get() != ')')
+      return {};
+
+    return std::make_unique<Probe>(x, y);
+  } else if (object == "LineProbe") {
+    auto [x0, y0, x1, y1] = read_coord_pair(in);
+    auto samples = std::stoi(read_token(in));
+    if (samples < 2 || in.get() != ')')
+      return {};
+
+    return std::make_unique<LineProbe>(x0, y0, x1, y1, samples);
   } else {
     std::cout << "Object: " << object << ":\n";
     // unrecognized object
@@ -366,6 +458,12 @@ void Environment::draw(const Programs &programs, glm::vec2 physical_scale_factor
   }
 }
 
+void Environment::rasterize(SimGrid &grid, float time) const {
+  for (const auto &obj : objects) {
+    obj->rasterize(grid, time);
+  }
+}
+
 void Environment::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor) const {
   for (size_t i = 0; i < objects.size(); i++) {
     objects[i]->draw_controls(programs, physical_scale_factor, (long int)i == active_object);
@@ -409,6 +507,17 @@ bool Environment::has_active_object() const {
   return active_object >= 0 && active_object < (long int)objects.size();
 }
 
+float Environment::max_ior_inv() const {
+  float res = 1.0;
+  for (const auto &obj : objects) {
+    const MediumType *medium = obj->object_medium();
+    if (medium != nullptr && !medium->is_boundary) {
+      res = std::max(res, medium->object_props().b);
+    }
+  }
+  return res;
+}
+
 std::string Environment::serialize() const {
   std::string res = "";
   for (const auto &obj : objects) {
@@ -459,6 +568,10 @@ void Rectangle::draw(const Programs &programs, glm::vec2 physical_scale_factor,
   programs.geo.draw_geo(GeometryType::Square);
 }
 
+void Rectangle::rasterize(SimGrid &grid, float time) const {
+  grid.fill_rect(x0, y0, x1, y1, medium.object_props(), medium.color_mask());
+}
+
 // create the transformation matrix for a translation from the origin to the specified x and y
 static glm::mat4 translate_to_point(float x, float y, glm::vec2 physical_scale_factor) {
   return glm::translate(glm::mat4(1.0f),
@@ -613,6 +726,15 @@ bool Rectangle::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+bool Rectangle::set_property(const std::string &name, float value) {
+  if (name == "ior" && !medium.is_boundary) {
+    medium.ior = value;
+    return true;
+  }
+  return set_field(name, "x0", x0, value) || set_field(name, "y0", y0, value) ||
+         set_field(name, "x1", x1, value) || set_field(name, "y1", y1, value);
+}
+
 std::string Rectangle::serialize() const {
   return "(Rectangle " + std::to_string(x0) + " " + std::to_string(y0) + " " + std::to_string(x1) +
          " " + std::to_string(y1) + " " + medium.serialize() + ")";
@@ -673,6 +795,12 @@ void LineBase::imgui_line_controls() {
   ImGui::DragFloat("Width", &width, 0.2f, 1.0, 1000.0, "%.0f px");
 }
 
+bool LineBase::set_property(const std::string &name, float value) {
+  return set_field(name, "x0", x0, value) || set_field(name, "y0", y0, value) ||
+         set_field(name, "x1", x1, value) || set_field(name, "y1", y1, value) ||
+         set_field(name, "width", width, value);
+}
+
 std::string LineBase::serialize_coordinates() const {
   return std::to_string(x0) + " " + std::to_string(y0) + " " + std::to_string(x1) + " " +
          std::to_string(y1) + " " + std::to_string(width);
@@ -684,6 +812,10 @@ void Line::draw(const Programs &programs, glm::vec2 physical_scale_factor, float
   draw_line(programs, x0, y0, x1, y1, physical_scale_factor);
 }
 
+void Line::rasterize(SimGrid &grid, float time) const {
+  grid.fill_line(x0, y0, x1, y1, width, medium.object_props(), medium.color_mask());
+}
+
 void Line::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                          bool active) const {
   LineBase::draw_controls(programs, physical_scale_factor, active, false);
@@ -696,6 +828,14 @@ bool Line::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+bool Line::set_property(const std::string &name, float value) {
+  if (name == "ior" && !medium.is_boundary) {
+    medium.ior = value;
+    return true;
+  }
+  return LineBase::set_property(name, value);
+}
+
 std::string Line::serialize() const {
   return "(Line " + serialize_coordinates() + " " + medium.serialize() + ")";
 }
@@ -711,14 +851,21 @@ void AreaClear::draw(const Programs &programs, glm::vec2 physical_scale_factor,
   programs.geo.draw_geo(GeometryType::Square);
 }
 
+void AreaClear::rasterize(SimGrid &grid, float time) const {
+  grid.fill(glm::vec4(0.0, 0.0, 1.0, 0.0), glm::bvec4(false, false, true, true));
+}
+
 std::string AreaClear::serialize() const { return "(AreaClear)"; }
 
+glm::vec4 Waveform::object_props(float time, float phase) const {
+  return glm::vec4(sample(time, phase), sample_diff(time, phase), 0.0, 0.0);
+}
+
 void Waveform::set_gl_program(const Programs &programs, float time, float phase) const {
   glUseProgram(programs.object_program);
-  glUniform4f(programs.object_object_props_loc, sample(time, phase), sample_diff(time, phase), 0.0,
-              0.0);
+  glUniform4fv(programs.object_object_props_loc, 1, glm::value_ptr(object_props(time, phase)));
 
-  glColorMask(GL_TRUE, GL_TRUE, GL_FALSE, GL_FALSE);
+  glColorMask(color_mask.r, color_mask.g, color_mask.b, color_mask.a);
 }
 
 void Waveform::draw_imgui_controls(std::unique_ptr<Waveform> &waveform, const char *label,
@@ -749,6 +896,8 @@ void Waveform::draw_imgui_controls(std::unique_ptr<Waveform> &waveform, const ch
   waveform->draw_imgui_prop_controls();
 }
 
+bool Waveform::set_property(const std::string &name, float value) { return false; }
+
 std::pair<float, float> Waveform::get_freq_amp() const { return {1.0, 1.0}; }
 
 std::optional<std::unique_ptr<Waveform>> Waveform::deserialze(std::istream &in) {
@@ -802,6 +951,10 @@ int SineWaveform::waveform_type_index() { return 0; }
 
 std::pair<float, float> SineWaveform::get_freq_amp() const { return {freq, amp}; }
 
+bool SineWaveform::set_property(const std::string &name, float value) {
+  return set_field(name, "amplitude", amp, value) || set_field(name, "frequency", freq, value);
+}
+
 std::string SineWaveform::serialize() const {
   return "(Sine " + std::to_string(amp) + " " + std::to_string(freq) + ")";
 }
@@ -839,6 +992,10 @@ int TriangleWaveform::waveform_type_index() { return 1; }
 
 std::pair<float, float> TriangleWaveform::get_freq_amp() const { return {freq, amp}; }
 
+bool TriangleWaveform::set_property(const std::string &name, float value) {
+  return set_field(name, "amplitude", amp, value) || set_field(name, "frequency", freq, value);
+}
+
 std::string TriangleWaveform::serialize() const {
   return "(Triangle " + std::to_string(amp) + " " + std::to_string(freq) + ")";
 }
@@ -867,6 +1024,10 @@ int SquareWaveform::waveform_type_index() { return 2; }
 
 std::pair<float, float> SquareWaveform::get_freq_amp() const { return {freq, amp}; }
 
+bool SquareWaveform::set_property(const std::string &name, float value) {
+  return set_field(name, "amplitude", amp, value) || set_field(name, "frequency", freq, value);
+}
+
 std::string SquareWaveform::serialize() const {
   return "(Square " + std::to_string(amp) + " " + std::to_string(freq) + ")";
 }
@@ -906,6 +1067,11 @@ int GaussianEnvelope::waveform_type_index() { return 3; }
 
 std::pair<float, float> GaussianEnvelope::get_freq_amp() const { return waveform->get_freq_amp(); }
 
+bool GaussianEnvelope::set_property(const std::string &name, float value) {
+  return set_field(name, "duration", duration_95, value) ||
+         set_field(name, "start", start_t, value) || waveform->set_property(name, value);
+}
+
 std::string GaussianEnvelope::serialize() const {
   return "(GaussianEnvelope " + std::to_string(duration_95) + " " + std::to_string(start_t) + " " +
          waveform->serialize() + ")";
@@ -918,6 +1084,10 @@ void PointSource::draw(const Programs &programs, glm::vec2 physical_scale_factor
   draw_point(programs, x, y, physical_scale_factor);
 }
 
+void PointSource::rasterize(SimGrid &grid, float time) const {
+  grid.fill_point(x, y, 1.0, waveform->object_props(time, phase), Waveform::color_mask);
+}
+
 const int point_handle_size = 16;
 
 void PointSource::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
@@ -943,6 +1113,11 @@ bool PointSource::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+bool PointSource::set_property(const std::string &name, float value) {
+  return set_field(name, "x", x, value) || set_field(name, "y", y, value) ||
+         set_field(name, "phase", phase, value) || waveform->set_property(name, value);
+}
+
 std::string PointSource::serialize() const {
   return "(PointSource " + std::to_string(x) + " " + std::to_string(y) + " " +
          waveform->serialize() + " " + std::to_string(phase) + ")";
@@ -969,6 +1144,12 @@ void MovingPointSource::draw(const Programs &programs, glm::vec2 physical_scale_
   draw_point(programs, pos.first, pos.second, physical_scale_factor);
 }
 
+void MovingPointSource::rasterize(SimGrid &grid, float time) const {
+  auto pos = current_pos(time);
+  grid.fill_point(pos.first, pos.second, 1.0, waveform->object_props(time, phase),
+                  Waveform::color_mask);
+}
+
 void MovingPointSource::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                                       bool active) const {
   glUseProgram(programs.handle_program);
@@ -1009,6 +1190,13 @@ bool MovingPointSource::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+bool MovingPointSource::set_property(const std::string &name, float value) {
+  return set_field(name, "x0", x0, value) || set_field(name, "y0", y0, value) ||
+         set_field(name, "x1", x1, value) || set_field(name, "y1", y1, value) ||
+         set_field(name, "speed", speed, value) || set_field(name, "phase", phase, value) ||
+         waveform->set_property(name, value);
+}
+
 std::string MovingPointSource::serialize() const {
   return "(MovingPointSource " + std::to_string(x0) + " " + std::to_string(y0) + " " + std::to_string(x1) + " " + std::to_string(y1) + " " + std::to_string(speed) + " " +
          waveform->serialize() + " " + std::to_string(phase) + ")";
@@ -1020,6 +1208,11 @@ void LineSource::draw(const Programs &programs, glm::vec2 physical_scale_factor,
   draw_line(programs, x0, y0, x1, y1, physical_scale_factor);
 }
 
+void LineSource::rasterize(SimGrid &grid, float time) const {
+  grid.fill_line(x0, y0, x1, y1, width, waveform->object_props(time, phase),
+                 Waveform::color_mask);
+}
+
 void LineSource::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                                bool active) const {
   LineBase::draw_controls(programs, physical_scale_factor, active, true);
@@ -1034,7 +1227,86 @@ bool LineSource::draw_imgui_controls() {
   return ImGui::Button("Delete Object");
 }
 
+bool LineSource::set_property(const std::string &name, float value) {
+  return LineBase::set_property(name, value) || set_field(name, "phase", phase, value) ||
+         waveform->set_property(name, value);
+}
+
 std::string LineSource::serialize() const {
   return "(LineSource " + serialize_coordinates() + " " + waveform->serialize() + " " +
          std::to_string(phase) + ")";
 }
+
+void Probe::draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const {
+  // probes only measure the simulation
+}
+
+void Probe::rasterize(SimGrid &grid, float time) const {}
+
+void Probe::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
+                          bool active) const {
+  glUseProgram(programs.handle_program);
+  glPointSize(point_handle_size);
+  // probes are drawn without a hole, to tell them apart from point sources
+  glUniform1i(programs.handle_hole_loc, 0);
+  glUniform1i(programs.handle_selected_loc, active);
+
+  draw_point(programs, x, y, physical_scale_factor);
+}
+
+bool Probe::handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) {
+  return handle_handle_events(delta_x, active, x, y, point_handle_size, screen_size);
+}
+
+bool Probe::draw_imgui_controls() {
+  imgui_point_input("Position", x, y);
+  ImGui::NewLine();
+  return ImGui::Button("Delete Object");
+}
+
+size_t Probe::probe_points(std::vector<glm::vec2> &points) const {
+  points.emplace_back(x, y);
+  return 1;
+}
+
+bool Probe::set_property(const std::string &name, float value) {
+  return set_field(name, "x", x, value) || set_field(name, "y", y, value);
+}
+
+std::string Probe::serialize() const {
+  return "(Probe " + std::to_string(x) + " " + std::to_string(y) + ")";
+}
+
+void LineProbe::draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const {
+  // probes only measure the simulation
+}
+
+void LineProbe::rasterize(SimGrid &grid, float time) const {}
+
+void LineProbe::draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
+                              bool active) const {
+  LineBase::draw_controls(programs, physical_scale_factor, active, false);
+}
+
+bool LineProbe::draw_imgui_controls() {
+  imgui_point_input("Point 0", x0, y0);
+  imgui_point_input("Point 1", x1, y1);
+  if (ImGui::InputInt("Samples", &samples)) {
+    samples = std::clamp(samples, 2, 4096);
+  }
+  ImGui::NewLine();
+  return ImGui::Button("Delete Object");
+}
+
+size_t LineProbe::probe_points(std::vector<glm::vec2> &points) const {
+  for (int i = 0; i < samples; i++) {
+    float s = (float)i / (float)(samples - 1);
+    points.emplace_back(x0 + (x1 - x0) * s, y0 + (y1 - y0) * s);
+  }
+  return samples;
+}
+
+std::string LineProbe::serialize() const {
+  return "(LineProbe " + std::to_string(x0) + " " + std::to_string(y0) + " " +
+         std::to_string(x1) + " " + std::to_string(y1) + " " + std::to_string(samples) + ")";
+}
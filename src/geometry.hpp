@@ -20,6 +20,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "grid.hpp"
+
 enum class GeometryType {
   // A VAO with a point at (0, 0)
   Point = 0,
@@ -61,6 +63,11 @@ class Programs {
   GLuint object_shader{};
   // fragment shader that draws editing handles
   GLuint handle_shader{};
+  // fragment shader that copies probe values out of the simulation state
+  GLuint probe_shader{};
+  // fragment shaders that draw the energy of each cell, and sum it over the grid
+  GLuint energy_shader{};
+  GLuint reduce_shader{};
 
 public:
   // program that runs simulation step
@@ -71,6 +78,12 @@ public:
   GLuint object_program{};
   // program that draws editing handles
   GLuint handle_program{};
+  // program that samples probes
+  GLuint probe_program{};
+  // program that draws the energy of each cell
+  GLuint energy_program{};
+  // program that sums 2x2 blocks of a texture
+  GLuint reduce_program{};
 
   // uniform location for sim_texture in sim_program
   GLint sim_sim_tex_loc{};
@@ -78,12 +91,33 @@ public:
   GLint display_sim_tex_loc{};
   GLint display_screen_size_loc{};
   GLint display_damping_area_size_loc{};
+  GLint display_mode_loc{};
+  GLint display_accum_tex_loc{};
+  GLint display_gain_loc{};
+  GLint display_phasor_tex_loc{};
+  GLint display_phasor_high_loc{};
+  GLint display_symmetry_loc{};
 
   // uniform locations for sim_program physical parameters
   GLint sim_delta_x_loc{};
+  GLint sim_delta_y_loc{};
   GLint sim_delta_t_loc{};
   GLint sim_wave_speed_vacuum_loc{};
   GLint sim_damping_area_size_loc{};
+  GLint sim_stencil_radius_loc{};
+  GLint sim_stencil_weights_loc{};
+  GLint sim_symmetry_loc{};
+  GLint sim_periodic_loc{};
+  // uniform locations for sim_program intensity accumulation
+  GLint sim_accum_enabled_loc{};
+  GLint sim_accum_tex_loc{};
+  GLint sim_accum_alpha_loc{};
+  GLint sim_accum_decay_loc{};
+  // uniform locations for sim_program phasor extraction
+  GLint sim_phasors_enabled_loc{};
+  GLint sim_phasor_tex_locs[2]{};
+  GLint sim_phasor_keep_loc{};
+  GLint sim_phasor_twiddles_locs[2]{};
 
   // transform matrix location
   GLint sim_transform_loc{};
@@ -97,6 +131,22 @@ public:
   GLint handle_hole_loc{};
   GLint handle_selected_loc{};
 
+  // probe uniform locations
+  GLint probe_sim_tex_loc{};
+  GLint probe_cells_tex_loc{};
+  GLint probe_symmetry_loc{};
+  GLint probe_transform_loc{};
+
+  // energy and reduction uniform locations
+  GLint energy_sim_tex_loc{};
+  GLint energy_delta_x_loc{};
+  GLint energy_delta_y_loc{};
+  GLint energy_wave_speed_vacuum_loc{};
+  GLint energy_symmetry_loc{};
+  GLint energy_transform_loc{};
+  GLint reduce_source_tex_loc{};
+  GLint reduce_transform_loc{};
+
   // geometry primitives
   GeometryManager geo{};
 
@@ -122,6 +172,10 @@ public:
   static MediumType Medium(float index_of_refraction);
   static MediumType Boundary();
 
+  // the (u, u_t, inv_ior, boundary) value drawn for this medium, and the channels it is drawn to
+  glm::vec4 object_props() const;
+  glm::bvec4 color_mask() const;
+
   // setup the appropriate glColorMask for this medium
   void set_gl_color_mask() const;
   // Set the object_program uniforms for this medium
@@ -142,12 +196,16 @@ private:
       : is_boundary(is_boundary), ior(index_of_refraction){};
 };
 
+class Waveform;
+
 // An object that is draw to the simulation texture, either a source, medium, or boundary.
 class SimObject {
 public:
   // draw the object to the simulation texture
   virtual void draw(const Programs &programs, glm::vec2 physical_scale_factor,
                     float time) const = 0;
+  // rasterize the object onto a cpu simulation grid, the same way draw does on the gpu
+  virtual void rasterize(SimGrid &grid, float time) const = 0;
   // draw the object's editing controls to the display
   virtual void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                              bool active) const;
@@ -158,6 +216,18 @@ public:
   // draw the imgui controls for this object. This is called within an imgui window (ie, within
   // ImGui::Begin and ImGui::End). Return true if this object should be deleted.
   virtual bool draw_imgui_controls();
+  // append the physical positions the object measures the field at (if it is a probe), and return
+  // the number of positions appended
+  virtual size_t probe_points(std::vector<glm::vec2> &points) const;
+  // the waveform the object emits if it is a source, or nullptr
+  virtual const Waveform *source_waveform() const;
+  // whether the cells the object draws to change over time
+  virtual bool moves() const;
+  // the medium or boundary the object draws, or nullptr if it doesn't draw one
+  virtual const MediumType *object_medium() const;
+  // set a numeric property of the object by name (the names are listed with each set_property
+  // override). Return false if the object has no such property.
+  virtual bool set_property(const std::string &name, float value);
   // convert the object to its textual representation
   virtual std::string serialize() const = 0;
   // get the object from its textual representation
@@ -173,10 +243,15 @@ public:
   long int active_object{-1};
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const;
+  void rasterize(SimGrid &grid, float time) const;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor) const;
   void handle_events(glm::vec2 delta_x, glm::vec2 screen_size);
   void draw_imgui_controls();
   bool has_active_object() const;
+  // Largest inverse index of refraction of the media in the environment, or 1 (vacuum) if that is
+  // larger. Wave speeds anywhere on a grid the environment is rasterized to are at most this times
+  // the vacuum speed.
+  float max_ior_inv() const;
   // generate a textual representation of the environment
   std::string serialize() const;
   // convert a textual representation to an Environment
@@ -189,6 +264,7 @@ public:
 class AreaClear : public SimObject {
 public:
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   std::string serialize() const override;
 
   AreaClear() = default;
@@ -205,11 +281,15 @@ public:
   int active_handle{-1};
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                      bool active) const override;
   bool handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) override;
 
   bool draw_imgui_controls() override;
+  const MediumType *object_medium() const override { return &medium; }
+  // x0, y0, x1, y1, ior
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   // (x0, y0) define the bottom left corner, (x1, y1) defines the top right corner
@@ -230,6 +310,8 @@ public:
   bool handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) override;
   void imgui_line_controls();
   std::string serialize_coordinates() const;
+  // x0, y0, x1, y1, width
+  bool set_property(const std::string &name, float value) override;
 
   LineBase(float x0, float y0, float x1, float y1, float width)
       : x0(x0), y0(y0), x1(x1), y1(y1), width(width){};
@@ -241,9 +323,13 @@ public:
   MediumType medium;
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                      bool active) const override;
   bool draw_imgui_controls() override;
+  const MediumType *object_medium() const override { return &medium; }
+  // x0, y0, x1, y1, width, ior
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   Line(float x0, float y0, float x1, float y1, float width, MediumType medium)
@@ -261,6 +347,11 @@ public:
   // Return the time derivative (df/dt) of sample
   virtual float sample_diff(float time, float phase) const = 0;
 
+  // The (u, u_t, inv_ior, boundary) value drawn for a source with this waveform, and the channels
+  // it is drawn to
+  glm::vec4 object_props(float time, float phase) const;
+  static constexpr glm::bvec4 color_mask{true, true, false, false};
+
   // Setup the gl program to draw this waveform on a source
   void set_gl_program(const Programs &programs, float time, float phase) const;
 
@@ -274,6 +365,8 @@ public:
 
   // return the frequency and amplitude of the wave (if periodic), 1.0 otherwise
   virtual std::pair<float, float> get_freq_amp() const;
+  // set a numeric property of the waveform by name. Return false if it has no such property.
+  virtual bool set_property(const std::string &name, float value);
 
   // convert the waveform to its stored textual representation
   virtual std::string serialize() const = 0;
@@ -295,6 +388,8 @@ public:
   void draw_imgui_prop_controls() override;
   int waveform_type_index() override;
   std::pair<float, float> get_freq_amp() const override;
+  // amplitude, frequency
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   SineWaveform(float amplitude, float frequency) : amp(amplitude), freq(frequency){};
@@ -311,6 +406,8 @@ public:
   void draw_imgui_prop_controls() override;
   int waveform_type_index() override;
   std::pair<float, float> get_freq_amp() const override;
+  // amplitude, frequency
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   TriangleWaveform(float amp, float freq) : amp(amp), freq(freq){};
@@ -327,6 +424,8 @@ public:
   void draw_imgui_prop_controls() override;
   int waveform_type_index() override;
   std::pair<float, float> get_freq_amp() const override;
+  // amplitude, frequency
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   SquareWaveform(float amp, float freq) : amp(amp), freq(freq){};
@@ -354,6 +453,8 @@ public:
   void draw_imgui_prop_controls() override;
   int waveform_type_index() override;
   std::pair<float, float> get_freq_amp() const override;
+  // duration, start, or a property of the underlying waveform
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   GaussianEnvelope(std::unique_ptr<Waveform> waveform, float duration, float start_t)
@@ -369,10 +470,14 @@ public:
   float phase;
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                      bool active) const override;
   bool handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) override;
   bool draw_imgui_controls() override;
+  const Waveform *source_waveform() const override { return waveform.get(); }
+  // x, y, phase, or a property of the waveform
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   PointSource(float x, float y, std::unique_ptr<Waveform> waveform, float phase)
@@ -398,10 +503,15 @@ public:
   std::pair<float, float> current_pos(float time) const;
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                      bool active) const override;
   bool handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) override;
   bool draw_imgui_controls() override;
+  const Waveform *source_waveform() const override { return waveform.get(); }
+  bool moves() const override { return true; }
+  // x0, y0, x1, y1, speed, phase, or a property of the waveform
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   MovingPointSource(float x0, float y0, float x1, float y1, float time_end, std::unique_ptr<Waveform> waveform, float phase)
@@ -415,9 +525,13 @@ public:
   float phase;
 
   void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
   void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
                      bool active) const override;
   bool draw_imgui_controls() override;
+  const Waveform *source_waveform() const override { return waveform.get(); }
+  // x0, y0, x1, y1, width, phase, or a property of the waveform
+  bool set_property(const std::string &name, float value) override;
   std::string serialize() const override;
 
   LineSource(float x0, float y0, float x1, float y1, float width,
@@ -425,4 +539,41 @@ public:
       : LineBase(x0, y0, x1, y1, width), waveform(std::move(waveform)), phase(phase){};
 };
 
+// A probe that measures u at a point. Probes aren't drawn to the simulation.
+class Probe : public SimObject {
+public:
+  // location
+  float x, y;
+
+  void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
+  void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
+                     bool active) const override;
+  bool handle_events(glm::vec2 delta_x, bool active, glm::vec2 screen_size) override;
+  bool draw_imgui_controls() override;
+  size_t probe_points(std::vector<glm::vec2> &points) const override;
+  // x, y
+  bool set_property(const std::string &name, float value) override;
+  std::string serialize() const override;
+
+  Probe(float x, float y) : x(x), y(y){};
+};
+
+// A probe that measures u at samples evenly spaced points on a line (including both ends)
+class LineProbe : public LineBase {
+public:
+  int samples;
+
+  void draw(const Programs &programs, glm::vec2 physical_scale_factor, float time) const override;
+  void rasterize(SimGrid &grid, float time) const override;
+  void draw_controls(const Programs &programs, glm::vec2 physical_scale_factor,
+                     bool active) const override;
+  bool draw_imgui_controls() override;
+  size_t probe_points(std::vector<glm::vec2> &points) const override;
+  std::string serialize() const override;
+
+  LineProbe(float x0, float y0, float x1, float y1, int samples)
+      : LineBase(x0, y0, x1, y1, 1.0), samples(samples){};
+};
+
 #endif
\ No newline at end of file
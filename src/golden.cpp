@@ -0,0 +1,437 @@
+#include "amr_engine.hpp"
+#include "batch_engine.hpp"
+#include "compare.hpp"
+#include "engine.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Golden output regression check. Each example scene is run for a fixed number of steps on every
+// backend that supports it, and the final u field is compared against a golden snapshot stored in
+// examples/golden/<scene>.golden. Run with --update to regenerate the snapshots from the reference
+// (first) backend after an intended change to the physics.
+//
+// Local time stepping also has to converge to global steps: on scenes whose waves are resolved at
+// the golden grid size, the difference between the two has to shrink by min_convergence_ratio when
+// the grid size and the number of steps are doubled.
+//
+// Tolerances: a field passes if
+//   max |u - golden| <= max_abs_tolerance * peak  and  rms(u - golden) <= rms_tolerance * peak
+// where peak is the largest |golden|. The engines that run the same scheme as the reference compute
+// in single precision, so differences only come from the order of floating point operations (and
+// fma contraction). These stay at a few ulp per step for this linear scheme, so the default
+// tolerances are loose enough for different compilers and tight enough to catch any change to the
+// scheme, stencil, sources, or boundaries. cpu-double runs the scheme in double precision, which
+// shows the rounding of single precision stays about a thousand times inside them. Backends that
+// approximate the scheme have looser tolerances of their own.
+
+#ifndef WAVES_EXAMPLES_DIR
+#define WAVES_EXAMPLES_DIR "examples"
+#endif
+
+static constexpr float max_abs_tolerance = 1e-3;
+static constexpr float rms_tolerance = 1e-4;
+
+// Mesh refinement runs the grid away from sources, boundaries and steep fields at half the
+// resolution, where waves have more dispersion. It runs with its default options, and has to stay
+// within the 1% of the reference it was measured at on full size scenes. At the golden grid size
+// its blocks cover most of the grid, so this mostly checks the steps of the blocks, and the coarse
+// cells that are replaced by their averages.
+static constexpr float amr_max_abs_tolerance = 1e-2;
+static constexpr float amr_rms_tolerance = 1e-3;
+
+// Local time stepping runs the tiles of slow media at the Courant number of the fastest one, which
+// changes the dispersion of their waves. At the golden grid size the dense media only have a few
+// cells per wavelength, and their fields are off by up to 6% of the peak (0.7% rms). The tolerances
+// still catch tiles that read their neighbors at the wrong time, or levels that step faster media.
+static constexpr float time_levels_max_abs_tolerance = 0.1;
+static constexpr float time_levels_rms_tolerance = 1e-2;
+
+// grid size and number of steps each scene is run for
+static constexpr size_t golden_grid_size = 128;
+static constexpr size_t golden_steps = 256;
+// number of copies of the scene stepped by the batch backend
+static constexpr size_t golden_batch_size = 3;
+// longest time step of the local time stepping backend, as a power of two multiple of delta_t
+static constexpr int golden_time_levels = 2;
+// Scenes local time stepping is checked for convergence on. Their waves are resolved in every
+// medium at the golden grid size, which is needed for the difference to global steps to shrink at
+// the order of the scheme. In the other scenes, the longer steps change the dispersion of the
+// waves by more than that.
+static const char *const convergence_scenes[] = {"slow_medium_pulse.sim"};
+// A coupling of the tiles that is second order gets close to 4, and one that isn't consistent
+// doesn't shrink the difference at all
+static constexpr double min_convergence_ratio = 2.5;
+
+static constexpr char golden_magic[8] = {'W', 'A', 'V', 'G', 'O', 'L', 'D', '1'};
+
+// A way of running the simulation. Returns the u field after steps steps.
+struct Backend {
+  const char *name;
+  float max_abs_tolerance, rms_tolerance;
+  // if the backend runs scenes with settings and environment. Other scenes are skipped.
+  std::function<bool(const SimSettings &, const Environment &)> supports;
+  std::function<std::vector<float>(const SimSettings &, Environment, size_t steps)> run;
+};
+
+static bool is_symmetric(const SimSettings &settings) {
+  return settings.symmetry_x != Symmetry::None || settings.symmetry_y != Symmetry::None;
+}
+
+// If the scene only uses what every backend supports: the 5 point stencil, absorbing edges, and no
+// symmetry planes
+static bool is_plain(const SimSettings &settings) {
+  return settings.stencil_order == 2 && !settings.periodic_x && !settings.periodic_y &&
+         !is_symmetric(settings);
+}
+
+static bool has_moving_sources(const Environment &env) {
+  for (const auto &obj : env.objects) {
+    if (obj->source_waveform() != nullptr && obj->moves()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Environments can't be copied, so copy env through its serialized form
+static Environment copy_environment(const Environment &env) {
+  std::istringstream in(env.serialize());
+  return std::move(*Environment::deserialize(in));
+}
+
+// rms difference between the u fields of the scene at path after steps local and global steps on
+// a size x size grid
+static std::optional<double> time_level_difference(const std::string &path, size_t size,
+                                                   size_t steps) {
+  auto global = Scene::load(path), local = Scene::load(path);
+  if (!global || !local) {
+    return {};
+  }
+  SimSettings settings = global->settings.resized(size, size);
+  Engine global_engine{settings, std::move(global->environment), 1};
+  Engine local_engine{settings, std::move(local->environment), 1};
+  if (!local_engine.set_time_levels(golden_time_levels)) {
+    return {};
+  }
+  global_engine.run(steps);
+  local_engine.run(steps);
+  return field_diff(local_engine.state().u.data(), global_engine.state().u.data(),
+                    settings.texture_width * settings.texture_height)
+      .rms;
+}
+
+// The scheme of Engine for plain scenes, with u and u_t in double precision. Sources are drawn the
+// same way as in BatchEngine, into a float grid whose written cells are copied over. The time is
+// summed in float like in the engines, so only the rounding of the field differs.
+static std::vector<float> run_double(const SimSettings &settings, Environment env, size_t steps) {
+  const size_t width = settings.texture_width, height = settings.texture_height;
+  SimGrid grid{width, height, settings.delta_x, settings.delta_y};
+  grid.pass_mask = glm::bvec4(false, false, true, true);
+  env.rasterize(grid, 0.0f);
+  grid.pass_mask = glm::bvec4(true, true, false, false);
+
+  // damping factor of each cell, as in Engine::init_damping
+  std::vector<double> damping(grid.size(), 1.0);
+  const double damping_area_size = settings.damping_area_size;
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      const double k = (double)std::min(std::min(x, width - 1 - x), std::min(y, height - 1 - y));
+      if (k + 0.5 < damping_area_size) {
+        damping[y * width + x] = std::tanh(2.0 * (k + 0.5) / damping_area_size + 1.0);
+      }
+    }
+  }
+
+  std::vector<double> u(grid.size(), 0.0), u_t(grid.size(), 0.0);
+  std::vector<double> next_u(grid.size()), next_u_t(grid.size());
+  std::vector<size_t> written;
+  const double inv_delta_x2 = 1.0 / ((double)settings.delta_x * settings.delta_x);
+  const double inv_delta_y2 = 1.0 / ((double)settings.delta_y * settings.delta_y);
+  const double delta_t = settings.delta_t;
+  float time = 0.0f;
+  for (size_t step = 0; step < steps; step++) {
+    written.clear();
+    grid.write_log = &written;
+    env.rasterize(grid, time);
+    grid.write_log = nullptr;
+    for (size_t c : written) {
+      u[c] = grid.u[c];
+      u_t[c] = grid.u_t[c];
+    }
+
+    for (size_t y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t c = y * width + x;
+        // neighbors outside the grid or on a boundary take the value of this cell
+        auto neighbor = [&](bool inside, size_t n) {
+          return inside && grid.boundary[n] == 0.0f ? u[n] : u[c];
+        };
+        const double laplace =
+            (neighbor(x > 0, c - 1) + neighbor(x + 1 < width, c + 1) - 2.0 * u[c]) *
+                inv_delta_x2 +
+            (neighbor(y > 0, c - width) + neighbor(y + 1 < height, c + width) - 2.0 * u[c]) *
+                inv_delta_y2;
+        const double wave_speed = (double)grid.ior_inv[c] * settings.wave_speed_vacuum;
+        next_u_t[c] = (u_t[c] + wave_speed * wave_speed * laplace * delta_t) * damping[c];
+        next_u[c] = u[c] + next_u_t[c] * delta_t;
+      }
+    }
+    std::swap(u, next_u);
+    std::swap(u_t, next_u_t);
+    time += settings.delta_t;
+  }
+  return std::vector<float>(u.begin(), u.end());
+}
+
+static const std::vector<Backend> backends = {
+    {"cpu-scalar", max_abs_tolerance, rms_tolerance,
+     [](const SimSettings &, const Environment &) { return true; },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       Engine engine{settings, std::move(env), 1};
+       engine.run(steps);
+       return engine.state().u;
+     }},
+    {"cpu-threaded", max_abs_tolerance, rms_tolerance,
+     [](const SimSettings &, const Environment &) { return true; },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       Engine engine{settings, std::move(env), 4};
+       engine.run(steps);
+       return engine.state().u;
+     }},
+    // the scheme without the rounding of single precision
+    {"cpu-double", max_abs_tolerance, rms_tolerance,
+     [](const SimSettings &settings, const Environment &) { return is_plain(settings); },
+     run_double},
+    // the whole grid of a symmetric scene, whose objects are drawn on both sides of the planes
+    {"cpu-unmirrored", max_abs_tolerance, rms_tolerance,
+     [](const SimSettings &settings, const Environment &) { return is_symmetric(settings); },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       SimSettings full = settings;
+       full.symmetry_x = Symmetry::None;
+       full.symmetry_y = Symmetry::None;
+       Engine engine{full, std::move(env), 1};
+       engine.run(steps);
+       return engine.state().u;
+     }},
+    // every tile steps with delta_t in the scenes without slow media, which checks the tiled loop
+    {"cpu-time-levels", time_levels_max_abs_tolerance, time_levels_rms_tolerance,
+     [](const SimSettings &, const Environment &env) { return !has_moving_sources(env); },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       Engine engine{settings, std::move(env), 1};
+       engine.set_time_levels(golden_time_levels);
+       engine.run(steps);
+       return engine.state().u;
+     }},
+    // the last of several copies of the scene, so the scene isn't in the first lane
+    {"cpu-batch", max_abs_tolerance, rms_tolerance,
+     [](const SimSettings &settings, const Environment &) { return is_plain(settings); },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       std::vector<Scene> scenes(golden_batch_size);
+       for (auto &scene : scenes) {
+         scene.settings = settings;
+         scene.environment = copy_environment(env);
+       }
+       auto engine = BatchEngine::create(std::move(scenes), 1);
+       engine->run(steps);
+       SimGrid grid;
+       engine->copy_state(golden_batch_size - 1, grid);
+       return grid.u;
+     }},
+    {"cpu-amr", amr_max_abs_tolerance, amr_rms_tolerance,
+     [](const SimSettings &settings, const Environment &) {
+       return is_plain(settings) && settings.texture_width % AmrEngine::block_size == 0 &&
+              settings.texture_height % AmrEngine::block_size == 0;
+     },
+     [](const SimSettings &settings, Environment env, size_t steps) {
+       auto engine = AmrEngine::create(settings, std::move(env), {}, 1);
+       engine->run(steps);
+       SimGrid grid;
+       engine->composite(grid);
+       return grid.u;
+     }},
+};
+
+struct Golden {
+  uint32_t width, height, steps;
+  std::vector<float> u;
+};
+
+static bool write_golden(const std::string &path, const Golden &golden) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  uint32_t header[3] = {golden.width, golden.height, golden.steps};
+  fwrite(golden_magic, 1, sizeof(golden_magic), file);
+  fwrite(header, sizeof(uint32_t), 3, file);
+  fwrite(golden.u.data(), sizeof(float), golden.u.size(), file);
+  fclose(file);
+  return true;
+}
+
+static std::optional<Golden> read_golden(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return {};
+  }
+
+  Golden golden;
+  char magic[8];
+  uint32_t header[3];
+  bool valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+               !memcmp(magic, golden_magic, sizeof(magic)) &&
+               fread(header, sizeof(uint32_t), 3, file) == 3;
+  if (valid) {
+    golden.width = header[0];
+    golden.height = header[1];
+    golden.steps = header[2];
+    golden.u.resize((size_t)golden.width * golden.height);
+    valid = fread(golden.u.data(), sizeof(float), golden.u.size(), file) == golden.u.size();
+  }
+  fclose(file);
+
+  if (!valid) {
+    fprintf(stderr, "Invalid golden file: %s\n", path.c_str());
+    return {};
+  }
+  return golden;
+}
+
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --update         regenerate the golden snapshots from the reference backend\n"
+          "  --examples dir   directory of .sim scenes (default %s)\n"
+          "  --golden dir     directory of golden snapshots (default <examples>/golden)\n",
+          name, WAVES_EXAMPLES_DIR);
+}
+
+int main(int argc, char **argv) {
+  std::string examples_dir = WAVES_EXAMPLES_DIR;
+  std::string golden_dir;
+  bool update = false;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--update")) {
+      update = true;
+    } else if (!strcmp(argv[i], "--examples") && has_value) {
+      examples_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--golden") && has_value) {
+      golden_dir = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+  if (golden_dir.empty()) {
+    golden_dir = examples_dir + "/golden";
+  }
+
+  std::vector<std::filesystem::path> scene_paths;
+  std::error_code err;
+  for (const auto &entry : std::filesystem::directory_iterator(examples_dir, err)) {
+    if (entry.path().extension() == ".sim") {
+      scene_paths.push_back(entry.path());
+    }
+  }
+  if (err || scene_paths.empty()) {
+    fprintf(stderr, "No scenes found in %s\n", examples_dir.c_str());
+    return -1;
+  }
+  std::sort(scene_paths.begin(), scene_paths.end());
+
+  int failures = 0;
+  for (const auto &path : scene_paths) {
+    std::string golden_path = golden_dir + "/" + path.stem().string() + ".golden";
+    std::optional<Golden> golden;
+    if (!update) {
+      golden = read_golden(golden_path);
+      if (!golden) {
+        failures++;
+        continue;
+      }
+    }
+
+    for (const auto &backend : backends) {
+      auto scene = Scene::load(path.string());
+      if (!scene) {
+        return -1;
+      }
+      SimSettings settings = scene->settings.resized(golden_grid_size, golden_grid_size);
+      if (!backend.supports(settings, scene->environment)) {
+        continue;
+      }
+      auto u = backend.run(settings, std::move(scene->environment), golden_steps);
+
+      if (update) {
+        std::filesystem::create_directories(golden_dir);
+        Golden res{(uint32_t)settings.texture_width, (uint32_t)settings.texture_height,
+                   (uint32_t)golden_steps, std::move(u)};
+        if (!write_golden(golden_path, res)) {
+          return -1;
+        }
+        printf("%-40s %-16s updated\n", path.filename().string().c_str(), backend.name);
+        // only the reference backend is used for the snapshot
+        break;
+      }
+
+      if (golden->u.size() != u.size() || golden->steps != golden_steps) {
+        printf("%-40s %-16s FAIL (golden snapshot has a different size)\n",
+               path.filename().string().c_str(), backend.name);
+        failures++;
+        continue;
+      }
+
+      FieldDiff diff = field_diff(u.data(), golden->u.data(), u.size());
+      float peak = std::max(1e-6f, diff.ref_max_abs);
+      bool pass = diff.max_abs <= backend.max_abs_tolerance * peak &&
+                  diff.rms <= backend.rms_tolerance * peak;
+      printf("%-40s %-16s %s (max abs %.3g, rms %.3g, peak %.3g)\n",
+             path.filename().string().c_str(), backend.name, pass ? "ok" : "FAIL", diff.max_abs,
+             diff.rms, diff.ref_max_abs);
+      if (!pass)
+        failures++;
+    }
+  }
+
+  for (const auto &path : scene_paths) {
+    const std::string name = path.filename().string();
+    bool checked = std::any_of(std::begin(convergence_scenes), std::end(convergence_scenes),
+                               [&](const char *scene) { return name == scene; });
+    if (update || !checked) {
+      continue;
+    }
+    auto coarse = time_level_difference(path.string(), golden_grid_size, golden_steps);
+    auto fine = time_level_difference(path.string(), 2 * golden_grid_size, 2 * golden_steps);
+    if (!coarse || !fine) {
+      failures++;
+      continue;
+    }
+    double ratio = *coarse / std::max(*fine, 1e-30);
+    bool pass = ratio >= min_convergence_ratio;
+    printf("%-40s %-16s %s (rms difference to global steps %.3g, %.3g at twice the size)\n",
+           name.c_str(), "cpu-convergence", pass ? "ok" : "FAIL", *coarse, *fine);
+    if (!pass)
+      failures++;
+  }
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,180 @@
+#include "grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+SimGrid::SimGrid(size_t width, size_t height, float delta_x, float delta_y)
+    : width(width), height(height), delta_x(delta_x), delta_y(delta_y), u(width * height, 0.0f),
+      u_t(width * height, 0.0f), ior_inv(width * height, 1.0f), boundary(width * height, 0.0f) {}
+
+glm::vec2 SimGrid::physical_to_cell(float x, float y) const {
+  return glm::vec2(x / delta_x + width / 2.0f, y / delta_y + height / 2.0f);
+}
+
+void SimGrid::resample_field(const SimGrid &other) {
+  for (size_t j = 0; j < height; j++) {
+    for (size_t i = 0; i < width; i++) {
+      const size_t c = j * width + i;
+      u[c] = 0.0f;
+      u_t[c] = 0.0f;
+
+      float x = ((float)i + 0.5f - width / 2.0f) * delta_x;
+      float y = ((float)j + 0.5f - height / 2.0f) * delta_y;
+      glm::vec2 p = other.physical_to_cell(x, y);
+      if (!(p.x >= 0.0f && p.x <= (float)other.width && p.y >= 0.0f &&
+            p.y <= (float)other.height)) {
+        continue;
+      }
+
+      // the 2x2 cells whose centers surround p, weighted by their distance and whether they're open
+      float fx = p.x - 0.5f, fy = p.y - 0.5f;
+      long x0 = (long)std::floor(fx), y0 = (long)std::floor(fy);
+      float tx = fx - (float)x0, ty = fy - (float)y0;
+      float weight_sum = 0.0f, u_sum = 0.0f, u_t_sum = 0.0f;
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+          long sx = std::clamp(x0 + dx, 0l, (long)other.width - 1);
+          long sy = std::clamp(y0 + dy, 0l, (long)other.height - 1);
+          size_t s = (size_t)sy * other.width + (size_t)sx;
+          float weight =
+              (dx ? tx : 1.0f - tx) * (dy ? ty : 1.0f - ty) * (1.0f - other.boundary[s]);
+          weight_sum += weight;
+          u_sum += weight * other.u[s];
+          u_t_sum += weight * other.u_t[s];
+        }
+      }
+      if (weight_sum > 0.0f) {
+        u[c] = u_sum / weight_sum;
+        u_t[c] = u_t_sum / weight_sum;
+      }
+    }
+  }
+}
+
+void mirror_plane(float *plane, size_t width, size_t height, Symmetry symmetry_x,
+                  Symmetry symmetry_y, bool odd_sign, size_t stride, size_t x0, size_t x1,
+                  size_t y0, size_t y1) {
+  const size_t start_x = mirror_start(width, symmetry_x);
+  const size_t start_y = mirror_start(height, symmetry_y);
+  const float sign_x = odd_sign ? (float)symmetry_x : 1.0f;
+  const float sign_y = odd_sign ? (float)symmetry_y : 1.0f;
+  for (size_t y = y0; y < y1; y++) {
+    const bool mirrored_y = y < start_y;
+    const float *source = plane + (mirrored_y ? height - 1 - y : y) * width * stride;
+    float *dest = plane + y * width * stride;
+    const float row_sign = mirrored_y ? sign_y : 1.0f;
+    // simulated rows only have the columns before start_x to fill, and the columns from start_x on
+    // of the other rows are a straight copy
+    const size_t end = mirrored_y ? x1 : std::min(x1, start_x);
+    const size_t mirrored_end = std::min(end, start_x);
+    const float mirrored_sign = sign_x * row_sign;
+    for (size_t x = x0; x < mirrored_end; x++) {
+      dest[x * stride] = mirrored_sign * source[(width - 1 - x) * stride];
+    }
+    for (size_t x = std::max(x0, start_x); x < end; x++) {
+      dest[x * stride] = row_sign * source[x * stride];
+    }
+  }
+}
+
+void SimGrid::mirror(Symmetry symmetry_x, Symmetry symmetry_y) {
+  mirror_plane(u.data(), width, height, symmetry_x, symmetry_y, true);
+  mirror_plane(u_t.data(), width, height, symmetry_x, symmetry_y, true);
+  mirror_plane(ior_inv.data(), width, height, symmetry_x, symmetry_y, false);
+  mirror_plane(boundary.data(), width, height, symmetry_x, symmetry_y, false);
+}
+
+// Return the range [first, last) of cells whose centers lie in [lo, hi), clamped to [0, size)
+static std::pair<long, long> covered_cells(float lo, float hi, size_t size) {
+  long first = std::max(0l, (long)std::ceil(lo - 0.5f));
+  long last = std::min((long)size, (long)std::ceil(hi - 0.5f));
+  return {first, std::max(first, last)};
+}
+
+void SimGrid::fill(glm::vec4 props, glm::bvec4 mask) {
+  mask = mask && pass_mask;
+  if (write_log != nullptr && (mask.r || mask.g)) {
+    for (size_t i = 0; i < size(); i++) {
+      write_log->push_back(i);
+    }
+  }
+  if (mask.r)
+    std::fill(u.begin(), u.end(), props.r);
+  if (mask.g)
+    std::fill(u_t.begin(), u_t.end(), props.g);
+  if (mask.b)
+    std::fill(ior_inv.begin(), ior_inv.end(), props.b);
+  if (mask.a)
+    std::fill(boundary.begin(), boundary.end(), props.a);
+}
+
+void SimGrid::fill_rect(float x0, float y0, float x1, float y1, glm::vec4 props,
+                        glm::bvec4 mask) {
+  mask = mask && pass_mask;
+  if (!glm::any(mask))
+    return;
+
+  glm::vec2 c0 = physical_to_cell(x0, y0);
+  glm::vec2 c1 = physical_to_cell(x1, y1);
+  auto [i0, i1] = covered_cells(std::min(c0.x, c1.x), std::max(c0.x, c1.x), width);
+  auto [j0, j1] = covered_cells(std::min(c0.y, c1.y), std::max(c0.y, c1.y), height);
+
+  for (long j = j0; j < j1; j++) {
+    for (long i = i0; i < i1; i++) {
+      write(j * width + i, props, mask);
+    }
+  }
+}
+
+// Lines are rasterized like non antialiased wide gl lines: for an x-major line, each column whose
+// center is on the line is filled with a vertical span of width cells centered on the line (and
+// likewise with rows for a y-major line).
+void SimGrid::fill_line(float x0, float y0, float x1, float y1, float line_width,
+                        glm::vec4 props, glm::bvec4 mask) {
+  mask = mask && pass_mask;
+  if (!glm::any(mask))
+    return;
+
+  glm::vec2 p0 = physical_to_cell(x0, y0);
+  glm::vec2 p1 = physical_to_cell(x1, y1);
+  glm::vec2 dir = p1 - p0;
+  float half_width = std::max(1.0f, std::round(line_width)) / 2.0f;
+
+  // rasterize along the major axis
+  bool x_major = std::abs(dir.x) >= std::abs(dir.y);
+  int major = x_major ? 0 : 1;
+  int minor = x_major ? 1 : 0;
+  size_t major_size = x_major ? width : height;
+  size_t minor_size = x_major ? height : width;
+  if (dir[major] == 0.0f)
+    return;
+
+  auto [m0, m1] = covered_cells(std::min(p0[major], p1[major]), std::max(p0[major], p1[major]),
+                                major_size);
+  for (long m = m0; m < m1; m++) {
+    float t = ((float)m + 0.5f - p0[major]) / dir[major];
+    float center = p0[minor] + t * dir[minor];
+    auto [n0, n1] = covered_cells(center - half_width, center + half_width, minor_size);
+    for (long n = n0; n < n1; n++) {
+      write(x_major ? n * width + m : m * width + n, props, mask);
+    }
+  }
+}
+
+void SimGrid::fill_point(float x, float y, float size, glm::vec4 props, glm::bvec4 mask) {
+  mask = mask && pass_mask;
+  if (!glm::any(mask))
+    return;
+
+  glm::vec2 p = physical_to_cell(x, y);
+  float half_size = std::max(1.0f, std::round(size)) / 2.0f;
+  auto [i0, i1] = covered_cells(p.x - half_size, p.x + half_size, width);
+  auto [j0, j1] = covered_cells(p.y - half_size, p.y + half_size, height);
+
+  for (long j = j0; j < j1; j++) {
+    for (long i = i0; i < i1; i++) {
+      write(j * width + i, props, mask);
+    }
+  }
+}
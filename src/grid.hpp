@@ -0,0 +1,107 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Mirror symmetry of the field about the plane x = 0 or y = 0. The value is the sign u takes in the
+// mirror image: Even fields are the same on both sides, and Odd fields change sign.
+enum class Symmetry : int { Odd = -1, None = 0, Even = 1 };
+
+// First simulated cell along an axis of size cells. Across a symmetry plane only the cells from the
+// middle of the grid on (x >= 0 or y >= 0) are simulated, and the rest are their mirror image.
+inline size_t mirror_start(size_t size, Symmetry symmetry) {
+  return symmetry == Symmetry::None ? 0 : size / 2;
+}
+
+// Copy the simulated cells of a width x height plane (see mirror_start) over the cells of columns
+// [x0, x1) and rows [y0, y1) that aren't simulated. Cell i along a mirrored axis is the image of
+// cell size - 1 - i. If odd_sign, copies across an Odd plane change sign (as u, u_t and phasors
+// do), otherwise they are kept as they are (as media, boundaries and intensities are). The values
+// of a plane are stride floats apart.
+void mirror_plane(float *plane, size_t width, size_t height, Symmetry symmetry_x,
+                  Symmetry symmetry_y, bool odd_sign, size_t stride, size_t x0, size_t x1,
+                  size_t y0, size_t y1);
+// Copy the simulated cells of a plane over all the others
+inline void mirror_plane(float *plane, size_t width, size_t height, Symmetry symmetry_x,
+                         Symmetry symmetry_y, bool odd_sign, size_t stride = 1) {
+  mirror_plane(plane, width, height, symmetry_x, symmetry_y, odd_sign, stride, 0, width, 0,
+               height);
+}
+
+// SimGrid is a cpu side copy of the simulation state, used by the headless engine. It stores the
+// same four channels as the gl simulation texture, but as separate planes. Cells are stored row by
+// row, with row 0 at the bottom of the simulation area (the same as texture coordinates).
+//
+// The fill functions rasterize the same primitives as GeometryManager and follow the same rules as
+// gl does for them. Each takes the (u, u_t, inv_ior, boundary) value to write and a mask of which
+// channels to write, matching the object_props uniform and glColorMask used by the gl path.
+class SimGrid {
+public:
+  size_t width{0}, height{0};
+  // Physical width and height of each cell (in m/cell)
+  float delta_x{1.0}, delta_y{1.0};
+
+  // position (u)
+  std::vector<float> u{};
+  // velocity (du/dt)
+  std::vector<float> u_t{};
+  // inverse index of refraction
+  std::vector<float> ior_inv{};
+  // boundary (0 = normal, 1 = boundary)
+  std::vector<float> boundary{};
+
+  // Channels the fill functions may write. This is combined with the mask passed to each function,
+  // and lets the engine rasterize the static (medium and boundary) and the dynamic (u and u_t)
+  // parts of the environment separately.
+  glm::bvec4 pass_mask{true, true, true, true};
+  // If set, the index of each cell whose u or u_t is written by the fill functions is appended to
+  // it, so the cells a pass changes can be found without comparing whole planes
+  std::vector<size_t> *write_log{nullptr};
+
+  SimGrid() = default;
+  SimGrid(size_t width, size_t height, float delta_x, float delta_y);
+
+  size_t size() const { return width * height; }
+
+  // Convert physical coordinates (in m, with (0, 0) at the center of the grid) to window
+  // coordinates (in cells, with (0, 0) at the bottom left corner of the grid).
+  glm::vec2 physical_to_cell(float x, float y) const;
+
+  // Replace u and u_t with those of other, interpolated bilinearly at the physical position of each
+  // cell's center, so a state can be moved to a grid of a different size or cell size. Boundary
+  // cells of other aren't interpolated from, and cells outside its simulation area are set to 0.
+  // The medium and boundary planes are kept.
+  void resample_field(const SimGrid &other);
+
+  // Make the cells that aren't simulated the mirror image of those that are (see mirror_plane), in
+  // every plane
+  void mirror(Symmetry symmetry_x, Symmetry symmetry_y);
+
+  // Write the masked channels of props to the cell at index
+  void write(size_t index, glm::vec4 props, glm::bvec4 mask) {
+    if (write_log != nullptr && (mask.r || mask.g))
+      write_log->push_back(index);
+    if (mask.r)
+      u[index] = props.r;
+    if (mask.g)
+      u_t[index] = props.g;
+    if (mask.b)
+      ior_inv[index] = props.b;
+    if (mask.a)
+      boundary[index] = props.a;
+  }
+
+  // Write props to every cell of the grid
+  void fill(glm::vec4 props, glm::bvec4 mask);
+  // Write props to the cells inside the rectangle with corners (x0, y0) and (x1, y1)
+  void fill_rect(float x0, float y0, float x1, float y1, glm::vec4 props, glm::bvec4 mask);
+  // Write props to the cells covered by a line from (x0, y0) to (x1, y1) that is width cells wide
+  void fill_line(float x0, float y0, float x1, float y1, float width, glm::vec4 props,
+                 glm::bvec4 mask);
+  // Write props to the cells covered by a point at (x, y) that is size cells wide
+  void fill_point(float x, float y, float size, glm::vec4 props, glm::bvec4 mask);
+};
+
+#endif
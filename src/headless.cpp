@@ -0,0 +1,549 @@
+#include "amr_engine.hpp"
+#include "engine.hpp"
+#include "helmholtz.hpp"
+#include "progressive.hpp"
+#include "recorder.hpp"
+#include "superposition.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+// Run a scene on the headless engine without opening a window.
+
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s <scene.sim> [options]\n"
+          "       %s --resume <snapshot> [options]\n"
+          "  --steps n             number of simulation steps to run (default 1000)\n"
+          "  --until-steady        stop once the field is steady (for periodic sources) or has\n"
+          "                        decayed (for pulses), running at most --steps steps\n"
+          "  --steady-tolerance t  relative change of the energy per period that counts as\n"
+          "                        steady (default 1e-3)\n"
+          "  --progressive n       start from the steady state of the scene on a grid 2^n times\n"
+          "                        coarser, refined twice at a time (for periodic sources). The\n"
+          "                        coarse grids run to the same tolerance and --steps, and 1\n"
+          "                        level is usually closest to the fine steady state.\n"
+          "  --auto-delta-t        run at the largest delta t that is stable for the scene\n"
+          "  --time-levels n       step tiles of slow media with up to 2^n times delta t (local\n"
+          "                        time stepping)\n"
+          "  --amr                 refine blocks of a grid at half the resolution around\n"
+          "                        boundaries, sources and steep parts of the field instead of\n"
+          "                        running the whole grid at full resolution\n"
+          "  --amr-threshold t     change of u between coarse cells, as a fraction of the largest\n"
+          "                        |u|, that refines a block (default 0.05)\n"
+          "  --threads n           number of threads to run on (default: all hardware threads)\n"
+          "  --trace file          write a chrome trace of the run to file\n"
+          "  --resume file         continue the run saved in a snapshot file\n"
+          "  --grid wxh            run on a grid of w x h cells over the same area. A resumed\n"
+          "                        snapshot of another size is resampled to it, so a coarse\n"
+          "                        preview can be continued at a finer resolution.\n"
+          "  --checkpoint file     save a snapshot to file at the end of the run\n"
+          "  --checkpoint-every n  also save the snapshot every n steps\n"
+          "  --record file         record the u field to a recording file\n"
+          "  --record-every n      record every n-th step (default 1)\n"
+          "  --record-downsample n record the average of each n x n block of cells (default 1)\n"
+          "  --record-error e      compress the recording with a maximum error of e\n"
+          "  --record-keyframe n   store a keyframe every n compressed frames (default 32)\n"
+          "  --probes file         write the probe samples of every step to file (as CSV if it\n"
+          "                        ends in .csv, and in the binary probe format otherwise)\n"
+          "  --accumulate w        average the intensity over a window of w seconds (default: the\n"
+          "                        whole run)\n"
+          "  --rms file            write the rms of u in each cell to a .pfm file\n"
+          "  --peak file           write the peak |u| in each cell to a .pfm file\n"
+          "  --phasors prefix      write the amplitude and phase of u at each frequency to\n"
+          "                        prefix_<k>_amplitude.pfm and prefix_<k>_phase.pfm\n"
+          "  --phasor-freq f       extract the phasor at f Hz (may be repeated, default: the\n"
+          "                        frequencies of the sources)\n"
+          "  --helmholtz           solve for the steady state in the frequency domain instead of\n"
+          "                        time stepping (the sources must be sine waves at a single\n"
+          "                        frequency), and write it with --phasors\n"
+          "  --helmholtz-tolerance t  relative residual the solve stops at (default 1e-6)\n"
+          "  --responses file      solve for the response to each source on its own in the\n"
+          "                        frequency domain, and write them to file\n"
+          "  --superpose file      combine the responses in file for the amplitudes and phases of\n"
+          "                        the sources of the scene instead of solving, and write the\n"
+          "                        result with --phasors\n",
+          name, name);
+}
+
+// Write a snapshot of the engine state. The snapshot is written to a temporary file first, so an
+// interrupted write doesn't destroy the last checkpoint.
+static bool write_checkpoint(const Snapshot &snapshot, const std::string &path) {
+  std::string tmp_path = path + ".tmp";
+  if (!snapshot.write(tmp_path)) {
+    return false;
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Write the amplitude and phase of phasor planes to prefix_0_amplitude.pfm and prefix_0_phase.pfm
+// (the same files --phasors writes)
+static bool write_phasor_maps(const char *prefix, const SimSettings &settings,
+                              const std::vector<float> &re, const std::vector<float> &im) {
+  const size_t width = settings.texture_width, height = settings.texture_height;
+  std::vector<float> amplitude(width * height), phase(width * height);
+  phasor_amplitude_phase(re.data(), im.data(), width * height, 1, amplitude.data(), phase.data());
+  std::string path = std::string(prefix) + "_0";
+  return write_pfm(path + "_amplitude.pfm", width, height, amplitude.data()) &&
+         write_pfm(path + "_phase.pfm", width, height, phase.data());
+}
+
+// Solve for the steady state of a scene in the frequency domain, and write its amplitude and phase
+// to prefix_0_amplitude.pfm and prefix_0_phase.pfm (the same files --phasors writes)
+static int solve_helmholtz(Scene &scene, unsigned threads, const HelmholtzOptions &options,
+                           const char *prefix) {
+  HelmholtzSolver solver{scene.settings, std::move(scene.environment), threads};
+
+  auto start = std::chrono::steady_clock::now();
+  bool ok = solver.solve(options);
+  auto end = std::chrono::steady_clock::now();
+  if (!ok) {
+    return -1;
+  }
+
+  std::vector<float> re, im;
+  solver.phasor_planes(re, im);
+  if (prefix != nullptr && !write_phasor_maps(prefix, scene.settings, re, im)) {
+    return -1;
+  }
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printf("Solved %zux%zu grid at %g Hz on %u threads in %.3f s (%zu iterations, residual %g)\n",
+         scene.settings.texture_width, scene.settings.texture_height, solver.frequency(),
+         solver.threads(), seconds, solver.iterations(), solver.residual());
+  return 0;
+}
+
+// Find the steady state of a scene by combining the response to each of its sources. The responses
+// are solved for and written to responses_path, or read from superpose_path if it isn't null.
+static int superpose(Scene &scene, unsigned threads, const HelmholtzOptions &options,
+                     const char *responses_path, const char *superpose_path, const char *prefix) {
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<SuperpositionCache> cache;
+  std::optional<std::vector<std::complex<float>>> phasors;
+  if (superpose_path != nullptr) {
+    cache = SuperpositionCache::read(superpose_path);
+    if (cache) {
+      phasors = cache->source_phasors(scene.settings, scene.environment);
+    }
+  } else {
+    cache = SuperpositionCache::solve(scene.settings, std::move(scene.environment), threads,
+                                      options);
+    if (cache && !cache->write(responses_path)) {
+      return -1;
+    }
+    if (cache) {
+      phasors = cache->solved_phasors();
+    }
+  }
+  if (!cache || !phasors) {
+    return -1;
+  }
+  auto loaded = std::chrono::steady_clock::now();
+
+  ThreadPool pool{threads};
+  std::vector<float> re, im;
+  cache->combine(*phasors, re, im, pool);
+  auto end = std::chrono::steady_clock::now();
+  if (prefix != nullptr && !write_phasor_maps(prefix, scene.settings, re, im)) {
+    return -1;
+  }
+
+  printf("%s %zu source responses in %.3f s, combined them in %.3f ms\n",
+         superpose_path != nullptr ? "Read" : "Solved", cache->source_count(),
+         std::chrono::duration<double>(loaded - start).count(),
+         std::chrono::duration<double, std::milli>(end - loaded).count());
+  return 0;
+}
+
+// Run a scene with adaptive mesh refinement for steps steps, and write its probe samples and a
+// snapshot of the field at full resolution
+static int run_amr(Scene &scene, unsigned threads, size_t steps, const AmrOptions &options,
+                   const char *probes_path, const char *checkpoint_path) {
+  auto engine = AmrEngine::create(scene.settings, std::move(scene.environment), options, threads);
+  if (!engine) {
+    return -1;
+  }
+  if (probes_path != nullptr) {
+    engine->capture_probes(steps);
+    if (engine->probes().point_count() == 0) {
+      fprintf(stderr, "The scene has no probes\n");
+      return -1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  engine->run(steps);
+  auto end = std::chrono::steady_clock::now();
+  if (probes_path != nullptr && !engine->probes().write(probes_path)) {
+    return -1;
+  }
+  if (checkpoint_path != nullptr && !write_checkpoint(engine->snapshot(), checkpoint_path)) {
+    return -1;
+  }
+
+  // the rate is of the cells of the full resolution grid, to compare with a run without refinement
+  const SimSettings &settings = engine->get_settings();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  double cells = (double)settings.texture_width * settings.texture_height * engine->get_steps();
+  printf("Ran %llu steps of %zux%zu grid with %zu refined blocks (%.1f%% of the cells) on %u "
+         "threads in %.3f s (%.1f Mcells/s), t = %f s\n",
+         (unsigned long long)engine->get_steps(), settings.texture_width, settings.texture_height,
+         engine->block_count(), 100.0 * engine->cell_fraction(), engine->threads(), seconds,
+         cells / seconds * 1e-6, engine->get_time());
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *scene_path = nullptr;
+  size_t steps = 1000;
+  unsigned threads = 0;
+  const char *trace_path = nullptr;
+  const char *resume_path = nullptr;
+  size_t grid_width = 0, grid_height = 0;
+  const char *checkpoint_path = nullptr;
+  size_t checkpoint_every = 0;
+  const char *record_path = nullptr;
+  RecorderOptions record_options{};
+  const char *probes_path = nullptr;
+  float accumulate_window = 0.0;
+  const char *rms_path = nullptr;
+  const char *peak_path = nullptr;
+  const char *phasors_prefix = nullptr;
+  std::vector<float> phasor_frequencies;
+  bool until_steady = false;
+  bool auto_delta_t = false;
+  int time_levels = 0;
+  bool amr = false;
+  AmrOptions amr_options{};
+  bool helmholtz = false;
+  HelmholtzOptions helmholtz_options{};
+  const char *responses_path = nullptr;
+  const char *superpose_path = nullptr;
+  SteadyStateOptions steady_options{};
+  int progressive_levels = 0;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--steps") && has_value) {
+      steps = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--until-steady")) {
+      until_steady = true;
+    } else if (!strcmp(argv[i], "--steady-tolerance") && has_value) {
+      steady_options.steady_tolerance = std::stod(argv[++i]);
+    } else if (!strcmp(argv[i], "--progressive") && has_value) {
+      progressive_levels = std::stoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--auto-delta-t")) {
+      auto_delta_t = true;
+    } else if (!strcmp(argv[i], "--time-levels") && has_value) {
+      time_levels = std::stoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--amr")) {
+      amr = true;
+    } else if (!strcmp(argv[i], "--amr-threshold") && has_value) {
+      amr_options.gradient_threshold = std::stof(argv[++i]);
+    } else if (!strcmp(argv[i], "--threads") && has_value) {
+      threads = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--trace") && has_value) {
+      trace_path = argv[++i];
+    } else if (!strcmp(argv[i], "--resume") && has_value) {
+      resume_path = argv[++i];
+    } else if (!strcmp(argv[i], "--grid") && has_value) {
+      if (sscanf(argv[++i], "%zux%zu", &grid_width, &grid_height) != 2 || grid_width == 0 ||
+          grid_height == 0) {
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--checkpoint") && has_value) {
+      checkpoint_path = argv[++i];
+    } else if (!strcmp(argv[i], "--checkpoint-every") && has_value) {
+      checkpoint_every = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--record") && has_value) {
+      record_path = argv[++i];
+    } else if (!strcmp(argv[i], "--record-every") && has_value) {
+      record_options.every = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--record-downsample") && has_value) {
+      record_options.downsample = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--record-error") && has_value) {
+      record_options.error_bound = std::stof(argv[++i]);
+    } else if (!strcmp(argv[i], "--record-keyframe") && has_value) {
+      record_options.keyframe_every = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--probes") && has_value) {
+      probes_path = argv[++i];
+    } else if (!strcmp(argv[i], "--accumulate") && has_value) {
+      accumulate_window = std::stof(argv[++i]);
+    } else if (!strcmp(argv[i], "--rms") && has_value) {
+      rms_path = argv[++i];
+    } else if (!strcmp(argv[i], "--peak") && has_value) {
+      peak_path = argv[++i];
+    } else if (!strcmp(argv[i], "--phasors") && has_value) {
+      phasors_prefix = argv[++i];
+    } else if (!strcmp(argv[i], "--phasor-freq") && has_value) {
+      phasor_frequencies.push_back(std::stof(argv[++i]));
+    } else if (!strcmp(argv[i], "--helmholtz")) {
+      helmholtz = true;
+    } else if (!strcmp(argv[i], "--helmholtz-tolerance") && has_value) {
+      helmholtz_options.tolerance = std::stod(argv[++i]);
+    } else if (!strcmp(argv[i], "--responses") && has_value) {
+      responses_path = argv[++i];
+    } else if (!strcmp(argv[i], "--superpose") && has_value) {
+      superpose_path = argv[++i];
+    } else if (argv[i][0] != '-' && scene_path == nullptr) {
+      scene_path = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if ((scene_path == nullptr) == (resume_path == nullptr) ||
+      phasor_frequencies.size() > PhasorAccumulator::max_frequencies ||
+      (checkpoint_every > 0 && checkpoint_path == nullptr) ||
+      ((amr || progressive_levels > 0) && resume_path != nullptr)) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  Tracer::set_thread_name("main");
+  if (trace_path != nullptr) {
+    Tracer::start();
+  }
+
+  std::unique_ptr<MappedSnapshot> snapshot;
+  std::optional<Scene> scene;
+  if (resume_path != nullptr) {
+    // the planes are copied straight from the mapped file, without loading a Snapshot first
+    snapshot = MappedSnapshot::open(resume_path);
+    if (snapshot) {
+      std::istringstream scene_text{snapshot->scene()};
+      scene = Scene::deserialize(scene_text);
+    }
+  } else {
+    scene = Scene::load(scene_path);
+  }
+  if (!scene) {
+    return -1;
+  }
+  if (grid_width > 0) {
+    scene->settings = scene->settings.resized(grid_width, grid_height);
+  }
+
+  // the fastest medium sets the stability limit
+  const float max_ior_inv = scene->environment.max_ior_inv();
+  if (auto_delta_t) {
+    scene->settings.delta_t = scene->settings.stable_delta_t(max_ior_inv);
+  } else if (!scene->settings.stable(max_ior_inv)) {
+    fprintf(stderr, "Warning: delta t of %g s is above the stability limit of %g s\n",
+            scene->settings.delta_t, scene->settings.max_delta_t(max_ior_inv));
+  }
+
+  if (amr || helmholtz || responses_path != nullptr || superpose_path != nullptr) {
+    int result =
+        amr         ? run_amr(*scene, threads, steps, amr_options, probes_path, checkpoint_path)
+        : helmholtz ? solve_helmholtz(*scene, threads, helmholtz_options, phasors_prefix)
+                    : superpose(*scene, threads, helmholtz_options, responses_path, superpose_path,
+                                phasors_prefix);
+    if (trace_path != nullptr) {
+      Tracer::stop();
+      if (!Tracer::write_chrome_trace(trace_path)) {
+        return -1;
+      }
+    }
+    return result;
+  }
+
+  if (phasors_prefix != nullptr && phasor_frequencies.empty()) {
+    phasor_frequencies = PhasorAccumulator::source_frequencies(scene->environment);
+    if (phasor_frequencies.empty()) {
+      fprintf(stderr, "The scene has no sources to take the phasor frequencies from\n");
+      return -1;
+    }
+  }
+
+  std::optional<SteadyStateDetector> detector;
+  if (until_steady) {
+    detector.emplace(scene->environment, scene->settings.delta_t, steady_options);
+  }
+
+  Engine engine{scene->settings, std::move(scene->environment), threads};
+  if (snapshot && (snapshot->width() != scene->settings.texture_width ||
+                   snapshot->height() != scene->settings.texture_height)) {
+    // the engine's own media and boundaries are kept, and the field is resampled onto them
+    Snapshot warm_start = engine.snapshot();
+    warm_start.grid.resample_field(snapshot->load().grid);
+    warm_start.time = snapshot->time();
+    fprintf(stderr, "Resampled the %zux%zu snapshot to the %zux%zu grid\n", snapshot->width(),
+            snapshot->height(), warm_start.grid.width, warm_start.grid.height);
+    engine.restore(warm_start);
+    snapshot.reset();
+  } else if (snapshot) {
+    if (!engine.restore(*snapshot)) {
+      return -1;
+    }
+    // the planes have been copied, so the mapping can be released
+    snapshot.reset();
+  }
+
+  double progressive_seconds = 0.0;
+  if (progressive_levels > 0) {
+    ProgressiveOptions progressive_options{progressive_levels, steady_options, steps};
+    std::vector<ProgressiveStage> stages = progressive_warm_start(engine, progressive_options);
+    if (stages.empty()) {
+      fprintf(stderr, "Only scenes with periodic sources can start from a coarse steady state\n");
+    }
+    for (const auto &stage : stages) {
+      printf("Ran %zu steps of %zux%zu grid in %.3f s: %s\n", stage.steps, stage.width,
+             stage.height, stage.seconds,
+             stage.state == RunState::Running ? "not settled" : run_state_name(stage.state));
+      progressive_seconds += stage.seconds;
+    }
+  }
+
+  if (time_levels > 0) {
+    if (!engine.set_time_levels(time_levels)) {
+      return -1;
+    }
+    fprintf(stderr, "Local time stepping skips %.1f%% of the updates\n",
+            100.0 * engine.time_level_savings());
+  }
+
+  if (probes_path != nullptr) {
+    engine.capture_probes(steps);
+    if (engine.probes().point_count() == 0) {
+      fprintf(stderr, "The scene has no probes\n");
+      return -1;
+    }
+  }
+
+  if (rms_path != nullptr || peak_path != nullptr) {
+    engine.accumulate(accumulate_window);
+  }
+
+  if (phasors_prefix != nullptr) {
+    engine.extract_phasors(phasor_frequencies);
+  }
+
+  std::unique_ptr<Recorder> recorder;
+  if (record_path != nullptr) {
+    recorder = Recorder::open(record_path, engine.get_settings(), record_options);
+    if (!recorder) {
+      return -1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  RunState run_state = RunState::Running;
+  size_t done = 0;
+  while (done < steps && run_state == RunState::Running) {
+    size_t chunk = checkpoint_every > 0 ? std::min(checkpoint_every, steps - done) : steps;
+    if (recorder || detector) {
+      // frames are numbered by the steps run so far, so step n is the state after n steps
+      size_t i = 0;
+      while (i < chunk && run_state == RunState::Running) {
+        engine.step();
+        i++;
+        if (recorder && recorder->wants(done + i)) {
+          recorder->push(engine.state().u.data(), 1, done + i, engine.get_time());
+        }
+        if (detector && detector->wants(done + i)) {
+          run_state = detector->add(engine.get_time(), engine.energy());
+        }
+      }
+      chunk = i;
+    } else {
+      engine.run(chunk);
+    }
+    done += chunk;
+
+    if (checkpoint_path != nullptr &&
+        (done == steps || checkpoint_every > 0 || run_state != RunState::Running)) {
+      if (!write_checkpoint(engine.snapshot(), checkpoint_path)) {
+        return -1;
+      }
+    }
+  }
+  if (recorder && !recorder->close()) {
+    return -1;
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (probes_path != nullptr && !engine.probes().write(probes_path)) {
+    return -1;
+  }
+  const SimGrid &state = engine.state();
+  if (rms_path != nullptr) {
+    std::vector<float> rms(engine.mean_square_plane());
+    for (auto &value : rms) {
+      value = std::sqrt(value);
+    }
+    if (!write_pfm(rms_path, state.width, state.height, rms.data())) {
+      return -1;
+    }
+  }
+  if (peak_path != nullptr &&
+      !write_pfm(peak_path, state.width, state.height, engine.peak_plane().data())) {
+    return -1;
+  }
+  if (phasors_prefix != nullptr) {
+    std::vector<float> amplitude(state.size()), phase(state.size());
+    for (size_t k = 0; k < phasor_frequencies.size(); k++) {
+      phasor_amplitude_phase(engine.phasor_re_plane(k).data(), engine.phasor_im_plane(k).data(),
+                             state.size(), 1, amplitude.data(), phase.data());
+      std::string path = std::string(phasors_prefix) + "_" + std::to_string(k);
+      if (!write_pfm(path + "_amplitude.pfm", state.width, state.height, amplitude.data()) ||
+          !write_pfm(path + "_phase.pfm", state.width, state.height, phase.data())) {
+        return -1;
+      }
+      printf("Phasor %zu: %g Hz over %llu steps\n", k, phasor_frequencies[k],
+             (unsigned long long)engine.phasors().steps);
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  double cells = (double)engine.state().size() * (double)done;
+  printf("Ran %zu steps of %zux%zu grid on %u threads in %.3f s (%.1f Mcells/s), t = %f s\n",
+         done, engine.state().width, engine.state().height, engine.threads(), seconds,
+         cells / seconds * 1e-6, engine.get_time());
+  if (progressive_seconds > 0.0) {
+    printf("Total %.3f s including the coarse grids\n", progressive_seconds + seconds);
+  }
+  if (recorder) {
+    double raw_size = (double)recorder->frames() * recorder->width() * recorder->height() * 4;
+    printf("Recorded %zu frames of %zux%zu to %.1f MB (%.1fx smaller than raw, %zu waits for the "
+           "writer)\n",
+           recorder->frames(), recorder->width(), recorder->height(),
+           recorder->file_size() * 1e-6, raw_size / recorder->file_size(), recorder->stall_count());
+  }
+
+  if (detector) {
+    if (run_state == RunState::Running) {
+      printf("Not settled after %zu steps, energy = %g (peak %g)\n", done, detector->energy(),
+             detector->peak_energy());
+    } else {
+      printf("Stopped at step %zu: %s, energy = %g (peak %g)\n", done, run_state_name(run_state),
+             detector->energy(), detector->peak_energy());
+    }
+  }
+
+  if (probes_path != nullptr) {
+    printf("Captured %zu samples of %zu probes (%zu points)\n", engine.probes().size(),
+           engine.probes().probe_count(), engine.probes().point_count());
+  }
+
+  if (trace_path != nullptr) {
+    Tracer::stop();
+    if (!Tracer::write_chrome_trace(trace_path)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,711 @@
+#include "helmholtz.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+static constexpr double pi = 3.141592653589793;
+
+// coarsening stops once a level is this small in either direction
+static constexpr size_t coarsest_size = 4;
+// the coarsest level is solved directly if it has at most this many cells. Smoothing diverges on it
+// without the damping of an absorbing layer, as on the coarse levels of a periodic grid.
+static constexpr size_t coarsest_direct_cells = 512;
+// smoothing sweeps that stand in for an exact solve on a coarsest level that is too large for that
+static constexpr size_t coarsest_sweeps = 32;
+// elements per block of sum()
+static constexpr size_t sum_block = 4096;
+
+// weights of the links along x and y on the finest level, whose rows are scaled by delta_x^2
+static void fine_link_weights(const SimSettings &settings, float weights[2]) {
+  weights[0] = 1.0f;
+  weights[1] = (settings.delta_x * settings.delta_x) / (settings.delta_y * settings.delta_y);
+}
+
+HelmholtzSolver::HelmholtzSolver(const SimSettings &settings, Environment environment,
+                                 unsigned threads)
+    : settings(settings), environment(std::move(environment)),
+      grid(settings.texture_width, settings.texture_height, settings.delta_x, settings.delta_y),
+      pool(threads) {
+  // media and boundaries don't depend on the frequency, so they are only rasterized once
+  grid.pass_mask = glm::bvec4(false, false, true, true);
+  this->environment.rasterize(grid, 0.0);
+}
+
+float HelmholtzSolver::source_frequency(const Environment &environment) {
+  float frequency = 0.0;
+  for (const auto &obj : environment.objects) {
+    const Waveform *waveform = obj->source_waveform();
+    if (waveform == nullptr) {
+      continue;
+    }
+    if (dynamic_cast<const SineWaveform *>(waveform) == nullptr) {
+      fprintf(stderr, "Only sine sources can be solved in the frequency domain\n");
+      return 0.0;
+    }
+    float freq = waveform->get_freq_amp().first;
+    if (frequency > 0.0f && std::abs(freq - frequency) > 1e-6f * frequency) {
+      fprintf(stderr, "The sources have different frequencies (%g Hz and %g Hz)\n", frequency,
+              freq);
+      return 0.0;
+    }
+    frequency = freq;
+  }
+  if (frequency <= 0.0f) {
+    fprintf(stderr, "The scene has no sources to solve for\n");
+  }
+  return frequency;
+}
+
+// A sine source drawn at time t writes Re(U e^(i w t)), so drawing a source at t = 0 gives Re(U),
+// and a quarter period later -Im(U). Each source is drawn on its own, so later sources replace the
+// cells of earlier ones the same way they do when the whole environment is drawn.
+bool find_source_cells(const Environment &environment, SimGrid &grid, float frequency,
+                       SourceCells &cells) {
+  const size_t n = grid.size();
+  std::vector<float> u0(n);
+  cells.cell_source.assign(n, -1);
+  cells.phasors.clear();
+  grid.pass_mask = glm::bvec4(true, false, false, false);
+  for (const auto &obj : environment.objects) {
+    if (obj->source_waveform() == nullptr) {
+      continue;
+    }
+    const int32_t source = (int32_t)cells.phasors.size();
+    // cells the source doesn't draw to stay nan
+    grid.u.assign(n, NAN);
+    obj->rasterize(grid, 0.0);
+    u0.swap(grid.u);
+    grid.u.assign(n, NAN);
+    obj->rasterize(grid, 0.25f / frequency);
+
+    std::complex<float> phasor = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+      if (std::isnan(u0[i]) && std::isnan(grid.u[i])) {
+        continue;
+      }
+      if (std::isnan(u0[i]) || std::isnan(grid.u[i])) {
+        fprintf(stderr, "Moving sources can't be solved in the frequency domain\n");
+        grid.u.assign(n, 0.0f);
+        return false;
+      }
+      cells.cell_source[i] = source;
+      phasor = std::complex<float>(u0[i], -grid.u[i]);
+    }
+    cells.phasors.push_back(phasor);
+  }
+  grid.u.assign(n, 0.0f);
+  return true;
+}
+
+bool HelmholtzSolver::find_sources(float frequency) {
+  if (!find_source_cells(environment, grid, frequency, sources)) {
+    return false;
+  }
+
+  const size_t n = grid.size();
+  levels.assign(1, Level{});
+  Level &fine = levels[0];
+  fine.width = grid.width;
+  fine.height = grid.height;
+  fine.wrap_x = settings.periodic_x ? cfloat(std::polar(1.0, 2.0 * pi * settings.bloch_x)) : 0.0f;
+  fine.wrap_y = settings.periodic_y ? cfloat(std::polar(1.0, 2.0 * pi * settings.bloch_y)) : 0.0f;
+  fine.free.assign(n, 1);
+  for (size_t i = 0; i < n; i++) {
+    if (grid.boundary[i] != 0.0f || sources.cell_source[i] >= 0) {
+      fine.free[i] = 0;
+    }
+  }
+  return true;
+}
+
+void HelmholtzSolver::neighbors(size_t x, size_t y, size_t cells[4], cfloat factors[4]) const {
+  const Level &fine = levels[0];
+  const size_t width = fine.width, height = fine.height, i = y * width + x;
+  const bool wrap_x = fine.wrap_x != 0.0f, wrap_y = fine.wrap_y != 0.0f;
+  cells[0] = x > 0 ? i - 1 : wrap_x ? i + width - 1 : SIZE_MAX;
+  cells[1] = x + 1 < width ? i + 1 : wrap_x ? i + 1 - width : SIZE_MAX;
+  cells[2] = y > 0 ? i - width : wrap_y ? i + (height - 1) * width : SIZE_MAX;
+  cells[3] = y + 1 < height ? i + width : wrap_y ? i - (height - 1) * width : SIZE_MAX;
+  factors[0] = x > 0 ? 1.0f : std::conj(fine.wrap_x);
+  factors[1] = x + 1 < width ? 1.0f : fine.wrap_x;
+  factors[2] = y > 0 ? 1.0f : std::conj(fine.wrap_y);
+  factors[3] = y + 1 < height ? 1.0f : fine.wrap_y;
+}
+
+void HelmholtzSolver::set_fixed(int32_t source) {
+  const size_t n = grid.size();
+  fixed.assign(n, 0.0f);
+  for (size_t i = 0; i < n; i++) {
+    const int32_t cell_source = sources.cell_source[i];
+    if (grid.boundary[i] != 0.0f || cell_source < 0) {
+      continue;
+    }
+    if (source < 0) {
+      fixed[i] = sources.phasors[cell_source];
+    } else if (cell_source == source) {
+      fixed[i] = 1.0f;
+    }
+  }
+
+  // the fixed cells move to the right hand side of the rows of their free neighbors
+  const size_t width = grid.width, height = grid.height;
+  const Level &fine = levels[0];
+  float link_weights[2];
+  fine_link_weights(settings, link_weights);
+  rhs.assign(n, 0.0f);
+  pool.parallel_for(height, [&](size_t y0, size_t y1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t i = y * width + x;
+        if (!fine.free[i]) {
+          continue;
+        }
+        size_t cells[4];
+        cfloat factors[4];
+        neighbors(x, y, cells, factors);
+        for (int k = 0; k < 4; k++) {
+          const size_t j = cells[k];
+          if (j != SIZE_MAX && grid.boundary[j] == 0.0f && !fine.free[j]) {
+            rhs[i] -= link_weights[k / 2] * factors[k] * fixed[j];
+          }
+        }
+      }
+    }
+  });
+}
+
+void HelmholtzSolver::build_levels(float frequency, float shift) {
+  TRACE_SCOPE("HelmholtzSolver::build_levels");
+
+  Level &fine = levels[0];
+  const size_t width = fine.width, height = fine.height, n = fine.size();
+  const double omega = 2.0 * pi * frequency;
+  const double delta_t = settings.delta_t, delta_x = settings.delta_x;
+  const std::complex<double> z = std::polar(1.0, omega * delta_t);
+  const float damping_area_size = (float)settings.damping_area_size;
+
+  // links to fixed cells (which move to the right hand side) and the shifted diagonal term of each
+  // cell, which are summed into the coarse levels
+  std::vector<float> fixed_links(n, 0.0f);
+  float link_weights[2];
+  fine_link_weights(settings, link_weights);
+  std::vector<cfloat> kappa_shifted(n, 0.0f);
+  fine.link_x.assign(n, 0.0f);
+  fine.link_y.assign(n, 0.0f);
+  diag.assign(n, 0.0f);
+
+  pool.parallel_for(height, [&](size_t y0, size_t y1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t i = y * width + x;
+        if (!fine.free[i]) {
+          continue;
+        }
+
+        // neighbors on a boundary or outside the grid mirror this cell, so they have no link
+        size_t cells[4];
+        cfloat factors[4];
+        neighbors(x, y, cells, factors);
+        float links = 0.0f;
+        for (int k = 0; k < 4; k++) {
+          const size_t j = cells[k];
+          if (j == SIZE_MAX || grid.boundary[j] != 0.0f) {
+            continue;
+          }
+          links += link_weights[k / 2];
+          if (!fine.free[j]) {
+            fixed_links[i] += link_weights[k / 2];
+          }
+        }
+        if (cells[1] != SIZE_MAX && fine.free[cells[1]]) {
+          fine.link_x[i] = link_weights[0];
+        }
+        if (cells[3] != SIZE_MAX && fine.free[cells[3]]) {
+          fine.link_y[i] = link_weights[1];
+        }
+
+        // the same damping factor as Engine::init_damping (and damping() in wave_sim.frag)
+        size_t k = std::min(settings.periodic_x ? SIZE_MAX : std::min(x, width - 1 - x),
+                            settings.periodic_y ? SIZE_MAX : std::min(y, height - 1 - y));
+        double d = (float)k + 0.5f < damping_area_size
+                       ? std::tanh(2.0 * ((double)k + 0.5) / damping_area_size + 1.0)
+                       : 1.0;
+        std::complex<double> s_term = (z - 1.0) * (z - d) / (z * d * delta_t * delta_t);
+        double speed = grid.ior_inv[i] * settings.wave_speed_vacuum;
+        std::complex<double> kappa = s_term * (delta_x * delta_x / (speed * speed));
+
+        diag[i] = cfloat(-(double)links - kappa);
+        // the shift adds damping, in the same direction as the absorbing layer
+        std::complex<double> kappa_shift(0.0, shift * std::abs(kappa.real()));
+        kappa_shifted[i] = cfloat(kappa + kappa_shift);
+      }
+    }
+  });
+
+  // the diagonal of the shifted operator on each level, from its links and its summed terms
+  auto set_diag_shifted = [this](Level &level, const std::vector<float> &fixed_links,
+                                 const std::vector<cfloat> &kappa) {
+    const size_t w = level.width;
+    level.diag_shifted.assign(level.size(), 1.0f);
+    level.inv_diag_shifted.assign(level.size(), 1.0f);
+    pool.parallel_for(level.height, [&](size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; y++) {
+        for (size_t x = 0; x < w; x++) {
+          const size_t i = y * w + x;
+          if (!level.free[i]) {
+            continue;
+          }
+          float links = level.link_x[i] + level.link_y[i] + fixed_links[i];
+          // the links at the far edge of a periodic axis are those of the cells at the near edge
+          // too (and 0 if it doesn't wrap)
+          links += x > 0 ? level.link_x[i - 1] : level.link_x[i + w - 1];
+          links += y > 0 ? level.link_y[i - w] : level.link_y[i + (level.height - 1) * w];
+          level.diag_shifted[i] = -links - kappa[i];
+          level.inv_diag_shifted[i] = 1.0f / level.diag_shifted[i];
+        }
+      }
+    });
+    level.b.assign(level.size(), 0.0f);
+    level.x.assign(level.size(), 0.0f);
+    level.x_next.assign(level.size(), 0.0f);
+  };
+  set_diag_shifted(levels[0], fixed_links, kappa_shifted);
+
+  // Each coarse cell aggregates a 2x2 block of fine cells, and its row is the sum of their rows.
+  // Summing rows doubles the weight of the links between blocks compared to the same operator on a
+  // grid of twice the spacing, so the links are halved, which keeps smooth errors (the ones the
+  // coarse levels are there for) at the right scale.
+  while (std::min(levels.back().width, levels.back().height) > coarsest_size) {
+    const Level &f = levels.back();
+    Level c;
+    c.width = (f.width + 1) / 2;
+    c.height = (f.height + 1) / 2;
+    c.wrap_x = f.wrap_x;
+    c.wrap_y = f.wrap_y;
+    c.free.assign(c.size(), 0);
+    c.link_x.assign(c.size(), 0.0f);
+    c.link_y.assign(c.size(), 0.0f);
+    std::vector<float> coarse_fixed_links(c.size(), 0.0f);
+    std::vector<cfloat> coarse_kappa(c.size(), 0.0f);
+
+    pool.parallel_for(c.height, [&](size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; y++) {
+        for (size_t x = 0; x < c.width; x++) {
+          const size_t i = y * c.width + x;
+          for (size_t fy = 2 * y; fy < std::min(2 * y + 2, f.height); fy++) {
+            for (size_t fx = 2 * x; fx < std::min(2 * x + 2, f.width); fx++) {
+              const size_t fi = fy * f.width + fx;
+              if (!f.free[fi]) {
+                continue;
+              }
+              c.free[i] = 1;
+              coarse_kappa[i] += kappa_shifted[fi];
+              coarse_fixed_links[i] += 0.5f * fixed_links[fi];
+              // only the links leaving the block count, the ones inside it cancel in the sum. The
+              // last block of an odd size level has a single cell, whose link leaves it.
+              if (fx == 2 * x + 1 || fx + 1 == f.width) {
+                c.link_x[i] += 0.5f * f.link_x[fi];
+              }
+              if (fy == 2 * y + 1 || fy + 1 == f.height) {
+                c.link_y[i] += 0.5f * f.link_y[fi];
+              }
+            }
+          }
+        }
+      }
+    });
+
+    levels.push_back(std::move(c));
+    fixed_links = std::move(coarse_fixed_links);
+    kappa_shifted = std::move(coarse_kappa);
+    set_diag_shifted(levels.back(), fixed_links, kappa_shifted);
+  }
+  factor_coarsest();
+}
+
+template <class Fn> std::complex<double> HelmholtzSolver::sum(size_t n, const Fn &fn) {
+  const size_t blocks = (n + sum_block - 1) / sum_block;
+  block_sums.assign(blocks, 0.0);
+  pool.parallel_for(blocks, [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      std::complex<double> total = 0.0;
+      for (size_t i = b * sum_block; i < std::min((b + 1) * sum_block, n); i++) {
+        total += fn(i);
+      }
+      block_sums[b] = total;
+    }
+  });
+
+  std::complex<double> total = 0.0;
+  for (auto block : block_sums) {
+    total += block;
+  }
+  return total;
+}
+
+// sum of the links of cell (x, y) times the neighbor values of v, where neighbors across the edge
+// of the grid are multiplied by wrap_x or wrap_y (see Level::wrap_x)
+static inline std::complex<float> neighbor_sum(const std::vector<float> &link_x,
+                                               const std::vector<float> &link_y,
+                                               const std::vector<std::complex<float>> &v,
+                                               size_t x, size_t y, size_t width, size_t height,
+                                               std::complex<float> wrap_x,
+                                               std::complex<float> wrap_y) {
+  const size_t i = y * width + x;
+  std::complex<float> res = 0.0f;
+  if (x > 0) {
+    res += link_x[i - 1] * v[i - 1];
+  } else if (wrap_x != 0.0f) {
+    res += std::conj(wrap_x) * (link_x[i + width - 1] * v[i + width - 1]);
+  }
+  if (x + 1 < width) {
+    res += link_x[i] * v[i + 1];
+  } else if (wrap_x != 0.0f) {
+    res += wrap_x * (link_x[i] * v[i + 1 - width]);
+  }
+  if (y > 0) {
+    res += link_y[i - width] * v[i - width];
+  } else if (wrap_y != 0.0f) {
+    const size_t j = i + (height - 1) * width;
+    res += std::conj(wrap_y) * (link_y[j] * v[j]);
+  }
+  if (y + 1 < height) {
+    res += link_y[i] * v[i + width];
+  } else if (wrap_y != 0.0f) {
+    res += wrap_y * (link_y[i] * v[i - (height - 1) * width]);
+  }
+  return res;
+}
+
+void HelmholtzSolver::apply(const std::vector<cfloat> &in, std::vector<cfloat> &out) {
+  const Level &fine = levels[0];
+  const size_t width = fine.width;
+  pool.parallel_for(fine.height, [&](size_t y0, size_t y1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t i = y * width + x;
+        if (!fine.free[i]) {
+          out[i] = 0.0f;
+          continue;
+        }
+        out[i] = diag[i] * in[i] + neighbor_sum(fine.link_x, fine.link_y, in, x, y, width,
+                                                fine.height, fine.wrap_x, fine.wrap_y);
+      }
+    }
+  });
+}
+
+void HelmholtzSolver::smooth(Level &level, size_t sweeps) {
+  const size_t width = level.width, height = level.height;
+  for (size_t sweep = 0; sweep < sweeps; sweep++) {
+    pool.parallel_for(height, [&](size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; y++) {
+        for (size_t x = 0; x < width; x++) {
+          const size_t i = y * width + x;
+          if (level.free[i]) {
+            cfloat sigma = neighbor_sum(level.link_x, level.link_y, level.x, x, y, width, height,
+                                        level.wrap_x, level.wrap_y);
+            cfloat jacobi = (level.b[i] - sigma) * level.inv_diag_shifted[i];
+            level.x_next[i] = level.x[i] + jacobi_weight * (jacobi - level.x[i]);
+          } else {
+            level.x_next[i] = 0.0f;
+          }
+        }
+      }
+    });
+    level.x.swap(level.x_next);
+  }
+}
+
+void HelmholtzSolver::factor_coarsest() {
+  Level &level = levels.back();
+  const size_t n = level.size();
+  coarsest_lu.clear();
+  coarsest_pivots.clear();
+  if (n > coarsest_direct_cells) {
+    return;
+  }
+
+  // column j of the operator is its product with the unit vector j. Fixed cells keep the row of
+  // the identity, so they stay 0.
+  std::vector<cfloat> &a = coarsest_lu;
+  a.assign(n * n, 0.0f);
+  std::vector<cfloat> unit(n, 0.0f);
+  for (size_t j = 0; j < n; j++) {
+    unit[j] = 1.0f;
+    for (size_t i = 0; i < n; i++) {
+      if (level.free[i]) {
+        a[i * n + j] = neighbor_sum(level.link_x, level.link_y, unit, i % level.width,
+                                    i / level.width, level.width, level.height, level.wrap_x,
+                                    level.wrap_y);
+      }
+    }
+    a[j * n + j] += level.diag_shifted[j];
+    unit[j] = 0.0f;
+  }
+
+  // Gaussian elimination with partial pivoting
+  coarsest_pivots.resize(n);
+  for (size_t k = 0; k < n; k++) {
+    size_t pivot = k;
+    for (size_t i = k + 1; i < n; i++) {
+      if (std::abs(a[i * n + k]) > std::abs(a[pivot * n + k])) {
+        pivot = i;
+      }
+    }
+    coarsest_pivots[k] = pivot;
+    if (pivot != k) {
+      std::swap_ranges(a.begin() + k * n, a.begin() + (k + 1) * n, a.begin() + pivot * n);
+    }
+    const cfloat inv_pivot = 1.0f / a[k * n + k];
+    for (size_t i = k + 1; i < n; i++) {
+      const cfloat factor = a[i * n + k] * inv_pivot;
+      a[i * n + k] = factor;
+      if (factor == 0.0f) {
+        continue;
+      }
+      for (size_t j = k + 1; j < n; j++) {
+        a[i * n + j] -= factor * a[k * n + j];
+      }
+    }
+  }
+}
+
+void HelmholtzSolver::solve_coarsest(Level &level) {
+  if (coarsest_lu.empty()) {
+    smooth(level, coarsest_sweeps);
+    return;
+  }
+
+  const size_t n = level.size();
+  const std::vector<cfloat> &a = coarsest_lu;
+  std::vector<cfloat> &x = level.x;
+  x = level.b;
+  for (size_t i = 0; i < n; i++) {
+    if (!level.free[i]) {
+      x[i] = 0.0f;
+    }
+  }
+  for (size_t k = 0; k < n; k++) {
+    std::swap(x[k], x[coarsest_pivots[k]]);
+    for (size_t i = k + 1; i < n; i++) {
+      x[i] -= a[i * n + k] * x[k];
+    }
+  }
+  for (size_t k = n; k-- > 0;) {
+    for (size_t j = k + 1; j < n; j++) {
+      x[k] -= a[k * n + j] * x[j];
+    }
+    x[k] /= a[k * n + k];
+  }
+}
+
+void HelmholtzSolver::v_cycle(size_t l) {
+  Level &fine = levels[l];
+  if (l + 1 == levels.size()) {
+    solve_coarsest(fine);
+    return;
+  }
+
+  smooth(fine, smoothing_steps);
+
+  // restrict the residual to the coarse level by summing each block
+  Level &coarse = levels[l + 1];
+  pool.parallel_for(coarse.height, [&](size_t y0, size_t y1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < coarse.width; x++) {
+        cfloat res = 0.0f;
+        for (size_t fy = 2 * y; fy < std::min(2 * y + 2, fine.height); fy++) {
+          for (size_t fx = 2 * x; fx < std::min(2 * x + 2, fine.width); fx++) {
+            const size_t fi = fy * fine.width + fx;
+            if (fine.free[fi]) {
+              cfloat sigma = neighbor_sum(fine.link_x, fine.link_y, fine.x, fx, fy, fine.width,
+                                          fine.height, fine.wrap_x, fine.wrap_y);
+              res += fine.b[fi] - sigma - fine.diag_shifted[fi] * fine.x[fi];
+            }
+          }
+        }
+        coarse.b[y * coarse.width + x] = res;
+      }
+    }
+  });
+  std::fill(coarse.x.begin(), coarse.x.end(), 0.0f);
+
+  v_cycle(l + 1);
+
+  // add the coarse correction to every cell of its block
+  pool.parallel_for(fine.height, [&](size_t y0, size_t y1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < fine.width; x++) {
+        const size_t i = y * fine.width + x;
+        if (fine.free[i]) {
+          fine.x[i] += coarse.x[(y / 2) * coarse.width + x / 2];
+        }
+      }
+    }
+  });
+
+  smooth(fine, smoothing_steps);
+}
+
+void HelmholtzSolver::precondition(const std::vector<cfloat> &in, std::vector<cfloat> &out) {
+  TRACE_SCOPE("HelmholtzSolver::precondition");
+  Level &fine = levels[0];
+  fine.b = in;
+  std::fill(fine.x.begin(), fine.x.end(), 0.0f);
+  v_cycle(0);
+  out = fine.x;
+}
+
+bool HelmholtzSolver::prepare(const HelmholtzOptions &options) {
+  iteration_count = 0;
+  relative_residual = 0.0;
+  if (settings.stencil_order != 2) {
+    fprintf(stderr, "The frequency domain solver only supports the 5 point stencil\n");
+    return false;
+  }
+  if (settings.symmetry_x != Symmetry::None || settings.symmetry_y != Symmetry::None) {
+    fprintf(stderr, "The frequency domain solver doesn't support symmetry planes\n");
+    return false;
+  }
+  solved_frequency = source_frequency(environment);
+  if (solved_frequency <= 0.0f || !find_sources(solved_frequency)) {
+    return false;
+  }
+  smoothing_steps = options.smoothing_steps;
+  jacobi_weight = options.jacobi_weight;
+  build_levels(solved_frequency, options.shift);
+  return true;
+}
+
+bool HelmholtzSolver::solve(const HelmholtzOptions &options) {
+  TRACE_SCOPE("HelmholtzSolver::solve");
+
+  if (!prepare(options)) {
+    return false;
+  }
+  set_fixed(-1);
+  return iterate(options);
+}
+
+bool HelmholtzSolver::solve_responses(const HelmholtzOptions &options,
+                                      std::vector<std::vector<cfloat>> &responses) {
+  TRACE_SCOPE("HelmholtzSolver::solve_responses");
+
+  if (!prepare(options)) {
+    return false;
+  }
+  // the operator is the same for every source, so the levels are only built once
+  responses.assign(sources.phasors.size(), {});
+  size_t total_iterations = 0;
+  for (size_t source = 0; source < responses.size(); source++) {
+    set_fixed((int32_t)source);
+    if (!iterate(options)) {
+      return false;
+    }
+    total_iterations += iteration_count;
+    responses[source] = field;
+  }
+  iteration_count = total_iterations;
+  return true;
+}
+
+bool HelmholtzSolver::iterate(const HelmholtzOptions &options) {
+  TRACE_SCOPE("HelmholtzSolver::iterate");
+
+  iteration_count = 0;
+  relative_residual = 0.0;
+  const size_t n = grid.size();
+  field.assign(n, 0.0f);
+  r = rhs;
+  r_hat = r;
+  p.assign(n, 0.0f);
+  v.assign(n, 0.0f);
+  p_hat.assign(n, 0.0f);
+  s.assign(n, 0.0f);
+  s_hat.assign(n, 0.0f);
+  t.assign(n, 0.0f);
+
+  auto norm = [this](const std::vector<cfloat> &a) {
+    return std::sqrt(sum(a.size(), [&](size_t i) { return (double)std::norm(a[i]); }).real());
+  };
+  auto dot = [this](const std::vector<cfloat> &a, const std::vector<cfloat> &b) {
+    return sum(a.size(), [&](size_t i) {
+      return std::conj(std::complex<double>(a[i])) * std::complex<double>(b[i]);
+    });
+  };
+
+  // BiCGStab with right preconditioning. The fixed cells stay 0 in every vector, and get their
+  // values once the free cells have converged.
+  const double rhs_norm = norm(rhs);
+  bool converged = rhs_norm == 0.0;
+  std::complex<double> rho = 1.0, alpha = 1.0, omega = 1.0;
+  while (!converged && iteration_count < options.max_iterations) {
+    iteration_count++;
+    std::complex<double> rho_next = dot(r_hat, r);
+    if (std::abs(rho_next) == 0.0) {
+      break;
+    }
+    std::complex<double> beta = (rho_next / rho) * (alpha / omega);
+    rho = rho_next;
+    const cfloat beta_f(beta), omega_f(omega);
+    pool.parallel_for(n, [&](size_t i0, size_t i1) {
+      for (size_t i = i0; i < i1; i++) {
+        p[i] = r[i] + beta_f * (p[i] - omega_f * v[i]);
+      }
+    });
+
+    precondition(p, p_hat);
+    apply(p_hat, v);
+    alpha = rho / dot(r_hat, v);
+    const cfloat alpha_f(alpha);
+    pool.parallel_for(n, [&](size_t i0, size_t i1) {
+      for (size_t i = i0; i < i1; i++) {
+        s[i] = r[i] - alpha_f * v[i];
+        field[i] += alpha_f * p_hat[i];
+      }
+    });
+    relative_residual = norm(s) / rhs_norm;
+    if (relative_residual <= options.tolerance) {
+      converged = true;
+      break;
+    }
+
+    precondition(s, s_hat);
+    apply(s_hat, t);
+    omega = dot(t, s) / dot(t, t);
+    const cfloat omega_next(omega);
+    pool.parallel_for(n, [&](size_t i0, size_t i1) {
+      for (size_t i = i0; i < i1; i++) {
+        field[i] += omega_next * s_hat[i];
+        r[i] = s[i] - omega_next * t[i];
+      }
+    });
+    relative_residual = norm(r) / rhs_norm;
+    converged = relative_residual <= options.tolerance;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (!levels[0].free[i]) {
+      field[i] = fixed[i];
+    }
+  }
+
+  if (!converged) {
+    fprintf(stderr, "Helmholtz solve didn't converge after %zu iterations (residual %g)\n",
+            iteration_count, relative_residual);
+    return false;
+  }
+  return true;
+}
+
+void HelmholtzSolver::phasor_planes(std::vector<float> &re, std::vector<float> &im) const {
+  re.resize(field.size());
+  im.resize(field.size());
+  for (size_t i = 0; i < field.size(); i++) {
+    re[i] = 0.5f * field[i].real();
+    im[i] = 0.5f * field[i].imag();
+  }
+}
@@ -0,0 +1,171 @@
+#ifndef HELMHOLTZ_H
+#define HELMHOLTZ_H
+
+#include "grid.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+struct HelmholtzOptions {
+  // relative residual the solve stops at
+  double tolerance{1e-6};
+  size_t max_iterations{1000};
+  // damped Jacobi sweeps before and after each coarse grid correction, and their weight.
+  // Gauss-Seidel diverges on levels where the cells are close to the wavelength in size, while
+  // Jacobi only slows down there.
+  size_t smoothing_steps{2};
+  float jacobi_weight{0.7};
+  // imaginary shift of the preconditioner, as a fraction of the real part of its diagonal
+  float shift{0.5};
+};
+
+// The cells the sources of an environment are drawn to, and the phasor each source fixes them to
+struct SourceCells {
+  // index of the source drawn last to each cell (counting only sources, in the order of the
+  // objects), or -1 if no source draws to the cell
+  std::vector<int32_t> cell_source{};
+  // phasor of each source. Sources that are drawn over completely by later ones have no cells.
+  std::vector<std::complex<float>> phasors{};
+};
+
+// Rasterize each source of environment onto the u plane of grid, and find the cells and phasor of
+// every source at frequency. The u plane is left at 0. Return false (and print to stderr) if a
+// source moves.
+bool find_source_cells(const Environment &environment, SimGrid &grid, float frequency,
+                       SourceCells &cells);
+
+// HelmholtzSolver finds the steady state of a scene driven by sine sources at a single frequency
+// directly, instead of time stepping until the transients have left. For u = Re(U e^(i w t)), each
+// step of the time domain scheme (see Engine::step_rows) becomes
+//
+//   c^2 * laplace(U) - s * U = 0,    s = (z - 1) (z - d) / (z d dt^2),    z = e^(i w dt)
+//
+// where d is the damping factor of the cell. This is the exact steady state of the discrete scheme,
+// so it matches a converged time domain run, absorbing layer included. Boundaries and sources are
+// rasterized the same way as for the engine: boundary cells are 0 and mirror their neighbors, and
+// source cells are fixed to the phasor of their waveform. Periodic axes link the cells at either
+// edge of the grid, with the Bloch phase of the axis (see SimSettings::bloch_x).
+//
+// The system is solved with BiCGStab, preconditioned by one multigrid V-cycle of the same operator
+// with an extra imaginary shift (the shifted Laplacian), which multigrid can solve even though the
+// Helmholtz operator itself is indefinite. Coarse levels aggregate 2x2 blocks of cells, and the
+// coarsest level is solved directly when it is small. All vector operations are split across a
+// ThreadPool.
+class HelmholtzSolver {
+  using cfloat = std::complex<float>;
+
+  // One level of the multigrid hierarchy. Rows are scaled so that each link between neighboring
+  // free cells has a real weight (on the finest level, 1 along x and (delta_x / delta_y)^2 along
+  // y), and the wave speed is in the diagonal.
+  struct Level {
+    size_t width{0}, height{0};
+    // 1 for unknown cells, 0 for cells with a fixed value (boundaries and sources)
+    std::vector<uint8_t> free{};
+    // weight of the link from each cell to the cell at x + 1 and at y + 1 (0 if there is none).
+    // Along a periodic axis, the cells at the far edge link to the cells at the near edge.
+    std::vector<float> link_x{}, link_y{};
+    // factor a neighbor across the edge of the grid is multiplied by along x and y: the Bloch phase
+    // factor e^(2 pi i bloch) across the far edge of a periodic axis (and its conjugate across the
+    // near edge), or 0 if the axis doesn't wrap
+    cfloat wrap_x{0.0f}, wrap_y{0.0f};
+    // diagonal of the shifted operator, and its inverse (1 for fixed cells)
+    std::vector<cfloat> diag_shifted{}, inv_diag_shifted{};
+    // right hand side and solution of the V-cycle on this level, and the next Jacobi iterate
+    std::vector<cfloat> b{}, x{}, x_next{};
+
+    size_t size() const { return width * height; }
+  };
+
+  SimSettings settings;
+  Environment environment;
+  SimGrid grid;
+  ThreadPool pool;
+
+  std::vector<Level> levels{};
+  SourceCells sources{};
+  // diagonal of the (unshifted) operator on the finest level, and the fixed value of each cell
+  std::vector<cfloat> diag{}, fixed{};
+  // right hand side (from the fixed cells next to free ones), solution, and the Krylov vectors of
+  // BiCGStab
+  std::vector<cfloat> rhs{}, field{}, r{}, r_hat{}, p{}, v{}, p_hat{}, s{}, s_hat{}, t{};
+  std::vector<std::complex<double>> block_sums{};
+  // LU decomposition of the shifted operator of the coarsest level (row major, L below the diagonal
+  // with a unit diagonal), and the row swapped into each row while factoring. This is empty if the
+  // level is too large to solve directly.
+  std::vector<cfloat> coarsest_lu{};
+  std::vector<size_t> coarsest_pivots{};
+
+  // frequency (in Hz) of the last solve, and the smoothing of its preconditioner
+  float solved_frequency{0.0};
+  size_t smoothing_steps{2};
+  float jacobi_weight{0.7};
+  size_t iteration_count{0};
+  double relative_residual{0.0};
+
+  // The neighbors of cell (x, y) of the finest level at -x, +x, -y and +y (SIZE_MAX past an edge
+  // that doesn't wrap), and the factor each is multiplied by
+  void neighbors(size_t x, size_t y, size_t cells[4], cfloat factors[4]) const;
+  // Find the sources and build the multigrid levels for their frequency
+  bool prepare(const HelmholtzOptions &options);
+  bool find_sources(float frequency);
+  void build_levels(float frequency, float shift);
+  // Fix the cells of every source to its phasor if source is -1, or the cells of source to 1 and
+  // all other source cells to 0, and update the right hand side to match
+  void set_fixed(int32_t source);
+  // Run BiCGStab from 0 until the residual is below the tolerance
+  bool iterate(const HelmholtzOptions &options);
+
+  // Sum fn(i) over [0, n), in fixed blocks so the total doesn't depend on the number of threads
+  template <class Fn> std::complex<double> sum(size_t n, const Fn &fn);
+  // out = A in, with the finest level operator
+  void apply(const std::vector<cfloat> &in, std::vector<cfloat> &out);
+  // out = (approximate) M^-1 in, with one V-cycle of the shifted operator
+  void precondition(const std::vector<cfloat> &in, std::vector<cfloat> &out);
+  void v_cycle(size_t level);
+  void smooth(Level &level, size_t sweeps);
+  // Factor the shifted operator of the coarsest level if it has at most coarsest_direct_cells cells
+  void factor_coarsest();
+  // Solve the coarsest level, directly if it was factored and with smoothing sweeps otherwise
+  void solve_coarsest(Level &level);
+
+public:
+  // Set up a solver for the given scene, running on threads threads (or all hardware threads if
+  // threads is 0). The media and boundaries are rasterized once.
+  HelmholtzSolver(const SimSettings &settings, Environment environment, unsigned threads = 0);
+
+  // Solve for the steady state. Every source must be a SineWaveform that doesn't move, and all of
+  // them must have the same frequency. Return false (and print to stderr) if the sources don't fit,
+  // the scene uses a higher order stencil or symmetry planes, or the solve doesn't converge within
+  // the maximum iterations.
+  bool solve(const HelmholtzOptions &options = {});
+
+  // Solve for the response to each source on its own: responses[k] is the steady state when the
+  // cells of source k are fixed to 1 and the cells of all other sources to 0. Since the scheme is
+  // linear, the steady state for any amplitudes and phases of the sources is the sum of the
+  // responses weighted by the phasors of the sources. The levels are only built once, so this
+  // costs a single solve per source. iterations() is the total of all the solves.
+  bool solve_responses(const HelmholtzOptions &options,
+                       std::vector<std::vector<cfloat>> &responses);
+
+  // The single frequency of the sources of environment, or 0 (and print to stderr) if they aren't
+  // all sine waves at the same frequency
+  static float source_frequency(const Environment &environment);
+  // The sources found by the last solve
+  const SourceCells &source_cells() const { return sources; }
+
+  // The complex amplitude U of each cell after the last solve
+  const std::vector<cfloat> &phasors() const { return field; }
+  // Real and imaginary planes in the same form as Engine::phasor_re_plane and phasor_im_plane (half
+  // of U), so phasor_amplitude_phase can be used on them
+  void phasor_planes(std::vector<float> &re, std::vector<float> &im) const;
+
+  float frequency() const { return solved_frequency; }
+  size_t iterations() const { return iteration_count; }
+  double residual() const { return relative_residual; }
+  unsigned threads() const { return pool.size(); }
+};
+
+#endif
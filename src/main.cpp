@@ -1,5 +1,9 @@
 #include "main.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <cstdio>
 #include <fstream>
 
@@ -67,8 +71,8 @@ int WavesApp::init_sim_texture() {
     glActiveTexture(GL_TEXTURE0 + i);
     glGenTextures(1, &sim_textures[i]);
     glBindTexture(GL_TEXTURE_2D, sim_textures[i]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, texture_width, texture_height, 0, GL_RGBA, GL_FLOAT,
-                 nullptr);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, settings.texture_width, settings.texture_height, 0,
+                 GL_RGBA, GL_FLOAT, nullptr);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -86,11 +90,271 @@ int WavesApp::init_sim_texture() {
   return 0;
 }
 
+void WavesApp::free_sim_texture() {
+  glDeleteFramebuffers(2, sim_framebuffers);
+  glDeleteTextures(2, sim_textures);
+}
+
+int WavesApp::resize_sim(const SimSettings &new_settings, bool resample) {
+  TRACE_SCOPE("resize_sim");
+  const bool resize = new_settings.texture_width != settings.texture_width ||
+                      new_settings.texture_height != settings.texture_height;
+  if (!resize && !resample) {
+    settings = new_settings;
+    return 0;
+  }
+
+  // the state is kept to be resampled, or to be restored if the new textures can't be created
+  SimGrid state = read_sim_state();
+  int res = 0;
+  if (resize) {
+#if !defined(__EMSCRIPTEN__)
+    // recordings and readbacks in flight are of the old grid
+    stop_recording();
+    discard_probe_readbacks();
+    discard_energy_readbacks();
+#endif
+    // the accumulators and phasors are attached to the sim framebuffers, so they are recreated
+    // with them
+    if (accumulate) {
+      free_accumulators();
+    }
+    bool phasors = phasor_attachments > 0;
+    if (phasors) {
+      free_phasors();
+    }
+    free_sim_texture();
+
+    SimSettings old_settings = settings;
+    settings = new_settings;
+    res = init_sim_texture();
+    if (res) {
+      free_sim_texture();
+      settings = old_settings;
+      init_sim_texture();
+    }
+    if (accumulate && init_accumulators()) {
+      fprintf(stderr, "Cannot create the intensity accumulators\n");
+      accumulate = false;
+    }
+    if (phasors && init_phasors()) {
+      fprintf(stderr, "Cannot create the phasor textures\n");
+      extract_phasors = false;
+    }
+  } else {
+    settings = new_settings;
+  }
+
+  if (res) {
+    write_sim_state(state);
+    return res;
+  }
+  if (!resample) {
+    return 0;
+  }
+
+  SimGrid grid{settings.texture_width, settings.texture_height, settings.delta_x,
+               settings.delta_y};
+  grid.resample_field(state);
+  write_sim_state(grid);
+  // the accumulated planes are of the old cells
+  if (accumulate) {
+    reset_accumulators();
+  }
+  if (extract_phasors) {
+    reset_phasors();
+  }
+#if !defined(__EMSCRIPTEN__)
+  if (detect_settled) {
+    reset_detector();
+  }
+#endif
+  return 0;
+}
+
+int WavesApp::init_accumulators() {
+  for (int i = 0; i < 2; i++) {
+    // units 0 to 4 hold the sim, playback, and probe textures
+    glActiveTexture(GL_TEXTURE5 + i);
+    glGenTextures(1, &accum_textures[i]);
+    glBindTexture(GL_TEXTURE_2D, accum_textures[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, settings.texture_width, settings.texture_height, 0,
+                 GL_RG, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // the second attachment is only drawn to by sim_program, so the draw buffers are left as is
+    glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, accum_textures[i],
+                           0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      free_accumulators();
+      return -1;
+    }
+  }
+
+  reset_accumulators();
+  return 0;
+}
+
+void WavesApp::free_accumulators() {
+  for (int i = 0; i < 2; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, 0, 0);
+  }
+  glDeleteTextures(2, accum_textures);
+  accum_textures[0] = accum_textures[1] = 0;
+}
+
+void WavesApp::reset_accumulators() {
+  TRACE_SCOPE("reset_accumulators");
+  const GLenum accum_buffers[2] = {GL_NONE, GL_COLOR_ATTACHMENT1};
+  const GLenum sim_buffers[1] = {GL_COLOR_ATTACHMENT0};
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  for (int i = 0; i < 2; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+    glViewport(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height);
+    glDrawBuffers(2, accum_buffers);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDrawBuffers(1, sim_buffers);
+  }
+  accumulator.reset();
+}
+
+void WavesApp::export_intensity(const std::string &path, DisplayMode mode) {
+  TRACE_SCOPE("export_intensity");
+  std::vector<float> pixels(settings.texture_width * settings.texture_height * 2);
+  glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
+  glReadBuffer(GL_COLOR_ATTACHMENT1);
+  glReadPixels(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height, GL_RG,
+               GL_FLOAT, pixels.data());
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  for (size_t channel = 0; channel < 2; channel++) {
+    mirror_plane(pixels.data() + channel, settings.texture_width, settings.texture_height,
+                 settings.symmetry_x, settings.symmetry_y, false, 2);
+  }
+
+  if (mode == DisplayMode::Rms) {
+    for (size_t i = 0; i < pixels.size(); i += 2) {
+      pixels[i] = std::sqrt(pixels[i]);
+    }
+  }
+  write_pfm(path, settings.texture_width, settings.texture_height,
+            pixels.data() + (mode == DisplayMode::Rms ? 0 : 1), 2);
+}
+
+int WavesApp::init_phasors() {
+  free_phasors();
+  phasor_attachments = (phasor.frequencies.size() + 1) / 2;
+  for (size_t a = 0; a < phasor_attachments; a++) {
+    for (int i = 0; i < 2; i++) {
+      // units 5 and 6 hold the accumulator textures
+      glActiveTexture(GL_TEXTURE7 + 2 * a + i);
+      glGenTextures(1, &phasor_textures[a][i]);
+      glBindTexture(GL_TEXTURE_2D, phasor_textures[a][i]);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, settings.texture_width, settings.texture_height,
+                   0, GL_RGBA, GL_FLOAT, nullptr);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2 + a, GL_TEXTURE_2D,
+                             phasor_textures[a][i], 0);
+      if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        free_phasors();
+        return -1;
+      }
+    }
+  }
+
+  reset_phasors();
+  return 0;
+}
+
+void WavesApp::free_phasors() {
+  for (size_t a = 0; a < phasor_attachments; a++) {
+    for (int i = 0; i < 2; i++) {
+      glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2 + a, GL_TEXTURE_2D, 0, 0);
+    }
+    glDeleteTextures(2, phasor_textures[a]);
+    phasor_textures[a][0] = phasor_textures[a][1] = 0;
+  }
+  phasor_attachments = 0;
+}
+
+void WavesApp::reset_phasors() {
+  TRACE_SCOPE("reset_phasors");
+  GLenum phasor_buffers[4] = {GL_NONE, GL_NONE, GL_COLOR_ATTACHMENT2, GL_NONE};
+  if (phasor_attachments > 1) {
+    phasor_buffers[3] = GL_COLOR_ATTACHMENT3;
+  }
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  for (int i = 0; i < 2 && phasor_attachments > 0; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[i]);
+    glViewport(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height);
+    glDrawBuffers(4, phasor_buffers);
+    glClear(GL_COLOR_BUFFER_BIT);
+    const GLenum sim_buffers[1] = {GL_COLOR_ATTACHMENT0};
+    glDrawBuffers(1, sim_buffers);
+  }
+  phasor.reset();
+}
+
+void WavesApp::export_phasor(const std::string &path, DisplayMode mode, size_t k) {
+  TRACE_SCOPE("export_phasor");
+  const size_t size = settings.texture_width * settings.texture_height;
+  std::vector<float> pixels(size * 4);
+  glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
+  glReadBuffer(GL_COLOR_ATTACHMENT2 + k / 2);
+  glReadPixels(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height, GL_RGBA,
+               GL_FLOAT, pixels.data());
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+  for (size_t channel = 0; channel < 4; channel++) {
+    mirror_plane(pixels.data() + channel, settings.texture_width, settings.texture_height,
+                 settings.symmetry_x, settings.symmetry_y, true, 4);
+  }
+
+  std::vector<float> amplitude(size), phase(size);
+  const float *re = pixels.data() + 2 * (k % 2);
+  phasor_amplitude_phase(re, re + 1, size, 4, amplitude.data(), phase.data());
+  write_pfm(path, settings.texture_width, settings.texture_height,
+            mode == DisplayMode::Amplitude ? amplitude.data() : phase.data());
+}
+
+void WavesApp::set_sim_draw_buffers() {
+  GLenum buffers[4] = {GL_COLOR_ATTACHMENT0, GL_NONE, GL_NONE, GL_NONE};
+  if (accumulate) {
+    buffers[1] = GL_COLOR_ATTACHMENT1;
+  }
+  for (size_t a = 0; a < phasor_attachments; a++) {
+    buffers[2 + a] = GL_COLOR_ATTACHMENT2 + a;
+  }
+  glDrawBuffers(phasor_attachments > 0 ? 4 : (accumulate ? 2 : 1), buffers);
+}
+
 int WavesApp::init() {
   open_file_browser.SetTitle("Open File");
   save_file_browser.SetTitle("Save File");
   open_file_browser.SetTypeFilters({".sim"});
   save_file_browser.SetTypeFilters({".sim"});
+  open_snapshot_browser.SetTitle("Load Snapshot");
+  save_snapshot_browser.SetTitle("Save Snapshot");
+  open_snapshot_browser.SetTypeFilters({".snap"});
+  save_snapshot_browser.SetTypeFilters({".snap"});
+  record_browser.SetTitle("Record To");
+  record_browser.SetTypeFilters({".rec"});
+  open_recording_browser.SetTitle("Play Recording");
+  open_recording_browser.SetTypeFilters({".rec"});
+  probe_export_browser.SetTitle("Export Probe Samples");
+  probe_export_browser.SetTypeFilters({".csv", ".probe"});
+  intensity_export_browser.SetTitle("Export Intensity");
+  intensity_export_browser.SetTypeFilters({".pfm"});
+  phasor_export_browser.SetTitle("Export Phasor");
+  phasor_export_browser.SetTypeFilters({".pfm"});
 
   return init_sdl_opengl() || init_sdl_window() || init_imgui() || programs.init() ||
          init_sim_texture();
@@ -116,65 +380,670 @@ int WavesApp::handle_sdl_events() {
 }
 
 glm::vec2 WavesApp::get_scale_factor() const {
-  return glm::vec2(2.0 / ((float)(texture_width)*delta_x), 2.0 / ((float)(texture_height)*delta_x));
+  return glm::vec2(2.0 / ((float)(settings.texture_width) * settings.delta_x),
+                   2.0 / ((float)(settings.texture_height) * settings.delta_y));
 }
 
-glm::vec2 WavesApp::get_display_scale_factor() const {
-  return glm::vec2(2.0 / ((texture_width - 2.0 * damping_area_size) * delta_x),
-                   2.0 / ((texture_height - 2.0 * damping_area_size) * delta_x));
+glm::vec2 WavesApp::get_display_crop() const {
+  return glm::vec2(settings.periodic_x ? 0.0f : (float)settings.damping_area_size,
+                   settings.periodic_y ? 0.0f : (float)settings.damping_area_size);
 }
 
+glm::vec2 WavesApp::get_display_area() const {
+  glm::vec2 crop = get_display_crop();
+  return glm::vec2((settings.texture_width - 2.0 * crop.x) * settings.delta_x,
+                   (settings.texture_height - 2.0 * crop.y) * settings.delta_y);
+}
+
+glm::vec2 WavesApp::get_display_scale_factor() const { return 2.0f / get_display_area(); }
+
 void WavesApp::clear_sim() {
+  TRACE_SCOPE("clear_sim");
   glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
-  glViewport(0, 0, (GLsizei)texture_width, (GLsizei)texture_height);
+  glViewport(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height);
 
   glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
   glClearColor(0.0, 0.0, 0.0, 0.0);
   glClear(GL_COLOR_BUFFER_BIT);
+
+  reset_run();
+}
+
+void WavesApp::reset_run() {
+  sim_step = 0;
+  if (accumulate) {
+    reset_accumulators();
+  }
+  if (extract_phasors) {
+    reset_phasors();
+  }
+#if !defined(__EMSCRIPTEN__)
+  discard_probe_readbacks();
+  probes.clear();
+  if (detect_settled) {
+    reset_detector();
+  }
+#endif
+}
+
+SimGrid WavesApp::read_sim_state() {
+  TRACE_SCOPE("read_sim_state");
+
+  SimGrid grid{settings.texture_width, settings.texture_height, settings.delta_x,
+               settings.delta_y};
+  std::vector<float> pixels(grid.size() * 4);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
+  glReadPixels(0, 0, (GLsizei)grid.width, (GLsizei)grid.height, GL_RGBA, GL_FLOAT, pixels.data());
+
+  for (size_t i = 0; i < grid.size(); i++) {
+    grid.u[i] = pixels[4 * i];
+    grid.u_t[i] = pixels[4 * i + 1];
+    grid.ior_inv[i] = pixels[4 * i + 2];
+    grid.boundary[i] = pixels[4 * i + 3];
+  }
+  // the texels that aren't simulated hold stale values, so they are replaced by their images
+  grid.mirror(settings.symmetry_x, settings.symmetry_y);
+
+  return grid;
+}
+
+void WavesApp::write_sim_state(const SimGrid &grid) {
+  TRACE_SCOPE("write_sim_state");
+
+  std::vector<float> pixels(grid.size() * 4);
+  for (size_t i = 0; i < grid.size(); i++) {
+    pixels[4 * i] = grid.u[i];
+    pixels[4 * i + 1] = grid.u_t[i];
+    pixels[4 * i + 2] = grid.ior_inv[i];
+    pixels[4 * i + 3] = grid.boundary[i];
+  }
+
+  int texture = current_sim_texture ? 0 : 1;
+  glActiveTexture(GL_TEXTURE0 + texture);
+  glBindTexture(GL_TEXTURE_2D, sim_textures[texture]);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)grid.width, (GLsizei)grid.height, GL_RGBA,
+                  GL_FLOAT, pixels.data());
 }
 
 // Draw the environment on the simulation texture
 void WavesApp::draw_environment() {
+  TRACE_SCOPE("draw_environment");
   // Bind the last written (ie next to be read) framebuffer
   glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
-  glViewport(0, 0, (GLsizei)texture_width, (GLsizei)texture_height);
+  glViewport(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height);
 
   environment.draw(programs, get_scale_factor(), time);
 }
 
 // Run one step of the simulation
 void WavesApp::run_simulation() {
+  TRACE_SCOPE("run_simulation");
   // draw to target framebuffer
   glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture]);
-  glViewport(0, 0, (GLsizei)texture_width, (GLsizei)texture_height);
+  glViewport(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height);
 
   glUseProgram(programs.sim_program);
   // set program to read from texture not being written to
   glUniform1i(programs.sim_sim_tex_loc, current_sim_texture ? 0 : 1);
 
-  glUniform1f(programs.sim_delta_x_loc, delta_x);
-  glUniform1f(programs.sim_delta_t_loc, delta_t);
-  glUniform1f(programs.sim_wave_speed_vacuum_loc, wave_speed_vacuum);
-  glUniform1f(programs.sim_damping_area_size_loc, (float)damping_area_size);
+  glUniform1f(programs.sim_delta_x_loc, settings.delta_x);
+  glUniform1f(programs.sim_delta_y_loc, settings.delta_y);
+  glUniform1f(programs.sim_delta_t_loc, settings.delta_t);
+  glUniform1f(programs.sim_wave_speed_vacuum_loc, settings.wave_speed_vacuum);
+  glUniform1f(programs.sim_damping_area_size_loc, (float)settings.damping_area_size);
+  const Stencil &stencil = settings.stencil();
+  const GLfloat stencil_weights[4] = {stencil.center, stencil.weights[0], stencil.weights[1],
+                                      stencil.weights[2]};
+  glUniform1i(programs.sim_stencil_radius_loc, stencil.radius);
+  glUniform1fv(programs.sim_stencil_weights_loc, 4, stencil_weights);
+  glUniform2i(programs.sim_symmetry_loc, (GLint)settings.symmetry_x, (GLint)settings.symmetry_y);
+  glUniform2i(programs.sim_periodic_loc, settings.periodic_x, settings.periodic_y);
+  // the accumulators are read from the textures paired with the sim texture being read
+  glUniform1i(programs.sim_accum_tex_loc, 5 + (current_sim_texture ? 0 : 1));
+  glUniform1i(programs.sim_phasor_tex_locs[0], 7 + (current_sim_texture ? 0 : 1));
+  glUniform1i(programs.sim_phasor_tex_locs[1], 9 + (current_sim_texture ? 0 : 1));
 
   glUniformMatrix4fv(programs.sim_transform_loc, 1, GL_FALSE,
                      glm::value_ptr(GeometryManager::square_screen_cover_transform));
   glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-  programs.geo.draw_geo(GeometryType::Square);
+  // only the texels on the positive side of the symmetry planes are stepped
+  const size_t start_x = mirror_start(settings.texture_width, settings.symmetry_x);
+  const size_t start_y = mirror_start(settings.texture_height, settings.symmetry_y);
+  glEnable(GL_SCISSOR_TEST);
+  glScissor((GLint)start_x, (GLint)start_y, (GLsizei)(settings.texture_width - start_x),
+            (GLsizei)(settings.texture_height - start_y));
+  // the accumulators and phasors are only read and written while they are in use
+  glUniform1i(programs.sim_accum_enabled_loc, accumulate);
+  glUniform1i(programs.sim_phasors_enabled_loc, phasor_attachments > 0);
+  if (accumulate) {
+    auto weights = accumulator.next_step(settings.delta_t);
+    glUniform1f(programs.sim_accum_alpha_loc, weights.alpha);
+    glUniform1f(programs.sim_accum_decay_loc, weights.decay);
+  }
+  if (phasor_attachments > 0) {
+    // the phasors sample the state written by this step
+    auto twiddles = phasor.next_step((double)time + settings.delta_t);
+    glUniform1f(programs.sim_phasor_keep_loc, twiddles.keep);
+    glUniform4f(programs.sim_phasor_twiddles_locs[0], twiddles.re[0], twiddles.im[0],
+                twiddles.re[1], twiddles.im[1]);
+    glUniform4f(programs.sim_phasor_twiddles_locs[1], twiddles.re[2], twiddles.im[2],
+                twiddles.re[3], twiddles.im[3]);
+  }
+  if (accumulate || phasor_attachments > 0) {
+    // the accumulators are only drawn to by this pass, so objects and clears don't touch them
+    set_sim_draw_buffers();
+    programs.geo.draw_geo(GeometryType::Square);
+    const GLenum sim_buffers[1] = {GL_COLOR_ATTACHMENT0};
+    glDrawBuffers(1, sim_buffers);
+  } else {
+    programs.geo.draw_geo(GeometryType::Square);
+  }
+  glDisable(GL_SCISSOR_TEST);
   // swap sim textures
   current_sim_texture = current_sim_texture ? 0 : 1;
 
-  time += delta_t;
+  time += settings.delta_t;
+  sim_step++;
+}
+
+#if !defined(__EMSCRIPTEN__)
+void WavesApp::start_recording(const std::string &path) {
+  recorder = Recorder::open(path, settings, record_options);
+  if (!recorder) {
+    ImGui::OpenPopup("Cannot Write Recording");
+    return;
+  }
+
+  glGenBuffers(record_pbo_count, record_pbos);
+  for (size_t i = 0; i < record_pbo_count; i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, record_pbos[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER,
+                 (GLsizeiptr)(settings.texture_width * settings.texture_height * sizeof(float)),
+                 nullptr, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  record_pbo_next = 0;
+  record_pbo_pending = 0;
+}
+
+void WavesApp::stop_recording() {
+  if (!recorder) {
+    return;
+  }
+
+  while (collect_record_readback(true)) {
+  }
+  glDeleteBuffers(record_pbo_count, record_pbos);
+
+  recorder->close();
+  fprintf(stderr, "Recorded %zu frames (%zu waits for the writer)\n", recorder->frames(),
+          recorder->stall_count());
+  recorder.reset();
+}
+
+void WavesApp::queue_record_readback() {
+  TRACE_SCOPE("queue_record_readback");
+  if (record_pbo_pending == record_pbo_count) {
+    // every buffer is in flight, so the oldest has to be finished first
+    collect_record_readback(true);
+  }
+
+  size_t pbo = (record_pbo_next + record_pbo_pending) % record_pbo_count;
+  glBindFramebuffer(GL_FRAMEBUFFER, sim_framebuffers[current_sim_texture ? 0 : 1]);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, record_pbos[pbo]);
+  // with a pack buffer bound, this only queues the copy and returns immediately
+  glReadPixels(0, 0, (GLsizei)settings.texture_width, (GLsizei)settings.texture_height, GL_RED,
+               GL_FLOAT, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  record_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  record_steps[pbo] = sim_step;
+  record_times[pbo] = time;
+  record_pbo_pending++;
+}
+
+bool WavesApp::collect_record_readback(bool wait) {
+  if (record_pbo_pending == 0) {
+    return false;
+  }
+
+  size_t pbo = record_pbo_next;
+  GLenum status;
+  do {
+    status = glClientWaitSync(record_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT,
+                              wait ? 1000000000 : 0);
+  } while (wait && status == GL_TIMEOUT_EXPIRED);
+  if (status == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+
+  TRACE_SCOPE("collect_record_readback");
+  glDeleteSync(record_fences[pbo]);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, record_pbos[pbo]);
+  const void *data = glMapBufferRange(
+      GL_PIXEL_PACK_BUFFER, 0,
+      (GLsizeiptr)(settings.texture_width * settings.texture_height * sizeof(float)),
+      GL_MAP_READ_BIT);
+  if (data != nullptr && (settings.symmetry_x != Symmetry::None ||
+                          settings.symmetry_y != Symmetry::None)) {
+    // the mapping is read only, so the mirror images are filled in on a copy
+    record_mirror.assign(static_cast<const float *>(data),
+                         static_cast<const float *>(data) +
+                             settings.texture_width * settings.texture_height);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    mirror_plane(record_mirror.data(), settings.texture_width, settings.texture_height,
+                 settings.symmetry_x, settings.symmetry_y, true);
+    recorder->push(record_mirror.data(), 1, record_steps[pbo], record_times[pbo]);
+  } else if (data != nullptr) {
+    recorder->push(static_cast<const float *>(data), 1, record_steps[pbo], record_times[pbo]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  record_pbo_next = (record_pbo_next + 1) % record_pbo_count;
+  record_pbo_pending--;
+  return true;
+}
+
+void WavesApp::update_probes() {
+  ProbeSet current{environment, settings.texture_width, settings.texture_height, settings.delta_x,
+                   settings.delta_y, 0};
+  bool textures_changed = current.point_count() > 0 &&
+                          (probe_texture_rows != (size_t)probe_batch_steps ||
+                           probes.capacity() != (size_t)probe_capacity);
+  if (!current.same_points(probes) || textures_changed) {
+    init_probes(ProbeSet{environment, settings.texture_width, settings.texture_height,
+                         settings.delta_x, settings.delta_y, (size_t)probe_capacity});
+  }
+}
+
+void WavesApp::init_probes(ProbeSet new_probes) {
+  TRACE_SCOPE("init_probes");
+  discard_probe_readbacks();
+  if (probe_texture) {
+    glDeleteFramebuffers(1, &probe_framebuffer);
+    glDeleteTextures(1, &probe_texture);
+    glDeleteTextures(1, &probe_cells_texture);
+    glDeleteBuffers(probe_pbo_count, probe_pbos);
+    probe_texture = 0;
+    probe_texture_rows = 0;
+  }
+
+  probes = std::move(new_probes);
+  const size_t points = probes.point_count();
+  if (points == 0) {
+    return;
+  }
+
+  std::vector<glm::vec2> cells(points);
+  for (size_t i = 0; i < points; i++) {
+    cells[i] = glm::vec2(probes.cell(i));
+  }
+  // units 0 and 1 hold the sim textures and unit 2 the playback texture, so the probe textures are
+  // bound to units after them
+  glGenTextures(1, &probe_cells_texture);
+  glActiveTexture(GL_TEXTURE3);
+  glBindTexture(GL_TEXTURE_2D, probe_cells_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, (GLsizei)points, 1, 0, GL_RG, GL_FLOAT, cells.data());
+
+  probe_texture_rows = probe_batch_steps;
+  glGenTextures(1, &probe_texture);
+  glActiveTexture(GL_TEXTURE4);
+  glBindTexture(GL_TEXTURE_2D, probe_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, (GLsizei)points, (GLsizei)probe_texture_rows, 0, GL_RED,
+               GL_FLOAT, nullptr);
+
+  glGenFramebuffers(1, &probe_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, probe_framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, probe_texture, 0);
+
+  glGenBuffers(probe_pbo_count, probe_pbos);
+  for (size_t i = 0; i < probe_pbo_count; i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, probe_pbos[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)(points * probe_texture_rows * sizeof(float)),
+                 nullptr, GL_STREAM_READ);
+    probe_pbo_steps[i].resize(probe_texture_rows);
+    probe_pbo_times[i].resize(probe_texture_rows);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  probe_row_steps.resize(probe_texture_rows);
+  probe_row_times.resize(probe_texture_rows);
+}
+
+void WavesApp::sample_probes() {
+  if (!probe_texture) {
+    return;
+  }
+  TRACE_SCOPE("sample_probes");
+
+  // draw a single row, with one fragment per probe point
+  glBindFramebuffer(GL_FRAMEBUFFER, probe_framebuffer);
+  glViewport(0, (GLint)probe_rows, (GLsizei)probes.point_count(), 1);
+
+  glUseProgram(programs.probe_program);
+  glUniform1i(programs.probe_sim_tex_loc, current_sim_texture ? 0 : 1);
+  glUniform1i(programs.probe_cells_tex_loc, 3);
+  glUniform2i(programs.probe_symmetry_loc, (GLint)settings.symmetry_x, (GLint)settings.symmetry_y);
+  glUniformMatrix4fv(programs.probe_transform_loc, 1, GL_FALSE,
+                     glm::value_ptr(GeometryManager::square_screen_cover_transform));
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  programs.geo.draw_geo(GeometryType::Square);
+
+  probe_row_steps[probe_rows] = sim_step;
+  probe_row_times[probe_rows] = time;
+  probe_rows++;
+  if (probe_rows == probe_texture_rows) {
+    queue_probe_readback();
+  }
+}
+
+void WavesApp::queue_probe_readback() {
+  TRACE_SCOPE("queue_probe_readback");
+  if (probe_pbo_pending == probe_pbo_count) {
+    // every buffer is in flight, so the oldest has to be finished first
+    collect_probe_readback(true);
+  }
+
+  // the rows are overwritten by the next steps, but gl orders those draws after this copy
+  size_t pbo = (probe_pbo_next + probe_pbo_pending) % probe_pbo_count;
+  glBindFramebuffer(GL_FRAMEBUFFER, probe_framebuffer);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, probe_pbos[pbo]);
+  glReadPixels(0, 0, (GLsizei)probes.point_count(), (GLsizei)probe_rows, GL_RED, GL_FLOAT, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  probe_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  probe_pbo_rows[pbo] = probe_rows;
+  std::copy_n(probe_row_steps.begin(), probe_rows, probe_pbo_steps[pbo].begin());
+  std::copy_n(probe_row_times.begin(), probe_rows, probe_pbo_times[pbo].begin());
+  probe_pbo_pending++;
+  probe_rows = 0;
+}
+
+bool WavesApp::collect_probe_readback(bool wait) {
+  if (probe_pbo_pending == 0) {
+    return false;
+  }
+
+  size_t pbo = probe_pbo_next;
+  GLenum status;
+  do {
+    status = glClientWaitSync(probe_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+  } while (wait && status == GL_TIMEOUT_EXPIRED);
+  if (status == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+
+  TRACE_SCOPE("collect_probe_readback");
+  glDeleteSync(probe_fences[pbo]);
+  const size_t points = probes.point_count();
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, probe_pbos[pbo]);
+  const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                      (GLsizeiptr)(points * probe_pbo_rows[pbo] * sizeof(float)),
+                                      GL_MAP_READ_BIT);
+  if (data != nullptr) {
+    const float *rows = static_cast<const float *>(data);
+    for (size_t i = 0; i < probe_pbo_rows[pbo]; i++) {
+      float *sample = probes.push(probe_pbo_steps[pbo][i], probe_pbo_times[pbo][i]);
+      std::copy_n(rows + i * points, points, sample);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  probe_pbo_next = (probe_pbo_next + 1) % probe_pbo_count;
+  probe_pbo_pending--;
+  return true;
+}
+
+void WavesApp::discard_probe_readbacks() {
+  // the buffers are only reused after a later fence, so the copies don't have to finish
+  for (; probe_pbo_pending > 0; probe_pbo_pending--) {
+    glDeleteSync(probe_fences[probe_pbo_next]);
+    probe_pbo_next = (probe_pbo_next + 1) % probe_pbo_count;
+  }
+  probe_rows = 0;
+}
+
+// history of u at a probe point, for ImGui::PlotLines
+struct ProbeHistory {
+  const ProbeSet *probes;
+  size_t point;
+
+  static float get(void *data, int i) {
+    const auto *history = static_cast<const ProbeHistory *>(data);
+    return history->probes->sample_values(i)[history->point];
+  }
+};
+
+void WavesApp::draw_probe_window() {
+  if (!show_probes || probes.point_count() == 0) {
+    return;
+  }
+
+  if (ImGui::Begin("Probes", &show_probes)) {
+    const size_t samples = probes.size();
+    if (samples > 0) {
+      ImGui::Text("%zu samples, steps %llu to %llu", samples,
+                  (unsigned long long)probes.sample_step(0),
+                  (unsigned long long)probes.sample_step(samples - 1));
+    } else {
+      ImGui::Text("No samples");
+    }
+
+    for (size_t p = 0; p < probes.probe_count(); p++) {
+      const auto &probe = probes.probe(p);
+      char label[32];
+      char overlay[32] = "";
+      if (probe.count == 1) {
+        // a point probe shows u over time
+        snprintf(label, sizeof(label), "Probe %zu", p);
+        if (samples > 0) {
+          snprintf(overlay, sizeof(overlay), "u = %.4f",
+                   probes.sample_values(samples - 1)[probe.first]);
+        }
+        ProbeHistory history{&probes, probe.first};
+        ImGui::PlotLines(label, &ProbeHistory::get, &history, (int)samples, 0, overlay, FLT_MAX,
+                         FLT_MAX, ImVec2(0, 80));
+      } else {
+        // a line probe shows u along the line at the last sample
+        snprintf(label, sizeof(label), "Line Probe %zu", p);
+        const float *values = samples > 0 ? probes.sample_values(samples - 1) + probe.first
+                                          : nullptr;
+        ImGui::PlotLines(label, values, values ? (int)probe.count : 0, 0, overlay, FLT_MAX,
+                         FLT_MAX, ImVec2(0, 80));
+      }
+    }
+
+    ImGui::Separator();
+    if (ImGui::InputInt("Samples kept", &probe_capacity)) {
+      probe_capacity = std::max(probe_capacity, 1);
+    }
+    if (ImGui::InputInt("Steps per readback", &probe_batch_steps)) {
+      probe_batch_steps = std::clamp(probe_batch_steps, 1, 1024);
+    }
+    if (ImGui::Button("Clear")) {
+      discard_probe_readbacks();
+      probes.clear();
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Export")) {
+      probe_export_browser.Open();
+    }
+  }
+  ImGui::End();
+}
+
+void WavesApp::init_energy(size_t width, size_t height) {
+  TRACE_SCOPE("init_energy");
+  discard_energy_readbacks();
+  if (!energy_textures.empty()) {
+    glDeleteFramebuffers((GLsizei)energy_framebuffers.size(), energy_framebuffers.data());
+    glDeleteTextures((GLsizei)energy_textures.size(), energy_textures.data());
+    glDeleteBuffers(energy_pbo_count, energy_pbos);
+    energy_textures.clear();
+    energy_framebuffers.clear();
+  }
+  energy_width = width;
+  energy_height = height;
+  if (width == 0 || height == 0) {
+    return;
+  }
+
+  // each level is half the size of the one before it (rounded up), down to a single texel. The
+  // levels are separate textures rather than mipmaps, so a level can be drawn while the one before
+  // it is read without a feedback loop.
+  // units 7 to 10 hold the phasor textures, so the levels are bound to unit 11 while they are read
+  glActiveTexture(GL_TEXTURE11);
+  while (true) {
+    GLuint texture, framebuffer;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, (GLsizei)width, (GLsizei)height, 0, GL_RED, GL_FLOAT,
+                 nullptr);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    energy_textures.push_back(texture);
+    energy_framebuffers.push_back(framebuffer);
+
+    if (width == 1 && height == 1) {
+      break;
+    }
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+
+  glGenBuffers(energy_pbo_count, energy_pbos);
+  for (size_t i = 0; i < energy_pbo_count; i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, energy_pbos[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float), nullptr, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void WavesApp::reset_detector() {
+  discard_energy_readbacks();
+  detector = SteadyStateDetector{environment, settings.delta_t};
+}
+
+void WavesApp::queue_energy_readback() {
+  TRACE_SCOPE("queue_energy_readback");
+  if (energy_width != (size_t)settings.texture_width ||
+      energy_height != (size_t)settings.texture_height) {
+    init_energy(settings.texture_width, settings.texture_height);
+  }
+  if (energy_pbo_pending == energy_pbo_count) {
+    collect_energy_readback(true);
+  }
+
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glBindFramebuffer(GL_FRAMEBUFFER, energy_framebuffers[0]);
+  glViewport(0, 0, (GLsizei)energy_width, (GLsizei)energy_height);
+  glUseProgram(programs.energy_program);
+  glUniform1i(programs.energy_sim_tex_loc, current_sim_texture ? 0 : 1);
+  glUniform1f(programs.energy_delta_x_loc, settings.delta_x);
+  glUniform1f(programs.energy_delta_y_loc, settings.delta_y);
+  glUniform1f(programs.energy_wave_speed_vacuum_loc, settings.wave_speed_vacuum);
+  glUniform2i(programs.energy_symmetry_loc, (GLint)settings.symmetry_x,
+              (GLint)settings.symmetry_y);
+  glUniformMatrix4fv(programs.energy_transform_loc, 1, GL_FALSE,
+                     glm::value_ptr(GeometryManager::square_screen_cover_transform));
+  programs.geo.draw_geo(GeometryType::Square);
+
+  glUseProgram(programs.reduce_program);
+  glUniform1i(programs.reduce_source_tex_loc, 11);
+  glUniformMatrix4fv(programs.reduce_transform_loc, 1, GL_FALSE,
+                     glm::value_ptr(GeometryManager::square_screen_cover_transform));
+  glActiveTexture(GL_TEXTURE11);
+  size_t width = energy_width, height = energy_height;
+  for (size_t level = 1; level < energy_textures.size(); level++) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    glBindTexture(GL_TEXTURE_2D, energy_textures[level - 1]);
+    glBindFramebuffer(GL_FRAMEBUFFER, energy_framebuffers[level]);
+    glViewport(0, 0, (GLsizei)width, (GLsizei)height);
+    programs.geo.draw_geo(GeometryType::Square);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  size_t pbo = (energy_pbo_next + energy_pbo_pending) % energy_pbo_count;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, energy_pbos[pbo]);
+  glReadPixels(0, 0, 1, 1, GL_RED, GL_FLOAT, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  energy_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  energy_times[pbo] = time;
+  energy_pbo_pending++;
+}
+
+bool WavesApp::collect_energy_readback(bool wait) {
+  if (energy_pbo_pending == 0) {
+    return false;
+  }
+
+  size_t pbo = energy_pbo_next;
+  GLenum status;
+  do {
+    status =
+        glClientWaitSync(energy_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+  } while (wait && status == GL_TIMEOUT_EXPIRED);
+  if (status == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+
+  TRACE_SCOPE("collect_energy_readback");
+  glDeleteSync(energy_fences[pbo]);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, energy_pbos[pbo]);
+  const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(float), GL_MAP_READ_BIT);
+  if (data != nullptr) {
+    bool was_running = detector.state() == RunState::Running;
+    RunState state = detector.add(energy_times[pbo], *static_cast<const float *>(data));
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    // the steps run since this sample was queued are kept, so the simulation stops a frame or two
+    // after the state it settled in
+    if (was_running && state != RunState::Running && pause_when_settled) {
+      run_sim = false;
+    }
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  energy_pbo_next = (energy_pbo_next + 1) % energy_pbo_count;
+  energy_pbo_pending--;
+  return true;
 }
 
-// Get size (in pixels) of area to draw
+void WavesApp::discard_energy_readbacks() {
+  for (; energy_pbo_pending > 0; energy_pbo_pending--) {
+    glDeleteSync(energy_fences[energy_pbo_next]);
+    energy_pbo_next = (energy_pbo_next + 1) % energy_pbo_count;
+  }
+}
+#endif
+
+// Get size (in pixels) of area to draw. This is the largest area with the same aspect ratio as the
+// simulation area inside the absorbing layer that fits in the window, so the physical layout isn't
+// stretched when the grid isn't square or its texels aren't.
 glm::vec2 WavesApp::get_display_size() {
-  float display_size = std::min(width, height);
-  return {display_size, display_size};
+  glm::vec2 area = get_display_area();
+  double area_width = area.x, area_height = area.y;
+  if (!(area_width > 0.0 && area_height > 0.0)) {
+    float display_size = std::min(width, height);
+    return {display_size, display_size};
+  }
+  double scale = std::min(width / area_width, height / area_height);
+  return {std::floor(area_width * scale), std::floor(area_height * scale)};
 }
 
 // Draw simulation state to display
 void WavesApp::run_display() {
+  TRACE_SCOPE("run_display");
   glm::vec2 display_size = get_display_size();
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -187,7 +1056,36 @@ void WavesApp::run_display() {
   glUseProgram(programs.display_program);
   glUniform1i(programs.display_sim_tex_loc, current_sim_texture ? 0 : 1);
   glUniform2f(programs.display_screen_size_loc, display_size.x, display_size.y);
-  glUniform1f(programs.display_damping_area_size_loc, (GLfloat)damping_area_size);
+  glm::vec2 crop = get_display_crop();
+  glUniform2f(programs.display_damping_area_size_loc, crop.x, crop.y);
+  // modes whose planes aren't being accumulated show the field instead
+  DisplayMode mode = display_mode;
+  if (player || (!accumulate && (mode == DisplayMode::Rms || mode == DisplayMode::Peak)) ||
+      (((size_t)display_phasor >= phasor.frequencies.size() || phasor_attachments == 0) &&
+       (mode == DisplayMode::Amplitude || mode == DisplayMode::Phase))) {
+    mode = DisplayMode::Field;
+  }
+  glUniform1i(programs.display_mode_loc, (GLint)mode);
+  glUniform1i(programs.display_accum_tex_loc, 5 + (current_sim_texture ? 0 : 1));
+  glUniform1f(programs.display_gain_loc, display_gain);
+  glUniform1i(programs.display_phasor_tex_loc,
+              7 + 2 * (display_phasor / 2) + (current_sim_texture ? 0 : 1));
+  glUniform1i(programs.display_phasor_high_loc, display_phasor % 2);
+  glUniform2i(programs.display_symmetry_loc, (GLint)settings.symmetry_x,
+              (GLint)settings.symmetry_y);
+  if (player && playback_texture_frame != SIZE_MAX) {
+    // the display shader samples the frame the same way as the sim texture. The absorbing layer is
+    // scaled from grid cells to cells of the shown level.
+    const RecordingHeader &info = player->recording().info();
+    float level_scale =
+        (float)player->recording().width(playback_texture_level) / (float)info.grid_width;
+    glUniform1i(programs.display_sim_tex_loc, 2);
+    glUniform2f(programs.display_damping_area_size_loc,
+                info.periodic_x ? 0.0f : (GLfloat)info.damping_area_size * level_scale,
+                info.periodic_y ? 0.0f : (GLfloat)info.damping_area_size * level_scale);
+    // recorded frames already hold the whole field
+    glUniform2i(programs.display_symmetry_loc, 0, 0);
+  }
 
   glUniformMatrix4fv(programs.display_transform_loc, 1, GL_FALSE,
                      glm::value_ptr(GeometryManager::square_screen_cover_transform));
@@ -195,6 +1093,7 @@ void WavesApp::run_display() {
 }
 
 void WavesApp::draw_env_controls() {
+  TRACE_SCOPE("draw_env_controls");
   glm::vec2 display_size = get_display_size();
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
   glViewport(0, 0, (GLsizei)display_size.x, (GLsizei)display_size.y);
@@ -203,10 +1102,139 @@ void WavesApp::draw_env_controls() {
 
   // only handle mouse events if they aren't on imgui windows
   if (!ImGui::GetIO().WantCaptureMouse) {
-    environment.handle_events(
-        glm::vec2(delta_x * (texture_width - 2.0 * damping_area_size) / display_size.x,
-                  delta_x * (texture_height - 2.0 * damping_area_size) / display_size.y),
-        display_size);
+    environment.handle_events(get_display_area() / display_size, display_size);
+  }
+}
+
+void WavesApp::open_playback(const std::string &path) {
+  close_playback();
+  player = Player::open(path);
+  if (!player) {
+    ImGui::OpenPopup("Cannot Read Recording");
+    return;
+  }
+
+  playback_frame = 0;
+  playback_running = false;
+  playback_texture_frame = SIZE_MAX;
+
+  // recordings only store u, so the other channels are swizzled to an empty medium
+  glGenTextures(1, &playback_texture);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, playback_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_ZERO);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_ONE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ZERO);
+}
+
+void WavesApp::close_playback() {
+  if (!player) {
+    return;
+  }
+  player.reset();
+  glDeleteTextures(1, &playback_texture);
+  playback_texture = 0;
+}
+
+void WavesApp::update_playback() {
+  TRACE_SCOPE("update_playback");
+  const RecordingReader &recording = player->recording();
+  int last_frame = (int)recording.frame_count() - 1;
+
+  // only advance once the current frame has been shown, so slow reads don't skip frames
+  if (playback_running && playback_texture_frame == (size_t)playback_frame) {
+    playback_frame = std::min(playback_frame + playback_speed, last_frame);
+    if (playback_frame == last_frame) {
+      playback_running = false;
+    }
+  }
+
+  // show the coarsest level that still has a cell for each pixel of the display, and a level 4x
+  // coarser than that while scrubbing
+  size_t level = 0;
+  while (level + 1 < recording.level_count() &&
+         (float)recording.width(level + 1) >= get_display_size().x) {
+    level++;
+  }
+  if (playback_scrubbing) {
+    level = std::min(level + 2, recording.level_count() - 1);
+  }
+  player->request(playback_frame, level);
+
+  if (playback_texture_frame == (size_t)playback_frame && playback_texture_level == level) {
+    return;
+  }
+  // until the level has been read, show the finest coarser level that has, unless the frame is
+  // already shown at a finer one
+  size_t shown_level = level;
+  auto data = player->get(playback_frame, level);
+  while (!data && ++shown_level < recording.level_count()) {
+    if (playback_texture_frame == (size_t)playback_frame && playback_texture_level <= shown_level) {
+      return;
+    }
+    data = player->get(playback_frame, shown_level);
+  }
+  if (!data) {
+    return;
+  }
+
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, playback_texture);
+  if (playback_texture_frame == SIZE_MAX || playback_texture_level != shown_level) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, (GLsizei)recording.width(shown_level),
+                 (GLsizei)recording.height(shown_level), 0, GL_RED, GL_FLOAT, data->data());
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)recording.width(shown_level),
+                    (GLsizei)recording.height(shown_level), GL_RED, GL_FLOAT, data->data());
+  }
+  playback_texture_frame = playback_frame;
+  playback_texture_level = shown_level;
+}
+
+void WavesApp::draw_playback_controls() {
+  const RecordingReader &recording = player->recording();
+  bool open = true;
+
+  if (ImGui::Begin("Playback", &open)) {
+    ImGui::Text("Frame %d of %zu, step %llu, t = %f s", playback_frame, recording.frame_count(),
+                (unsigned long long)recording.frame_step(playback_frame),
+                recording.frame_time(playback_frame));
+
+    if (ImGui::Button(playback_running ? "Pause" : "Play")) {
+      playback_running = !playback_running;
+      if (playback_running && playback_frame == (int)recording.frame_count() - 1) {
+        playback_frame = 0;
+      }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("<")) {
+      playback_frame = std::max(playback_frame - 1, 0);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button(">")) {
+      playback_frame = std::min(playback_frame + 1, (int)recording.frame_count() - 1);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Keyframe")) {
+      playback_frame = (int)recording.keyframe_before(playback_frame);
+    }
+
+    ImGui::SliderInt("Frame", &playback_frame, 0, (int)recording.frame_count() - 1);
+    playback_scrubbing = ImGui::IsItemActive();
+    ImGui::SliderInt("Frames per display cycle", &playback_speed, 1, 32);
+
+    if (playback_texture_level == 0) {
+      ImGui::Text("Showing full frame");
+    } else {
+      ImGui::Text("Showing preview at 1/%d resolution", 1 << playback_texture_level);
+    }
+  }
+  ImGui::End();
+
+  if (!open) {
+    close_playback();
   }
 }
 
@@ -221,6 +1249,56 @@ void WavesApp::draw_error_popups() {
     ImGui::EndPopup();
   }
 
+  if (ImGui::BeginPopupModal("Cannot Read Snapshot")) {
+    ImGui::Text("The selected file is not a valid snapshot.");
+    ImGui::Separator();
+    if (ImGui::Button("Ok")) {
+      ImGui::CloseCurrentPopup();
+    }
+
+    ImGui::EndPopup();
+  }
+
+  if (ImGui::BeginPopupModal("Cannot Write Snapshot")) {
+    ImGui::Text("The snapshot file cannot be written.");
+    ImGui::Separator();
+    if (ImGui::Button("Ok")) {
+      ImGui::CloseCurrentPopup();
+    }
+
+    ImGui::EndPopup();
+  }
+
+  if (ImGui::BeginPopupModal("Cannot Resize Grid")) {
+    ImGui::Text("The simulation textures can't be created at the requested grid size.");
+    ImGui::Separator();
+    if (ImGui::Button("Ok")) {
+      ImGui::CloseCurrentPopup();
+    }
+
+    ImGui::EndPopup();
+  }
+
+  if (ImGui::BeginPopupModal("Cannot Write Recording")) {
+    ImGui::Text("The recording file cannot be written.");
+    ImGui::Separator();
+    if (ImGui::Button("Ok")) {
+      ImGui::CloseCurrentPopup();
+    }
+
+    ImGui::EndPopup();
+  }
+
+  if (ImGui::BeginPopupModal("Cannot Read Recording")) {
+    ImGui::Text("The selected file is not a valid recording.");
+    ImGui::Separator();
+    if (ImGui::Button("Ok")) {
+      ImGui::CloseCurrentPopup();
+    }
+
+    ImGui::EndPopup();
+  }
+
   if (ImGui::BeginPopupModal("Invalid Environment File")) {
     ImGui::Text("The selected file is not a valid environment description.");
     ImGui::Separator();
@@ -233,6 +1311,7 @@ void WavesApp::draw_error_popups() {
 }
 
 void WavesApp::load_from_file(const std::string &path) {
+  TRACE_SCOPE("load_from_file");
   std::fstream file{path, std::ios_base::in};
   if (!file.is_open()) {
     fprintf(stderr, "Cannot open file: %s\n", path.c_str());
@@ -240,7 +1319,8 @@ void WavesApp::load_from_file(const std::string &path) {
     return;
   }
 
-  if (!deserialize_settings(file)) {
+  SimSettings new_settings;
+  if (!new_settings.deserialize(file)) {
     fprintf(stderr, "Environment file is missing simulation settings\n");
     ImGui::OpenPopup("Invalid Environment File");
     return;
@@ -253,9 +1333,50 @@ void WavesApp::load_from_file(const std::string &path) {
     return;
   }
 
+  // the new scene starts at rest, so the old state isn't resampled
+  if (resize_sim(new_settings, false)) {
+    ImGui::OpenPopup("Cannot Resize Grid");
+    return;
+  }
   environment = std::move(*new_env);
 }
 
+void WavesApp::save_snapshot(const std::string &path) {
+  Snapshot snapshot;
+  snapshot.scene = serialize();
+  snapshot.time = time;
+  snapshot.grid = read_sim_state();
+  if (!snapshot.write(path)) {
+    ImGui::OpenPopup("Cannot Write Snapshot");
+  }
+}
+
+void WavesApp::load_snapshot(const std::string &path) {
+  auto snapshot = Snapshot::read(path);
+  std::optional<Scene> scene;
+  if (snapshot) {
+    scene = snapshot->load_scene();
+  }
+  if (!scene) {
+    ImGui::OpenPopup("Cannot Read Snapshot");
+    return;
+  }
+
+  // the grid is reallocated at the snapshot's size, and its state replaces the current one
+  SimSettings new_settings = scene->settings;
+  new_settings.texture_width = snapshot->grid.width;
+  new_settings.texture_height = snapshot->grid.height;
+  if (resize_sim(new_settings, false)) {
+    ImGui::OpenPopup("Cannot Resize Grid");
+    return;
+  }
+  environment = std::move(scene->environment);
+  time = snapshot->time;
+  write_sim_state(snapshot->grid);
+  // nothing measured on the state before carries over to the snapshot's
+  reset_run();
+}
+
 void WavesApp::draw_add_menu() {
   bool added = false;
 
@@ -271,6 +1392,14 @@ void WavesApp::draw_add_menu() {
                                             std::make_unique<SineWaveform>(1.0, 1.0), 0.0));
     added = true;
   }
+  if (ImGui::MenuItem("Probe")) {
+    add_object(std::make_unique<Probe>(2, 0));
+    added = true;
+  }
+  if (ImGui::MenuItem("Line Probe")) {
+    add_object(std::make_unique<LineProbe>(-5, 2, 5, 2, 64));
+    added = true;
+  }
   if (ImGui::MenuItem("Box")) {
     add_object(std::make_unique<Rectangle>(-3, -3, 3, 3, MediumType::Boundary()));
     added = true;
@@ -285,9 +1414,12 @@ void WavesApp::draw_add_menu() {
   }
 }
 
-std::string WavesApp::serialize() { return serialize_settings() + "\n" + environment.serialize(); }
+std::string WavesApp::serialize() {
+  return settings.serialize() + "\n" + environment.serialize();
+}
 
 void WavesApp::save_to_file() {
+  TRACE_SCOPE("save_to_file");
   if (!open_file_path) {
     save_file_browser.Open();
   } else {
@@ -308,6 +1440,62 @@ void WavesApp::draw_file_menu() {
     open_file_path = {};
     save_to_file();
   }
+  ImGui::Separator();
+  if (ImGui::MenuItem("Save Snapshot")) {
+    save_snapshot_browser.Open();
+  }
+  if (ImGui::MenuItem("Load Snapshot")) {
+    open_snapshot_browser.Open();
+  }
+}
+
+void WavesApp::draw_trace_menu() {
+  if (ImGui::MenuItem("Start Trace", nullptr, false, !Tracer::is_enabled())) {
+    Tracer::start();
+  }
+  if (ImGui::MenuItem("Stop and Save Trace", nullptr, false, Tracer::is_enabled())) {
+    Tracer::stop();
+    if (Tracer::write_chrome_trace(trace_path)) {
+      fprintf(stderr, "Wrote trace to %s\n", trace_path.c_str());
+    }
+  }
+}
+
+void WavesApp::draw_record_menu() {
+#if !defined(__EMSCRIPTEN__)
+  if (ImGui::MenuItem("Start Recording", nullptr, false, !recorder)) {
+    record_browser.Open();
+  }
+  if (ImGui::MenuItem("Stop Recording", nullptr, false, (bool)recorder)) {
+    stop_recording();
+  }
+  if (recorder) {
+    ImGui::Text("Recorded %zu frames", recorder->frames());
+  }
+  ImGui::Separator();
+  if (ImGui::MenuItem("Play Recording")) {
+    open_recording_browser.Open();
+  }
+  if (ImGui::MenuItem("Close Recording", nullptr, false, (bool)player)) {
+    close_playback();
+  }
+
+  ImGui::Separator();
+  ImGui::BeginDisabled((bool)recorder);
+  int every = (int)record_options.every;
+  if (ImGui::InputInt("Record every n steps", &every)) {
+    record_options.every = std::max(every, 1);
+  }
+  int downsample = (int)record_options.downsample;
+  if (ImGui::InputInt("Downsample", &downsample)) {
+    record_options.downsample = std::max(downsample, 1);
+  }
+  ImGui::InputFloat("Max error (0 = uncompressed)", &record_options.error_bound, 0.0f, 0.0f,
+                    "%g");
+  ImGui::EndDisabled();
+#else
+  ImGui::Text("Recording is not available in the browser.");
+#endif
 }
 
 void WavesApp::draw_menu_bar() {
@@ -320,29 +1508,35 @@ void WavesApp::draw_menu_bar() {
       draw_add_menu();
       ImGui::EndMenu();
     }
+    if (ImGui::BeginMenu("Trace")) {
+      draw_trace_menu();
+      ImGui::EndMenu();
+    }
+    if (ImGui::BeginMenu("Record")) {
+      draw_record_menu();
+      ImGui::EndMenu();
+    }
     if (ImGui::MenuItem("Settings")) {
       show_settings = true;
     }
+#if !defined(__EMSCRIPTEN__)
+    if (ImGui::MenuItem("Probes")) {
+      show_probes = true;
+    }
+#endif
 
     ImGui::EndMainMenuBar();
   }
 }
 
-// check the condition for numerical stability
-bool WavesApp::solver_settings_stable() {
-  // 1.5 was empirically determined
-  return delta_x / (delta_t * wave_speed_vacuum) >= 1.5;
-}
-
-// solve the stability condition for maximum delta t
-float WavesApp::solver_stable_delta_t() { return (double)delta_x / (1.5 * (double)wave_speed_vacuum) - 1e-35f; }
-
 void WavesApp::draw_settings() {
   // Draw simulation controls
   if (show_settings) {
     // check if solver is numerically stable
-    bool stable = solver_settings_stable();
+    bool stable = settings.stable(environment.max_ior_inv());
 
+    // a grid size picked in the settings window, applied once the window is done
+    std::optional<SimSettings> resized_settings;
     if (ImGui::Begin("Simulation Settings", &show_settings)) {
       if (ImGui::Button(run_sim ? "Stop Simulation" : "Start Simulation")) {
         run_sim = !run_sim;
@@ -357,7 +1551,7 @@ void WavesApp::draw_settings() {
 
       ImGui::NewLine();
       ImGui::Text("Time: %f s", time);
-      ImGui::DragFloat("Wave Speed", &wave_speed_vacuum, 1e25, 0.0, 1e29, "%.3f m/s",
+      ImGui::DragFloat("Wave Speed", &settings.wave_speed_vacuum, 1e25, 0.0, 1e29, "%.3f m/s",
                        ImGuiSliderFlags_Logarithmic);
       if (!stable) {
         ImGui::TextColored(ImVec4(1.0, 0.0, 0.0, 1.0), "Warning: Solver may be unstable.");
@@ -370,11 +1564,34 @@ void WavesApp::draw_settings() {
       }
 
       if (ImGui::CollapsingHeader("PDE Solver Settings")) {
-        ImGui::DragFloat("Delta x", &delta_x, 1e25, 0.0, 1e29, "%.3f m",
+        ImGui::DragFloat("Delta x", &settings.delta_x, 1e25, 0.0, 1e29, "%.3f m",
+                         ImGuiSliderFlags_Logarithmic);
+        ImGui::DragFloat("Delta y", &settings.delta_y, 1e25, 0.0, 1e29, "%.3f m",
                          ImGuiSliderFlags_Logarithmic);
+        // higher orders need fewer cells per wavelength, but a smaller delta t
+        int stencil_index = settings.stencil_order / 2 - 1;
+        if (ImGui::Combo("Stencil", &stencil_index,
+                         "2nd order (5 point)\0004th order (9 point)\0006th order (13 point)\0")) {
+          settings.stencil_order = 2 * (stencil_index + 1);
+        }
+
+        // a mirror symmetric scene only simulates the cells on the positive side of the planes.
+        // The images are filled in before a change, so the state carries over.
+        auto symmetry_combo = [&](const char *label, Symmetry &symmetry) {
+          int symmetry_index = symmetry == Symmetry::Odd ? 2 : (int)symmetry;
+          if (ImGui::Combo(label, &symmetry_index, "None\0Even\0Odd\0")) {
+            write_sim_state(read_sim_state());
+            symmetry = symmetry_index == 2 ? Symmetry::Odd : (Symmetry)symmetry_index;
+          }
+        };
+        symmetry_combo("Symmetry about x = 0", settings.symmetry_x);
+        symmetry_combo("Symmetry about y = 0", settings.symmetry_y);
+        // a periodic axis wraps around, with no absorbing layer along it
+        ImGui::Checkbox("Periodic along x", &settings.periodic_x);
+        ImGui::Checkbox("Periodic along y", &settings.periodic_y);
 
         ImGui::BeginDisabled(auto_delta_t);
-        ImGui::DragFloat("Delta t", &delta_t, 1e25, 0.0, 1e29, "%.3f s",
+        ImGui::DragFloat("Delta t", &settings.delta_t, 1e25, 0.0, 1e29, "%.3f s",
                          ImGuiSliderFlags_Logarithmic);
         ImGui::EndDisabled();
 
@@ -388,16 +1605,181 @@ void WavesApp::draw_settings() {
               "Warning: Solver may be unstable. Decrease delta t (or increase delta x).");
         }
 
-        ImGui::SliderInt("Absorbing layer width", &damping_area_size, 0,
-                         std::min(texture_width, texture_height) / 2 - 1, "%i tx");
+        ImGui::SliderInt("Absorbing layer width", &settings.damping_area_size, 0,
+                         std::min(settings.texture_width, settings.texture_height) / 2 - 1, "%i tx");
+
+        // a run can be previewed on a coarse grid, and then continued on a finer one from the
+        // resampled state (the area and the absorbing layer keep their physical size)
+        ImGui::Text("Grid: %zu x %zu cells", settings.texture_width, settings.texture_height);
+        ImGui::BeginDisabled(std::min(settings.texture_width, settings.texture_height) < 32);
+        if (ImGui::Button("Halve Resolution")) {
+          resized_settings =
+              settings.resized(settings.texture_width / 2, settings.texture_height / 2);
+        }
+        ImGui::EndDisabled();
+        ImGui::SameLine();
+        if (ImGui::Button("Double Resolution")) {
+          resized_settings =
+              settings.resized(settings.texture_width * 2, settings.texture_height * 2);
+        }
         ImGui::SliderInt("Iterations per display cycle", &sim_cycles, 1, 100);
       }
+
+      if (ImGui::CollapsingHeader("Intensity")) {
+        if (ImGui::Checkbox("Accumulate intensity", &accumulate)) {
+          if (!accumulate) {
+            free_accumulators();
+          } else if (init_accumulators()) {
+            fprintf(stderr, "Cannot create the intensity accumulators\n");
+            accumulate = false;
+          }
+        }
+
+        ImGui::BeginDisabled(!accumulate);
+        ImGui::DragFloat("Window (0 = whole run)", &accumulator.window, 0.05, 0.0, 1000.0,
+                         "%.2f s");
+        ImGui::Text("Accumulated %llu steps", (unsigned long long)accumulator.steps);
+        if (ImGui::Button("Reset Intensity")) {
+          reset_accumulators();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Export RMS")) {
+          intensity_export_mode = DisplayMode::Rms;
+          intensity_export_browser.Open();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Export Peak")) {
+          intensity_export_mode = DisplayMode::Peak;
+          intensity_export_browser.Open();
+        }
+        ImGui::EndDisabled();
+      }
+
+      if (ImGui::CollapsingHeader("Phasors")) {
+        if (ImGui::Checkbox("Extract phasors", &extract_phasors)) {
+          if (extract_phasors && phasor.frequencies.empty()) {
+            phasor.frequencies = PhasorAccumulator::source_frequencies(environment);
+            if (phasor.frequencies.empty()) {
+              phasor.frequencies.push_back(1.0);
+            }
+          }
+          if (!extract_phasors) {
+            free_phasors();
+          } else if (init_phasors()) {
+            fprintf(stderr, "Cannot create the phasor textures\n");
+            extract_phasors = false;
+          }
+        }
+
+        ImGui::BeginDisabled(!extract_phasors);
+        bool frequencies_changed = false;
+        for (size_t k = 0; k < phasor.frequencies.size(); k++) {
+          char label[32];
+          snprintf(label, sizeof(label), "Frequency %zu", k);
+          frequencies_changed |= ImGui::InputFloat(label, &phasor.frequencies[k], 0.0f, 0.0f,
+                                                   "%g Hz", ImGuiInputTextFlags_EnterReturnsTrue);
+        }
+        if (ImGui::Button("Add") &&
+            phasor.frequencies.size() < PhasorAccumulator::max_frequencies) {
+          phasor.frequencies.push_back(phasor.frequencies.empty() ? 1.0f
+                                                                  : phasor.frequencies.back());
+          frequencies_changed = true;
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Remove") && phasor.frequencies.size() > 1) {
+          phasor.frequencies.pop_back();
+          frequencies_changed = true;
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Use Source Frequencies")) {
+          auto frequencies = PhasorAccumulator::source_frequencies(environment);
+          if (!frequencies.empty()) {
+            phasor.frequencies = frequencies;
+            frequencies_changed = true;
+          }
+        }
+        // a phasor is only meaningful for a single frequency, so any change starts over
+        if (frequencies_changed && extract_phasors && init_phasors()) {
+          fprintf(stderr, "Cannot create the phasor textures\n");
+          extract_phasors = false;
+        }
+
+        ImGui::Text("Accumulated %llu steps", (unsigned long long)phasor.steps);
+        if (ImGui::Button("Reset Phasors")) {
+          reset_phasors();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Export Amplitude")) {
+          phasor_export_mode = DisplayMode::Amplitude;
+          phasor_export_browser.Open();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Export Phase")) {
+          phasor_export_mode = DisplayMode::Phase;
+          phasor_export_browser.Open();
+        }
+        ImGui::EndDisabled();
+      }
+
+#if !defined(__EMSCRIPTEN__)
+      if (ImGui::CollapsingHeader("Steady State")) {
+        if (ImGui::Checkbox("Detect steady state and decay", &detect_settled)) {
+          if (detect_settled) {
+            reset_detector();
+          } else {
+            init_energy(0, 0);
+          }
+        }
+        ImGui::Checkbox("Stop when settled", &pause_when_settled);
+
+        ImGui::BeginDisabled(!detect_settled);
+        if (detector.is_periodic()) {
+          ImGui::Text("Periodic sources, %.4g s window", detector.window());
+        } else {
+          ImGui::Text("Pulsed sources");
+        }
+        ImGui::Text("Energy: %.4g (peak %.4g)", detector.energy(), detector.peak_energy());
+        ImGui::Text("State: %s", run_state_name(detector.state()));
+        if (ImGui::Button("Restart Detection")) {
+          reset_detector();
+        }
+        ImGui::EndDisabled();
+      }
+#endif
+
+      if (ImGui::CollapsingHeader("Display")) {
+        int mode = (int)display_mode;
+        if (ImGui::Combo("Show", &mode, "Field\0RMS\0Peak\0Amplitude\0Phase\0")) {
+          display_mode = (DisplayMode)mode;
+        }
+        ImGui::DragFloat("Gain", &display_gain, 0.05, 0.01, 100.0, "%.2f",
+                         ImGuiSliderFlags_Logarithmic);
+        ImGui::SliderInt("Phasor", &display_phasor, 0,
+                         std::max((int)phasor.frequencies.size() - 1, 0));
+        if (display_mode != DisplayMode::Field && display_mode != DisplayMode::Phase &&
+            !((display_mode == DisplayMode::Amplitude) ? extract_phasors : accumulate)) {
+          ImGui::TextColored(ImVec4(1.0, 1.0, 0.0, 1.0), "Not accumulated, showing the field.");
+        }
+      }
     }
     ImGui::End();
+
+    if (resized_settings && resize_sim(*resized_settings, true)) {
+      ImGui::OpenPopup("Cannot Resize Grid");
+    }
   }
 
   open_file_browser.Display();
   save_file_browser.Display();
+  open_snapshot_browser.Display();
+  save_snapshot_browser.Display();
+  record_browser.Display();
+  open_recording_browser.Display();
+  intensity_export_browser.Display();
+  phasor_export_browser.Display();
+#if !defined(__EMSCRIPTEN__)
+  probe_export_browser.Display();
+#endif
 
   if (save_file_browser.HasSelected()) {
     open_file_path = save_file_browser.GetSelected().string();
@@ -412,9 +1794,53 @@ void WavesApp::draw_settings() {
     clear_sim();
     open_file_browser.ClearSelected();
   }
+
+  if (save_snapshot_browser.HasSelected()) {
+    save_snapshot(save_snapshot_browser.GetSelected().string());
+    save_snapshot_browser.ClearSelected();
+  }
+
+  if (intensity_export_browser.HasSelected()) {
+    if (accumulate) {
+      export_intensity(intensity_export_browser.GetSelected().string(), intensity_export_mode);
+    }
+    intensity_export_browser.ClearSelected();
+  }
+
+  if (phasor_export_browser.HasSelected()) {
+    if (extract_phasors && (size_t)display_phasor < phasor.frequencies.size()) {
+      export_phasor(phasor_export_browser.GetSelected().string(), phasor_export_mode,
+                    display_phasor);
+    }
+    phasor_export_browser.ClearSelected();
+  }
+
+  if (open_snapshot_browser.HasSelected()) {
+    load_snapshot(open_snapshot_browser.GetSelected().string());
+    open_snapshot_browser.ClearSelected();
+  }
+
+#if !defined(__EMSCRIPTEN__)
+  if (record_browser.HasSelected()) {
+    start_recording(record_browser.GetSelected().string());
+    record_browser.ClearSelected();
+  }
+
+  if (open_recording_browser.HasSelected()) {
+    open_playback(open_recording_browser.GetSelected().string());
+    open_recording_browser.ClearSelected();
+  }
+
+  if (probe_export_browser.HasSelected()) {
+    probes.write(probe_export_browser.GetSelected().string());
+    probe_export_browser.ClearSelected();
+  }
+#endif
 }
 
 int WavesApp::draw_frame() {
+  TRACE_SCOPE("draw_frame");
+
   if (handle_sdl_events()) {
     return 1;
   }
@@ -423,27 +1849,57 @@ int WavesApp::draw_frame() {
   ImGui_ImplSDL2_NewFrame(window);
   ImGui::NewFrame();
 
-  // automatically set delta_t
+  // automatically set delta_t to just under the stability limit of the current media
   if (auto_delta_t) {
-    delta_t = solver_stable_delta_t();
+    settings.delta_t = settings.stable_delta_t(environment.max_ior_inv());
   }
 
   draw_settings();
+#if !defined(__EMSCRIPTEN__)
+  update_probes();
+#endif
 
-  // run simulation step
-  if (run_sim) {
+  // run simulation step. The simulation is paused while a recording is played.
+  if (player) {
+    draw_playback_controls();
+    update_playback();
+  } else if (run_sim) {
     for (int i = 0; i < sim_cycles; i++) {
       draw_environment();
       run_simulation();
+#if !defined(__EMSCRIPTEN__)
+      if (recorder && recorder->wants(sim_step)) {
+        queue_record_readback();
+      }
+      sample_probes();
+      if (detect_settled && detector.wants(sim_step)) {
+        queue_energy_readback();
+      }
+#endif
     }
   } else {
     draw_environment();
   }
 
+#if !defined(__EMSCRIPTEN__)
+  // push the frames whose readback has finished
+  while (recorder && collect_record_readback(false)) {
+  }
+
+  // once the simulation stops, the rows of an unfinished batch are read back so they are shown
+  if ((player || !run_sim) && probe_rows > 0) {
+    queue_probe_readback();
+  }
+  while (collect_probe_readback(false)) {
+  }
+  while (collect_energy_readback(false)) {
+  }
+#endif
+
   // render state
   run_display();
   // handle environment controls
-  if (show_edit) {
+  if (show_edit && !player) {
     draw_env_controls();
 
     if (environment.has_active_object()) {
@@ -454,6 +1910,9 @@ int WavesApp::draw_frame() {
     }
   }
 
+#if !defined(__EMSCRIPTEN__)
+  draw_probe_window();
+#endif
   draw_error_popups();
   draw_menu_bar();
 
@@ -461,12 +1920,20 @@ int WavesApp::draw_frame() {
   ImGui::Render();
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
-  SDL_GL_SwapWindow(window);
+  {
+    TRACE_SCOPE("swap_window");
+    SDL_GL_SwapWindow(window);
+  }
 
   return 0;
 }
 
 void WavesApp::shutdown() {
+#if !defined(__EMSCRIPTEN__)
+  stop_recording();
+#endif
+  close_playback();
+
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplSDL2_Shutdown();
   ImGui::DestroyContext();
@@ -483,33 +1950,13 @@ void WavesApp::add_object(std::unique_ptr<SimObject> object, bool selected) {
   }
 }
 
-std::string WavesApp::serialize_settings() const {
-  return "(Settings " + std::to_string(delta_t) + " " + std::to_string(delta_x) + " " +
-         std::to_string(wave_speed_vacuum) + " " + std::to_string(damping_area_size) + " " +
-         std::to_string(texture_width) + " " + std::to_string(texture_height) + ")";
-}
-
-bool WavesApp::deserialize_settings(std::istream &in) {
-  auto type = SimObject::read_token(in);
-  if (type == "Settings") {
-    delta_t = std::stof(SimObject::read_token(in));
-    delta_x = std::stof(SimObject::read_token(in));
-    wave_speed_vacuum = std::stof(SimObject::read_token(in));
-    damping_area_size = std::stoi(SimObject::read_token(in));
-    texture_width = std::stoul(SimObject::read_token(in));
-    texture_height = std::stoul(SimObject::read_token(in));
-    // read closing paren
-    return in.get() == ')';
-  }
-
-  return false;
-}
-
 WavesApp app{};
 
 void webDrawFrame() { app.draw_frame(); }
 
 int main() {
+  Tracer::set_thread_name("main");
+
   if (app.init()) {
     return -1;
   }
@@ -1,7 +1,15 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include "accumulator.hpp"
+#include "energy.hpp"
 #include "geometry.hpp"
+#include "phasor.hpp"
+#include "player.hpp"
+#include "probe.hpp"
+#include "recorder.hpp"
+#include "scene.hpp"
+#include "snapshot.hpp"
 #include <imfilebrowser.h>
 #include <imgui.h>
 #include <imgui_impl_opengl3.h>
@@ -17,6 +25,20 @@
 #include <SDL_opengl.h>
 #endif
 
+// What the display shows
+enum class DisplayMode {
+  // the wave value u
+  Field = 0,
+  // the rms of u over the accumulation window
+  Rms = 1,
+  // the peak |u| over the accumulation window
+  Peak = 2,
+  // the amplitude of a phasor
+  Amplitude = 3,
+  // the phase of a phasor
+  Phase = 4,
+};
+
 class WavesApp {
   // Window and gl context
   SDL_Window *window;
@@ -27,6 +49,13 @@ class WavesApp {
 
   ImGui::FileBrowser open_file_browser{};
   ImGui::FileBrowser save_file_browser{ImGuiFileBrowserFlags_EnterNewFilename};
+  ImGui::FileBrowser open_snapshot_browser{};
+  ImGui::FileBrowser save_snapshot_browser{ImGuiFileBrowserFlags_EnterNewFilename};
+  ImGui::FileBrowser record_browser{ImGuiFileBrowserFlags_EnterNewFilename};
+  ImGui::FileBrowser open_recording_browser{};
+  ImGui::FileBrowser probe_export_browser{ImGuiFileBrowserFlags_EnterNewFilename};
+  ImGui::FileBrowser intensity_export_browser{ImGuiFileBrowserFlags_EnterNewFilename};
+  ImGui::FileBrowser phasor_export_browser{ImGuiFileBrowserFlags_EnterNewFilename};
 
   // Simulation state storage texture. This is an rgba floating point texture.
   // The red channel is position (u), green is velocity (du/dt), blue is wave speed (c), alpha is
@@ -40,19 +69,38 @@ class WavesApp {
   // Index of sim texture that is to be written to next. The opposite texture contains the last
   // written state.
   int current_sim_texture{0};
-  // Width and height (in texels) of texture
-  size_t texture_width{1024}, texture_height{1024};
 
-  // Time step size for simulation (in s).
-  float delta_t{0.01};
+  // Intensity accumulation (see IntensityAccumulator). While enabled, sim_program also writes the
+  // (mean u^2, peak |u|) accumulators to a second color attachment, so they are updated in the same
+  // pass as the step. Like the sim textures, there are two accumulator textures, and
+  // accum_textures[i] is attached to sim_framebuffers[i].
+  IntensityAccumulator accumulator{};
+  bool accumulate{false};
+  GLuint accum_textures[2]{0, 0};
+  DisplayMode display_mode{DisplayMode::Field};
+  // scale applied to intensities before they are displayed
+  float display_gain{1.0};
+  // plane written when intensity_export_browser selects a file (DisplayMode::Rms or Peak)
+  DisplayMode intensity_export_mode{DisplayMode::Rms};
+
+  // Phasor extraction (see PhasorAccumulator). While enabled, sim_program also writes the phasors
+  // of two frequencies to each of the third and fourth color attachments. phasor_textures[a][i] is
+  // attachment a + 2 of sim_framebuffers[i], and only the first phasor_attachments are created.
+  PhasorAccumulator phasor{};
+  bool extract_phasors{false};
+  GLuint phasor_textures[2][2]{};
+  size_t phasor_attachments{0};
+  // frequency shown by the amplitude and phase display modes (and exported)
+  int display_phasor{0};
+  // plane written when phasor_export_browser selects a file (DisplayMode::Amplitude or Phase)
+  DisplayMode phasor_export_mode{DisplayMode::Amplitude};
+
+  // Solver settings (time step, texel size, texture size, etc)
+  SimSettings settings{};
   // Current time (in s)
   float time{0.0};
-  // Physical size of each texel (in m/texel)
-  float delta_x{0.04};
-  // Wave speed in free space (in m/s)
-  float wave_speed_vacuum{2.0};
-  // Size (in texels) of absorbing boundary layer
-  int damping_area_size{128};
+  // Number of steps run since the simulation was last cleared
+  uint64_t sim_step{0};
 
   // if delta t should be set automatically based on delta x
   bool auto_delta_t{true};
@@ -68,6 +116,89 @@ class WavesApp {
 
   // the current open path
   std::optional<std::string> open_file_path{};
+  // path traces are saved to (see Tracer)
+  std::string trace_path{"waves_trace.json"};
+
+#if !defined(__EMSCRIPTEN__)
+  // Recording of the u field (see Recorder)
+  std::unique_ptr<Recorder> recorder{};
+  RecorderOptions record_options{};
+  // Pixel pack buffers that recorded frames are read back into. A readback is queued right after
+  // its step and a fence is inserted behind it. The frame is only mapped and pushed to the recorder
+  // once the fence has signalled, so reading a frame never stalls the gl pipeline.
+  static constexpr size_t record_pbo_count = 4;
+  GLuint record_pbos[record_pbo_count]{};
+  GLsync record_fences[record_pbo_count]{};
+  uint64_t record_steps[record_pbo_count]{};
+  float record_times[record_pbo_count]{};
+  // oldest in flight readback, and number of readbacks in flight
+  size_t record_pbo_next{0}, record_pbo_pending{0};
+  // copy of a mapped readback, where the mirror images of a symmetric scene are filled in
+  std::vector<float> record_mirror{};
+
+  // Samples of the probes in the environment (see ProbeSet). After each step, the u value at every
+  // probe point is copied into a row of probe_texture on the gpu. Every probe_batch_steps steps,
+  // all of its rows are read back into a pixel pack buffer with a single glReadPixels, and the
+  // samples are only mapped once the readback's fence has signalled, so sampling never stalls the
+  // gl pipeline.
+  ProbeSet probes{};
+  // number of samples kept for plotting and export
+  int probe_capacity{8192};
+  // number of steps sampled between readbacks
+  int probe_batch_steps{16};
+  // cell of each probe point (an RG32F texture with one texel per point), and the R32F texture of
+  // point_count x probe_texture_rows samples that the probe program draws to
+  GLuint probe_cells_texture{0}, probe_texture{0}, probe_framebuffer{0};
+  size_t probe_texture_rows{0};
+  // number of rows written since the last readback, and the step and time of each row
+  size_t probe_rows{0};
+  std::vector<uint64_t> probe_row_steps{};
+  std::vector<float> probe_row_times{};
+  static constexpr size_t probe_pbo_count = 4;
+  GLuint probe_pbos[probe_pbo_count]{};
+  GLsync probe_fences[probe_pbo_count]{};
+  // rows read back into each buffer, and their steps and times
+  size_t probe_pbo_rows[probe_pbo_count]{};
+  std::vector<uint64_t> probe_pbo_steps[probe_pbo_count]{};
+  std::vector<float> probe_pbo_times[probe_pbo_count]{};
+  size_t probe_pbo_next{0}, probe_pbo_pending{0};
+  // if the probe window should be shown
+  bool show_probes{true};
+
+  // Steady state and decay detection (see SteadyStateDetector). When the detector wants a sample,
+  // energy_program draws the energy of each cell to energy_textures[0], and reduce_program sums
+  // each level into the next, half as large, until the total is in the single texel of the last
+  // level. That texel is read back like the probe samples, so checking never stalls the gl
+  // pipeline.
+  bool detect_settled{false};
+  // if the simulation is paused once the detector finds it has settled
+  bool pause_when_settled{true};
+  SteadyStateDetector detector{};
+  std::vector<GLuint> energy_textures{}, energy_framebuffers{};
+  // size of energy_textures[0] (in cells)
+  size_t energy_width{0}, energy_height{0};
+  static constexpr size_t energy_pbo_count = 4;
+  GLuint energy_pbos[energy_pbo_count]{};
+  GLsync energy_fences[energy_pbo_count]{};
+  // time of the sample read back into each buffer
+  double energy_times[energy_pbo_count]{};
+  size_t energy_pbo_next{0}, energy_pbo_pending{0};
+#endif
+
+  // Playback of a recording (see Player). While a recording is open, its frames are displayed
+  // instead of the simulation.
+  std::unique_ptr<Player> player{};
+  // frame being shown, and if it is advanced each display cycle
+  int playback_frame{0};
+  bool playback_running{false};
+  // number of frames advanced each display cycle
+  int playback_speed{1};
+  // if the frame slider is being dragged
+  bool playback_scrubbing{false};
+  // single channel texture the shown frame is uploaded to, and the frame and level it holds
+  GLuint playback_texture{0};
+  size_t playback_texture_frame{SIZE_MAX};
+  size_t playback_texture_level{0};
 
   // gl programs and geometry
   Programs programs{};
@@ -83,20 +214,61 @@ class WavesApp {
   int init_imgui();
   // Create the texture and framebuffer for simulation
   int init_sim_texture();
+  // Delete the textures and framebuffers of the simulation
+  void free_sim_texture();
+  // Switch to new settings, and reallocate the simulation textures (and the accumulators and
+  // phasors attached to them) if the grid size has changed. If resample is set, the current state
+  // is resampled to the new cells at the same physical positions (see SimGrid::resample_field), so
+  // the run continues on the new grid; otherwise the new textures must be cleared. Return non zero
+  // (keeping the old grid) if the textures can't be created.
+  int resize_sim(const SimSettings &new_settings, bool resample);
 
   // Handle window events, and return non zero if program should quit
   int handle_sdl_events();
 
   // Get the factor by which physical coordinates are scaled to texture coordinates
   glm::vec2 get_scale_factor() const;
+  // Get the width of the absorbing layer that isn't displayed along x and y (in texels). Periodic
+  // axes have no absorbing layer, so they are displayed whole.
+  glm::vec2 get_display_crop() const;
+  // Get the physical size of the displayed area (in m)
+  glm::vec2 get_display_area() const;
   // Get the factor by which physical coordinates are scaled to display coordinates
   // (same as texture coordinates, but excludes absorbing layer area)
   glm::vec2 get_display_scale_factor() const;
 
+  // Read the last written sim texture back into a cpu grid
+  SimGrid read_sim_state();
+  // Write a cpu grid to the last written sim texture. The grid must be the same size as the
+  // texture.
+  void write_sim_state(const SimGrid &grid);
+
+  // Create the accumulator textures and attach them to the sim framebuffers
+  int init_accumulators();
+  // Detach and delete the accumulator textures
+  void free_accumulators();
+  // Zero the accumulators
+  void reset_accumulators();
+  // Write the rms or peak plane of the accumulators to a .pfm file
+  void export_intensity(const std::string &path, DisplayMode mode);
+  // Create the phasor textures for the current frequencies and attach them to the sim framebuffers
+  int init_phasors();
+  // Detach and delete the phasor textures
+  void free_phasors();
+  // Zero the phasors
+  void reset_phasors();
+  // Write the amplitude or phase of the k-th phasor to a .pfm file
+  void export_phasor(const std::string &path, DisplayMode mode, size_t k);
+  // Set the draw buffers of the bound sim framebuffer to the state and any enabled accumulators
+  void set_sim_draw_buffers();
+
   // Draw the environment onto the last written sim texture
   void draw_environment();
   // Clear current wave state
   void clear_sim();
+  // Reset the step count, intensity accumulators, phasors, probe series and steady state detector,
+  // when the wave state is replaced by one that doesn't follow from it
+  void reset_run();
   // Run one step of the simulation program, rendering the new state onto the current texture
   void run_simulation();
   // Get the size (in pixels) to display the simulation state at
@@ -111,23 +283,67 @@ class WavesApp {
   void draw_menu_bar();
   void draw_add_menu();
   void draw_file_menu();
+  void draw_trace_menu();
+  void draw_record_menu();
   // Save the current environment
   void save_to_file();
+  // Save the full simulation state (see Snapshot)
+  void save_snapshot(const std::string &path);
+  // Restore the environment and simulation state from a snapshot
+  void load_snapshot(const std::string &path);
+#if !defined(__EMSCRIPTEN__)
+  // Start recording the simulation to path
+  void start_recording(const std::string &path);
+  // Write the frames still being read back and close the recording
+  void stop_recording();
+  // Start reading back the last written sim texture for the recorder
+  void queue_record_readback();
+  // Push the oldest queued readback to the recorder. If wait is false and the readback hasn't
+  // finished, return false without waiting for it.
+  bool collect_record_readback(bool wait);
+
+  // Find the probes in the environment, and recreate the probe textures if they have changed
+  void update_probes();
+  // Replace the probe set, and create the textures and buffers to sample it
+  void init_probes(ProbeSet new_probes);
+  // Copy the probe values of the last written sim texture into the next row of probe_texture
+  void sample_probes();
+  // Start reading back the rows of probe_texture written since the last readback
+  void queue_probe_readback();
+  // Push the samples of the oldest queued readback to the probe set. If wait is false and the
+  // readback hasn't finished, return false without waiting for it.
+  bool collect_probe_readback(bool wait);
+  // Drop the samples being read back
+  void discard_probe_readbacks();
+  // Draw the probe plots window
+  void draw_probe_window();
+
+  // Create the energy reduction textures for the current grid size (or delete them if the size is
+  // 0)
+  void init_energy(size_t width, size_t height);
+  // Start a new detector for the current environment, and drop the energies being read back
+  void reset_detector();
+  // Sum the energy of the last written sim texture and start reading it back
+  void queue_energy_readback();
+  // Add the oldest queued energy to the detector. If wait is false and the readback hasn't
+  // finished, return false without waiting for it.
+  bool collect_energy_readback(bool wait);
+  void discard_energy_readbacks();
+#endif
+
+  // Open a recording for playback
+  void open_playback(const std::string &path);
+  void close_playback();
+  // Advance playback, and upload the shown frame to playback_texture once it has been read
+  void update_playback();
+  // Draw the playback controls window
+  void draw_playback_controls();
   // Draw simulation settings
   void draw_settings();
 
-  // Serialize the simulation settings
-  std::string serialize_settings() const;
-  bool deserialize_settings(std::istream &in);
-
   // Write the current environment to stream
   std::string serialize();
 
-  // Return true if current delta x / delta t settings should be stable
-  bool solver_settings_stable();
-  // Return the delta t setting that would make the solver stable
-  float solver_stable_delta_t();
-
 public:
   WavesApp() = default;
 
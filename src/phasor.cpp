@@ -0,0 +1,49 @@
+#include "phasor.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+static constexpr double pi = 3.141592653589793;
+
+PhasorAccumulator::Twiddles PhasorAccumulator::next_step(double time) {
+  steps++;
+  const double weight = 1.0 / (double)steps;
+
+  Twiddles res{};
+  res.keep = (float)(1.0 - weight);
+  for (size_t k = 0; k < frequencies.size() && k < max_frequencies; k++) {
+    // reduce the phase in double, so it stays accurate for long runs
+    double phase = 2.0 * pi * std::fmod((double)frequencies[k] * time, 1.0);
+    res.re[k] = (float)(std::cos(phase) * weight);
+    res.im[k] = (float)(-std::sin(phase) * weight);
+  }
+  return res;
+}
+
+std::vector<float> PhasorAccumulator::source_frequencies(const Environment &environment) {
+  std::vector<float> res;
+  for (const auto &obj : environment.objects) {
+    const Waveform *waveform = obj->source_waveform();
+    if (waveform == nullptr) {
+      continue;
+    }
+    float freq = waveform->get_freq_amp().first;
+    bool seen = std::any_of(res.begin(), res.end(), [freq](float f) {
+      return std::abs(f - freq) <= 1e-6f * std::max(std::abs(f), std::abs(freq));
+    });
+    if (!seen && freq > 0.0f && res.size() < max_frequencies) {
+      res.push_back(freq);
+    }
+  }
+  return res;
+}
+
+void phasor_amplitude_phase(const float *re, const float *im, size_t n, size_t stride,
+                            float *amplitude, float *phase) {
+  for (size_t i = 0; i < n; i++) {
+    float z_re = 2.0f * re[stride * i];
+    float z_im = 2.0f * im[stride * i];
+    amplitude[i] = std::sqrt(z_re * z_re + z_im * z_im);
+    phase[i] = std::atan2(z_im, z_re);
+  }
+}
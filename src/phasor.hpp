@@ -0,0 +1,49 @@
+#ifndef PHASOR_H
+#define PHASOR_H
+
+#include "geometry.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// PhasorAccumulator extracts the steady state amplitude and phase of u at a few frequencies with a
+// running DFT, so complex amplitude maps come out of a single run without recording frames. For
+// each frequency f, each cell keeps the running mean of u * e^(-i 2 pi f t) over the steps since
+// the last reset:
+//
+//   phasor = keep * phasor + u * twiddle
+//
+// where keep = 1 - 1 / n and twiddle = e^(-i 2 pi f t) / n at step n. keep and the twiddles are the
+// same for every cell, so they are computed once per step on the host. For
+// u = A cos(2 pi f t + phi), the mean tends to (A / 2) e^(i phi), so the complex amplitude is twice
+// the phasor.
+class PhasorAccumulator {
+public:
+  static constexpr size_t max_frequencies = 4;
+
+  struct Twiddles {
+    float keep;
+    float re[max_frequencies], im[max_frequencies];
+  };
+
+  // frequencies to extract (in Hz), at most max_frequencies
+  std::vector<float> frequencies{};
+  // number of steps accumulated since the last reset
+  uint64_t steps{0};
+
+  // Return the factors for the u field at time (in s), and count the step
+  Twiddles next_step(double time);
+  void reset() { steps = 0; }
+
+  // The distinct frequencies of the sources in environment (see Waveform::get_freq_amp), at most
+  // max_frequencies of them
+  static std::vector<float> source_frequencies(const Environment &environment);
+};
+
+// Convert the real and imaginary phasor planes of n cells to the amplitude and phase (in rad) of
+// the complex amplitude. The value of cell i is re[stride * i] and im[stride * i].
+void phasor_amplitude_phase(const float *re, const float *im, size_t n, size_t stride,
+                            float *amplitude, float *phase);
+
+#endif
@@ -0,0 +1,128 @@
+#include "player.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+Player::Player(std::unique_ptr<RecordingReader> reader, size_t prefetch_frames)
+    : reader(std::move(reader)), prefetch_frames(prefetch_frames),
+      // keep a couple of frames outside of the prefetch window, so switching back to the last frame
+      // or level shown doesn't read it again
+      cache(prefetch_frames + 2) {
+  prefetcher = std::thread(&Player::prefetch_loop, this);
+}
+
+Player::~Player() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  request_cv.notify_all();
+  prefetcher.join();
+}
+
+std::unique_ptr<Player> Player::open(const std::string &path, size_t prefetch_frames) {
+  auto reader = RecordingReader::open(path);
+  if (!reader) {
+    return nullptr;
+  }
+  if (reader->frame_count() == 0) {
+    fprintf(stderr, "Recording has no frames: %s\n", path.c_str());
+    return nullptr;
+  }
+  return std::unique_ptr<Player>(
+      new Player(std::move(reader), std::max<size_t>(prefetch_frames, 1)));
+}
+
+// must be called with mutex held
+Player::CachedFrame *Player::find(size_t frame, size_t level) {
+  for (auto &cached : cache) {
+    if (cached.frame == frame && cached.level == level) {
+      return &cached;
+    }
+  }
+  return nullptr;
+}
+
+void Player::request(size_t frame, size_t level) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (frame == requested_frame && level == requested_level) {
+      return;
+    }
+    requested_frame = frame;
+    requested_level = level;
+  }
+  request_cv.notify_one();
+}
+
+std::shared_ptr<const std::vector<float>> Player::get(size_t frame, size_t level) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    CachedFrame *cached = find(frame, level);
+    if (cached == nullptr) {
+      return nullptr;
+    }
+    if (cached->valid) {
+      cached->last_used = ++use_count;
+      return cached->data;
+    }
+    // drop the failed read, so the prefetcher tries again
+    cached->frame = SIZE_MAX;
+  }
+  request_cv.notify_one();
+  return nullptr;
+}
+
+void Player::prefetch_loop() {
+  Tracer::set_thread_name("prefetch");
+
+  std::shared_ptr<std::vector<float>> data;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    // first frame in the prefetch window that hasn't been read
+    size_t frame = SIZE_MAX;
+    size_t window_end = std::min(requested_frame + prefetch_frames, reader->frame_count());
+    size_t level = requested_level;
+    for (size_t i = requested_frame; i < window_end; i++) {
+      if (find(i, level) == nullptr) {
+        frame = i;
+        break;
+      }
+    }
+    if (frame == SIZE_MAX) {
+      request_cv.wait(lock);
+      continue;
+    }
+
+    // replace the least recently used frame outside of the window
+    CachedFrame *slot = nullptr;
+    for (auto &cached : cache) {
+      bool in_window = cached.level == level && cached.frame >= requested_frame &&
+                       cached.frame < window_end;
+      if (!in_window && (slot == nullptr || cached.last_used < slot->last_used)) {
+        slot = &cached;
+      }
+    }
+    slot->frame = SIZE_MAX;
+    std::swap(data, slot->data);
+    if (data.use_count() != 1) {
+      // the last frame in this slot is still in use
+      data = std::make_shared<std::vector<float>>();
+    }
+
+    lock.unlock();
+    bool ok;
+    {
+      TRACE_SCOPE("Player::prefetch");
+      data->resize(reader->width(level) * reader->height(level));
+      ok = reader->read_frame(frame, data->data(), level);
+    }
+    lock.lock();
+
+    std::swap(data, slot->data);
+    slot->frame = frame;
+    slot->level = level;
+    slot->valid = ok;
+    slot->last_used = use_count;
+  }
+}
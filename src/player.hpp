@@ -0,0 +1,66 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include "recorder.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// Player streams the frames of a recording for interactive playback. A background thread reads and
+// decodes the last requested frame first, and then prefetches the frames after it, so playing
+// forward doesn't wait on the disk or the decoder. Decoded frames are kept in a small cache.
+class Player {
+  std::unique_ptr<RecordingReader> reader;
+  // number of frames read ahead of the requested frame (including it)
+  size_t prefetch_frames;
+
+  struct CachedFrame {
+    size_t frame{SIZE_MAX};
+    size_t level{0};
+    // false if the frame couldn't be read
+    bool valid{false};
+    // use_count when the frame was last used (the least recently used frame is replaced first)
+    uint64_t last_used{0};
+    // the frame, which is shared with the callers of get, so it is reused for the next read only
+    // once they have all released it
+    std::shared_ptr<std::vector<float>> data{};
+  };
+
+  std::mutex mutex{};
+  // signalled when a new frame is requested (or the player is stopping)
+  std::condition_variable request_cv{};
+  std::vector<CachedFrame> cache{};
+  size_t requested_frame{0};
+  size_t requested_level{0};
+  uint64_t use_count{0};
+  bool stopping{false};
+
+  std::thread prefetcher{};
+
+  Player(std::unique_ptr<RecordingReader> reader, size_t prefetch_frames);
+  CachedFrame *find(size_t frame, size_t level);
+  void prefetch_loop();
+
+public:
+  ~Player();
+  Player(const Player &) = delete;
+  Player &operator=(const Player &) = delete;
+
+  // Open the recording at path. Return nullptr (and print to stderr) if it can't be opened.
+  static std::unique_ptr<Player> open(const std::string &path, size_t prefetch_frames = 8);
+
+  // The recording being played. Only its const members may be used, since the reader itself is used
+  // by the prefetch thread.
+  const RecordingReader &recording() const { return *reader; }
+
+  // Ask for a level of frame (see RecordingReader::level_count). It is read in the background,
+  // followed by the frames after it.
+  void request(size_t frame, size_t level);
+  // A level of frame if it has been read, or nullptr if it isn't ready or couldn't be read. A frame
+  // that couldn't be read is read again after it has been asked for. The frame isn't copied, and
+  // stays valid for as long as the caller holds it.
+  std::shared_ptr<const std::vector<float>> get(size_t frame, size_t level);
+};
+
+#endif
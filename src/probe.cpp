@@ -0,0 +1,166 @@
+#include "probe.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static constexpr char probe_magic[8] = {'W', 'A', 'V', 'P', 'R', 'O', 'B', '1'};
+
+static_assert(sizeof(ProbeFileHeader) == 24, "ProbeFileHeader must not contain padding");
+static_assert(sizeof(ProbeFileProbe) == 8, "ProbeFileProbe must not contain padding");
+
+ProbeSet::ProbeSet(const Environment &environment, size_t grid_width, size_t grid_height,
+                   float delta_x, float delta_y, size_t capacity)
+    : grid_width(grid_width) {
+  for (const auto &obj : environment.objects) {
+    size_t first = positions.size();
+    size_t count = obj->probe_points(positions);
+    if (count > 0) {
+      probes.push_back({first, count});
+    }
+  }
+
+  // a point measures the cell it is in, which is the same cell a point source there is drawn to
+  cells.reserve(positions.size());
+  for (auto pos : positions) {
+    float x = pos.x / delta_x + grid_width / 2.0f;
+    float y = pos.y / delta_y + grid_height / 2.0f;
+    cells.emplace_back(std::clamp((long)std::floor(x), 0l, (long)grid_width - 1),
+                       std::clamp((long)std::floor(y), 0l, (long)grid_height - 1));
+  }
+
+  if (!positions.empty()) {
+    steps.resize(capacity);
+    times.resize(capacity);
+    values.resize(capacity * positions.size());
+  }
+}
+
+bool ProbeSet::same_points(const ProbeSet &other) const {
+  if (probes.size() != other.probes.size() || cells != other.cells) {
+    return false;
+  }
+  for (size_t i = 0; i < probes.size(); i++) {
+    if (probes[i].first != other.probes[i].first || probes[i].count != other.probes[i].count) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ProbeSet::clear() {
+  next = 0;
+  count = 0;
+}
+
+float *ProbeSet::push(uint64_t step, float time) {
+  size_t i = next;
+  steps[i] = step;
+  times[i] = time;
+  next = (next + 1) % steps.size();
+  count = std::min(count + 1, steps.size());
+  return &values[i * positions.size()];
+}
+
+void ProbeSet::sample(const float *u, uint64_t step, float time) {
+  float *out = push(step, time);
+  for (size_t i = 0; i < cells.size(); i++) {
+    out[i] = u[cells[i].y * grid_width + cells[i].x];
+  }
+}
+
+bool ProbeSet::write_csv(const std::string &path) const {
+  TRACE_SCOPE("ProbeSet::write_csv");
+
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  // columns are named by probe, and by point for probes with more than one point
+  fprintf(file, "step,time");
+  for (size_t p = 0; p < probes.size(); p++) {
+    for (size_t i = 0; i < probes[p].count; i++) {
+      if (probes[p].count == 1) {
+        fprintf(file, ",probe%zu", p);
+      } else {
+        fprintf(file, ",probe%zu_%zu", p, i);
+      }
+    }
+  }
+  fprintf(file, "\n");
+
+  for (size_t s = 0; s < count; s++) {
+    fprintf(file, "%llu,%.9g", (unsigned long long)sample_step(s), sample_time(s));
+    const float *row = sample_values(s);
+    for (size_t i = 0; i < positions.size(); i++) {
+      fprintf(file, ",%.9g", row[i]);
+    }
+    fprintf(file, "\n");
+  }
+
+  bool ok = !ferror(file);
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ProbeSet::write_binary(const std::string &path) const {
+  TRACE_SCOPE("ProbeSet::write_binary");
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  ProbeFileHeader header{};
+  memcpy(header.magic, probe_magic, sizeof(probe_magic));
+  header.probe_count = probes.size();
+  header.point_count = positions.size();
+  header.sample_count = count;
+
+  std::vector<ProbeFileProbe> file_probes;
+  for (const auto &probe : probes) {
+    file_probes.push_back({(uint32_t)probe.first, (uint32_t)probe.count});
+  }
+
+  // the ring wraps around, so the samples are copied out in order
+  std::vector<uint64_t> sample_steps(count);
+  std::vector<float> sample_times(count);
+  std::vector<float> sample_rows(count * positions.size());
+  for (size_t s = 0; s < count; s++) {
+    sample_steps[s] = sample_step(s);
+    sample_times[s] = sample_time(s);
+    std::copy_n(sample_values(s), positions.size(), &sample_rows[s * positions.size()]);
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(file_probes.data(), sizeof(ProbeFileProbe), file_probes.size(), file) ==
+                file_probes.size() &&
+            fwrite(positions.data(), sizeof(glm::vec2), positions.size(), file) ==
+                positions.size() &&
+            fwrite(sample_steps.data(), sizeof(uint64_t), count, file) == count &&
+            fwrite(sample_times.data(), sizeof(float), count, file) == count &&
+            fwrite(sample_rows.data(), sizeof(float), sample_rows.size(), file) ==
+                sample_rows.size();
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ProbeSet::write(const std::string &path) const {
+  const std::string csv = ".csv";
+  if (path.size() >= csv.size() && path.compare(path.size() - csv.size(), csv.size(), csv) == 0) {
+    return write_csv(path);
+  }
+  return write_binary(path);
+}
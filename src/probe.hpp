@@ -0,0 +1,91 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "geometry.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary probe files start with a ProbeFileHeader, followed by probe_count ProbeFileProbes, then
+// the position of each point (point_count pairs of float x and y, in m). The samples follow as
+// planes: sample_count uint64 steps, sample_count float times (in s), and then sample_count rows of
+// point_count float u values. All values are little endian.
+struct ProbeFileHeader {
+  // "WAVPROB1"
+  char magic[8];
+  uint32_t probe_count, point_count;
+  uint64_t sample_count;
+};
+
+struct ProbeFileProbe {
+  // index of the probe's first point, and its number of points
+  uint32_t first, count;
+};
+
+// ProbeSet holds the points measured by the probes of an environment, and a preallocated ring of
+// the latest samples of u at those points. Each sample is a row with the value at every point, so
+// all probes are captured together. Once the ring is full, each new sample replaces the oldest.
+class ProbeSet {
+public:
+  // The points of a probe object are points [first, first + count)
+  struct Probe {
+    size_t first, count;
+  };
+
+private:
+  std::vector<Probe> probes{};
+  // physical position and grid cell of each point
+  std::vector<glm::vec2> positions{};
+  std::vector<glm::ivec2> cells{};
+  size_t grid_width{0};
+
+  // ring of samples. The oldest retained sample is at slot (next + capacity - count) % capacity.
+  std::vector<uint64_t> steps{};
+  std::vector<float> times{};
+  std::vector<float> values{};
+  size_t next{0}, count{0};
+
+  size_t slot(size_t i) const { return (next + steps.size() - count + i) % steps.size(); }
+
+public:
+  ProbeSet() = default;
+  // Find the probes of environment on a grid of grid_width x grid_height cells of size delta_x x
+  // delta_y, and preallocate a ring of capacity samples
+  ProbeSet(const Environment &environment, size_t grid_width, size_t grid_height, float delta_x,
+           float delta_y, size_t capacity);
+
+  size_t probe_count() const { return probes.size(); }
+  const Probe &probe(size_t i) const { return probes[i]; }
+  size_t point_count() const { return positions.size(); }
+  glm::vec2 position(size_t point) const { return positions[point]; }
+  // cell a point is in (with (0, 0) at the bottom left corner of the grid)
+  glm::ivec2 cell(size_t point) const { return cells[point]; }
+  // If other measures the same cells with the same probes
+  bool same_points(const ProbeSet &other) const;
+
+  size_t capacity() const { return steps.size(); }
+  // Number of retained samples
+  size_t size() const { return count; }
+  void clear();
+
+  // Start a sample at step and time, and return the point_count values to fill it with. If the ring
+  // is full, the oldest sample is replaced. The capacity must be positive.
+  float *push(uint64_t step, float time);
+  // Sample the u field of a grid at step and time
+  void sample(const float *u, uint64_t step, float time);
+
+  // Step, time, and point values of the i-th oldest retained sample
+  uint64_t sample_step(size_t i) const { return steps[slot(i)]; }
+  float sample_time(size_t i) const { return times[slot(i)]; }
+  const float *sample_values(size_t i) const { return &values[slot(i) * positions.size()]; }
+
+  // Write the retained samples as CSV (one row per sample) or in the binary probe format. Return
+  // false (and print to stderr) if the file can't be written.
+  bool write_csv(const std::string &path) const;
+  bool write_binary(const std::string &path) const;
+  // Write CSV if path ends in .csv, and the binary format otherwise
+  bool write(const std::string &path) const;
+};
+
+#endif
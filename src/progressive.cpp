@@ -0,0 +1,81 @@
+#include "progressive.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <sstream>
+
+RunState run_until_steady(Engine &engine, SteadyStateDetector &detector, size_t max_steps,
+                          size_t &steps_run) {
+  RunState state = RunState::Running;
+  steps_run = 0;
+  while (steps_run < max_steps && state == RunState::Running) {
+    engine.step();
+    steps_run++;
+    if (detector.wants(steps_run)) {
+      state = detector.add(engine.get_time(), engine.energy());
+    }
+  }
+  return state;
+}
+
+std::vector<ProgressiveStage> progressive_warm_start(Engine &engine,
+                                                     const ProgressiveOptions &options) {
+  TRACE_SCOPE("progressive_warm_start");
+  std::vector<ProgressiveStage> stages;
+  const SimSettings &settings = engine.get_settings();
+  // the scene of the engine, and the state its own media and boundaries are kept from
+  Snapshot target = engine.snapshot();
+
+  int levels = 0;
+  while (levels < options.levels &&
+         std::min(settings.texture_width, settings.texture_height) >> (levels + 1) >=
+             progressive_min_size) {
+    levels++;
+  }
+
+  // field and time of the last coarse grid
+  std::optional<SimGrid> field;
+  float time = 0.0;
+  for (int level = levels; level > 0; level--) {
+    auto start = std::chrono::steady_clock::now();
+    // environments can't be copied, so each grid parses its own from the scene text
+    std::istringstream scene_text{target.scene};
+    std::optional<Scene> scene = Scene::deserialize(scene_text);
+    if (!scene) {
+      break;
+    }
+    scene->settings =
+        settings.resized(settings.texture_width >> level, settings.texture_height >> level);
+    SteadyStateDetector detector{scene->environment, scene->settings.delta_t, options.steady};
+    if (!detector.is_periodic()) {
+      break;
+    }
+
+    Engine coarse{scene->settings, std::move(scene->environment), engine.threads()};
+    if (field) {
+      Snapshot warm_start = coarse.snapshot();
+      warm_start.grid.resample_field(*field);
+      warm_start.time = time;
+      coarse.restore(warm_start);
+    }
+    ProgressiveStage stage{coarse.state().width, coarse.state().height, 0, 0.0, RunState::Running};
+    stage.state = run_until_steady(coarse, detector, options.max_steps, stage.steps);
+    field = coarse.state();
+    time = coarse.get_time();
+    auto end = std::chrono::steady_clock::now();
+    stage.seconds = std::chrono::duration<double>(end - start).count();
+    stages.push_back(stage);
+  }
+
+  if (field) {
+    auto start = std::chrono::steady_clock::now();
+    target.grid.resample_field(*field);
+    target.time = time;
+    engine.restore(target);
+    auto end = std::chrono::steady_clock::now();
+    stages.back().seconds += std::chrono::duration<double>(end - start).count();
+  }
+  return stages;
+}
@@ -0,0 +1,50 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "energy.hpp"
+#include "engine.hpp"
+
+#include <cstddef>
+#include <vector>
+
+struct ProgressiveOptions {
+  // number of coarse grids, each half the size of the next, so the coarsest is 2^levels times
+  // coarser than the target grid. The damping area of a coarse grid has fewer cells and reflects
+  // more, so the steady state of a much coarser grid is further from that of the target grid.
+  int levels{1};
+  // when a coarse grid is steady. The coarse grids are cheap to run, so they can settle as well as
+  // the target grid has to.
+  SteadyStateOptions steady{};
+  // most steps run on each coarse grid
+  size_t max_steps{100000};
+};
+
+// A grid of a progressive run
+struct ProgressiveStage {
+  size_t width, height;
+  size_t steps;
+  // wall time of the stage, including creating its engine and resampling the fields between grids
+  // (in s)
+  double seconds;
+  RunState state;
+};
+
+// smallest side of a coarse grid (in cells)
+static constexpr size_t progressive_min_size = 32;
+
+// Step an engine until detector finds its field is steady (or has decayed), or max_steps steps
+// have run. Return the final state and set steps_run to the number of steps run.
+RunState run_until_steady(Engine &engine, SteadyStateDetector &detector, size_t max_steps,
+                          size_t &steps_run);
+
+// Warm start engine from coarser grids: its scene is run on a grid 2^levels times coarser until the
+// field is steady (or max_steps steps have run), the field is resampled onto a grid twice as fine
+// and run again, and so on, and the field of the finest coarse grid is resampled onto engine. The
+// engine keeps its own media and boundaries, and continues from the time of the last coarse grid.
+// Only periodic sources settle into a steady state, so nothing is run for scenes without them.
+// Levels that would make a grid smaller than progressive_min_size cells are skipped. Return the
+// stages that were run, coarsest first.
+std::vector<ProgressiveStage> progressive_warm_start(Engine &engine,
+                                                     const ProgressiveOptions &options);
+
+#endif
@@ -0,0 +1,502 @@
+#include "recorder.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static constexpr char recording_magic[8] = {'W', 'A', 'V', 'R', 'E', 'C', '0', '3'};
+static constexpr char recording_index_magic[8] = {'W', 'A', 'V', 'R', 'I', 'D', 'X', '1'};
+
+static_assert(sizeof(RecordingHeader) == 64, "RecordingHeader must not contain padding");
+static_assert(sizeof(RecordingChunkHeader) == 16, "RecordingChunkHeader must not contain padding");
+static_assert(sizeof(RecordingFrameHeader) == 32, "RecordingFrameHeader must not contain padding");
+static_assert(sizeof(RecordingIndexEntry) == 40, "RecordingIndexEntry must not contain padding");
+static_assert(sizeof(RecordingTrailer) == 16, "RecordingTrailer must not contain padding");
+
+// how long the writer sleeps when it is waiting for frames
+static constexpr std::chrono::microseconds writer_poll_interval{500};
+
+// Average factor x factor blocks of a field into an out_width x out_height field. The value of cell
+// (x, y) of the input is in[stride * (y * in_width + x)].
+static void downsample(const float *in, size_t stride, size_t in_width, size_t factor,
+                       size_t out_width, size_t out_height, float *out) {
+  const float scale = 1.0f / (float)(factor * factor);
+  for (size_t y = 0; y < out_height; y++) {
+    if (factor == 1) {
+      const float *row = in + stride * y * in_width;
+      for (size_t x = 0; x < out_width; x++) {
+        out[x] = row[stride * x];
+      }
+    } else {
+      std::fill(out, out + out_width, 0.0f);
+      for (size_t j = 0; j < factor; j++) {
+        const float *row = in + stride * (y * factor + j) * in_width;
+        for (size_t x = 0; x < out_width; x++) {
+          for (size_t i = 0; i < factor; i++) {
+            out[x] += row[stride * (x * factor + i)];
+          }
+        }
+      }
+      for (size_t x = 0; x < out_width; x++) {
+        out[x] *= scale;
+      }
+    }
+    out += out_width;
+  }
+}
+
+FrameRing::FrameRing(size_t capacity, size_t frame_size) : frames(capacity) {
+  for (auto &frame : frames) {
+    frame.u.resize(frame_size);
+  }
+}
+
+size_t FrameRing::count() const {
+  return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+RecorderFrame *FrameRing::begin_push() {
+  size_t h = head.load(std::memory_order_relaxed);
+  if (h - tail.load(std::memory_order_acquire) >= frames.size()) {
+    return nullptr;
+  }
+  return &frames[h % frames.size()];
+}
+
+void FrameRing::end_push() {
+  head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+RecorderFrame *FrameRing::front(size_t i) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  if (head.load(std::memory_order_acquire) - t <= i) {
+    return nullptr;
+  }
+  return &frames[(t + i) % frames.size()];
+}
+
+void FrameRing::pop() {
+  tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+Recorder::Recorder(FILE *file, const RecordingHeader &header, const RecorderOptions &options)
+    : file(file), header(header), options(options),
+      ring(options.ring_frames, (size_t)header.width * header.height),
+      codec_pool(header.codec == RecordingCodec::Quantized ? options.codec_threads : 1),
+      file_offset(sizeof(header)) {
+  if (header.codec == RecordingCodec::Quantized) {
+    codec = std::make_unique<FieldCodec>(header.width, header.height, header.error_bound,
+                                         codec_pool);
+    encoded_frames.resize(options.chunk_frames);
+  }
+  if (header.preview_levels > 0) {
+    previews.resize(header.preview_levels);
+    for (size_t k = 0; k < previews.size(); k++) {
+      size_t width = header.width >> (k + 1), height = header.height >> (k + 1);
+      previews[k].resize(width * height);
+      if (codec) {
+        preview_codecs.push_back(
+            std::make_unique<FieldCodec>(width, height, header.error_bound, codec_pool));
+      }
+    }
+    encoded_previews.resize(options.chunk_frames);
+  }
+  writer = std::thread(&Recorder::writer_loop, this);
+}
+
+Recorder::~Recorder() { close(); }
+
+std::unique_ptr<Recorder> Recorder::open(const std::string &path, const SimSettings &settings,
+                                         const RecorderOptions &options) {
+  RecorderOptions opts = options;
+  opts.every = std::max<size_t>(opts.every, 1);
+  opts.downsample = std::max<size_t>(opts.downsample, 1);
+  opts.chunk_frames = std::max<size_t>(opts.chunk_frames, 1);
+  opts.keyframe_every = std::max<size_t>(opts.keyframe_every, 1);
+  // the writer holds up to a chunk of frames while writing, so leave room for the solver
+  opts.ring_frames = std::max(opts.ring_frames, 2 * opts.chunk_frames);
+
+  RecordingHeader header{};
+  memcpy(header.magic, recording_magic, sizeof(recording_magic));
+  header.width = settings.texture_width / opts.downsample;
+  header.height = settings.texture_height / opts.downsample;
+  header.grid_width = settings.texture_width;
+  header.grid_height = settings.texture_height;
+  header.every = opts.every;
+  header.downsample = opts.downsample;
+  header.delta_t = settings.delta_t;
+  header.delta_x = settings.delta_x * (float)opts.downsample;
+  header.damping_area_size = settings.damping_area_size;
+  header.periodic_x = settings.periodic_x;
+  header.periodic_y = settings.periodic_y;
+  header.codec = opts.error_bound > 0.0f ? RecordingCodec::Quantized : RecordingCodec::Raw;
+  header.error_bound = std::max(opts.error_bound, 0.0f);
+  // each preview level halves the one before it
+  size_t preview_width = header.width / 2, preview_height = header.height / 2;
+  while (opts.min_preview_size > 0 && preview_width >= opts.min_preview_size &&
+         preview_height >= opts.min_preview_size) {
+    header.preview_levels++;
+    preview_width /= 2;
+    preview_height /= 2;
+  }
+
+  if (header.width == 0 || header.height == 0) {
+    fprintf(stderr, "Recording downsample factor is larger than the grid\n");
+    return nullptr;
+  }
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return nullptr;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    fclose(file);
+    return nullptr;
+  }
+
+  return std::unique_ptr<Recorder>(new Recorder(file, header, opts));
+}
+
+void Recorder::push(const float *u, size_t stride, uint64_t step, float time) {
+  TRACE_SCOPE("Recorder::push");
+
+  RecorderFrame *frame = ring.begin_push();
+  if (frame == nullptr) {
+    // the writer is a full ring behind, so wait for it to free a slot
+    TRACE_SCOPE("Recorder::stall");
+    stalls++;
+    while ((frame = ring.begin_push()) == nullptr) {
+      std::this_thread::yield();
+    }
+  }
+
+  frame->step = step;
+  frame->time = time;
+  downsample(u, stride, header.grid_width, header.downsample, header.width, header.height,
+             frame->u.data());
+
+  ring.end_push();
+  frames_pushed++;
+}
+
+// Write the next frame_count frames in the ring as one chunk
+bool Recorder::write_chunk(size_t frame_count) {
+  TRACE_SCOPE("Recorder::write_chunk");
+
+  const uint64_t raw_bytes = (uint64_t)header.width * header.height * sizeof(float);
+  std::vector<RecordingIndexEntry> entries(frame_count);
+  std::vector<const void *> frame_data(frame_count), preview_data(frame_count);
+
+  RecordingChunkHeader chunk{};
+  chunk.frame_count = frame_count;
+  chunk.type = RecordingChunkType::Frames;
+  for (size_t i = 0; i < frame_count; i++) {
+    const RecorderFrame *frame = ring.front(i);
+    auto &entry = entries[i];
+    entry.header.step = frame->step;
+    entry.header.time = frame->time;
+    bool keyframe = !codec || (index.size() + i) % options.keyframe_every == 0;
+    entry.header.flags = keyframe ? recording_keyframe_flag : 0;
+
+    if (codec) {
+      codec->encode(frame->u.data(), keyframe, encoded_frames[i]);
+      entry.header.size = encoded_frames[i].size();
+      frame_data[i] = encoded_frames[i].data();
+    } else {
+      entry.header.size = raw_bytes;
+      frame_data[i] = frame->u.data();
+    }
+
+    if (!previews.empty()) {
+      // the size of each level, followed by the levels
+      auto &data = encoded_previews[i];
+      data.assign(previews.size() * sizeof(uint64_t), 0);
+      const float *above = frame->u.data();
+      size_t above_width = header.width;
+      for (size_t k = 0; k < previews.size(); k++) {
+        size_t width = header.width >> (k + 1), height = header.height >> (k + 1);
+        downsample(above, 1, above_width, 2, width, height, previews[k].data());
+        uint64_t size = width * height * sizeof(float);
+        const uint8_t *level_data = (const uint8_t *)previews[k].data();
+        if (codec) {
+          preview_codecs[k]->encode(previews[k].data(), keyframe, encoded_level);
+          size = encoded_level.size();
+          level_data = encoded_level.data();
+        }
+        memcpy(data.data() + k * sizeof(uint64_t), &size, sizeof(size));
+        data.insert(data.end(), level_data, level_data + size);
+        above = previews[k].data();
+        above_width = width;
+      }
+      entry.header.preview_size = data.size();
+      preview_data[i] = data.data();
+    }
+    chunk.size += sizeof(RecordingFrameHeader) + entry.header.size + entry.header.preview_size;
+  }
+  // encoded frames no longer need their slots, so release them before the (slow) write
+  for (size_t i = 0; codec && i < frame_count; i++) {
+    ring.pop();
+  }
+
+  bool ok = fwrite(&chunk, sizeof(chunk), 1, file) == 1;
+  file_offset += sizeof(chunk);
+  for (size_t i = 0; i < frame_count; i++) {
+    auto &entry = entries[i];
+    entry.offset = file_offset + sizeof(RecordingFrameHeader);
+    ok = ok && fwrite(&entry.header, sizeof(entry.header), 1, file) == 1 &&
+         fwrite(frame_data[i], 1, entry.header.size, file) == entry.header.size &&
+         fwrite(preview_data[i], 1, entry.header.preview_size, file) == entry.header.preview_size;
+    file_offset = entry.offset + entry.header.size + entry.header.preview_size;
+    index.push_back(entry);
+  }
+  for (size_t i = 0; !codec && i < frame_count; i++) {
+    ring.pop();
+  }
+  return ok;
+}
+
+// Write the frame index and trailer after the last chunk
+bool Recorder::write_index() {
+  RecordingChunkHeader chunk{};
+  chunk.frame_count = index.size();
+  chunk.type = RecordingChunkType::Index;
+  chunk.size = index.size() * sizeof(RecordingIndexEntry);
+
+  RecordingTrailer trailer{};
+  trailer.index_offset = file_offset;
+  memcpy(trailer.magic, recording_index_magic, sizeof(recording_index_magic));
+
+  bool ok = fwrite(&chunk, sizeof(chunk), 1, file) == 1 &&
+            fwrite(index.data(), sizeof(RecordingIndexEntry), index.size(), file) ==
+                index.size() &&
+            fwrite(&trailer, sizeof(trailer), 1, file) == 1;
+  file_offset += sizeof(chunk) + chunk.size + sizeof(trailer);
+  return ok;
+}
+
+void Recorder::writer_loop() {
+  Tracer::set_thread_name("recorder");
+
+  while (true) {
+    // load closing before counting, so no frames pushed before close are missed
+    bool done = closing.load(std::memory_order_acquire);
+    size_t available = ring.count();
+
+    if (available >= options.chunk_frames || (done && available > 0)) {
+      if (!write_chunk(std::min(available, options.chunk_frames))) {
+        write_ok.store(false);
+      }
+    } else if (done) {
+      break;
+    } else {
+      std::this_thread::sleep_for(writer_poll_interval);
+    }
+  }
+}
+
+bool Recorder::close() {
+  if (file == nullptr) {
+    return write_ok.load();
+  }
+
+  closing.store(true, std::memory_order_release);
+  writer.join();
+
+  bool ok = write_ok.load() && write_index();
+  ok = fclose(file) == 0 && ok;
+  file = nullptr;
+  if (!ok) {
+    fprintf(stderr, "Cannot write recording\n");
+  }
+  write_ok.store(ok);
+  return ok;
+}
+
+RecordingReader::RecordingReader(FILE *file, const RecordingHeader &header, unsigned threads)
+    : file(file), header(header), pool(header.codec == RecordingCodec::Quantized ? threads : 1) {
+  levels.resize(header.preview_levels + 1);
+  for (size_t k = 0; k < levels.size(); k++) {
+    levels[k].width = header.width >> k;
+    levels[k].height = header.height >> k;
+  }
+
+  if (header.codec == RecordingCodec::Quantized) {
+    for (auto &level : levels) {
+      level.codec =
+          std::make_unique<FieldCodec>(level.width, level.height, header.error_bound, pool);
+      level.scratch.resize(level.width * level.height);
+    }
+  }
+}
+
+RecordingReader::~RecordingReader() { fclose(file); }
+
+std::unique_ptr<RecordingReader> RecordingReader::open(const std::string &path, unsigned threads) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  RecordingHeader header{};
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, recording_magic, sizeof(recording_magic)) != 0 ||
+      (header.codec != RecordingCodec::Raw && header.codec != RecordingCodec::Quantized) ||
+      (header.codec == RecordingCodec::Quantized && !(header.error_bound > 0.0f)) ||
+      header.preview_levels >= 32 || (header.width >> header.preview_levels) == 0 ||
+      (header.height >> header.preview_levels) == 0) {
+    fprintf(stderr, "Invalid recording file: %s\n", path.c_str());
+    fclose(file);
+    return nullptr;
+  }
+
+  std::unique_ptr<RecordingReader> res{new RecordingReader(file, header, threads)};
+
+  fseek(file, 0, SEEK_END);
+  uint64_t file_size = ftell(file);
+  if (!res->read_index(file_size) && !res->scan_chunks(file_size)) {
+    fprintf(stderr, "Invalid recording chunk in %s\n", path.c_str());
+    return nullptr;
+  }
+
+  return res;
+}
+
+// Read the index written when the recording was closed. Return false if there isn't a valid index.
+bool RecordingReader::read_index(uint64_t file_size) {
+  TRACE_SCOPE("RecordingReader::read_index");
+
+  RecordingTrailer trailer;
+  RecordingChunkHeader chunk;
+  if (file_size < sizeof(header) + sizeof(chunk) + sizeof(trailer) ||
+      fseek(file, (long)(file_size - sizeof(trailer)), SEEK_SET) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer.magic, recording_index_magic, sizeof(recording_index_magic)) != 0 ||
+      trailer.index_offset + sizeof(chunk) > file_size ||
+      fseek(file, (long)trailer.index_offset, SEEK_SET) != 0 ||
+      fread(&chunk, sizeof(chunk), 1, file) != 1 || chunk.type != RecordingChunkType::Index ||
+      chunk.size != chunk.frame_count * sizeof(RecordingIndexEntry) ||
+      trailer.index_offset + sizeof(chunk) + chunk.size > file_size) {
+    return false;
+  }
+
+  entries.resize(chunk.frame_count);
+  if (fread(entries.data(), sizeof(RecordingIndexEntry), entries.size(), file) != entries.size()) {
+    entries.clear();
+    return false;
+  }
+  for (const auto &entry : entries) {
+    if (entry.offset + entry.header.size + entry.header.preview_size > trailer.index_offset) {
+      entries.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+// Index the frames by reading each chunk. A truncated last chunk (from an interrupted run) is
+// ignored. Return false if a chunk is invalid.
+bool RecordingReader::scan_chunks(uint64_t file_size) {
+  TRACE_SCOPE("RecordingReader::scan_chunks");
+
+  fseek(file, sizeof(header), SEEK_SET);
+  RecordingChunkHeader chunk;
+  while (fread(&chunk, sizeof(chunk), 1, file) == 1 && chunk.type == RecordingChunkType::Frames) {
+    uint64_t chunk_end = (uint64_t)ftell(file) + chunk.size;
+    for (size_t i = 0; i < chunk.frame_count; i++) {
+      RecordingIndexEntry entry;
+      if (fread(&entry.header, sizeof(entry.header), 1, file) != 1) {
+        return true;
+      }
+      entry.offset = ftell(file);
+      uint64_t size = entry.header.size + entry.header.preview_size;
+      if (entry.offset + size > file_size) {
+        return true;
+      }
+      fseek(file, (long)size, SEEK_CUR);
+      entries.push_back(entry);
+    }
+    if ((uint64_t)ftell(file) != chunk_end) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+size_t RecordingReader::keyframe_before(size_t frame) const {
+  while (frame > 0 && !is_keyframe(frame)) {
+    frame--;
+  }
+  return frame;
+}
+
+// Find where a level of frame is stored in the file. Return false if the preview data is invalid.
+bool RecordingReader::level_range(size_t frame, size_t level, uint64_t &offset, uint64_t &size) {
+  const auto &entry = entries[frame];
+  if (level == 0) {
+    offset = entry.offset;
+    size = entry.header.size;
+    return true;
+  }
+
+  // skip the levels before this one
+  level_sizes.resize(header.preview_levels);
+  const uint64_t table_size = level_sizes.size() * sizeof(uint64_t);
+  const uint64_t end = entry.offset + entry.header.size + entry.header.preview_size;
+  offset = entry.offset + entry.header.size;
+  if (entry.header.preview_size < table_size || fseek(file, (long)offset, SEEK_SET) != 0 ||
+      fread(level_sizes.data(), sizeof(uint64_t), level_sizes.size(), file) != level_sizes.size()) {
+    return false;
+  }
+  offset += table_size;
+  for (size_t k = 1; k <= level; k++) {
+    if (level_sizes[k - 1] > end - offset) {
+      return false;
+    }
+    size = level_sizes[k - 1];
+    if (k < level) {
+      offset += size;
+    }
+  }
+  return true;
+}
+
+bool RecordingReader::read_frame(size_t frame, float *out, size_t level) {
+  TRACE_SCOPE("RecordingReader::read_frame");
+
+  LevelDecoder &decoder = levels[level];
+  uint64_t offset, size;
+
+  if (!decoder.codec) {
+    return level_range(frame, level, offset, size) &&
+           size == decoder.width * decoder.height * sizeof(float) &&
+           fseek(file, (long)offset, SEEK_SET) == 0 && fread(out, 1, size, file) == size;
+  }
+
+  // decode forward from the closest frame the codec can start from
+  size_t start = keyframe_before(frame);
+  if (decoder.decoded_frame != SIZE_MAX && decoder.decoded_frame >= start &&
+      decoder.decoded_frame < frame) {
+    start = decoder.decoded_frame + 1;
+  }
+
+  for (size_t i = start; i <= frame; i++) {
+    bool ok = level_range(i, level, offset, size);
+    frame_data.resize(ok ? size : 0);
+    ok = ok && fseek(file, (long)offset, SEEK_SET) == 0 &&
+         fread(frame_data.data(), 1, size, file) == size &&
+         decoder.codec->decode(frame_data.data(), size, is_keyframe(i),
+                               i == frame ? out : decoder.scratch.data());
+    if (!ok) {
+      decoder.decoded_frame = SIZE_MAX;
+      return false;
+    }
+    decoder.decoded_frame = i;
+  }
+
+  return true;
+}
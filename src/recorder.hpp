@@ -0,0 +1,274 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "codec.hpp"
+#include "scene.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Recording files store a sequence of u fields. All values are little endian. The file starts with
+// a RecordingHeader, followed by chunks. Each frames chunk is a RecordingChunkHeader, then
+// frame_count frames, each a RecordingFrameHeader followed by size bytes of frame data and
+// preview_size bytes of preview data. The previews form a pyramid: preview level k is the frame
+// averaged down by 2^k, so viewers can show a frame while reading a fraction of the data. The
+// preview data is the size (in bytes, as a uint64) of each level, followed by the data of levels 1
+// to preview_levels, each coded the same way (and with the same keyframes) as the frame. When the
+// recording is closed, an index chunk (frame_count RecordingIndexEntries) and a RecordingTrailer
+// pointing to it are written, so readers can seek without scanning the file. A recording without
+// an index (from an interrupted run) can still be read by scanning its chunks.
+enum class RecordingCodec : uint32_t {
+  // width * height floats, row 0 first
+  Raw = 0,
+  // a FieldCodec frame
+  Quantized = 1,
+};
+
+enum class RecordingChunkType : uint32_t {
+  Frames = 0,
+  Index = 1,
+};
+
+// Set in RecordingFrameHeader::flags if the frame can be decoded without the frames before it
+static constexpr uint32_t recording_keyframe_flag = 1;
+
+struct RecordingHeader {
+  // "WAVREC03"
+  char magic[8];
+  // size of each recorded frame (in cells)
+  uint32_t width, height;
+  // size of the simulation grid the frames were recorded from (in cells)
+  uint32_t grid_width, grid_height;
+  // a frame is recorded every every steps, and each recorded cell is the average of a
+  // downsample x downsample block of simulation cells
+  uint32_t every, downsample;
+  // simulation delta t (in s) and recorded cell size (in m)
+  float delta_t, delta_x;
+  RecordingCodec codec;
+  // largest difference between a recorded and decoded value (for the quantized codec)
+  float error_bound;
+  // number of preview levels (0 if there are no previews). Each cell of level k is the average of a
+  // 2 x 2 block of cells of level k - 1 (with level 0 the frame), so level k is (width >> k) x
+  // (height >> k) cells.
+  uint32_t preview_levels;
+  // 1 if the simulation grid is periodic along x (periodic_x) or y (periodic_y), and so has no
+  // absorbing layer along that axis
+  uint32_t periodic_x, periodic_y;
+  // size of the absorbing layer of the simulation grid (in cells)
+  uint32_t damping_area_size;
+};
+
+struct RecordingChunkHeader {
+  uint32_t frame_count;
+  RecordingChunkType type;
+  // size of the chunk after this header (in bytes)
+  uint64_t size;
+};
+
+struct RecordingFrameHeader {
+  // simulation step the frame was recorded at
+  uint64_t step;
+  // simulation time (in s)
+  float time;
+  uint32_t flags;
+  // size of the frame data and the preview data (in bytes)
+  uint64_t size, preview_size;
+};
+
+struct RecordingIndexEntry {
+  RecordingFrameHeader header;
+  // offset of the frame data from the start of the file
+  uint64_t offset;
+};
+
+// The last bytes of an indexed recording
+struct RecordingTrailer {
+  // offset of the index chunk header from the start of the file
+  uint64_t index_offset;
+  // "WAVRIDX1"
+  char magic[8];
+};
+
+// A frame waiting to be written
+struct RecorderFrame {
+  uint64_t step{0};
+  float time{0.0};
+  std::vector<float> u{};
+};
+
+// A single producer, single consumer ring of preallocated frames. The producer fills the slot
+// returned by begin_push and publishes it with end_push. The consumer reads the slot returned by
+// front and releases it with pop. Neither side takes a lock or allocates.
+class FrameRing {
+  std::vector<RecorderFrame> frames;
+  // next slot to be pushed (only written by the producer)
+  std::atomic<size_t> head{0};
+  // next slot to be popped (only written by the consumer)
+  std::atomic<size_t> tail{0};
+
+public:
+  // Create a ring of capacity frames of frame_size floats
+  FrameRing(size_t capacity, size_t frame_size);
+
+  size_t capacity() const { return frames.size(); }
+  // Number of frames pushed but not popped
+  size_t count() const;
+
+  // Slot to fill with the next frame, or nullptr if the ring is full
+  RecorderFrame *begin_push();
+  void end_push();
+
+  // i-th oldest pushed frame, or nullptr if fewer than i + 1 frames are pushed
+  RecorderFrame *front(size_t i = 0);
+  void pop();
+};
+
+struct RecorderOptions {
+  // record a frame every every steps
+  size_t every{1};
+  // average downsample x downsample blocks of cells into each recorded cell
+  size_t downsample{1};
+  // number of preallocated frames the solver can get ahead of the writer by
+  size_t ring_frames{16};
+  // maximum frames written in one chunk
+  size_t chunk_frames{8};
+
+  // If positive, frames are compressed with FieldCodec so that no value is off by more than
+  // error_bound. Otherwise frames are stored as raw floats.
+  float error_bound{0.0};
+  // a compressed recording stores a keyframe every keyframe_every frames
+  size_t keyframe_every{32};
+  // number of threads the writer compresses frames on
+  unsigned codec_threads{2};
+  // also store a pyramid of previews, halving the frame until the next level would be smaller than
+  // min_preview_size cells along either axis (or no previews if 0)
+  size_t min_preview_size{32};
+};
+
+// Recorder writes every k-th u field of a simulation to a recording file without slowing down the
+// solver. push copies (and downsamples) the field into a preallocated ring slot, and a background
+// writer thread drains the ring to the file in chunks. push only waits if the writer falls a full
+// ring behind.
+class Recorder {
+  FILE *file;
+  RecordingHeader header;
+  RecorderOptions options;
+
+  FrameRing ring;
+  std::thread writer;
+
+  // state used only by the writer thread
+  ThreadPool codec_pool;
+  std::unique_ptr<FieldCodec> codec{};
+  std::vector<std::unique_ptr<FieldCodec>> preview_codecs{};
+  // the coded frames of the chunk being written, and the preview data of each of them
+  std::vector<std::vector<uint8_t>> encoded_frames{}, encoded_previews{};
+  // each preview level of the frame being coded, and the coded level
+  std::vector<std::vector<float>> previews{};
+  std::vector<uint8_t> encoded_level{};
+  std::vector<RecordingIndexEntry> index{};
+  uint64_t file_offset{0};
+  // set once the producer is done, so the writer drains the ring and exits
+  std::atomic<bool> closing{false};
+  // false once a write fails
+  std::atomic<bool> write_ok{true};
+
+  size_t frames_pushed{0};
+  // number of pushes that had to wait for the writer
+  size_t stalls{0};
+
+  Recorder(FILE *file, const RecordingHeader &header, const RecorderOptions &options);
+  void writer_loop();
+  bool write_chunk(size_t frame_count);
+  bool write_index();
+
+public:
+  ~Recorder();
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Start recording a simulation run with settings to path. Return nullptr (and print to stderr) if
+  // the file can't be opened.
+  static std::unique_ptr<Recorder> open(const std::string &path, const SimSettings &settings,
+                                        const RecorderOptions &options);
+
+  // If the frame at step should be recorded
+  bool wants(uint64_t step) const { return step % options.every == 0; }
+
+  // Record the u field of the simulation at step. u[stride * (y * grid_width + x)] is the value of
+  // cell (x, y), so fields interleaved with other channels can be passed directly.
+  void push(const float *u, size_t stride, uint64_t step, float time);
+
+  // Write all pushed frames and close the file. Return false if any write failed.
+  bool close();
+
+  size_t width() const { return header.width; }
+  size_t height() const { return header.height; }
+  size_t frames() const { return frames_pushed; }
+  size_t stall_count() const { return stalls; }
+  // Size of the written file (in bytes). Only valid after close.
+  uint64_t file_size() const { return file_offset; }
+};
+
+// Sequential and random access to the frames of a recording file
+class RecordingReader {
+  FILE *file;
+  RecordingHeader header;
+  std::vector<RecordingIndexEntry> entries{};
+
+  ThreadPool pool;
+  struct LevelDecoder {
+    size_t width{0}, height{0};
+    std::unique_ptr<FieldCodec> codec{};
+    // last frame decoded by codec (or SIZE_MAX if none)
+    size_t decoded_frame{SIZE_MAX};
+    std::vector<float> scratch{};
+  };
+  // the frame, followed by the preview levels
+  std::vector<LevelDecoder> levels{};
+  std::vector<uint8_t> frame_data{};
+  // size of each preview level of the frame being read
+  std::vector<uint64_t> level_sizes{};
+
+  RecordingReader(FILE *file, const RecordingHeader &header, unsigned threads);
+  bool read_index(uint64_t file_size);
+  bool level_range(size_t frame, size_t level, uint64_t &offset, uint64_t &size);
+  bool scan_chunks(uint64_t file_size);
+
+public:
+  ~RecordingReader();
+  RecordingReader(const RecordingReader &) = delete;
+  RecordingReader &operator=(const RecordingReader &) = delete;
+
+  // Open the recording at path and index its frames. Compressed frames are decoded on threads
+  // threads (or all hardware threads if threads is 0). Return nullptr (and print to stderr) if it
+  // can't be opened or is invalid.
+  static std::unique_ptr<RecordingReader> open(const std::string &path, unsigned threads = 0);
+
+  const RecordingHeader &info() const { return header; }
+  // Number of levels of detail stored for each frame: level 0 is the frame itself, and the others
+  // its previews (see RecordingHeader::preview_levels)
+  size_t level_count() const { return levels.size(); }
+  size_t width(size_t level) const { return levels[level].width; }
+  size_t height(size_t level) const { return levels[level].height; }
+  size_t frame_count() const { return entries.size(); }
+  uint64_t frame_step(size_t frame) const { return entries[frame].header.step; }
+  float frame_time(size_t frame) const { return entries[frame].header.time; }
+  bool is_keyframe(size_t frame) const {
+    return entries[frame].header.flags & recording_keyframe_flag;
+  }
+  // Last keyframe at or before frame
+  size_t keyframe_before(size_t frame) const;
+
+  // Read a level of frame into out (width(level) * height(level) floats). Compressed frames are
+  // decoded from the last keyframe, or from the last frame read if that is closer, so reading
+  // frames in order only decodes each frame once. Return false if it can't be read.
+  bool read_frame(size_t frame, float *out, size_t level = 0);
+};
+
+#endif
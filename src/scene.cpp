@@ -0,0 +1,207 @@
+#include "scene.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+// second derivative stencils of order 2, 4 and 6 (Fornberg's central difference weights)
+static const Stencil stencils[] = {
+    {2, 1, -2.0f, {1.0f, 0.0f, 0.0f}, 4.0f},
+    {4, 2, -5.0f / 2.0f, {4.0f / 3.0f, -1.0f / 12.0f, 0.0f}, 16.0f / 3.0f},
+    {6, 3, -49.0f / 18.0f, {3.0f / 2.0f, -3.0f / 20.0f, 1.0f / 90.0f}, 272.0f / 45.0f},
+};
+
+const Stencil &SimSettings::stencil() const {
+  for (const auto &s : stencils) {
+    if (s.order == stencil_order) {
+      return s;
+    }
+  }
+  return stencils[0];
+}
+
+bool SimSettings::valid_stencil_order(int order) {
+  for (const auto &s : stencils) {
+    if (s.order == order) {
+      return true;
+    }
+  }
+  return false;
+}
+
+float SimSettings::max_delta_t(float max_ior_inv) const {
+  double max_wave_speed = (double)wave_speed_vacuum * std::max(max_ior_inv, 0.0f);
+  double inv_spacing2 = 1.0 / ((double)delta_x * delta_x) + 1.0 / ((double)delta_y * delta_y);
+  return 2.0 / (max_wave_speed * std::sqrt(stencil().max_eigenvalue * inv_spacing2));
+}
+
+bool SimSettings::stable(float max_ior_inv) const { return delta_t <= max_delta_t(max_ior_inv); }
+
+float SimSettings::stable_delta_t(float max_ior_inv) const {
+  return stable_safety_factor * max_delta_t(max_ior_inv);
+}
+
+SimSettings SimSettings::resized(size_t width, size_t height) const {
+  SimSettings res = *this;
+  float scale = (float)texture_width / (float)width;
+  float scale_y = (float)texture_height / (float)height;
+
+  res.texture_width = width;
+  res.texture_height = height;
+  res.delta_x = delta_x * scale;
+  res.delta_y = delta_y * scale_y;
+  res.delta_t = delta_t * std::min(scale, scale_y);
+  res.damping_area_size = (int)std::lround(damping_area_size / scale);
+
+  return res;
+}
+
+bool SimSettings::set_property(const std::string &name, float value) {
+  if (name == "delta_t") {
+    delta_t = value;
+  } else if (name == "delta_x") {
+    delta_y = delta_x != 0.0f ? delta_y * (value / delta_x) : value;
+    delta_x = value;
+  } else if (name == "delta_y") {
+    delta_y = value;
+  } else if (name == "wave_speed") {
+    wave_speed_vacuum = value;
+  } else if (name == "damping_area_size") {
+    damping_area_size = (int)std::lround(value);
+  } else if (name == "width") {
+    texture_width = (size_t)std::lround(value);
+  } else if (name == "height") {
+    texture_height = (size_t)std::lround(value);
+  } else if (name == "stencil") {
+    if (!valid_stencil_order((int)std::lround(value))) {
+      return false;
+    }
+    stencil_order = (int)std::lround(value);
+  } else if (name == "symmetry_x" || name == "symmetry_y") {
+    long sign = std::lround(value);
+    if (sign < -1 || sign > 1) {
+      return false;
+    }
+    (name == "symmetry_x" ? symmetry_x : symmetry_y) = (Symmetry)sign;
+  } else if (name == "periodic_x" || name == "periodic_y") {
+    if (value != 0.0f && value != 1.0f) {
+      return false;
+    }
+    (name == "periodic_x" ? periodic_x : periodic_y) = value != 0.0f;
+  } else if (name == "bloch_x") {
+    bloch_x = value;
+  } else if (name == "bloch_y") {
+    bloch_y = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Format value with the fewest significant digits that read back to exactly the same float (at most
+// 9), so settings written to a file or snapshot are restored exactly
+static std::string format_float(float value) {
+  char buf[32];
+  for (int digits = 6; digits < 9; digits++) {
+    snprintf(buf, sizeof(buf), "%.*g", digits, value);
+    if (std::strtof(buf, nullptr) == value) {
+      return buf;
+    }
+  }
+  snprintf(buf, sizeof(buf), "%.9g", value);
+  return buf;
+}
+
+std::string SimSettings::serialize() const {
+  std::string res = "(Settings " + format_float(delta_t) + " " + format_float(delta_x) + " " +
+                    format_float(wave_speed_vacuum) + " " + std::to_string(damping_area_size) +
+                    " " + std::to_string(texture_width) + " " + std::to_string(texture_height);
+  // optional settings follow as name value pairs, and are only written if they aren't the default,
+  // so scenes that don't use them can still be read by older versions
+  if (delta_y != delta_x) {
+    res += " delta_y " + format_float(delta_y);
+  }
+  if (stencil_order != 2) {
+    res += " stencil " + std::to_string(stencil_order);
+  }
+  if (symmetry_x != Symmetry::None) {
+    res += " symmetry_x " + std::to_string((int)symmetry_x);
+  }
+  if (symmetry_y != Symmetry::None) {
+    res += " symmetry_y " + std::to_string((int)symmetry_y);
+  }
+  if (periodic_x) {
+    res += " periodic_x 1";
+  }
+  if (periodic_y) {
+    res += " periodic_y 1";
+  }
+  if (bloch_x != 0.0f) {
+    res += " bloch_x " + format_float(bloch_x);
+  }
+  if (bloch_y != 0.0f) {
+    res += " bloch_y " + format_float(bloch_y);
+  }
+  return res + ")";
+}
+
+bool SimSettings::deserialize(std::istream &in) {
+  auto type = SimObject::read_token(in);
+  if (type == "Settings") {
+    delta_t = std::stof(SimObject::read_token(in));
+    delta_x = std::stof(SimObject::read_token(in));
+    delta_y = delta_x;
+    wave_speed_vacuum = std::stof(SimObject::read_token(in));
+    damping_area_size = std::stoi(SimObject::read_token(in));
+    texture_width = std::stoul(SimObject::read_token(in));
+    texture_height = std::stoul(SimObject::read_token(in));
+
+    // optional name value pairs, until the closing paren
+    while (true) {
+      auto name = SimObject::read_token(in);
+      if (name.empty()) {
+        // read closing paren
+        return in.get() == ')';
+      }
+      auto value = SimObject::read_token(in);
+      if (value.empty() || !set_property(name, std::stof(value))) {
+        fprintf(stderr, "Invalid setting: %s %s\n", name.c_str(), value.c_str());
+        return false;
+      }
+    }
+  }
+
+  return false;
+}
+
+std::optional<Scene> Scene::deserialize(std::istream &in) {
+  Scene scene;
+  if (!scene.settings.deserialize(in)) {
+    fprintf(stderr, "Environment file is missing simulation settings\n");
+    return {};
+  }
+
+  auto env = Environment::deserialize(in);
+  if (!env) {
+    fprintf(stderr, "Environment file is invalid\n");
+    return {};
+  }
+  scene.environment = std::move(*env);
+
+  return scene;
+}
+
+std::optional<Scene> Scene::load(const std::string &path) {
+  TRACE_SCOPE("Scene::load");
+
+  std::fstream file{path, std::ios_base::in};
+  if (!file.is_open()) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return {};
+  }
+
+  return deserialize(file);
+}
@@ -0,0 +1,109 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "geometry.hpp"
+
+// Coefficients of a central difference approximation of the second derivative along one axis:
+//
+//   u_xx ~ (center * u + sum(weights[k - 1] * (u(x - k) + u(x + k)), k = 1..radius)) / delta_x^2
+//
+// The laplacian adds the same sum along y, so it reads the 4 * radius + 1 cells of a cross.
+struct Stencil {
+  int order;
+  int radius;
+  float center;
+  float weights[3];
+  // largest eigenvalue of -delta_x^2 u_xx (for the highest frequency the grid can hold). Time
+  // stepping is stable for c dt / dx <= 2 / sqrt(2 * max_eigenvalue).
+  float max_eigenvalue;
+};
+
+// The solver settings stored at the top of each environment file. These are shared by the gl app
+// and the headless engine.
+class SimSettings {
+public:
+  // Time step size for simulation (in s).
+  float delta_t{0.01};
+  // Physical width and height of each texel (in m/texel). Texels are square unless the scene sets
+  // delta_y, so long, thin layouts can use fewer cells across than along them.
+  float delta_x{0.04};
+  float delta_y{0.04};
+  // Wave speed in free space (in m/s)
+  float wave_speed_vacuum{2.0};
+  // Size (in texels) of absorbing boundary layer
+  int damping_area_size{128};
+  // Width and height (in texels) of the simulation grid
+  size_t texture_width{1024}, texture_height{1024};
+  // Order of accuracy of the laplacian: 2 (5 point), 4 (9 point), or 6 (13 point stencil). Higher
+  // orders have less numerical dispersion, so the same accuracy needs fewer cells per wavelength.
+  int stencil_order{2};
+  // Mirror symmetry of the scene about x = 0 (symmetry_x) and y = 0 (symmetry_y). Only the cells on
+  // the positive side of a symmetry plane are simulated, and the rest of the grid is their mirror
+  // image (see mirror_start), so a symmetric scene steps half or a quarter of the cells. Objects on
+  // the mirrored side are ignored.
+  Symmetry symmetry_x{Symmetry::None}, symmetry_y{Symmetry::None};
+  // Periodic boundaries along x (periodic_x) and y (periodic_y). The field wraps around from one
+  // edge of the grid to the other, and there is no absorbing layer along a periodic axis, so the
+  // grid is one unit cell of a structure that repeats forever. Objects aren't wrapped, so those of
+  // the unit cell should lie inside the grid.
+  bool periodic_x{false}, periodic_y{false};
+  // Bloch phase of the field across one period along x and y, in cycles like the phase of a source:
+  // U(x + width) = e^(2 pi i bloch_x) U(x) for the phasor U of a frequency domain solve. The time
+  // domain field is real, so the engines always run with a phase of 0.
+  float bloch_x{0.0}, bloch_y{0.0};
+
+  // Stencil of the laplacian for stencil_order
+  const Stencil &stencil() const;
+  // Return true if there is a stencil of order order
+  static bool valid_stencil_order(int order);
+
+  // The automatic delta t is this fraction of the largest stable delta t, so rounding can't push it
+  // over the limit
+  static constexpr float stable_safety_factor = 0.98f;
+
+  // Largest stable delta t (in s) when the fastest medium has inverse index of refraction
+  // max_ior_inv (see Environment::max_ior_inv). The step is leapfrog, which is stable for
+  //
+  //   c dt * sqrt(max_eigenvalue * (1 / dx^2 + 1 / dy^2)) <= 2
+  //
+  // where c is the fastest wave speed and max_eigenvalue is that of the stencil (so c dt / dx is at
+  // most 1 / sqrt(2) for the 5 point stencil on square cells). The absorbing layer only damps, so
+  // it doesn't change the bound.
+  float max_delta_t(float max_ior_inv = 1.0f) const;
+  // Return true if delta t is stable when the fastest medium has inverse index of refraction
+  // max_ior_inv
+  bool stable(float max_ior_inv = 1.0f) const;
+  // Return the delta t setting that runs as close to the stability limit as is safe
+  float stable_delta_t(float max_ior_inv = 1.0f) const;
+
+  // Return a copy of these settings for a grid of width x height texels. The physical size of the
+  // simulation area is kept, so delta x and the absorbing layer width are scaled with the grid
+  // width, delta y with the grid height, and delta t with the smaller of the two scales.
+  SimSettings resized(size_t width, size_t height) const;
+
+  // Set a setting by name: delta_t, delta_x, delta_y, wave_speed, damping_area_size, width, height,
+  // stencil, symmetry_x, symmetry_y, periodic_x, periodic_y, bloch_x or bloch_y. Setting delta_x
+  // scales delta_y with it, so the shape of the texels is kept. Return false if there is no such
+  // setting, or value isn't a valid stencil order, symmetry (-1 for odd, 0 for none, or 1 for
+  // even) or periodic flag (0 or 1).
+  bool set_property(const std::string &name, float value);
+
+  // convert the settings to their textual representation
+  std::string serialize() const;
+  // read the settings from their textual representation. Return false if they are invalid.
+  bool deserialize(std::istream &in);
+};
+
+// A scene is an environment and the settings it should be simulated with
+class Scene {
+public:
+  SimSettings settings{};
+  Environment environment{};
+
+  // Read a scene in the environment file format. Errors are printed to stderr.
+  static std::optional<Scene> deserialize(std::istream &in);
+  // Load a scene from an environment file. Errors are printed to stderr.
+  static std::optional<Scene> load(const std::string &path);
+};
+
+#endif
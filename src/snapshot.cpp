@@ -0,0 +1,220 @@
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+#define SNAPSHOT_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char snapshot_magic[8] = {'W', 'A', 'V', 'S', 'N', 'A', 'P', '2'};
+
+static_assert(sizeof(SnapshotHeader) == 40 + 24 * snapshot_plane_count,
+              "SnapshotHeader must not contain padding");
+
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+}
+
+std::optional<Scene> Snapshot::load_scene() const {
+  std::istringstream in{scene};
+  return Scene::deserialize(in);
+}
+
+bool Snapshot::write(const std::string &path) const {
+  TRACE_SCOPE("Snapshot::write");
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  std::vector<uint8_t> boundary(grid.size());
+  for (size_t i = 0; i < grid.size(); i++) {
+    boundary[i] = grid.boundary[i] != 0.0f;
+  }
+  const void *plane_data[snapshot_plane_count] = {grid.u.data(), grid.u_t.data(),
+                                                  grid.ior_inv.data(), boundary.data()};
+
+  SnapshotHeader header{};
+  memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+  header.width = grid.width;
+  header.height = grid.height;
+  header.time = time;
+  header.plane_count = snapshot_plane_count;
+  header.scene_offset = sizeof(SnapshotHeader);
+  header.scene_size = scene.size();
+
+  uint64_t offset = align_offset(header.scene_offset + header.scene_size);
+  for (size_t i = 0; i < snapshot_plane_count; i++) {
+    auto &plane = header.planes[i];
+    plane.element_size = i == (size_t)SnapshotPlane::Boundary ? 1 : sizeof(float);
+    plane.offset = offset;
+    plane.size = grid.size() * plane.element_size;
+    offset = align_offset(plane.offset + plane.size);
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(scene.data(), 1, scene.size(), file) == scene.size();
+  for (size_t i = 0; ok && i < snapshot_plane_count; i++) {
+    const auto &plane = header.planes[i];
+    ok = fseek(file, (long)plane.offset, SEEK_SET) == 0 &&
+         fwrite(plane_data[i], 1, plane.size, file) == plane.size;
+  }
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok) {
+    fprintf(stderr, "Cannot write snapshot: %s\n", path.c_str());
+  }
+  return ok;
+}
+
+std::optional<Snapshot> Snapshot::read(const std::string &path) {
+  auto mapped = MappedSnapshot::open(path);
+  if (!mapped) {
+    return {};
+  }
+  return mapped->load();
+}
+
+MappedSnapshot::~MappedSnapshot() {
+#ifdef SNAPSHOT_USE_MMAP
+  if (mapped) {
+    munmap(const_cast<uint8_t *>(data), size);
+  }
+#endif
+}
+
+std::unique_ptr<MappedSnapshot> MappedSnapshot::open(const std::string &path) {
+  TRACE_SCOPE("MappedSnapshot::open");
+
+  std::unique_ptr<MappedSnapshot> res{new MappedSnapshot()};
+
+#ifdef SNAPSHOT_USE_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+    res->size = file_stat.st_size;
+    void *map = mmap(nullptr, res->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      res->data = static_cast<const uint8_t *>(map);
+      res->mapped = true;
+    }
+  }
+  close(fd);
+#else
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (len > 0) {
+    res->buffer.reset(new uint8_t[len]);
+    if (fread(res->buffer.get(), 1, len, file) == (size_t)len) {
+      res->data = res->buffer.get();
+      res->size = len;
+    }
+  }
+  fclose(file);
+#endif
+
+  if (res->data == nullptr || !res->validate()) {
+    fprintf(stderr, "Invalid snapshot file: %s\n", path.c_str());
+    return nullptr;
+  }
+  return res;
+}
+
+// check that the header is valid and the scene and planes are inside the file
+bool MappedSnapshot::validate() const {
+  if (size < sizeof(SnapshotHeader)) {
+    return false;
+  }
+
+  const SnapshotHeader &h = header();
+  if (memcmp(h.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+      h.plane_count != snapshot_plane_count || h.scene_offset + h.scene_size > size) {
+    return false;
+  }
+
+  uint64_t cells = (uint64_t)h.width * h.height;
+  for (size_t i = 0; i < snapshot_plane_count; i++) {
+    const auto &plane = h.planes[i];
+    uint32_t element_size = i == (size_t)SnapshotPlane::Boundary ? 1 : sizeof(float);
+    if (plane.element_size != element_size || plane.size != cells * element_size ||
+        plane.offset % element_size != 0 || plane.offset + plane.size > size) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::string MappedSnapshot::scene() const {
+  const SnapshotHeader &h = header();
+  return std::string(reinterpret_cast<const char *>(data + h.scene_offset), h.scene_size);
+}
+
+const float *MappedSnapshot::plane(SnapshotPlane plane) const {
+  if (plane == SnapshotPlane::Boundary) {
+    return nullptr;
+  }
+  return reinterpret_cast<const float *>(data + header().planes[(size_t)plane].offset);
+}
+
+const uint8_t *MappedSnapshot::boundary() const {
+  return data + header().planes[(size_t)SnapshotPlane::Boundary].offset;
+}
+
+void MappedSnapshot::read_region(SnapshotPlane plane, size_t x, size_t y, size_t w, size_t h,
+                                 float *out) const {
+  const size_t grid_width = width();
+
+  for (size_t row = 0; row < h; row++) {
+    size_t start = (y + row) * grid_width + x;
+    if (plane == SnapshotPlane::Boundary) {
+      const uint8_t *src = boundary() + start;
+      for (size_t i = 0; i < w; i++) {
+        out[row * w + i] = src[i];
+      }
+    } else {
+      memcpy(out + row * w, this->plane(plane) + start, w * sizeof(float));
+    }
+  }
+}
+
+Snapshot MappedSnapshot::load() const {
+  TRACE_SCOPE("MappedSnapshot::load");
+
+  Snapshot res;
+  res.scene = scene();
+  res.time = time();
+
+  auto scene = res.load_scene();
+  float delta_x = scene ? scene->settings.delta_x : 1.0f;
+  float delta_y = scene ? scene->settings.delta_y : 1.0f;
+  res.grid = SimGrid(width(), height(), delta_x, delta_y);
+
+  read_region(SnapshotPlane::U, 0, 0, width(), height(), res.grid.u.data());
+  read_region(SnapshotPlane::UT, 0, 0, width(), height(), res.grid.u_t.data());
+  read_region(SnapshotPlane::IorInv, 0, 0, width(), height(), res.grid.ior_inv.data());
+  read_region(SnapshotPlane::Boundary, 0, 0, width(), height(), res.grid.boundary.data());
+
+  return res;
+}
@@ -0,0 +1,114 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "grid.hpp"
+#include "scene.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+// The planes stored in a snapshot
+enum class SnapshotPlane {
+  // position (float)
+  U = 0,
+  // velocity (float)
+  UT = 1,
+  // inverse index of refraction (float)
+  IorInv = 2,
+  // boundary (uint8, 0 or 1)
+  Boundary = 3,
+};
+
+// Snapshot files are laid out so they can be memory mapped and used in place. All values are
+// little endian. The file starts with a SnapshotHeader, followed by the scene text (as stored in a
+// .sim file). Each plane then starts on its own page (snapshot_alignment bytes), and stores
+// width * height values, row 0 first.
+static constexpr size_t snapshot_alignment = 4096;
+static constexpr size_t snapshot_plane_count = 4;
+
+struct SnapshotPlaneHeader {
+  // offset of the plane from the start of the file (in bytes)
+  uint64_t offset;
+  // size of the plane (in bytes)
+  uint64_t size;
+  uint32_t element_size;
+  uint32_t reserved;
+};
+
+struct SnapshotHeader {
+  // "WAVSNAP2"
+  char magic[8];
+  uint32_t width, height;
+  // Current time (in s)
+  float time;
+  uint32_t plane_count;
+  uint64_t scene_offset, scene_size;
+  SnapshotPlaneHeader planes[snapshot_plane_count];
+};
+
+// A Snapshot is the full state of a simulation: the scene (settings and environment), the current
+// time, and the u, u_t, medium, and boundary planes. It can be saved to a binary file and restored
+// exactly, so runs can be resumed later.
+class Snapshot {
+public:
+  // Simulation settings and environment, as serialized in a .sim file
+  std::string scene{};
+  // Current time (in s)
+  float time{0.0};
+  // Simulation state
+  SimGrid grid{};
+
+  // Parse the scene stored in the snapshot
+  std::optional<Scene> load_scene() const;
+
+  // Write the snapshot to path. Return false if the file can't be written.
+  bool write(const std::string &path) const;
+  // Read a snapshot from path. Errors are printed to stderr.
+  static std::optional<Snapshot> read(const std::string &path);
+};
+
+// A snapshot file mapped into memory. Opening only reads the header, and the planes are paged in as
+// they are accessed, so large snapshots open instantly and sub-regions can be read without loading
+// the whole file. On platforms without mmap, the file is read into memory instead.
+class MappedSnapshot {
+  const uint8_t *data{nullptr};
+  size_t size{0};
+  // if data is mmap-ed (rather than pointing into buffer)
+  bool mapped{false};
+  std::unique_ptr<uint8_t[]> buffer{};
+
+  const SnapshotHeader &header() const { return *reinterpret_cast<const SnapshotHeader *>(data); }
+
+  MappedSnapshot() = default;
+  bool validate() const;
+
+public:
+  ~MappedSnapshot();
+  MappedSnapshot(const MappedSnapshot &) = delete;
+  MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+  // Map the snapshot at path. Return nullptr (and print to stderr) if it can't be opened or is
+  // invalid.
+  static std::unique_ptr<MappedSnapshot> open(const std::string &path);
+
+  size_t width() const { return header().width; }
+  size_t height() const { return header().height; }
+  float time() const { return header().time; }
+  std::string scene() const;
+
+  // Pointer to the start of a float plane (u, u_t, or inv_ior)
+  const float *plane(SnapshotPlane plane) const;
+  // Pointer to the start of the boundary plane
+  const uint8_t *boundary() const;
+
+  // Copy the w x h region with bottom left corner (x, y) of a plane into out (row by row). The
+  // region must be inside the grid.
+  void read_region(SnapshotPlane plane, size_t x, size_t y, size_t w, size_t h, float *out) const;
+
+  // Copy the whole snapshot into memory
+  Snapshot load() const;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include "superposition.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static constexpr char superposition_magic[8] = {'W', 'A', 'V', 'S', 'U', 'P', 'R', '1'};
+
+// FNV-1a, continued from hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Rasterize the media and boundaries of a scene and find its sources. Return the hash of
+// everything the responses depend on other than the sources.
+static std::optional<uint64_t> scene_layout(const SimSettings &settings,
+                                            const Environment &environment, float frequency,
+                                            SourceCells &cells) {
+  SimGrid grid{settings.texture_width, settings.texture_height, settings.delta_x,
+               settings.delta_y};
+  grid.pass_mask = glm::bvec4(false, false, true, true);
+  environment.rasterize(grid, 0.0);
+  if (!find_source_cells(environment, grid, frequency, cells)) {
+    return std::nullopt;
+  }
+
+  std::string settings_text = settings.serialize();
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ull, settings_text.data(), settings_text.size());
+  hash = hash_bytes(hash, grid.ior_inv.data(), grid.ior_inv.size() * sizeof(float));
+  hash = hash_bytes(hash, grid.boundary.data(), grid.boundary.size() * sizeof(float));
+  return hash;
+}
+
+std::unique_ptr<SuperpositionCache> SuperpositionCache::solve(const SimSettings &settings,
+                                                              Environment environment,
+                                                              unsigned threads,
+                                                              const HelmholtzOptions &options) {
+  TRACE_SCOPE("SuperpositionCache::solve");
+
+  float frequency = HelmholtzSolver::source_frequency(environment);
+  if (frequency <= 0.0f) {
+    return nullptr;
+  }
+  SourceCells cells;
+  auto layout_hash = scene_layout(settings, environment, frequency, cells);
+  if (!layout_hash) {
+    return nullptr;
+  }
+
+  auto res = std::make_unique<SuperpositionCache>();
+  HelmholtzSolver solver{settings, std::move(environment), threads};
+  if (!solver.solve_responses(options, res->responses)) {
+    return nullptr;
+  }
+  res->width = settings.texture_width;
+  res->height = settings.texture_height;
+  res->frequency = frequency;
+  res->layout_hash = *layout_hash;
+  res->cell_source = std::move(cells.cell_source);
+  res->scene_phasors = std::move(cells.phasors);
+  return res;
+}
+
+std::unique_ptr<SuperpositionCache> SuperpositionCache::read(const std::string &path) {
+  TRACE_SCOPE("SuperpositionCache::read");
+
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  auto res = std::make_unique<SuperpositionCache>();
+  SuperpositionFileHeader header{};
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, superposition_magic, sizeof(superposition_magic)) == 0;
+  if (ok) {
+    const size_t n = (size_t)header.width * header.height;
+    res->width = header.width;
+    res->height = header.height;
+    res->frequency = header.frequency;
+    res->layout_hash = header.layout_hash;
+    res->cell_source.resize(n);
+    ok = fread(res->cell_source.data(), sizeof(int32_t), n, file) == n;
+    res->responses.resize(header.source_count);
+    for (size_t k = 0; ok && k < header.source_count; k++) {
+      res->responses[k].resize(n);
+      ok = fread(res->responses[k].data(), sizeof(std::complex<float>), n, file) == n;
+    }
+    for (size_t i = 0; ok && i < n; i++) {
+      ok = res->cell_source[i] < (int32_t)header.source_count;
+    }
+  }
+  fclose(file);
+
+  if (!ok) {
+    fprintf(stderr, "Invalid superposition file: %s\n", path.c_str());
+    return nullptr;
+  }
+  return res;
+}
+
+bool SuperpositionCache::write(const std::string &path) const {
+  TRACE_SCOPE("SuperpositionCache::write");
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  SuperpositionFileHeader header{};
+  memcpy(header.magic, superposition_magic, sizeof(superposition_magic));
+  header.width = width;
+  header.height = height;
+  header.frequency = frequency;
+  header.source_count = responses.size();
+  header.layout_hash = layout_hash;
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(cell_source.data(), sizeof(int32_t), cell_source.size(), file) ==
+                cell_source.size();
+  for (const auto &response : responses) {
+    ok = ok && fwrite(response.data(), sizeof(std::complex<float>), response.size(), file) ==
+                   response.size();
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::optional<std::vector<std::complex<float>>>
+SuperpositionCache::source_phasors(const SimSettings &settings,
+                                   const Environment &environment) const {
+  if (settings.texture_width != width || settings.texture_height != height) {
+    fprintf(stderr, "The responses are for a %zux%zu grid, not %zux%zu\n", width, height,
+            settings.texture_width, settings.texture_height);
+    return std::nullopt;
+  }
+  float scene_frequency = HelmholtzSolver::source_frequency(environment);
+  if (scene_frequency <= 0.0f) {
+    return std::nullopt;
+  }
+  if (std::abs(scene_frequency - frequency) > 1e-6f * frequency) {
+    fprintf(stderr, "The responses are for sources at %g Hz, not %g Hz\n", frequency,
+            scene_frequency);
+    return std::nullopt;
+  }
+
+  SourceCells cells;
+  auto scene_hash = scene_layout(settings, environment, frequency, cells);
+  if (!scene_hash) {
+    return std::nullopt;
+  }
+  if (*scene_hash != layout_hash) {
+    fprintf(stderr, "The settings, media, or boundaries differ from the responses\n");
+    return std::nullopt;
+  }
+  if (cells.phasors.size() != responses.size() || cells.cell_source != cell_source) {
+    fprintf(stderr, "The sources are in different places than for the responses\n");
+    return std::nullopt;
+  }
+  return cells.phasors;
+}
+
+void SuperpositionCache::combine(const std::vector<std::complex<float>> &phasors,
+                                 std::vector<float> &re, std::vector<float> &im,
+                                 ThreadPool &pool) const {
+  TRACE_SCOPE("SuperpositionCache::combine");
+
+  const size_t n = width * height;
+  re.assign(n, 0.0f);
+  im.assign(n, 0.0f);
+  // each range is summed one source at a time, so the responses are streamed through in order
+  pool.parallel_for(n, [&](size_t i0, size_t i1) {
+    for (size_t k = 0; k < responses.size(); k++) {
+      // the planes hold half of the complex amplitude
+      const std::complex<float> weight = 0.5f * phasors[k];
+      if (weight == 0.0f) {
+        continue;
+      }
+      const std::complex<float> *response = responses[k].data();
+      for (size_t i = i0; i < i1; i++) {
+        re[i] += weight.real() * response[i].real() - weight.imag() * response[i].imag();
+        im[i] += weight.real() * response[i].imag() + weight.imag() * response[i].real();
+      }
+    }
+  });
+}
@@ -0,0 +1,75 @@
+#ifndef SUPERPOSITION_H
+#define SUPERPOSITION_H
+
+#include "helmholtz.hpp"
+#include "thread_pool.hpp"
+
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Superposition files start with a SuperpositionFileHeader, followed by the source of each cell
+// (width * height int32, -1 for cells no source is drawn to), and then the response to each source
+// (width * height pairs of float re and im). All values are little endian.
+struct SuperpositionFileHeader {
+  // "WAVSUPR1"
+  char magic[8];
+  uint32_t width, height;
+  // frequency of the sources (in Hz)
+  float frequency;
+  uint32_t source_count;
+  // hash of the settings, media, and boundaries the responses were solved for
+  uint64_t layout_hash;
+};
+
+// SuperpositionCache holds the steady state response of a scene to each of its sine sources on its
+// own (see HelmholtzSolver::solve_responses). The wave equation is linear, so the steady state for
+// any amplitudes and phases of the sources is a weighted sum of the responses, which takes a
+// fraction of the time of a solve. Variants of a scene that only change the amplitudes and phases
+// of its sources (such as the steering of a phased array) can be combined from the same cache,
+// which can be written to a file and read back later.
+class SuperpositionCache {
+  size_t width{0}, height{0};
+  float frequency{0.0};
+  uint64_t layout_hash{0};
+  // index of the source each cell is fixed by, or -1
+  std::vector<int32_t> cell_source{};
+  std::vector<std::vector<std::complex<float>>> responses{};
+  // phasor of each source of the scene the responses were solved for (not stored in the file)
+  std::vector<std::complex<float>> scene_phasors{};
+
+public:
+  // Solve for the response to each source of a scene, on threads threads (or all hardware threads
+  // if threads is 0). Return nullptr (and print to stderr) if the sources can't be solved for.
+  static std::unique_ptr<SuperpositionCache> solve(const SimSettings &settings,
+                                                   Environment environment, unsigned threads = 0,
+                                                   const HelmholtzOptions &options = {});
+  // Read a cache written by write. Errors are printed to stderr.
+  static std::unique_ptr<SuperpositionCache> read(const std::string &path);
+  // Write the cache to path. Return false if the file can't be written.
+  bool write(const std::string &path) const;
+
+  // The phasor of each source of a scene, if the scene is the one the responses were solved for
+  // with at most the amplitudes and phases of its sources changed. Otherwise, print the difference
+  // to stderr and return nothing.
+  std::optional<std::vector<std::complex<float>>>
+  source_phasors(const SimSettings &settings, const Environment &environment) const;
+
+  // Sum the responses weighted by the phasor of each source, into real and imaginary planes in the
+  // same form as Engine::phasor_re_plane and phasor_im_plane (half of the complex amplitude)
+  void combine(const std::vector<std::complex<float>> &phasors, std::vector<float> &re,
+               std::vector<float> &im, ThreadPool &pool) const;
+
+  // The phasor of each source of the scene passed to solve
+  const std::vector<std::complex<float>> &solved_phasors() const { return scene_phasors; }
+
+  size_t grid_width() const { return width; }
+  size_t grid_height() const { return height; }
+  float source_frequency() const { return frequency; }
+  size_t source_count() const { return responses.size(); }
+};
+
+#endif
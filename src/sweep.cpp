@@ -0,0 +1,100 @@
+#include "sweep_spec.hpp"
+#include "trace.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Run every variant of a scene described by a sweep file, in parallel, and collect the results.
+
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s <spec.sweep> [options]\n"
+          "  --threads n       number of runs to do at once (default: all hardware threads)\n"
+          "  --batch n         step up to n runs of the same size together (default 8)\n"
+          "  --output file     write the probe samples and summary of every run to file\n"
+          "  --trace file      write a chrome trace of the sweep to file\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  const char *spec_path = nullptr;
+  unsigned threads = 0;
+  size_t batch = 8;
+  const char *output_path = nullptr;
+  const char *trace_path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--threads") && has_value) {
+      threads = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--batch") && has_value) {
+      batch = std::max(1ul, std::stoul(argv[++i]));
+    } else if (!strcmp(argv[i], "--output") && has_value) {
+      output_path = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && has_value) {
+      trace_path = argv[++i];
+    } else if (argv[i][0] != '-' && spec_path == nullptr) {
+      spec_path = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+  if (spec_path == nullptr) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  Tracer::set_thread_name("main");
+  if (trace_path != nullptr) {
+    Tracer::start();
+  }
+
+  auto spec = SweepSpec::load(spec_path);
+  if (!spec) {
+    return -1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto results = run_sweep(*spec, threads, batch);
+  auto end = std::chrono::steady_clock::now();
+  if (!results) {
+    return -1;
+  }
+
+  // summary of each run, as csv
+  printf("run");
+  for (const auto &variable : spec->variables) {
+    printf(",%s", variable.property.c_str());
+  }
+  printf(",steps,state,energy,seconds\n");
+  double run_seconds = 0.0;
+  for (size_t run = 0; run < results->size(); run++) {
+    const SweepResult &result = (*results)[run];
+    printf("%zu", run);
+    for (float value : spec->run_values(run)) {
+      printf(",%g", value);
+    }
+    printf(",%llu,%s,%g,%.3f\n", (unsigned long long)result.steps, run_state_name(result.state),
+           result.energy, result.seconds);
+    run_seconds += result.seconds;
+  }
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  fprintf(stderr, "Ran %zu runs in %.3f s (%.3f s of runs, %.2fx parallel)\n", results->size(),
+          seconds, run_seconds, seconds > 0.0 ? run_seconds / seconds : 0.0);
+
+  if (output_path != nullptr && !write_sweep_results(output_path, *spec, *results)) {
+    return -1;
+  }
+
+  if (trace_path != nullptr) {
+    Tracer::stop();
+    if (!Tracer::write_chrome_trace(trace_path)) {
+      return -1;
+    }
+  }
+  return 0;
+}
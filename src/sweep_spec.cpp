@@ -0,0 +1,400 @@
+#include "sweep_spec.hpp"
+#include "batch_engine.hpp"
+#include "engine.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <thread>
+
+static constexpr char sweep_magic[8] = {'W', 'A', 'V', 'S', 'W', 'E', 'P', '1'};
+static constexpr size_t sweep_name_size = 32;
+
+// Skip whitespace, and return the next character without reading it (or EOF)
+static int peek_entry(std::istream &in) {
+  int c = in.peek();
+  while (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+    in.get();
+    c = in.peek();
+  }
+  return c;
+}
+
+// Read numbers until the closing paren of a list
+template <class T, class Parse>
+static bool read_list(std::istream &in, std::vector<T> &out, const Parse &parse) {
+  while (peek_entry(in) != ')' && peek_entry(in) != EOF) {
+    out.push_back(parse(SimObject::read_token(in)));
+  }
+  return in.get() == ')';
+}
+
+static bool read_variable(std::istream &in, SweepVariable &variable) {
+  variable.property = SimObject::read_token(in);
+  while (peek_entry(in) != ')' && peek_entry(in) != EOF) {
+    auto entry = SimObject::read_token(in);
+    bool ok = true;
+    if (entry == "Increment") {
+      variable.increment = true;
+    } else if (entry == "Objects") {
+      ok = read_list(in, variable.objects, [](const std::string &s) { return std::stoul(s); });
+    } else if (entry == "Values") {
+      ok = read_list(in, variable.values, [](const std::string &s) { return std::stof(s); });
+    } else if (entry == "Range") {
+      float start = std::stof(SimObject::read_token(in));
+      float end = std::stof(SimObject::read_token(in));
+      size_t count = std::stoul(SimObject::read_token(in));
+      for (size_t i = 0; i < count; i++) {
+        float t = count > 1 ? (float)i / (float)(count - 1) : 0.0f;
+        variable.values.push_back(start + t * (end - start));
+      }
+      ok = in.get() == ')';
+    } else {
+      fprintf(stderr, "Unknown sweep variable entry: %s\n", entry.c_str());
+      return false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return !variable.property.empty() && !variable.values.empty();
+}
+
+std::optional<SweepSpec> SweepSpec::load(const std::string &path) {
+  TRACE_SCOPE("SweepSpec::load");
+
+  std::ifstream file{path};
+  if (!file.is_open()) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return {};
+  }
+
+  SweepSpec spec;
+  while (peek_entry(file) != EOF) {
+    auto entry = SimObject::read_token(file);
+    bool ok = true;
+    if (entry == "Scene") {
+      spec.scene_path = SimObject::read_token(file);
+    } else if (entry == "Steps") {
+      spec.steps = std::stoul(SimObject::read_token(file));
+    } else if (entry == "Duration") {
+      spec.duration = std::stof(SimObject::read_token(file));
+    } else if (entry == "UntilSteady") {
+      spec.until_steady = true;
+    } else if (entry == "Vary") {
+      spec.variables.emplace_back();
+      ok = read_variable(file, spec.variables.back());
+    } else {
+      fprintf(stderr, "Unknown sweep entry: %s\n", entry.c_str());
+      return {};
+    }
+    if (!ok || file.get() != ')') {
+      fprintf(stderr, "Invalid sweep file: %s\n", path.c_str());
+      return {};
+    }
+  }
+  if (spec.scene_path.empty()) {
+    fprintf(stderr, "The sweep file has no scene\n");
+    return {};
+  }
+
+  // the scene is relative to the sweep file
+  size_t slash = path.find_last_of('/');
+  if (spec.scene_path[0] != '/' && slash != std::string::npos) {
+    spec.scene_path = path.substr(0, slash + 1) + spec.scene_path;
+  }
+  std::ifstream scene_file{spec.scene_path};
+  if (!scene_file.is_open()) {
+    fprintf(stderr, "Cannot open file: %s\n", spec.scene_path.c_str());
+    return {};
+  }
+  std::stringstream scene_text;
+  scene_text << scene_file.rdbuf();
+  spec.scene_text = scene_text.str();
+
+  // which properties exist doesn't depend on their values, so building the first run checks them
+  if (!spec.scene(0)) {
+    return {};
+  }
+  return spec;
+}
+
+size_t SweepSpec::run_count() const {
+  size_t count = 1;
+  for (const auto &variable : variables) {
+    count *= variable.values.size();
+  }
+  return count;
+}
+
+std::vector<float> SweepSpec::run_values(size_t run) const {
+  std::vector<float> values(variables.size());
+  for (size_t k = variables.size(); k-- > 0;) {
+    values[k] = variables[k].values[run % variables[k].values.size()];
+    run /= variables[k].values.size();
+  }
+  return values;
+}
+
+std::optional<Scene> SweepSpec::scene(size_t run) const {
+  std::istringstream in{scene_text};
+  auto scene = Scene::deserialize(in);
+  if (!scene) {
+    return {};
+  }
+
+  auto values = run_values(run);
+  for (size_t k = 0; k < variables.size(); k++) {
+    const SweepVariable &variable = variables[k];
+    if (variable.objects.empty() && !scene->settings.set_property(variable.property, values[k])) {
+      fprintf(stderr, "There is no setting %s\n", variable.property.c_str());
+      return {};
+    }
+    for (size_t j = 0; j < variable.objects.size(); j++) {
+      size_t index = variable.objects[j];
+      if (index >= scene->environment.objects.size()) {
+        fprintf(stderr, "The scene has no object %zu\n", index);
+        return {};
+      }
+      float value = variable.increment ? (float)j * values[k] : values[k];
+      if (!scene->environment.objects[index]->set_property(variable.property, value)) {
+        fprintf(stderr, "Object %zu has no property %s\n", index, variable.property.c_str());
+        return {};
+      }
+    }
+  }
+  return scene;
+}
+
+size_t SweepSpec::run_steps(const SimSettings &settings) const {
+  if (duration > 0.0f) {
+    return std::max<size_t>(std::lround(duration / settings.delta_t), 1);
+  }
+  return steps;
+}
+
+static SweepResult run_scene(Scene scene, size_t steps, bool until_steady) {
+  TRACE_SCOPE("run_scene");
+
+  auto start = std::chrono::steady_clock::now();
+  SweepResult res;
+
+  std::optional<SteadyStateDetector> detector;
+  if (until_steady) {
+    detector.emplace(scene.environment, scene.settings.delta_t);
+  }
+  std::vector<glm::vec2> points;
+  for (const auto &obj : scene.environment.objects) {
+    obj->probe_points(points);
+  }
+
+  Engine engine{scene.settings, std::move(scene.environment), 1};
+  if (!points.empty()) {
+    engine.capture_probes(steps);
+  }
+
+  if (detector) {
+    while (res.steps < steps && res.state == RunState::Running) {
+      engine.step();
+      res.steps++;
+      if (detector->wants(res.steps)) {
+        res.state = detector->add(engine.get_time(), engine.energy());
+      }
+    }
+  } else {
+    engine.run(steps);
+    res.steps = steps;
+  }
+
+  res.energy = engine.energy();
+  res.probes = engine.probes();
+  res.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return res;
+}
+
+// Run scenes (which have the same grid size) for steps steps together on one BatchEngine, and
+// write the result of each to results[runs[k]]. The wall time is split evenly between the runs.
+static void run_batch(std::vector<Scene> scenes, size_t steps, const std::vector<size_t> &runs,
+                      std::vector<SweepResult> &results) {
+  TRACE_SCOPE("run_batch");
+
+  auto start = std::chrono::steady_clock::now();
+  bool has_probes = false;
+  for (const auto &scene : scenes) {
+    std::vector<glm::vec2> points;
+    for (const auto &obj : scene.environment.objects) {
+      obj->probe_points(points);
+    }
+    has_probes = has_probes || !points.empty();
+  }
+
+  auto engine = BatchEngine::create(std::move(scenes), 1);
+  if (has_probes) {
+    engine->capture_probes(steps);
+  }
+  engine->run(steps);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (size_t k = 0; k < runs.size(); k++) {
+    SweepResult &res = results[runs[k]];
+    res.steps = steps;
+    res.energy = engine->energy(k);
+    res.probes = engine->probes(k);
+    res.seconds = seconds / (double)runs.size();
+  }
+}
+
+std::optional<std::vector<SweepResult>> run_sweep(const SweepSpec &spec, unsigned threads,
+                                                  size_t batch) {
+  TRACE_SCOPE("run_sweep");
+
+  const size_t runs = spec.run_count();
+  std::vector<std::optional<Scene>> scenes(runs);
+  std::vector<size_t> steps(runs);
+  std::vector<double> costs(runs);
+  for (size_t run = 0; run < runs; run++) {
+    scenes[run] = spec.scene(run);
+    if (!scenes[run]) {
+      return {};
+    }
+    const SimSettings &settings = scenes[run]->settings;
+    steps[run] = spec.run_steps(settings);
+    costs[run] = (double)settings.texture_width * settings.texture_height * steps[run];
+  }
+
+  // longest runs first, so a long run started last doesn't keep one worker busy after the others
+  // are done
+  std::vector<size_t> order(runs);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  // a batch runs on one worker, so batches are kept small enough to give every worker a job
+  batch = std::min(batch, std::max<size_t>(1, (runs + threads - 1) / threads));
+
+  // runs with the same grid size and length are stepped together in batches of up to batch runs.
+  // Runs that stop once steady end at different steps, and higher order stencils, periodic
+  // boundaries and symmetry planes aren't batched, so those always run on their own.
+  std::vector<std::vector<size_t>> jobs;
+  for (size_t run : order) {
+    const SimSettings &settings = scenes[run]->settings;
+    auto fits = [&](const std::vector<size_t> &job) {
+      const SimSettings &first = scenes[job[0]]->settings;
+      return job.size() < batch && steps[job[0]] == steps[run] &&
+             first.texture_width == settings.texture_width &&
+             first.texture_height == settings.texture_height &&
+             first.stencil_order == settings.stencil_order;
+    };
+    bool alone = spec.until_steady || settings.stencil_order != 2 || settings.periodic_x ||
+                 settings.periodic_y || settings.symmetry_x != Symmetry::None ||
+                 settings.symmetry_y != Symmetry::None;
+    auto job = alone ? jobs.end() : std::find_if(jobs.begin(), jobs.end(), fits);
+    if (job != jobs.end()) {
+      job->push_back(run);
+    } else {
+      jobs.push_back({run});
+    }
+  }
+
+  std::vector<SweepResult> results(runs);
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i = next++; i < jobs.size(); i = next++) {
+      const std::vector<size_t> &job = jobs[i];
+      if (job.size() == 1) {
+        results[job[0]] = run_scene(std::move(*scenes[job[0]]), steps[job[0]], spec.until_steady);
+        continue;
+      }
+      std::vector<Scene> batch_scenes;
+      for (size_t run : job) {
+        batch_scenes.push_back(std::move(*scenes[run]));
+      }
+      run_batch(std::move(batch_scenes), steps[job[0]], job, results);
+    }
+  };
+
+  threads = (unsigned)std::min<size_t>(threads, jobs.size());
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+  return results;
+}
+
+bool write_sweep_results(const std::string &path, const SweepSpec &spec,
+                         const std::vector<SweepResult> &results) {
+  TRACE_SCOPE("write_sweep_results");
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  SweepFileHeader header{};
+  memcpy(header.magic, sweep_magic, sizeof(sweep_magic));
+  header.run_count = results.size();
+  header.variable_count = spec.variables.size();
+  header.point_count = results.empty() ? 0 : results[0].probes.point_count();
+
+  std::vector<char> names(spec.variables.size() * sweep_name_size, 0);
+  for (size_t k = 0; k < spec.variables.size(); k++) {
+    const std::string &name = spec.variables[k].property;
+    memcpy(&names[k * sweep_name_size], name.data(), std::min(name.size(), sweep_name_size - 1));
+  }
+
+  // the samples of each run follow the index, in run order
+  uint64_t offset = sizeof(header) + names.size() + results.size() * sizeof(SweepFileRun) +
+                    results.size() * spec.variables.size() * sizeof(float);
+  std::vector<SweepFileRun> runs(results.size());
+  std::vector<float> values;
+  for (size_t run = 0; run < results.size(); run++) {
+    const SweepResult &result = results[run];
+    runs[run].offset = offset;
+    runs[run].sample_count = result.probes.size();
+    runs[run].steps = result.steps;
+    runs[run].energy = result.energy;
+    runs[run].state = (uint32_t)result.state;
+    offset += result.probes.size() * (1 + header.point_count) * sizeof(float);
+
+    auto run_values = spec.run_values(run);
+    values.insert(values.end(), run_values.begin(), run_values.end());
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(names.data(), 1, names.size(), file) == names.size() &&
+            fwrite(runs.data(), sizeof(SweepFileRun), runs.size(), file) == runs.size() &&
+            fwrite(values.data(), sizeof(float), values.size(), file) == values.size();
+  for (const auto &result : results) {
+    const ProbeSet &probes = result.probes;
+    for (size_t s = 0; ok && s < probes.size(); s++) {
+      float time = probes.sample_time(s);
+      ok = fwrite(&time, sizeof(float), 1, file) == 1;
+    }
+    for (size_t s = 0; ok && s < probes.size(); s++) {
+      ok = fwrite(probes.sample_values(s), sizeof(float), header.point_count, file) ==
+           header.point_count;
+    }
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Cannot write file: %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,116 @@
+#ifndef SWEEP_SPEC_H
+#define SWEEP_SPEC_H
+
+#include "energy.hpp"
+#include "probe.hpp"
+#include "scene.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A scene property varied by a sweep
+struct SweepVariable {
+  // name of the property (see SimObject::set_property and SimSettings::set_property)
+  std::string property{};
+  // indices of the objects the property is set on (counting from 0 in the order of the scene
+  // file, after the settings), or empty if it is a setting
+  std::vector<size_t> objects{};
+  // if the j-th object is set to j * value instead of value, so the value is a step between the
+  // objects (such as the phase increment across an array of sources)
+  bool increment{false};
+  std::vector<float> values{};
+};
+
+// A SweepSpec expands a scene into a set of independent runs, one for each combination of the
+// values of its variables. Sweep files use the same format as scene files:
+//
+//   (Scene phased_array.sim)
+//   (Steps 3000)
+//   (UntilSteady)
+//   (Vary phase Increment (Objects 2 3 4 5 6) (Range 0.0 0.25 11))
+//   (Vary ior (Objects 1) (Values 1.0 1.2 1.5))
+//   (Vary delta_t (Values 0.01 0.008))
+//
+// The scene path is relative to the sweep file. (Duration s) runs each scene for s seconds
+// instead of a number of steps, and (UntilSteady) stops a run early once its field is steady or
+// its pulses have decayed (see SteadyStateDetector). (Range start end count) is count evenly
+// spaced values from start to end. A variable without (Objects ...) is a setting.
+class SweepSpec {
+public:
+  // path of the scene, and its text
+  std::string scene_path{};
+  std::string scene_text{};
+  // length of each run, in steps, or in seconds if duration is positive
+  size_t steps{1000};
+  float duration{0.0};
+  bool until_steady{false};
+  std::vector<SweepVariable> variables{};
+
+  // Number of runs (the product of the number of values of each variable)
+  size_t run_count() const;
+  // Value of each variable in run. The first variable changes slowest.
+  std::vector<float> run_values(size_t run) const;
+  // The scene of run. Errors are printed to stderr.
+  std::optional<Scene> scene(size_t run) const;
+  // Number of steps of a run with settings (the most it runs if until_steady is set)
+  size_t run_steps(const SimSettings &settings) const;
+
+  // Load a sweep file and the scene it refers to, and check that every variable can be set.
+  // Errors are printed to stderr.
+  static std::optional<SweepSpec> load(const std::string &path);
+};
+
+// The outcome of one run of a sweep
+struct SweepResult {
+  // number of steps run, and the state the field ended in
+  uint64_t steps{0};
+  RunState state{RunState::Running};
+  // field energy at the end of the run
+  double energy{0.0};
+  // wall time of the run (in s)
+  double seconds{0.0};
+  // samples of the probes of the scene after each step
+  ProbeSet probes{};
+};
+
+// Run every run of a sweep on threads worker threads (or all hardware threads if threads is 0),
+// each with its own single threaded Engine. Runs are taken from a shared queue, longest (by cells
+// times steps) first, so the workers finish close together even when the runs differ in length.
+// Up to batch runs with the same grid size and number of steps are stepped together on one
+// BatchEngine (unless the runs stop once steady), which is faster for small grids. Batches are
+// made smaller when there would be fewer jobs than workers. Return the results in run order, or
+// nothing (and print to stderr) if a scene can't be built.
+std::optional<std::vector<SweepResult>> run_sweep(const SweepSpec &spec, unsigned threads = 0,
+                                                  size_t batch = 1);
+
+// Sweep result files start with a SweepFileHeader, followed by the name of each variable
+// (variable_count null padded char[32]), then a SweepFileRun for each run, and then the value of
+// each variable in each run (run_count rows of variable_count floats). The probe samples of each
+// run are at the offset in its SweepFileRun: sample_count float times (in s), then sample_count
+// rows of point_count float u values. All values are little endian.
+struct SweepFileHeader {
+  // "WAVSWEP1"
+  char magic[8];
+  uint32_t run_count, variable_count;
+  uint32_t point_count, reserved;
+};
+
+struct SweepFileRun {
+  // offset of the run's samples from the start of the file (in bytes)
+  uint64_t offset;
+  uint64_t sample_count;
+  uint64_t steps;
+  double energy;
+  // RunState the run ended in
+  uint32_t state;
+  uint32_t reserved;
+};
+
+// Write the results of a sweep to path. Return false (and print to stderr) if the file can't be
+// written.
+bool write_sweep_results(const std::string &path, const SweepSpec &spec,
+                         const std::vector<SweepResult> &results);
+
+#endif
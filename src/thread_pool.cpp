@@ -0,0 +1,86 @@
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <string>
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // the calling thread runs the first part of each loop
+  for (unsigned i = 1; i < threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_cv.notify_all();
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::worker_loop(size_t index) {
+  uint64_t last_generation = 0;
+  Tracer::set_thread_name(("worker " + std::to_string(index)).c_str());
+
+  while (true) {
+    const std::function<void(size_t, size_t)> *fn;
+    size_t n;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_cv.wait(lock, [&] { return stopping || generation != last_generation; });
+      if (stopping)
+        return;
+
+      last_generation = generation;
+      fn = job;
+      n = job_size;
+    }
+
+    size_t threads = size();
+    size_t begin = n * index / threads;
+    size_t end = n * (index + 1) / threads;
+    if (begin < end)
+      (*fn)(begin, end);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending--;
+    }
+    done_cv.notify_one();
+  }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn) {
+  if (workers.empty()) {
+    if (n > 0)
+      fn(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    job_size = n;
+    pending = workers.size();
+    generation++;
+  }
+  start_cv.notify_all();
+
+  // run the first part on this thread
+  size_t end = n / size();
+  if (end > 0)
+    fn(0, end);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [&] { return pending == 0; });
+  job = nullptr;
+}
@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run parallel loops. The workers are kept alive between loops,
+// so a parallel_for is cheap enough to run every simulation step.
+class ThreadPool {
+  std::vector<std::thread> workers{};
+
+  std::mutex mutex{};
+  // signalled when a new loop is started (or the pool is stopping)
+  std::condition_variable start_cv{};
+  // signalled when a worker finishes its part of a loop
+  std::condition_variable done_cv{};
+
+  // the loop currently being run
+  const std::function<void(size_t, size_t)> *job{nullptr};
+  size_t job_size{0};
+  // incremented each time a loop is started
+  uint64_t generation{0};
+  // number of workers that haven't finished the current loop
+  size_t pending{0};
+  bool stopping{false};
+
+  void worker_loop(size_t index);
+
+public:
+  // Create a pool that runs loops on threads threads (including the calling thread). If threads is
+  // 0, the number of hardware threads is used.
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Number of threads loops are run on
+  unsigned size() const { return (unsigned)workers.size() + 1; }
+
+  // Split [0, n) into one contiguous range per thread and call fn(begin, end) for each range.
+  // Returns once all ranges are done.
+  void parallel_for(size_t n, const std::function<void(size_t begin, size_t end)> &fn);
+};
+
+#endif
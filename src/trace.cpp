@@ -0,0 +1,181 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+  const char *name;
+  uint64_t begin_ns, end_ns;
+};
+
+// Events recorded by one thread. Only the owning thread writes events. It publishes them by
+// storing count with release ordering, so the writer can read events [0, count) at any time.
+struct ThreadBuffer {
+  static constexpr size_t capacity = 1 << 16;
+
+  std::unique_ptr<TraceEvent[]> events{new TraceEvent[capacity]};
+  std::atomic<size_t> count{0};
+  // the trace (see trace_generation) the events belong to. The owning thread discards its events
+  // when it first records into a new trace.
+  std::atomic<uint64_t> generation{0};
+  // events that didn't fit in the buffer
+  std::atomic<size_t> dropped{0};
+
+  // thread id and name written to the trace
+  size_t tid;
+  std::string name;
+  // if the owning thread has exited (guarded by registry_mutex)
+  bool exited{false};
+};
+
+std::atomic<bool> Tracer::enabled{false};
+
+// incremented each time a trace is started
+static std::atomic<uint64_t> trace_generation{0};
+// time the current trace was started
+static std::atomic<uint64_t> trace_start_ns{0};
+
+// the buffers of running threads that have recorded an event, and of exited threads whose events
+// belong to the current trace (so they can still be written out). Buffers of exited threads are
+// freed when the next trace starts.
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadBuffer>> registry;
+static size_t next_tid = 1;
+
+// name given to the calling thread, which is empty until set_thread_name is called
+static thread_local std::string thread_name;
+
+// Owns the buffer of a thread, which is only allocated when the thread first records an event
+struct ThreadBufferHandle {
+  ThreadBuffer *buffer{nullptr};
+
+  ~ThreadBufferHandle() {
+    if (buffer == nullptr)
+      return;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (buffer->generation.load(std::memory_order_relaxed) == trace_generation.load() &&
+        buffer->count.load(std::memory_order_relaxed) > 0) {
+      buffer->exited = true;
+      return;
+    }
+    registry.erase(std::find_if(registry.begin(), registry.end(),
+                                [&](const auto &b) { return b.get() == buffer; }));
+  }
+};
+
+static thread_local ThreadBufferHandle thread_buffer;
+
+static ThreadBuffer *get_thread_buffer() {
+  if (thread_buffer.buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(std::make_unique<ThreadBuffer>());
+    ThreadBuffer *buffer = registry.back().get();
+    buffer->tid = next_tid++;
+    buffer->name = thread_name.empty() ? "thread " + std::to_string(buffer->tid) : thread_name;
+    thread_buffer.buffer = buffer;
+  }
+  return thread_buffer.buffer;
+}
+
+uint64_t Tracer::now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::start() {
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(std::remove_if(registry.begin(), registry.end(),
+                                  [](const auto &buffer) { return buffer->exited; }),
+                   registry.end());
+  }
+  trace_start_ns.store(now_ns());
+  trace_generation.fetch_add(1);
+  enabled.store(true);
+}
+
+void Tracer::stop() { enabled.store(false); }
+
+void Tracer::set_thread_name(const char *name) {
+  thread_name = name;
+  if (thread_buffer.buffer != nullptr) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    thread_buffer.buffer->name = name;
+  }
+}
+
+void Tracer::record(const char *name, uint64_t begin_ns, uint64_t end_ns) {
+  ThreadBuffer *buffer = get_thread_buffer();
+
+  uint64_t generation = trace_generation.load(std::memory_order_relaxed);
+  if (buffer->generation.load(std::memory_order_relaxed) != generation) {
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->dropped.store(0, std::memory_order_relaxed);
+    buffer->generation.store(generation, std::memory_order_release);
+  }
+
+  size_t count = buffer->count.load(std::memory_order_relaxed);
+  if (count >= ThreadBuffer::capacity) {
+    buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  buffer->events[count] = {name, begin_ns, end_ns};
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+bool Tracer::write_chrome_trace(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+    return false;
+  }
+
+  uint64_t generation = trace_generation.load();
+  uint64_t start_ns = trace_start_ns.load();
+  size_t dropped = 0;
+  bool first = true;
+
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const auto &buffer : registry) {
+    fprintf(file,
+            "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, "
+            "\"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",\n", buffer->tid, buffer->name.c_str());
+    first = false;
+
+    if (buffer->generation.load(std::memory_order_acquire) != generation)
+      continue;
+
+    size_t count = buffer->count.load(std::memory_order_acquire);
+    dropped += buffer->dropped.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+      const TraceEvent &event = buffer->events[i];
+      if (event.begin_ns < start_ns)
+        continue;
+
+      fprintf(file,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, "
+              "\"dur\": %.3f}",
+              event.name, buffer->tid, (event.begin_ns - start_ns) * 1e-3,
+              (event.end_ns - event.begin_ns) * 1e-3);
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  fclose(file);
+
+  if (dropped > 0) {
+    fprintf(stderr, "Trace buffers were full, %zu events were dropped\n", dropped);
+  }
+
+  return true;
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Tracer records scoped timing events and writes them as a Chrome Trace (json) file, which can be
+// opened in chrome://tracing or Perfetto.
+//
+// Each thread records into its own fixed size buffer, so recording an event doesn't take a lock.
+// The buffer is only allocated when the thread records its first event. While tracing is stopped, a
+// TraceScope costs one relaxed atomic load.
+class Tracer {
+  static std::atomic<bool> enabled;
+
+public:
+  static bool is_enabled() { return enabled.load(std::memory_order_relaxed); }
+
+  // Discard any recorded events and start recording
+  static void start();
+  // Stop recording. Recorded events are kept until the next start.
+  static void stop();
+
+  // Name the calling thread in written traces
+  static void set_thread_name(const char *name);
+
+  // Record an event that ran from begin_ns to end_ns (as returned by now_ns) on the calling thread.
+  // name must be a string literal (or otherwise outlive the trace).
+  static void record(const char *name, uint64_t begin_ns, uint64_t end_ns);
+  // Current time (in ns) of the trace clock
+  static uint64_t now_ns();
+
+  // Write the recorded events to path. Return false if the file can't be written.
+  static bool write_chrome_trace(const std::string &path);
+};
+
+// Records an event covering the lifetime of the scope
+class TraceScope {
+  const char *name;
+  // if tracing was enabled when the scope started
+  bool active;
+  uint64_t begin_ns{0};
+
+public:
+  explicit TraceScope(const char *name) : name(name), active(Tracer::is_enabled()) {
+    if (active)
+      begin_ns = Tracer::now_ns();
+  }
+
+  ~TraceScope() {
+    if (active && Tracer::is_enabled())
+      Tracer::record(name, begin_ns, Tracer::now_ns());
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Trace the rest of the enclosing scope as an event called name
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif